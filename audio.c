@@ -0,0 +1,281 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "audio.h"
+#include "dbg.h"
+
+#define AUDIO_MASK (AUDIO_RING_FRAMES - 1)
+
+int audioInit(audio_capture *a){
+  int c;
+
+  memset(a, 0, sizeof(*a));
+  check (posix_memalign((void **) &a->ring, 64, AUDIO_RING_FRAMES * AUDIO_CHANNELS * sizeof(int32_t)) == 0,
+         "Could not allocate audio ring.");
+  for (c = 0; c < AUDIO_CHANNELS; c++)
+    a->level_db[c] = -120;
+  stageTimerInit(&a->write, "audio write");
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+void audioFree(audio_capture *a){
+  audioStop(a);
+  free (a->ring);
+  a->ring = NULL;
+}
+
+/*
+  Producer side, on the libfreenect thread. Never blocks: what does not fit
+  is dropped and counted.
+*/
+void audioPush(audio_capture *a, int frames, const int32_t *mic1, const int32_t *mic2,
+               const int32_t *mic3, const int32_t *mic4){
+  uint32_t head = a->head;
+  uint32_t tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+  int room = AUDIO_RING_FRAMES - (int) (head - tail);
+  int n = frames < room ? frames : room;
+  int i;
+
+  for (i = 0; i < n; i++){
+    int32_t *f = a->ring + ((head + i) & AUDIO_MASK) * AUDIO_CHANNELS;
+    f[0] = mic1[i];
+    f[1] = mic2[i];
+    f[2] = mic3[i];
+    f[3] = mic4[i];
+  }
+  __atomic_store_n(&a->head, head + n, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&a->callbacks, 1, __ATOMIC_RELAXED);
+  if (n < frames)
+    __atomic_add_fetch(&a->overruns, frames - n, __ATOMIC_RELAXED);
+}
+
+/*
+  Sum of squares per channel, samples scaled to +-1.0 full scale. Frames are
+  interleaved, so one frame is one vector: four float lanes accumulate a
+  block, then fold into doubles before the float sum loses precision.
+*/
+void audioSumSquares(const int32_t *frames, int count, double sum[AUDIO_CHANNELS]){
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  double lo[2], hi[2];
+  int i = 0, end;
+
+  while (i < count){
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    end = i + 256 < count ? i + 256 : count;
+    for (; i + 1 < end; i += 2){
+      __m128 x0 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (frames + i * 4))), scale);
+      __m128 x1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (frames + i * 4 + 4))), scale);
+      acc0 = _mm_add_ps(acc0, _mm_mul_ps(x0, x0));
+      acc1 = _mm_add_ps(acc1, _mm_mul_ps(x1, x1));
+    }
+    if (i < end){
+      __m128 x0 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (frames + i * 4))), scale);
+      acc0 = _mm_add_ps(acc0, _mm_mul_ps(x0, x0));
+      i++;
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    _mm_storeu_pd(lo, _mm_cvtps_pd(acc0));
+    _mm_storeu_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(acc0, acc0)));
+    sum[0] += lo[0];
+    sum[1] += lo[1];
+    sum[2] += hi[0];
+    sum[3] += hi[1];
+  }
+#else
+  audioSumSquaresScalar(frames, count, sum);
+#endif
+}
+
+void audioSumSquaresScalar(const int32_t *frames, int count, double sum[AUDIO_CHANNELS]){
+  int i, c;
+  for (i = 0; i < count; i++){
+    for (c = 0; c < AUDIO_CHANNELS; c++){
+      double x = frames[i * AUDIO_CHANNELS + c] / 2147483648.0;
+      sum[c] += x * x;
+    }
+  }
+}
+
+/*
+  A sine per channel, 250 Hz times the channel number at half, third,
+  quarter and fifth of full scale, so each level reads differently.
+*/
+void audioSynthetic(int32_t *mic[AUDIO_CHANNELS], int frames, uint64_t start){
+  int i, c;
+  for (c = 0; c < AUDIO_CHANNELS; c++){
+    double w = 2.0 * M_PI * 250.0 * (c + 1) / AUDIO_RATE;
+    double amp = 2147483647.0 / (c + 2);
+    for (i = 0; i < frames; i++)
+      mic[c][i] = (int32_t) (amp * sin(w * (double) (start + i)));
+  }
+}
+
+static void putLe32(uint8_t *p, uint32_t v){
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void putLe16(uint8_t *p, uint16_t v){
+  p[0] = v; p[1] = v >> 8;
+}
+
+// 32 bit PCM, sizes are patched in when the capture stops.
+static void wavHeader(uint8_t h[44], uint32_t frames){
+  uint32_t data = frames * AUDIO_CHANNELS * sizeof(int32_t);
+
+  memcpy(h, "RIFF", 4);
+  putLe32(h + 4, 36 + data);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  putLe32(h + 16, 16);
+  putLe16(h + 20, 1);
+  putLe16(h + 22, AUDIO_CHANNELS);
+  putLe32(h + 24, AUDIO_RATE);
+  putLe32(h + 28, AUDIO_RATE * AUDIO_CHANNELS * sizeof(int32_t));
+  putLe16(h + 32, AUDIO_CHANNELS * sizeof(int32_t));
+  putLe16(h + 34, 32);
+  memcpy(h + 36, "data", 4);
+  putLe32(h + 40, data);
+}
+
+/*
+  Take everything that arrived: levels first, then the file. The last drain
+  after stop may find a short period, that is not an underrun.
+*/
+static void audioDrain(audio_capture *a, int last){
+  uint32_t head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = a->tail;
+  int avail = (int) (head - tail);
+  double sum[AUDIO_CHANNELS] = { 0, 0, 0, 0 };
+  uint64_t start = nowNs();
+  int c;
+
+  if (!last && avail == 0 && head != 0)
+    __atomic_add_fetch(&a->underruns, 1, __ATOMIC_RELAXED);
+  if (avail == 0)
+    return;
+
+  while (tail != head){
+    int at = tail & AUDIO_MASK;
+    int n = (int) (head - tail);
+    if (n > AUDIO_RING_FRAMES - at)
+      n = AUDIO_RING_FRAMES - at;
+    audioSumSquares(a->ring + at * AUDIO_CHANNELS, n, sum);
+    if (a->wav)
+      a->written += fwrite(a->ring + at * AUDIO_CHANNELS, AUDIO_CHANNELS * sizeof(int32_t), n, a->wav);
+    tail += n;
+  }
+  __atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+
+  for (c = 0; c < AUDIO_CHANNELS; c++){
+    double ms = sum[c] / avail;
+    int db = ms > 1e-12 ? (int) (10.0 * log10(ms)) : -120;
+    __atomic_store_n(&a->level_db[c], db, __ATOMIC_RELAXED);
+  }
+  stageTimerRecord(&a->write, nowNs() - start);
+}
+
+static void sleepMs(int ms){
+  struct timespec ts = { 0, ms * 1000000L };
+  nanosleep(&ts, NULL);
+}
+
+static void *audioWriterThread(void *arg){
+  audio_capture *a = arg;
+
+  while (!__atomic_load_n(&a->quit, __ATOMIC_ACQUIRE)){
+    sleepMs(AUDIO_PERIOD_MS);
+    audioDrain(a, 0);
+  }
+  audioDrain(a, 1);
+  return NULL;
+}
+
+// Stands in for the libfreenect callback, 10 ms blocks on absolute deadlines.
+static void *audioSynthThread(void *arg){
+  audio_capture *a = arg;
+  int32_t buf[AUDIO_CHANNELS][AUDIO_RATE / 100];
+  int32_t *mic[AUDIO_CHANNELS] = { buf[0], buf[1], buf[2], buf[3] };
+  uint64_t t = 0;
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!__atomic_load_n(&a->quit, __ATOMIC_ACQUIRE)){
+    audioSynthetic(mic, AUDIO_RATE / 100, t);
+    audioPush(a, AUDIO_RATE / 100, mic[0], mic[1], mic[2], mic[3]);
+    t += AUDIO_RATE / 100;
+    next.tv_nsec += 10000000L;
+    if (next.tv_nsec >= 1000000000L){
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+/*
+  Start the writer, and with `synthetic` the test source in place of the
+  device callback. `path` may be NULL to only meter the levels.
+*/
+int audioStart(audio_capture *a, const char *path, int synthetic){
+  uint8_t h[44];
+
+  check (!a->running, "Audio capture already running.");
+  a->head = a->tail = 0;
+  a->written = 0;
+  a->callbacks = a->overruns = a->underruns = 0;
+  a->quit = 0;
+  a->synthetic = synthetic;
+  a->path[0] = '\0';
+  if (path){
+    snprintf(a->path, sizeof(a->path), "%s", path);
+    a->wav = fopen(path, "wb");
+    check (a->wav, "Could not open audio file.");
+    wavHeader(h, 0);
+    check (fwrite(h, sizeof(h), 1, a->wav) == 1, "Could not write audio file.");
+  }
+  check (pthread_create(&a->thread, NULL, audioWriterThread, a) == 0, "Could not create audio writer thread.");
+  if (synthetic && pthread_create(&a->synth_thread, NULL, audioSynthThread, a) != 0){
+    __atomic_store_n(&a->quit, 1, __ATOMIC_RELEASE);
+    pthread_join(a->thread, NULL);
+    check (0, "Could not create synthetic audio thread.");
+  }
+  a->running = 1;
+  return 0;
+
+ error:
+  debug ("%s", USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  if (a->wav)
+    fclose(a->wav);
+  a->wav = NULL;
+  return 1;
+}
+
+// The device must have stopped calling audioPush, the writer drains the rest.
+void audioStop(audio_capture *a){
+  uint8_t h[44];
+
+  if (!a->running)
+    return;
+  __atomic_store_n(&a->quit, 1, __ATOMIC_RELEASE);
+  if (a->synthetic)
+    pthread_join(a->synth_thread, NULL);
+  pthread_join(a->thread, NULL);
+  if (a->wav){
+    wavHeader(h, (uint32_t) a->written);
+    fseek(a->wav, 0, SEEK_SET);
+    fwrite(h, sizeof(h), 1, a->wav);
+    fclose(a->wav);
+    a->wav = NULL;
+  }
+  a->running = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __audio_h__
+#define __audio_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "stats.h"
+
+#define AUDIO_CHANNELS 4
+#define AUDIO_RATE 16000
+#define AUDIO_RING_FRAMES 32768      // About 2 s, a power of two.
+#define AUDIO_PERIOD_MS 20
+
+/*
+  Four channel mic array capture. The libfreenect audio callback is the
+  single producer: it interleaves the mics into a preallocated ring and
+  only moves `head`. The writer thread is the single consumer: every
+  period it takes what arrived, updates the channel levels and appends it
+  to a WAV file.
+
+  Overruns are frames the callback could not fit and dropped; underruns are
+  writer periods that found the ring empty once audio had started, meaning
+  the stream stalled for a whole period.
+*/
+typedef struct {
+  int32_t *ring;
+  uint32_t head;     // Frames written, producer only.
+  uint32_t tail;     // Frames read, consumer only.
+
+  pthread_t thread;
+  pthread_t synth_thread;
+  int running;
+  int synthetic;
+  int quit;
+
+  FILE *wav;
+  char path[64];
+  uint64_t written;  // Frames in the file.
+
+  int level_db[AUDIO_CHANNELS];  // dBFS of the last period, -120 for silence.
+  uint64_t callbacks;
+  uint64_t overruns;
+  uint64_t underruns;
+  stage_timer write;
+} audio_capture;
+
+int audioInit(audio_capture *a);
+void audioFree(audio_capture *a);
+int audioStart(audio_capture *a, const char *path, int synthetic);
+void audioStop(audio_capture *a);
+void audioPush(audio_capture *a, int frames, const int32_t *mic1, const int32_t *mic2,
+               const int32_t *mic3, const int32_t *mic4);
+void audioSumSquares(const int32_t *frames, int count, double sum[AUDIO_CHANNELS]);
+void audioSumSquaresScalar(const int32_t *frames, int count, double sum[AUDIO_CHANNELS]);
+void audioSynthetic(int32_t *mic[AUDIO_CHANNELS], int frames, uint64_t start);
+
+#endif
@@ -0,0 +1,1150 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#include "bench.h"
+#include "audio.h"
+#include "calib.h"
+#include "demosaic.h"
+#include "depth_filter.h"
+#include "depth_proc.h"
+#include "floor.h"
+#include "hotplug.h"
+#include "probe.h"
+#include "framepool.h"
+#include "log.h"
+#include "modes.h"
+#include "motion.h"
+#include "recorder.h"
+#include "stats.h"
+#include "unpack.h"
+#include "voxel.h"
+#include "workpool.h"
+#include "dbg.h"
+
+#define BENCH_W 640
+#define BENCH_H 480
+#define BENCH_BAR 40
+
+/*
+  A slanted floor with a box moving across it, light noise and occlusion
+  holes along the box edge, close enough to a room scene for the kernels to
+  take their usual branches.
+*/
+void benchSyntheticDepth(uint16_t *depth, int width, int height, int seq){
+  int x, y;
+  int bx = (seq * 7) % width;
+  unsigned int r = 12345u + seq;
+
+  for (y = 0; y < height; y++){
+    for (x = 0; x < width; x++){
+      int v = 500 + y * 2;
+      r = r * 1103515245u + 12345u;
+      if (x >= bx && x < bx + width / 5 && y > height / 3 && y < height * 2 / 3)
+        v = 350;
+      v += (r >> 16) % 5;
+      if (x == bx - 1 || x == bx - 2 || (r >> 8) % 97 == 0)
+        v = DEPTH_NO_DATA;
+      depth[(size_t) y * width + x] = v > DEPTH_NO_DATA ? DEPTH_NO_DATA : v;
+    }
+  }
+}
+
+static void benchLine(bench_print print, int cores, double ms, double speedup){
+  char line[128];
+  char bar[BENCH_BAR + 1];
+  int n = (int) (speedup * BENCH_BAR / 8);
+  if (n > BENCH_BAR) n = BENCH_BAR;
+  if (n < 1) n = 1;
+  memset(bar, '#', n);
+  bar[n] = '\0';
+  snprintf(line, sizeof(line), "%2d cores %7.2f ms x%4.2f |%s", cores, ms, speedup, bar);
+  print(line);
+}
+
+/*
+  Filter (median3 + holes) and colorize on 1..N bands, one fresh pool per
+  step, workers pinned from cpu 1. The bar is scaled so x8 fills it.
+*/
+void benchThreads(colormap *cmap, int frames, bench_print print){
+  int cpus = get_nprocs();
+  int cores, i;
+  double base = 0;
+  uint16_t *synth[4] = { NULL, NULL, NULL, NULL };
+  uint8_t *out = NULL;
+  colorize_job *job = NULL;
+  char line[128];
+
+  if (cpus > WORK_POOL_MAX_THREADS + 1) cpus = WORK_POOL_MAX_THREADS + 1;
+  if (frames < 1) frames = 1;
+
+  for (i = 0; i < 4; i++){
+    synth[i] = malloc(BENCH_W * BENCH_H * sizeof(uint16_t));
+    check_mem(synth[i]);
+    benchSyntheticDepth(synth[i], BENCH_W, BENCH_H, i);
+  }
+  out = malloc(BENCH_W * BENCH_H * 3);
+  check_mem(out);
+  job = malloc(sizeof(*job));
+  check_mem(job);
+
+  snprintf(line, sizeof(line), "Filter median3+holes and colorize, %d frames %dx%d", frames, BENCH_W, BENCH_H);
+  print(line);
+
+  for (cores = 1; cores <= cpus; cores++){
+    work_pool pool;
+    depth_filter filter;
+    depth_rect full = { 0, 0, BENCH_W, BENCH_H };
+    int alert, first;
+    uint64_t start;
+    double ms;
+
+    workPoolInit(&pool, cores - 1, 1);
+    if (depthFilterInit(&filter, BENCH_W, BENCH_H) != 0){
+      workPoolShutdown(&pool);
+      print("Out of memory.");
+      break;
+    }
+    depthFilterSetMode(&filter, FILTER_MEDIAN3);
+    depthFilterSetHoles(&filter, 1);
+    job->lut = colormapActive(cmap)->lut;
+  job->near_limit = cmap->near_limit;
+    job->out = out;
+    job->stride = BENCH_W;
+    job->x = job->y = 0;
+    job->step = 1;
+    job->width = BENCH_W;
+    job->no_data = DEPTH_NO_DATA;
+    job->shift_left = 0;
+    job->shift = 0;
+    job->stats = NULL;
+
+    start = nowNs();
+    for (i = 0; i < frames; i++){
+      job->in = depthFilterApply(&filter, &pool, synth[i % 4], &full);
+      colorizeDepth(&pool, job, BENCH_H, &alert, &first);
+    }
+    ms = (nowNs() - start) / 1e6 / frames;
+    if (cores == 1)
+      base = ms;
+    benchLine(print, cores, ms, base / ms);
+
+    depthFilterFree(&filter);
+    workPoolShutdown(&pool);
+  }
+
+  for (i = 0; i < 4; i++)
+    free (synth[i]);
+  free (out);
+  free (job);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  for (i = 0; i < 4; i++)
+    free (synth[i]);
+  free (out);
+  free (job);
+}
+
+/*
+  Colorize alone against colorize with the fused statistics, on every core.
+  The two runs alternate per frame so they see the same cache state.
+*/
+void benchStats(colormap *cmap, int frames, bench_print print){
+  work_pool pool;
+  uint16_t *synth = NULL;
+  uint8_t *out = NULL;
+  colorize_job *job = NULL;
+  depth_stats *stats = NULL;
+  uint64_t bare = 0, fused = 0, start;
+  int i, alert, first;
+  char line[128];
+
+  if (frames < 1) frames = 1;
+  workPoolInit(&pool, get_nprocs() - 1, 1);
+
+  synth = malloc(BENCH_W * BENCH_H * sizeof(uint16_t));
+  check_mem(synth);
+  benchSyntheticDepth(synth, BENCH_W, BENCH_H, 0);
+  out = malloc(BENCH_W * BENCH_H * 3);
+  check_mem(out);
+  job = malloc(sizeof(*job));
+  check_mem(job);
+  stats = malloc(sizeof(*stats));
+  check_mem(stats);
+
+  job->in = synth;
+  job->lut = colormapActive(cmap)->lut;
+  job->near_limit = cmap->near_limit;
+  job->out = out;
+  job->stride = BENCH_W;
+  job->x = job->y = 0;
+  job->step = 1;
+  job->width = BENCH_W;
+  job->no_data = DEPTH_NO_DATA;
+  job->shift_left = 0;
+  job->shift = 0;
+
+  for (i = 0; i < frames; i++){
+    job->stats = NULL;
+    start = nowNs();
+    colorizeDepth(&pool, job, BENCH_H, &alert, &first);
+    bare += nowNs() - start;
+
+    job->stats = stats;
+    start = nowNs();
+    colorizeDepth(&pool, job, BENCH_H, &alert, &first);
+    fused += nowNs() - start;
+  }
+
+  snprintf(line, sizeof(line), "Colorize on %d bands, %d frames %dx%d", pool.bands, frames, BENCH_W, BENCH_H);
+  print(line);
+  snprintf(line, sizeof(line), "bare  %7.3f ms", bare / 1e6 / frames);
+  print(line);
+  snprintf(line, sizeof(line), "stats %7.3f ms (+%.1f%%)", fused / 1e6 / frames, (fused - (double) bare) * 100.0 / bare);
+  print(line);
+
+  workPoolShutdown(&pool);
+  free (synth);
+  free (out);
+  free (job);
+  free (stats);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  workPoolShutdown(&pool);
+  free (synth);
+  free (out);
+  free (job);
+  free (stats);
+}
+
+/*
+  A GRBG mosaic of a smooth color ramp with a sharp bar, so the interpolation
+  sees both flat areas and edges.
+*/
+static void benchSyntheticBayer(uint8_t *bayer, int width, int height){
+  int x, y, v;
+
+  for (y = 0; y < height; y++){
+    for (x = 0; x < width; x++){
+      int odd_row = y & 1, odd_col = x & 1;
+      if (!odd_row && odd_col)
+        v = x * 255 / width;                     // R
+      else if (odd_row && !odd_col)
+        v = y * 255 / height;                    // B
+      else
+        v = (x + y) * 255 / (width + height);    // G
+      if (x > width / 2 && x < width / 2 + 8)
+        v = 255;
+      bayer[(size_t) y * width + x] = v;
+    }
+  }
+}
+
+/*
+  The scalar bilinear loop libfreenect runs for FREENECT_VIDEO_RGB against
+  the SSE2 kernel, on one core and on the band pool. Output is checked
+  against the scalar result.
+*/
+void benchDemosaic(int frames, bench_print print){
+  work_pool pool;
+  uint8_t *bayer = NULL, *ref = NULL, *out = NULL;
+  uint64_t start;
+  double scalar, simd, banded;
+  int i, w, h, bad = 0;
+  char line[128];
+  static const int sizes[2][2] = { { 640, 480 }, { 1280, 1024 } };
+
+  if (frames < 1) frames = 1;
+  workPoolInit(&pool, get_nprocs() - 1, 1);
+
+  bayer = malloc(1280 * 1024);
+  check_mem(bayer);
+  ref = malloc(1280 * 1024 * 3);
+  check_mem(ref);
+  out = malloc(1280 * 1024 * 3);
+  check_mem(out);
+
+  for (i = 0; i < 2; i++){
+    int f;
+    w = sizes[i][0];
+    h = sizes[i][1];
+    benchSyntheticBayer(bayer, w, h);
+
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      demosaicRowsScalar(bayer, ref, w, h, 0, h);
+    scalar = (nowNs() - start) / 1e6 / frames;
+
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      demosaicRows(bayer, out, w, h, 0, h);
+    simd = (nowNs() - start) / 1e6 / frames;
+
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      demosaic(&pool, bayer, out, w, h);
+    banded = (nowNs() - start) / 1e6 / frames;
+
+    if (memcmp(ref, out, (size_t) w * h * 3) != 0)
+      bad++;
+
+    snprintf(line, sizeof(line), "Demosaic %dx%d, %d frames, %d bytes in, %d out", w, h, frames, w * h, w * h * 3);
+    print(line);
+    snprintf(line, sizeof(line), "scalar %7.3f ms", scalar);
+    print(line);
+    snprintf(line, sizeof(line), "sse2   %7.3f ms x%4.2f", simd, scalar / simd);
+    print(line);
+    snprintf(line, sizeof(line), "%2d bands %5.3f ms x%4.2f", pool.bands, banded, scalar / banded);
+    print(line);
+  }
+  print(bad ? "Mismatch against the scalar demosaic." : "Output matches the scalar demosaic.");
+
+  workPoolShutdown(&pool);
+  free (bayer);
+  free (ref);
+  free (out);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  workPoolShutdown(&pool);
+  free (bayer);
+  free (ref);
+  free (out);
+}
+
+/*
+  Pack a synthetic frame at 10 and 11 bits, unpack it with the libfreenect
+  bit reader and with unpackDepth, and check both give the frame back. The
+  byte counts are what one frame costs in the depth slots.
+*/
+void benchUnpack(int frames, bench_print print){
+  work_pool pool;
+  uint16_t *synth = NULL, *ref = NULL, *out = NULL;
+  uint8_t *packed = NULL;
+  uint64_t start;
+  double scalar, swar, banded;
+  int bits, f, bad = 0;
+  int n = BENCH_W * BENCH_H;
+  char line[128];
+
+  if (frames < 1) frames = 1;
+  workPoolInit(&pool, get_nprocs() - 1, 1);
+
+  synth = malloc(n * sizeof(uint16_t));
+  check_mem(synth);
+  ref = malloc(n * sizeof(uint16_t));
+  check_mem(ref);
+  out = malloc(n * sizeof(uint16_t));
+  check_mem(out);
+  packed = malloc(packedBytes(11, n));
+  check_mem(packed);
+  benchSyntheticDepth(synth, BENCH_W, BENCH_H, 0);
+
+  for (bits = 11; bits >= 10; bits--){
+    // 10 bit keeps the low bits, the no data value becomes 1023.
+    for (f = 0; f < n; f++)
+      ref[f] = synth[f] & ((1 << bits) - 1);
+    packDepth(ref, packed, bits, n);
+
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      unpackDepthScalar(packed, out, bits, n);
+    scalar = (nowNs() - start) / 1e6 / frames;
+    if (memcmp(ref, out, n * sizeof(uint16_t)) != 0)
+      bad++;
+
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      unpackDepth(packed, out, bits, n);
+    swar = (nowNs() - start) / 1e6 / frames;
+    if (memcmp(ref, out, n * sizeof(uint16_t)) != 0)
+      bad++;
+
+    memset(out, 0, n * sizeof(uint16_t));
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      unpackDepthFrame(&pool, packed, out, bits, BENCH_W, BENCH_H);
+    banded = (nowNs() - start) / 1e6 / frames;
+    if (memcmp(ref, out, n * sizeof(uint16_t)) != 0)
+      bad++;
+
+    snprintf(line, sizeof(line), "%d bit packed %dx%d: %d bytes against %d (-%d%%), %d frames", bits, BENCH_W, BENCH_H,
+             (int) packedBytes(bits, n), (int) (n * sizeof(uint16_t)),
+             (int) (100 - packedBytes(bits, n) * 100 / (n * sizeof(uint16_t))), frames);
+    print(line);
+    snprintf(line, sizeof(line), "bit reader %7.3f ms", scalar);
+    print(line);
+    snprintf(line, sizeof(line), "64 bit     %7.3f ms x%4.2f", swar, scalar / swar);
+    print(line);
+    snprintf(line, sizeof(line), "%2d bands   %7.3f ms x%4.2f", pool.bands, banded, scalar / banded);
+    print(line);
+  }
+  print(bad ? "Unpacked frames do not match the source." : "Unpacked frames match the source.");
+
+  workPoolShutdown(&pool);
+  free (synth);
+  free (ref);
+  free (out);
+  free (packed);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  workPoolShutdown(&pool);
+  free (synth);
+  free (ref);
+  free (out);
+  free (packed);
+}
+
+/*
+  Levels of the synthetic mic source through the ring, SIMD against scalar.
+  The channels are sines at 1/2 to 1/5 of full scale, so the expected level
+  is 20 log10(1 / (n sqrt 2)) dBFS.
+*/
+void benchAudio(int seconds, bench_print print){
+  audio_capture a;
+  int32_t *mic[AUDIO_CHANNELS] = { NULL, NULL, NULL, NULL };
+  int32_t *frames = NULL;
+  double simd[AUDIO_CHANNELS] = { 0, 0, 0, 0 }, scalar[AUDIO_CHANNELS] = { 0, 0, 0, 0 };
+  uint64_t t_simd = 0, t_scalar = 0, start;
+  int block = AUDIO_RATE / 100, total, got, c, i, n;
+  char line[128];
+
+  if (seconds < 1) seconds = 1;
+  total = seconds * AUDIO_RATE;
+  if (audioInit(&a) != 0){
+    print("Out of memory.");
+    return;
+  }
+  for (c = 0; c < AUDIO_CHANNELS; c++){
+    mic[c] = malloc(block * sizeof(int32_t));
+    check_mem(mic[c]);
+  }
+  frames = malloc(block * AUDIO_CHANNELS * sizeof(int32_t));
+  check_mem(frames);
+
+  // Callback sized blocks in and out of the ring, as the capture does.
+  for (got = 0; got < total; got += block){
+    audioSynthetic(mic, block, got);
+    audioPush(&a, block, mic[0], mic[1], mic[2], mic[3]);
+    n = (int) (a.head - a.tail);
+    for (i = 0; i < n; i++)
+      memcpy(frames + i * AUDIO_CHANNELS, a.ring + ((a.tail + i) & (AUDIO_RING_FRAMES - 1)) * AUDIO_CHANNELS,
+             AUDIO_CHANNELS * sizeof(int32_t));
+    a.tail += n;
+
+    start = nowNs();
+    audioSumSquares(frames, n, simd);
+    t_simd += nowNs() - start;
+    start = nowNs();
+    audioSumSquaresScalar(frames, n, scalar);
+    t_scalar += nowNs() - start;
+  }
+
+  snprintf(line, sizeof(line), "Synthetic audio, %d s of %d channels, overruns %d", seconds, AUDIO_CHANNELS,
+           (int) a.overruns);
+  print(line);
+  for (c = 0; c < AUDIO_CHANNELS; c++){
+    snprintf(line, sizeof(line), "mic %d: %6.2f dBFS, scalar %6.2f, expected %6.2f", c + 1,
+             10.0 * log10(simd[c] / total), 10.0 * log10(scalar[c] / total),
+             20.0 * log10(1.0 / ((c + 2) * sqrt(2.0))));
+    print(line);
+  }
+  snprintf(line, sizeof(line), "levels sse2 %7.3f ms, scalar %7.3f ms x%4.2f", t_simd / 1e6, t_scalar / 1e6,
+           (double) t_scalar / t_simd);
+  print(line);
+
+  for (c = 0; c < AUDIO_CHANNELS; c++)
+    free (mic[c]);
+  free (frames);
+  audioFree(&a);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  for (c = 0; c < AUDIO_CHANNELS; c++)
+    free (mic[c]);
+  free (frames);
+  audioFree(&a);
+}
+
+/*
+  The motion kernel against its scalar loop, both updating their own copy
+  of the background over the same frames, then the whole gate in bands.
+  The synthetic box moves every frame, so the gate should open.
+*/
+void benchMotion(int frames, bench_print print){
+  work_pool pool;
+  motion_gate gate;
+  uint16_t *synth[8] = { NULL };
+  int16_t *bg_ref = NULL, *bg = NULL;
+  uint64_t start, t_scalar = 0, t_simd = 0, sad_ref, sad;
+  uint32_t valid_ref, valid;
+  int i, f, bad = 0, rows = BENCH_H / MOTION_ROW_STEP;
+  size_t bg_bytes = (size_t) rows * BENCH_W * sizeof(int16_t);
+  double banded;
+  char line[128];
+
+  if (frames < 1) frames = 1;
+  workPoolInit(&pool, get_nprocs() - 1, 1);
+  memset(&gate, 0, sizeof(gate));
+  check (motionGateInit(&gate, BENCH_W, BENCH_H) == 0, "Out of memory.");
+  for (i = 0; i < 8; i++){
+    synth[i] = malloc(BENCH_W * BENCH_H * sizeof(uint16_t));
+    check_mem(synth[i]);
+    benchSyntheticDepth(synth[i], BENCH_W, BENCH_H, i);
+  }
+  bg_ref = malloc(bg_bytes);
+  check_mem(bg_ref);
+  bg = malloc(bg_bytes);
+  check_mem(bg);
+  for (i = 0; i < rows * BENCH_W; i++)
+    bg_ref[i] = bg[i] = DEPTH_NO_DATA;
+
+  for (f = 0; f < frames; f++){
+    start = nowNs();
+    motionSadScalar(synth[f & 7], bg_ref, BENCH_W, rows, BENCH_W * MOTION_ROW_STEP, DEPTH_NO_DATA, &sad_ref, &valid_ref);
+    t_scalar += nowNs() - start;
+    start = nowNs();
+    motionSad(synth[f & 7], bg, BENCH_W, rows, BENCH_W * MOTION_ROW_STEP, DEPTH_NO_DATA, &sad, &valid);
+    t_simd += nowNs() - start;
+    if (sad != sad_ref || valid != valid_ref)
+      bad++;
+  }
+  if (memcmp(bg, bg_ref, bg_bytes) != 0)
+    bad++;
+
+  start = nowNs();
+  for (f = 0; f < frames; f++)
+    motionGateUpdate(&gate, &pool, synth[f & 7], DEPTH_NO_DATA);
+  banded = (nowNs() - start) / 1e6 / frames;
+
+  snprintf(line, sizeof(line), "Motion gate %dx%d, every %d rows, %d frames", BENCH_W, BENCH_H, MOTION_ROW_STEP, frames);
+  print(line);
+  snprintf(line, sizeof(line), "scalar %7.3f ms", t_scalar / 1e6 / frames);
+  print(line);
+  snprintf(line, sizeof(line), "sse2   %7.3f ms x%4.2f", t_simd / 1e6 / frames, (double) t_scalar / t_simd);
+  print(line);
+  snprintf(line, sizeof(line), "%2d bands %5.3f ms", pool.bands, banded);
+  print(line);
+  snprintf(line, sizeof(line), "last score %d against threshold %d, gate %s, opened %d times", (int) gate.score,
+           gate.threshold, gate.open ? "open" : "closed", (int) gate.events);
+  print(line);
+  print(bad ? "Mismatch against the scalar kernel." : "Sums and background match the scalar kernel.");
+
+  workPoolShutdown(&pool);
+  motionGateFree(&gate);
+  for (i = 0; i < 8; i++)
+    free (synth[i]);
+  free (bg_ref);
+  free (bg);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  workPoolShutdown(&pool);
+  motionGateFree(&gate);
+  for (i = 0; i < 8; i++)
+    free (synth[i]);
+  free (bg_ref);
+  free (bg);
+}
+
+#define BENCH_LOG_THREADS 4
+
+typedef struct {
+  int messages;
+  uint64_t total, worst;
+} bench_log_thread;
+
+static void *benchLogThread(void *arg){
+  bench_log_thread *t = arg;
+  uint64_t start, ns;
+  int i;
+
+  for (i = 0; i < t->messages; i++){
+    start = nowNs();
+    logWrite(LOG_DEBUG, __FILE__, __LINE__, "bench log %d of %d, depth %d mm", i, t->messages, 500 + i);
+    ns = nowNs() - start;
+    t->total += ns;
+    if (ns > t->worst) t->worst = ns;
+  }
+  return NULL;
+}
+
+/*
+  What a debug line costs the thread that writes it, through the rings
+  from a few threads at once and through a line buffered fprintf the way
+  the old macros wrote. The lines land on stdout, keep `messages` under a
+  ring's worth.
+*/
+void benchLog(int messages, bench_print print){
+  bench_log_thread t[BENCH_LOG_THREADS];
+  pthread_t threads[BENCH_LOG_THREADS];
+  uint64_t total = 0, worst = 0, start, ns, written, dropped;
+  FILE *null_out = NULL;
+  char line[128];
+  int i, n = 0;
+
+  if (messages < 1) messages = 1;
+  if (messages > LOG_RING_SLOTS) messages = LOG_RING_SLOTS;
+  memset(t, 0, sizeof(t));
+  for (i = 0; i < BENCH_LOG_THREADS; i++){
+    t[i].messages = messages;
+    if (pthread_create(&threads[i], NULL, benchLogThread, &t[i]) == 0)
+      n++;
+    else
+      t[i].messages = 0;
+  }
+  for (i = 0; i < BENCH_LOG_THREADS; i++){
+    if (t[i].messages == 0)
+      continue;
+    pthread_join(threads[i], NULL);
+    total += t[i].total;
+    if (t[i].worst > worst) worst = t[i].worst;
+  }
+  logFlush();
+  logCounts(&written, &dropped);
+  snprintf(line, sizeof(line), "Log rings, %d threads x %d: avg %5.0f ns max %6.0f ns", n, messages,
+           n ? (double) total / (n * messages) : 0.0, (double) worst);
+  print(line);
+
+  null_out = fopen("/dev/null", "w");
+  check (null_out, "Could not open /dev/null.");
+  setvbuf(null_out, NULL, _IOLBF, BUFSIZ);
+  total = worst = 0;
+  for (i = 0; i < messages; i++){
+    start = nowNs();
+    fprintf(null_out, ":> bench log %d of %d, depth %d mm\n", i, messages, 500 + i);
+    ns = nowNs() - start;
+    total += ns;
+    if (ns > worst) worst = ns;
+  }
+  snprintf(line, sizeof(line), "fprintf, 1 thread x %d:  avg %5.0f ns max %6.0f ns", messages,
+           (double) total / messages, (double) worst);
+  print(line);
+  snprintf(line, sizeof(line), "%d written, %d dropped since start", (int) written, (int) dropped);
+  print(line);
+  fclose(null_out);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+static bench_print hotplug_print;
+
+static void benchHotplugNotify(const char *line){
+  hotplug_print(line);
+}
+
+/*
+  The supervisor against the simulated device: it drops out every 200
+  services, alternately with a bus error and by going quiet, and misses
+  two scans before it is back. Backoff and stall limits are scaled down so
+  a run takes a second or two.
+*/
+void benchHotplug(int drops, bench_print print){
+  hotplug_backend be;
+  hotplug_sim sim;
+  hotplug h;
+  volatile int die = 0;
+  uint64_t start;
+  char line[128];
+
+  if (drops < 1) drops = 1;
+  if (drops > 50) drops = 50;
+  hotplug_print = print;
+  hotplugSimInit(&sim, &be, 200, 2);
+  sim.max_drops = drops;
+  sim.die = &die;
+  hotplugInit(&h, &be, benchHotplugNotify);
+  hotplugSetSerial(&h, "SIM0000000000");
+  h.backoff_min = 10;
+  h.backoff_max = 80;
+  h.stall_ms = 100;
+
+  start = nowNs();
+  hotplugRun(&h, &die);
+  snprintf(line, sizeof(line), "%d drops in %d ms: %d recovered, %d failed scans", (int) h.disconnects,
+           (int) ((nowNs() - start) / 1000000), (int) h.recoveries, (int) h.failed);
+  print(line);
+  snprintf(line, sizeof(line), "recovery avg %d ms, max %d ms, expected %d ms (%d scans)",
+           h.recovery.count ? (int) (h.recovery.sum_ns / h.recovery.count / 1000000) : 0,
+           (int) (h.recovery.max_ns / 1000000), 10 + 20 + 40, sim.absent + 1);
+  print(line);
+  print(h.recoveries == (uint64_t) drops && sim.opens == (uint64_t) drops ? "Every drop recovered."
+        : "Recovery did not match the drops.");
+}
+
+/*
+  Depth queries against a held synthetic frame: single pixels and a 64x64
+  region, next to what converting the whole frame to millimeters would
+  cost. The same frame packed to 11 bits must read back the same.
+*/
+void benchProbe(int probes, bench_print print){
+  frame_pool pool;
+  depth_probe pr;
+  probe_result r, rp, roi;
+  frame *f = NULL, *fp = NULL;
+  uint64_t start, t_point, t_roi, t_full;
+  uint16_t *mm = NULL;
+  int i, bad = 0, pixels = BENCH_W * BENCH_H, rois = probes / 100 + 1;
+  char line[128];
+
+  if (probes < 1) probes = 1;
+  memset(&pool, 0, sizeof(pool));
+  depthProbeInit(&pr, BENCH_W, BENCH_H);
+  check (framePoolInit(&pool, "Probe", 2, pixels * sizeof(uint16_t), 0) == 0, "Out of memory.");
+  f = frameAcquire(&pool);
+  fp = frameAcquire(&pool);
+  mm = malloc(pixels * sizeof(uint16_t));
+  check_mem(f && fp && mm);
+  benchSyntheticDepth((uint16_t *) f->data, BENCH_W, BENCH_H, 0);
+  packDepth((const uint16_t *) f->data, fp->data, 11, pixels);
+  f->host_ns = fp->host_ns = nowNs();
+
+  depthProbeHold(&pr, f, 0, DEPTH_NO_DATA);
+  start = nowNs();
+  for (i = 0; i < probes; i++)
+    depthProbePoint(&pr, (i * 7) % BENCH_W, (i * 13) % BENCH_H, &r);
+  t_point = nowNs() - start;
+  start = nowNs();
+  for (i = 0; i < rois; i++)
+    depthProbeRoi(&pr, 288, 208, 64, 64, &roi);
+  t_roi = (nowNs() - start) / rois;
+  start = nowNs();
+  for (i = 0; i < pixels; i++)
+    mm[i] = pr.lut11[((const uint16_t *) f->data)[i] & (PROBE_LUT_SIZE - 1)];
+  t_full = nowNs() - start;
+
+  // Packed against unpacked, every 97th pixel.
+  for (i = 0; i < pixels; i += 97){
+    depthProbeHold(&pr, f, 0, DEPTH_NO_DATA);
+    depthProbePoint(&pr, i % BENCH_W, i / BENCH_W, &r);
+    depthProbeHold(&pr, fp, 11, DEPTH_NO_DATA);
+    depthProbePoint(&pr, i % BENCH_W, i / BENCH_W, &rp);
+    if (r.mm != rp.mm || r.mm != mm[i])
+      bad++;
+  }
+
+  snprintf(line, sizeof(line), "Point probe %5.0f ns, %d per second", (double) t_point / probes,
+           (int) (probes * 1e9 / (t_point ? t_point : 1)));
+  print(line);
+  snprintf(line, sizeof(line), "64x64 roi   %5.1f us, median %d mm, %d to %d mm over %d pixels", t_roi / 1e3,
+           roi.mm, roi.min, roi.max, roi.valid);
+  print(line);
+  snprintf(line, sizeof(line), "Full frame  %5.1f us to convert, which probes never do", t_full / 1e3);
+  print(line);
+  print(bad ? "Packed probes do not match." : "Packed and unpacked probes match the table.");
+
+  depthProbeFree(&pr);
+  frameRelease(f);
+  frameRelease(fp);
+  framePoolFree(&pool);
+  free (mm);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  depthProbeFree(&pr);
+  frameRelease(f);
+  frameRelease(fp);
+  framePoolFree(&pool);
+  free (mm);
+}
+
+/*
+  A floor `height` meters below a camera pitched `pitch` degrees, up to a
+  wall 6 m ahead, in millimeters with noise growing with the square of
+  the depth like the Kinect's, and a few holes.
+*/
+static void floorScene(uint16_t *mm, const depth_intrinsics *k, double pitch, double height){
+  double s = sin(pitch * M_PI / 180.0), c = cos(pitch * M_PI / 180.0), dy, up, fwd, z, zw;
+  uint32_t h = 12345;
+  int u, v;
+
+  for (v = 0; v < BENCH_H; v++)
+    for (u = 0; u < BENCH_W; u++){
+      dy = (v - k->cy) / k->fy;
+      up = -c * dy + s;
+      fwd = s * dy + c;
+      z = up < 0 ? -height / up : 1e9;
+      zw = fwd > 0 ? 6.0 / fwd : 1e9;
+      if (zw < z)
+        z = zw;
+      h = h * 1664525 + 1013904223;
+      z += 0.0028 * z * z * ((int) (h >> 16 & 0xff) - 128) / 128.0;
+      *mm++ = z < 0.5 || z > 8 || (h >> 8 & 0x1f) == 0 ? 0 : (uint16_t) (z * 1000);
+    }
+}
+
+/*
+  Floor fits on a camera swept through four pitches, the accelerometer
+  agreeing, or on every frame of a depth clip from `record` when `path`
+  is given, which has no accelerometer and should hold one pitch.
+*/
+void benchFloor(const char *path, bench_print print){
+  static const double pitches[] = { -25, -15, -10, -5 };
+  work_pool pool;
+  frame_pool frames;
+  depth_probe pr;
+  floor_estimator fl;
+  floor_fit fit;
+  tilt_state accel;
+  krec_header hdr;
+  krec_frame meta;
+  frame *f = NULL;
+  FILE *in = NULL;
+  uint64_t worst = 0, total = 0;
+  double sum = 0, sum2 = 0, lo = 90, hi = -90, height = 0;
+  int i, n, fitted = 0, bad = 0;
+  char line[160];
+
+  workPoolInit(&pool, get_nprocs() - 1, 1);
+  memset(&frames, 0, sizeof(frames));
+  memset(&fl, 0, sizeof(fl));
+  depthProbeInit(&pr, BENCH_W, BENCH_H);
+  check (floorInit(&fl, &pr, &pool, NULL, NULL) == 0, "Out of memory.");
+
+  if (!path){
+    check (framePoolInit(&frames, "Floor", 1, BENCH_W * BENCH_H * sizeof(uint16_t), 0) == 0, "Out of memory.");
+    check_mem(f = frameAcquire(&frames));
+    memset(&accel, 0, sizeof(accel));
+    accel.valid = 1;
+    snprintf(line, sizeof(line), "Floor fit %dx%d points, %d hypotheses on %d bands", fl.cols, fl.rows, FLOOR_ITERATIONS, pool.bands);
+    print(line);
+    for (i = 0; i < 4; i++){
+      floorScene((uint16_t *) f->data, &fl.k, pitches[i], 1.2);
+      f->seq = i;
+      f->host_ns = nowNs();
+      depthProbeHold(&pr, f, 0, 0);
+      accel.ay = 9.81 * cos(pitches[i] * M_PI / 180.0);
+      accel.az = 9.81 * sin(pitches[i] * M_PI / 180.0);
+      worst = total = 0;
+      for (n = 0; n < 50; n++){
+        if (floorFit(&fl, &accel, &fit) != 0)
+          break;
+        total += fit.fit_ns;
+        if (fit.fit_ns > worst) worst = fit.fit_ns;
+      }
+      if (!fit.valid || fabs(fit.pitch - pitches[i]) > 0.5 || fabs(fit.height - 1.2) > 0.02)
+        bad++;
+      snprintf(line, sizeof(line), "pitch %5.1f: fit %6.2f roll %5.2f, %.3f m up, %d of %d inliers, %.2f ms, worst %.2f ms",
+               pitches[i], fit.pitch, fit.roll, fit.height, fit.inliers, fit.points, n ? total / 1e6 / n : 0, worst / 1e6);
+      print(line);
+    }
+    print(bad ? "Floor fits off by more than half a degree or 2 cm." : "Every pitch recovered within half a degree and 2 cm.");
+  }
+  else {
+    check ((in = fopen(path, "rb")) != NULL, "Could not open the clip.");
+    check (fread(&hdr, sizeof(hdr), 1, in) == 1 && memcmp(hdr.magic, "KREC", 4) == 0, "Not a .krec clip.");
+    check (hdr.stream == KREC_DEPTH && hdr.width == BENCH_W && hdr.height == BENCH_H, "Not a 640x480 depth clip.");
+    check (framePoolInit(&frames, "Floor", 1, hdr.frame_bytes, 0) == 0, "Out of memory.");
+    check_mem(f = frameAcquire(&frames));
+    for (n = 0; fread(&meta, sizeof(meta), 1, in) == 1; n++){
+      check (meta.bytes == hdr.frame_bytes && fread(f->data, 1, meta.bytes, in) == meta.bytes, "Clip ends in the middle of a frame.");
+      f->bytes = meta.bytes;
+      f->seq = meta.seq;
+      f->host_ns = nowNs();
+      depthProbeHold(&pr, f, modeDepthPackedBits(hdr.format), modeDepthNoData(hdr.format));
+      if (floorFit(&fl, NULL, &fit) != 0)
+        continue;
+      fitted++;
+      sum += fit.pitch;
+      sum2 += fit.pitch * fit.pitch;
+      height += fit.height;
+      if (fit.pitch < lo) lo = fit.pitch;
+      if (fit.pitch > hi) hi = fit.pitch;
+      total += fit.fit_ns;
+      if (fit.fit_ns > worst) worst = fit.fit_ns;
+    }
+    snprintf(line, sizeof(line), "Floor in %d of %d frames of %s", fitted, n, path);
+    print(line);
+    if (fitted){
+      sum /= fitted;
+      snprintf(line, sizeof(line), "pitch %.2f, sd %.2f, %.2f to %.2f, %.3f m up, fit %.2f ms, worst %.2f ms", sum,
+               sqrt(fabs(sum2 / fitted - sum * sum)), lo, hi, height / fitted, total / 1e6 / fitted, worst / 1e6);
+      print(line);
+    }
+  }
+
+  if (in)
+    fclose(in);
+  floorFree(&fl);
+  depthProbeFree(&pr);
+  frameRelease(f);
+  framePoolFree(&frames);
+  workPoolShutdown(&pool);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  if (in)
+    fclose(in);
+  floorFree(&fl);
+  depthProbeFree(&pr);
+  frameRelease(f);
+  framePoolFree(&frames);
+  workPoolShutdown(&pool);
+}
+
+/*
+  Voxel grid cost against voxel size on the floor scene, every band
+  inserting its rows, and the same frame on one band, which has to give
+  the same voxels.
+*/
+void benchVoxel(int frames, bench_print print){
+  static const int sizes[] = { 10, 20, 50, 100, 200 };
+  work_pool pool;
+  depth_probe pr;
+  voxel_grid vg;
+  depth_intrinsics k;
+  uint16_t *mm = NULL;
+  uint64_t start, t_total, total_n = 0, seq = 0;
+  int i, f, n, serial, bad = 0;
+  char line[160];
+
+  if (frames < 1) frames = 1;
+  workPoolInit(&pool, get_nprocs() - 1, 1);
+  memset(&vg, 0, sizeof(vg));
+  depthProbeInit(&pr, BENCH_W, BENCH_H);
+  check (voxelGridInit(&vg, &pr, NULL, pool.bands) == 0, "Out of memory.");
+  mm = malloc(BENCH_W * BENCH_H * sizeof(uint16_t));
+  check_mem(mm);
+  depthIntrinsicsDefault(&k);
+  floorScene(mm, &k, -15, 1.2);
+
+  snprintf(line, sizeof(line), "Voxel grid %dx%d, %d frames on %d bands", BENCH_W, BENCH_H, frames, pool.bands);
+  print(line);
+  for (i = 0; i < 5; i++){
+    voxelSetSize(&vg, sizes[i]);
+    stageTimerInit(&vg.insert, "voxel insert");
+    stageTimerInit(&vg.merge, "voxel merge");
+    start = nowNs();
+    for (f = 0; f < frames; f++)
+      voxelGridUpdate(&vg, &pool, mm, 0, seq++);
+    t_total = nowNs() - start;
+    n = vg.count[vg.front];
+    snprintf(line, sizeof(line), "%4d mm: %6d voxels of %d points, x%5.1f less, %5.2f ms: insert %5.2f merge %5.2f, lost %d",
+             sizes[i], n, (int) vg.in_points, n ? (double) vg.in_points / n : 0, t_total / 1e6 / frames,
+             vg.insert.sum_ns / 1e6 / frames, vg.merge.sum_ns / 1e6 / frames, (int) vg.merged.overflow);
+    print(line);
+
+    total_n = 0;
+    for (f = 0; f < n; f++)
+      total_n += vg.points[vg.front][f].n;
+    voxelGridUpdate(&vg, NULL, mm, 0, seq++);
+    serial = vg.count[vg.front];
+    if (vg.merged.overflow == 0 && serial != n)
+      bad++;
+    for (f = 0; f < serial; f++)
+      total_n -= vg.points[vg.front][f].n;
+    if (vg.merged.overflow == 0 && total_n != 0)
+      bad++;
+  }
+  print(bad ? "Banded and single band voxels differ." : "Banded and single band give the same voxels.");
+
+  voxelGridFree(&vg);
+  depthProbeFree(&pr);
+  workPoolShutdown(&pool);
+  free (mm);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  voxelGridFree(&vg);
+  depthProbeFree(&pr);
+  workPoolShutdown(&pool);
+  free (mm);
+}
+
+/*
+  A checkerboard seen through a known lens from `pose`, R row major and t
+  in millimeters: each pixel averages four samples, whose rays were
+  undistorted once into `rays`, and gets a little noise. The board has a
+  white border a square wide and hangs in front of a gray wall.
+*/
+static void calibScene(uint8_t *rgb, const float *rays, int cols, int rows, double square, const double *R, const double *t, uint32_t seed){
+  double n[3] = { R[2], R[5], R[8] }, nt = n[0] * t[0] + n[1] * t[1] + n[2] * t[2], d, s, px, py, pz, X, Y;
+  int i, k, sum, g;
+
+  for (i = 0; i < BENCH_W * BENCH_H; i++){
+    sum = 0;
+    for (k = 0; k < 4; k++){
+      const float *r = rays + ((size_t) k * BENCH_W * BENCH_H + i) * 2;
+      d = n[0] * r[0] + n[1] * r[1] + n[2];
+      g = 90;
+      if (fabs(d) > 1e-9 && (s = nt / d) > 0){
+        px = s * r[0] - t[0];
+        py = s * r[1] - t[1];
+        pz = s - t[2];
+        X = (R[0] * px + R[3] * py + R[6] * pz) / square;
+        Y = (R[1] * px + R[4] * py + R[7] * pz) / square;
+        if (X >= -2 && Y >= -2 && X < cols + 1 && Y < rows + 1)
+          g = X < -1 || Y < -1 || X >= cols || Y >= rows || ((int) floor(X) + (int) floor(Y)) % 2 == 0 ? 235 : 25;
+      }
+      sum += g;
+    }
+    seed = seed * 1664525 + 1013904223;
+    g = sum / 4 + (int) (seed >> 28) - 8;
+    g = g < 0 ? 0 : g > 255 ? 255 : g;
+    rgb[3 * i] = g;
+    rgb[3 * i + 1] = g;
+    rgb[3 * i + 2] = g * 7 / 8;
+  }
+}
+
+// Rotation of rx then ry then rz degrees about the camera axes, row major.
+static void calibRotation(double rx, double ry, double rz, double *R){
+  double a = rx * M_PI / 180, b = ry * M_PI / 180, c = rz * M_PI / 180;
+  double ca = cos(a), sa = sin(a), cb = cos(b), sb = sin(b), cc = cos(c), sc = sin(c);
+
+  R[0] = cc * cb;
+  R[1] = cc * sb * sa - sc * ca;
+  R[2] = cc * sb * ca + sc * sa;
+  R[3] = sc * cb;
+  R[4] = sc * sb * sa + cc * ca;
+  R[5] = sc * sb * ca - cc * sa;
+  R[6] = -sb;
+  R[7] = cb * sa;
+  R[8] = cb * ca;
+}
+
+static double rayErrorMm(const depth_intrinsics *a, const depth_intrinsics *b, double u, double v, double range){
+  float ax, ay, bx, by;
+
+  depthIntrinsicsRay(a, u, v, &ax, &ay);
+  depthIntrinsicsRay(b, u, v, &bx, &by);
+  return hypot(ax - bx, ay - by) * range;
+}
+
+/*
+  Renders the board at `views` poses through a lens with distortion,
+  times detection on every frame and on a frame without the board, and
+  checks the solve recovers the lens.
+*/
+void benchCalib(int views, bench_print print){
+  const int cols = 9, rows = 6;
+  const double square = 30;
+  depth_intrinsics truth, nominal;
+  calibrator cal;
+  calib_view view;
+  calib_result res;
+  freenect_frame_mode mode;
+  uint8_t *rgb = NULL;
+  float *rays = NULL;
+  double R[9], t[3], cx, cy, z, ms, worst = 0, sum = 0;
+  uint64_t start, ns;
+  int i, k, u, v, found = 0, kept = 0, bad;
+  char line[200];
+
+  memset(&cal, 0, sizeof(cal));
+  memset(&truth, 0, sizeof(truth));
+  truth.fx = 588.0;
+  truth.fy = 585.5;
+  truth.cx = 316.3;
+  truth.cy = 245.8;
+  truth.k1 = -0.12;
+  truth.k2 = 0.09;
+  truth.p1 = 0.0012;
+  truth.p2 = -0.0008;
+  depthIntrinsicsDefault(&nominal);
+  memset(&mode, 0, sizeof(mode));
+  mode.video_format = FREENECT_VIDEO_RGB;
+  mode.width = BENCH_W;
+  mode.height = BENCH_H;
+  mode.bytes = BENCH_W * BENCH_H * 3;
+
+  check (views >= CALIB_MIN_VIEWS && views <= CALIB_MAX_VIEWS, "Bench calib takes 6 to 40 views.");
+  check (calibInit(&cal, NULL, NULL, NULL) == 0, "Out of memory.");
+  calibSetBoard(&cal, cols, rows, square);
+  rgb = malloc(BENCH_W * BENCH_H * 3);
+  rays = malloc((size_t) 4 * BENCH_W * BENCH_H * 2 * sizeof(float));
+  check_mem(rgb && rays);
+  for (k = 0; k < 4; k++)
+    for (v = 0; v < BENCH_H; v++)
+      for (u = 0; u < BENCH_W; u++){
+        i = (k * BENCH_W * BENCH_H + v * BENCH_W + u) * 2;
+        depthIntrinsicsRay(&truth, u + (k & 1 ? 0.25 : -0.25), v + (k & 2 ? 0.25 : -0.25), &rays[i], &rays[i + 1]);
+      }
+
+  snprintf(line, sizeof(line), "Checkerboard %dx%d inner corners of %.0f mm, %d views at 640x480 RGB", cols, rows, square, views);
+  print(line);
+  for (i = 0; i < views; i++){
+    // Spread over the view, 45 to 85 cm away, tilted up to 35 degrees either way.
+    z = 450 + 400 * ((i * 7) % views) / views;
+    calibRotation(35 * sin(i * 2.1), 35 * cos(i * 1.3), 20 * sin(i * 0.7), R);
+    cx = 0.22 * cos(i * 2.4);
+    cy = 0.16 * sin(i * 1.7);
+    for (k = 0; k < 3; k++)
+      t[k] = (k == 0 ? cx * z : k == 1 ? cy * z : z) - (R[k * 3] * (cols - 1) + R[k * 3 + 1] * (rows - 1)) * square / 2;
+    calibScene(rgb, rays, cols, rows, square, R, t, i + 1);
+    start = nowNs();
+    calibGray(rgb, &mode, cal.gray);
+    if (calibDetect(&cal, cal.gray, BENCH_W, BENCH_H, &view) > 0){
+      found++;
+      kept += calibAddView(&cal, &view) == 0;
+    }
+    ns = nowNs() - start;
+    sum += ns;
+    worst = ns > worst ? ns : worst;
+  }
+  ms = sum / views / 1e6;
+  snprintf(line, sizeof(line), "Board found in %d of %d views, %d kept: %.2f ms a frame, worst %.2f, %.0f fps on one core",
+           found, views, kept, ms, worst / 1e6, 1000 / ms);
+  print(line);
+
+  memset(rgb, 90, BENCH_W * BENCH_H * 3);
+  start = nowNs();
+  for (i = 0; i < 10; i++){
+    calibGray(rgb, &mode, cal.gray);
+    calibDetect(&cal, cal.gray, BENCH_W, BENCH_H, &view);
+  }
+  snprintf(line, sizeof(line), "Without a board: %.2f ms a frame", (nowNs() - start) / 1e6 / 10);
+  print(line);
+
+  check (calibSolve(&cal, BENCH_W, BENCH_H, &res) == 0, "Calibration did not converge.");
+  snprintf(line, sizeof(line), "Solved in %.1f ms: fx %.2f (%.2f) fy %.2f (%.2f) cx %.2f (%.2f) cy %.2f (%.2f)",
+           cal.solve_timer.last_ns / 1e6, res.k.fx, truth.fx, res.k.fy, truth.fy, res.k.cx, truth.cx, res.k.cy, truth.cy);
+  print(line);
+  snprintf(line, sizeof(line), "k1 %.4f (%.4f) k2 %.4f (%.4f) p1 %.5f (%.5f) p2 %.5f (%.5f), %.3f px rms, %d views dropped",
+           res.k.k1, truth.k1, res.k.k2, truth.k2, res.k.p1, truth.p1, res.k.p2, truth.p2, res.rms, res.dropped);
+  print(line);
+  snprintf(line, sizeof(line), "Image corner ray at 3 m: %.1f mm off with the nominal intrinsics, %.1f mm calibrated",
+           rayErrorMm(&nominal, &truth, 0, 0, 3000), rayErrorMm(&res.k, &truth, 0, 0, 3000));
+  print(line);
+  bad = fabs(res.k.fx - truth.fx) > 1 || fabs(res.k.fy - truth.fy) > 1 || fabs(res.k.cx - truth.cx) > 1 ||
+        fabs(res.k.cy - truth.cy) > 1 || rayErrorMm(&res.k, &truth, 0, 0, 3000) > 5;
+  print(bad ? "Calibration off by more than a pixel or 5 mm at 3 m." : "Lens recovered within a pixel, and 5 mm at 3 m.");
+
+  calibFree(&cal);
+  free (rgb);
+  free (rays);
+  return;
+
+ error:
+  print(USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  calibFree(&cal);
+  free (rgb);
+  free (rays);
+}
@@ -0,0 +1,27 @@
+#ifndef __bench_h__
+#define __bench_h__
+
+#include <stdint.h>
+#include "colormap.h"
+
+/*
+  Offline benchmarks on synthetic frames, run from the console. Results are
+  handed back one line at a time so the caller decides where they go.
+*/
+typedef void (*bench_print)(const char *line);
+
+void benchSyntheticDepth(uint16_t *depth, int width, int height, int seq);
+void benchThreads(colormap *cmap, int frames, bench_print print);
+void benchStats(colormap *cmap, int frames, bench_print print);
+void benchDemosaic(int frames, bench_print print);
+void benchUnpack(int frames, bench_print print);
+void benchAudio(int seconds, bench_print print);
+void benchMotion(int frames, bench_print print);
+void benchLog(int messages, bench_print print);
+void benchHotplug(int drops, bench_print print);
+void benchProbe(int probes, bench_print print);
+void benchFloor(const char *path, bench_print print);
+void benchVoxel(int frames, bench_print print);
+void benchCalib(int views, bench_print print);
+
+#endif
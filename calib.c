@@ -0,0 +1,1365 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "calib.h"
+#include "recorder.h"
+#include "dbg.h"
+
+#define GRID_SPAN (2 * CALIB_MAX_SIDE + 1)
+#define CALIB_SEEDS 8            // Strongest responses tried as the first corner of the board.
+#define CALIB_MIN_RESPONSE 64
+#define CALIB_ITERATIONS 100     // Levenberg-Marquardt steps.
+#define CALIB_INTRINSICS 8       // fx fy cx cy k1 k2 p1 p2
+#define CALIB_PARAMS (CALIB_INTRINSICS + 6)
+
+// The ChESS sampling ring, radius 5; n and n + 8 are opposite.
+static const int ring[16][2] = { {5, 0}, {5, 2}, {4, 4}, {2, 5}, {0, 5}, {-2, 5}, {-4, 4}, {-5, 2},
+                                 {-5, 0}, {-5, -2}, {-4, -4}, {-2, -5}, {0, -5}, {2, -5}, {4, -4}, {5, -2} };
+
+typedef struct {
+  double R[9];
+  double t[3];
+} calib_pose;
+
+static int calibStage(void *ctx, frame *f);
+
+// Registers the stage when `pl` is given, so before the pipeline starts.
+int calibInit(calibrator *cal, pipeline *pl, calib_notify_fn notify, calib_apply_fn apply){
+  memset(cal, 0, sizeof(*cal));
+  cal->pl = pl;
+  cal->notify = notify;
+  cal->apply = apply;
+  pthread_mutex_init(&cal->lock, NULL);
+  pthread_cond_init(&cal->cond, NULL);
+  stageTimerInit(&cal->detect, "calib detect");
+  stageTimerInit(&cal->solve_timer, "calib solve");
+  cal->gray = malloc(CALIB_MAX_WIDTH * CALIB_MAX_HEIGHT);
+  cal->resp = malloc(CALIB_MAX_WIDTH * CALIB_MAX_HEIGHT * sizeof(int32_t));
+  cal->views = malloc(CALIB_MAX_VIEWS * sizeof(calib_view));
+  check_mem(cal->gray && cal->resp && cal->views);
+  calibSetBoard(cal, CALIB_DEFAULT_COLS, CALIB_DEFAULT_ROWS, CALIB_DEFAULT_SQUARE_MM);
+  if (pl){
+    check (pipelineAdd(pl, "calibrate", calibStage, cal, 0, 0, 0) == 0, "No room for the calibration stage.");
+    pipelineEnable(pl, "calibrate", 0);
+  }
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  calibFree(cal);
+  return 1;
+}
+
+void calibFree(calibrator *cal){
+  free (cal->gray);
+  free (cal->resp);
+  free (cal->views);
+  cal->gray = NULL;
+  cal->resp = NULL;
+  cal->views = NULL;
+}
+
+static int boardValid(int cols, int rows, double square_mm){
+  return cols >= 3 && rows >= 3 && cols <= CALIB_MAX_SIDE && rows <= CALIB_MAX_SIDE &&
+         cols * rows <= CALIB_MAX_CORNERS && square_mm > 0;
+}
+
+// Also drops the views, which were of the old board.
+int calibSetBoard(calibrator *cal, int cols, int rows, double square_mm){
+  if (!boardValid(cols, rows, square_mm))
+    return 1;
+  cal->cols = cols;
+  cal->rows = rows;
+  cal->square_mm = square_mm;
+  cal->prev.count = 0;
+  pthread_mutex_lock(&cal->lock);
+  cal->nviews = 0;
+  pthread_mutex_unlock(&cal->lock);
+  return 0;
+}
+
+static int grayFormat(freenect_video_format format){
+  return format == FREENECT_VIDEO_RGB || format == FREENECT_VIDEO_YUV_RGB || format == FREENECT_VIDEO_BAYER ||
+         format == FREENECT_VIDEO_IR_8BIT || format == FREENECT_VIDEO_IR_10BIT;
+}
+
+/*
+  Gray image of a raw video frame. Bayer frames go through a 3x3 binomial
+  filter, which takes the colors of the mosaic in the same proportions
+  at every pixel without moving edges the way a 2x2 average would.
+*/
+int calibGray(const uint8_t *raw, const freenect_frame_mode *mode, uint8_t *gray){
+  const uint16_t *ir = (const uint16_t *) raw;
+  const uint8_t *p;
+  int w = mode->width, h = mode->height, x, y, i, n = w * h;
+
+  if (w > CALIB_MAX_WIDTH || h > CALIB_MAX_HEIGHT)
+    return 1;
+  switch (mode->video_format){
+  case FREENECT_VIDEO_RGB:
+  case FREENECT_VIDEO_YUV_RGB:
+    for (i = 0; i < n; i++, raw += 3)
+      gray[i] = (77 * raw[0] + 150 * raw[1] + 29 * raw[2]) >> 8;
+    return 0;
+  case FREENECT_VIDEO_IR_8BIT:
+    memcpy(gray, raw, n);
+    return 0;
+  case FREENECT_VIDEO_IR_10BIT:
+    for (i = 0; i < n; i++)
+      gray[i] = ir[i] > 1023 ? 255 : ir[i] >> 2;
+    return 0;
+  case FREENECT_VIDEO_BAYER:
+    memcpy(gray, raw, w);
+    memcpy(gray + (h - 1) * w, raw + (h - 1) * w, w);
+    for (y = 1; y < h - 1; y++){
+      p = raw + y * w;
+      gray[y * w] = p[0];
+      gray[y * w + w - 1] = p[w - 1];
+      for (x = 1; x < w - 1; x++)
+        gray[y * w + x] = (p[x - w - 1] + 2 * p[x - w] + p[x - w + 1] + 2 * p[x - 1] + 4 * p[x] + 2 * p[x + 1] +
+                           p[x + w - 1] + 2 * p[x + w] + p[x + w + 1]) >> 4;
+    }
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+/*
+  ChESS response: opposite samples on the ring agree at a corner and
+  neighbouring quarters disagree, where an edge makes opposite samples
+  differ and a blob makes the ring differ from the center. Returns the
+  largest response.
+*/
+static int32_t cornerResponse(calibrator *cal, const uint8_t *gray, int w, int h){
+  int off[16], x, y, n;
+  int32_t sum, diff, mean, ring_sum, r, best = 0, *out;
+  const uint8_t *p;
+
+  for (n = 0; n < 16; n++)
+    off[n] = ring[n][1] * w + ring[n][0];
+  memset(cal->resp, 0, (size_t) w * h * sizeof(int32_t));
+  for (y = 5; y < h - 5; y++){
+    p = gray + y * w;
+    out = cal->resp + y * w;
+    for (x = 5; x < w - 5; x++){
+      sum = diff = ring_sum = 0;
+      for (n = 0; n < 4; n++)
+        sum += abs(p[x + off[n]] + p[x + off[n + 8]] - p[x + off[n + 4]] - p[x + off[n + 12]]);
+      for (n = 0; n < 8; n++){
+        diff += abs(p[x + off[n]] - p[x + off[n + 8]]);
+        ring_sum += p[x + off[n]] + p[x + off[n + 8]];
+      }
+      mean = p[x] + p[x - 1] + p[x + 1] + p[x - w] + p[x + w];
+      r = sum - diff - abs(ring_sum - mean * 16 / 5);
+      if (r > 0){
+        out[x] = r;
+        if (r > best)
+          best = r;
+      }
+    }
+  }
+  return best;
+}
+
+static int candidateCompare(const void *a, const void *b){
+  const calib_candidate *ca = a, *cb = b;
+  return (cb->r > ca->r) - (cb->r < ca->r);
+}
+
+// Local maxima over 7x7 above `floor`, strongest first.
+static void findCandidates(calibrator *cal, int w, int h, int32_t floor){
+  const int32_t *resp = cal->resp;
+  int x, y, dx, dy, max;
+  int32_t r, q;
+
+  cal->ncand = 0;
+  for (y = 8; y < h - 8; y++)
+    for (x = 8; x < w - 8; x++){
+      if ((r = resp[y * w + x]) < floor)
+        continue;
+      max = 1;
+      for (dy = -3; dy <= 3 && max; dy++)
+        for (dx = -3; dx <= 3; dx++){
+          q = resp[(y + dy) * w + x + dx];
+          // A plateau keeps its last pixel in scan order.
+          if (q > r || (q == r && (dy > 0 || (dy == 0 && dx > 0)))){
+            max = 0;
+            break;
+          }
+        }
+      if (!max)
+        continue;
+      if (cal->ncand == CALIB_MAX_CANDIDATES)
+        goto done;
+      cal->cand[cal->ncand].x = x;
+      cal->cand[cal->ncand].y = y;
+      cal->cand[cal->ncand].r = r;
+      cal->ncand++;
+    }
+ done:
+  qsort(cal->cand, cal->ncand, sizeof(calib_candidate), candidateCompare);
+}
+
+// Closest unused candidate within `reach` of x, y, or -1.
+static int nearestCandidate(calibrator *cal, float x, float y, float reach){
+  float best = reach * reach, d, dx, dy;
+  int i, found = -1;
+
+  for (i = 0; i < cal->ncand; i++){
+    if (cal->used[i])
+      continue;
+    dx = cal->cand[i].x - x;
+    dy = cal->cand[i].y - y;
+    d = dx * dx + dy * dy;
+    if (d < best){
+      best = d;
+      found = i;
+    }
+  }
+  return found;
+}
+
+static inline int *gridCell(calibrator *cal, int i, int j){
+  return &cal->grid[(j + CALIB_MAX_SIDE) * GRID_SPAN + i + CALIB_MAX_SIDE];
+}
+
+static inline int gridHas(calibrator *cal, int i, int j){
+  return i >= -CALIB_MAX_SIDE && j >= -CALIB_MAX_SIDE && i <= CALIB_MAX_SIDE && j <= CALIB_MAX_SIDE && *gridCell(cal, i, j) >= 0;
+}
+
+/*
+  The step from corner i, j to its neighbour along di, dj: the step that
+  led to it, else the same step taken by a corner next to it, else the
+  seed's.
+*/
+static void gridStep(calibrator *cal, int i, int j, int di, int dj, const float *a, const float *b, float *sx, float *sy){
+  const calib_candidate *c = cal->cand, *p, *q;
+  int e;
+
+  if (gridHas(cal, i - di, j - dj)){
+    p = &c[*gridCell(cal, i, j)];
+    q = &c[*gridCell(cal, i - di, j - dj)];
+    *sx = p->x - q->x;
+    *sy = p->y - q->y;
+    return;
+  }
+  for (e = -1; e <= 1; e += 2)
+    if (gridHas(cal, i + e * dj, j + e * di) && gridHas(cal, i + e * dj + di, j + e * di + dj)){
+      p = &c[*gridCell(cal, i + e * dj + di, j + e * di + dj)];
+      q = &c[*gridCell(cal, i + e * dj, j + e * di)];
+      *sx = p->x - q->x;
+      *sy = p->y - q->y;
+      return;
+    }
+  *sx = di * a[0] + dj * b[0];
+  *sy = di * a[1] + dj * b[1];
+}
+
+/*
+  Grows the lattice from candidate `seed` and fills `idx` with the board's
+  corners row by row when it comes out exactly cols x rows, either way
+  round. Returns the corner spacing at the seed, 0 without a board.
+*/
+static float growGrid(calibrator *cal, int seed, int *idx){
+  static const int dirs[4][2] = { {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+  const calib_candidate *c = cal->cand, *s = &c[seed];
+  int qi[CALIB_MAX_CANDIDATES], qj[CALIB_MAX_CANDIDATES], head = 0, tail = 0;
+  int i, j, k, n, d, found = 1, side = cal->cols > cal->rows ? cal->cols : cal->rows;
+  int imin = 0, imax = 0, jmin = 0, jmax = 0;
+  float a[2], b[2], la, lb, best, dx, dy, sx, sy, len, cross;
+
+  memset(cal->used, 0, cal->ncand);
+  cal->used[seed] = 1;
+  n = nearestCandidate(cal, s->x, s->y, 1e9f);
+  if (n < 0)
+    return 0;
+  a[0] = c[n].x - s->x;
+  a[1] = c[n].y - s->y;
+  la = sqrtf(a[0] * a[0] + a[1] * a[1]);
+  // The second axis: the closest corner well off the first.
+  best = 1.6f * la;
+  d = -1;
+  for (k = 0; k < cal->ncand; k++){
+    if (k == seed || k == n)
+      continue;
+    dx = c[k].x - s->x;
+    dy = c[k].y - s->y;
+    len = sqrtf(dx * dx + dy * dy);
+    cross = fabsf(a[0] * dy - a[1] * dx);
+    if (len < best && cross > 0.7f * la * len){
+      best = len;
+      d = k;
+    }
+  }
+  if (d < 0)
+    return 0;
+  b[0] = c[d].x - s->x;
+  b[1] = c[d].y - s->y;
+  lb = best;
+  if (lb < 0.5f * la)
+    return 0;
+
+  for (k = 0; k < GRID_SPAN * GRID_SPAN; k++)
+    cal->grid[k] = -1;
+  *gridCell(cal, 0, 0) = seed;
+  qi[tail] = 0;
+  qj[tail++] = 0;
+  while (head < tail){
+    i = qi[head];
+    j = qj[head++];
+    for (d = 0; d < 4; d++){
+      if (abs(i + dirs[d][0]) >= side || abs(j + dirs[d][1]) >= side || gridHas(cal, i + dirs[d][0], j + dirs[d][1]))
+        continue;
+      gridStep(cal, i, j, dirs[d][0], dirs[d][1], a, b, &sx, &sy);
+      len = sqrtf(sx * sx + sy * sy);
+      k = nearestCandidate(cal, c[*gridCell(cal, i, j)].x + sx, c[*gridCell(cal, i, j)].y + sy, 0.3f * len);
+      if (k < 0)
+        continue;
+      cal->used[k] = 1;
+      *gridCell(cal, i + dirs[d][0], j + dirs[d][1]) = k;
+      if (++found > cal->cols * cal->rows || tail == CALIB_MAX_CANDIDATES)
+        return 0;
+      qi[tail] = i + dirs[d][0];
+      qj[tail++] = j + dirs[d][1];
+      imin = imin < qi[tail - 1] ? imin : qi[tail - 1];
+      imax = imax > qi[tail - 1] ? imax : qi[tail - 1];
+      jmin = jmin < qj[tail - 1] ? jmin : qj[tail - 1];
+      jmax = jmax > qj[tail - 1] ? jmax : qj[tail - 1];
+    }
+  }
+  if (found != cal->cols * cal->rows)
+    return 0;
+  if (imax - imin + 1 == cal->cols && jmax - jmin + 1 == cal->rows){
+    for (j = jmin; j <= jmax; j++)
+      for (i = imin; i <= imax; i++)
+        *idx++ = *gridCell(cal, i, j);
+  }
+  else if (imax - imin + 1 == cal->rows && jmax - jmin + 1 == cal->cols){
+    for (i = imin; i <= imax; i++)
+      for (j = jmin; j <= jmax; j++)
+        *idx++ = *gridCell(cal, i, j);
+  }
+  else
+    return 0;
+  return la < lb ? la : lb;
+}
+
+/*
+  Moves a corner to where the gradients around it all point through it,
+  the least squares point orthogonal to every gradient in the window.
+*/
+static int refineCorner(const uint8_t *gray, int w, int h, int half, float *x, float *y){
+  double a11, a12, a22, b1, b2, gx, gy, wt, det, nx, ny;
+  int cx, cy, dx, dy, iter, done;
+  const uint8_t *p;
+
+  for (iter = 0; iter < 10; iter++){
+    cx = (int) lrintf(*x);
+    cy = (int) lrintf(*y);
+    if (cx - half - 1 < 0 || cy - half - 1 < 0 || cx + half + 1 >= w || cy + half + 1 >= h)
+      return 1;
+    a11 = a12 = a22 = b1 = b2 = 0;
+    for (dy = -half; dy <= half; dy++)
+      for (dx = -half; dx <= half; dx++){
+        p = gray + (cy + dy) * w + cx + dx;
+        gx = p[1] - p[-1];
+        gy = p[w] - p[-w];
+        wt = exp(-(dx * dx + dy * dy) / (double) (half * half));
+        a11 += wt * gx * gx;
+        a12 += wt * gx * gy;
+        a22 += wt * gy * gy;
+        b1 += wt * (gx * gx * (cx + dx) + gx * gy * (cy + dy));
+        b2 += wt * (gx * gy * (cx + dx) + gy * gy * (cy + dy));
+      }
+    det = a11 * a22 - a12 * a12;
+    if (det <= 1e-6 * (a11 + a22) * (a11 + a22))
+      return 1;
+    nx = (a22 * b1 - a12 * b2) / det;
+    ny = (a11 * b2 - a12 * b1) / det;
+    done = fabs(nx - *x) + fabs(ny - *y) < 0.01;
+    *x = nx;
+    *y = ny;
+    if (done)
+      break;
+  }
+  return 0;
+}
+
+static float dist(const calib_view *v, int a, int b){
+  return hypotf(v->u[a] - v->u[b], v->v[a] - v->v[b]);
+}
+
+/*
+  Where the board is and how it is tilted, in ways that do not depend on
+  which of its symmetric orders the corners came out in: the center and
+  the square root of the area of its outline over the image width, and
+  the foreshortening of its two pairs of opposite sides, larger first.
+*/
+static void viewShape(calib_view *v, int cols, int rows, int width){
+  int c00 = 0, c10 = cols - 1, c01 = (rows - 1) * cols, c11 = rows * cols - 1;
+  float area, t1, t2;
+
+  v->shape[0] = (v->u[c00] + v->u[c10] + v->u[c01] + v->u[c11]) / 4 / width;
+  v->shape[1] = (v->v[c00] + v->v[c10] + v->v[c01] + v->v[c11]) / 4 / width;
+  area = 0.5f * fabsf((v->u[c11] - v->u[c00]) * (v->v[c01] - v->v[c10]) - (v->u[c01] - v->u[c10]) * (v->v[c11] - v->v[c00]));
+  v->shape[2] = sqrtf(area) / width;
+  t1 = fabsf(logf(dist(v, c00, c10) / dist(v, c01, c11)));
+  t2 = fabsf(logf(dist(v, c00, c01) / dist(v, c10, c11)));
+  v->shape[3] = t1 > t2 ? t1 : t2;
+  v->shape[4] = t1 > t2 ? t2 : t1;
+}
+
+static float viewDistance(const calib_view *a, const calib_view *b){
+  float d = 0, e;
+  int i;
+
+  for (i = 0; i < 5; i++)
+    if ((e = fabsf(a->shape[i] - b->shape[i])) > d)
+      d = e;
+  return d;
+}
+
+// Finds the board in a gray frame; returns its corner count, 0 when it is not all in view.
+int calibDetect(calibrator *cal, const uint8_t *gray, int width, int height, calib_view *out){
+  int idx[CALIB_MAX_CORNERS], s, i, n = cal->cols * cal->rows, half;
+  int32_t best;
+  float step;
+
+  out->count = 0;
+  if (width > CALIB_MAX_WIDTH || height > CALIB_MAX_HEIGHT)
+    return 0;
+  best = cornerResponse(cal, gray, width, height);
+  if (best < CALIB_MIN_RESPONSE)
+    return 0;
+  findCandidates(cal, width, height, best / 5 > CALIB_MIN_RESPONSE ? best / 5 : CALIB_MIN_RESPONSE);
+  if (cal->ncand < n)
+    return 0;
+  for (s = 0; s < CALIB_SEEDS && s < cal->ncand; s++){
+    if ((step = growGrid(cal, s, idx)) == 0)
+      continue;
+    half = (int) (step * 0.35f);
+    half = half < 2 ? 2 : half > 6 ? 6 : half;
+    for (i = 0; i < n; i++){
+      out->u[i] = cal->cand[idx[i]].x;
+      out->v[i] = cal->cand[idx[i]].y;
+      if (refineCorner(gray, width, height, half, &out->u[i], &out->v[i]) != 0 ||
+          fabsf(out->u[i] - cal->cand[idx[i]].x) > half || fabsf(out->v[i] - cal->cand[idx[i]].y) > half)
+        break;
+    }
+    if (i < n)
+      continue;
+    out->count = n;
+    viewShape(out, cal->cols, cal->rows, width);
+    return n;
+  }
+  return 0;
+}
+
+// Keeps a view unlike the kept ones: 0 when kept, 1 when too close to one, 2 when full.
+int calibAddView(calibrator *cal, const calib_view *view){
+  int i, res = 0;
+
+  pthread_mutex_lock(&cal->lock);
+  if (cal->nviews == CALIB_MAX_VIEWS)
+    res = 2;
+  for (i = 0; i < cal->nviews && res == 0; i++)
+    if (viewDistance(view, &cal->views[i]) < CALIB_MIN_CHANGE)
+      res = 1;
+  if (res == 0)
+    cal->views[cal->nviews++] = *view;
+  pthread_mutex_unlock(&cal->lock);
+  return res;
+}
+
+/*
+  Eigenvectors of a symmetric n x n matrix by cyclic Jacobi rotations,
+  small enough here for it to be exact and quick. `a` is destroyed; the
+  vector of the smallest eigenvalue goes to `vec`.
+*/
+static void smallestEigenvector(double *a, int n, double *vec){
+  double v[81], theta, t, c, s, g, h;
+  int p, q, k, sweep, min = 0;
+
+  for (p = 0; p < n * n; p++)
+    v[p] = p % (n + 1) == 0;
+  for (sweep = 0; sweep < 50; sweep++){
+    g = 0;
+    for (p = 0; p < n; p++)
+      for (q = p + 1; q < n; q++)
+        g += a[p * n + q] * a[p * n + q];
+    if (g < 1e-30)
+      break;
+    for (p = 0; p < n; p++)
+      for (q = p + 1; q < n; q++){
+        if (fabs(a[p * n + q]) < 1e-300)
+          continue;
+        theta = (a[q * n + q] - a[p * n + p]) / (2 * a[p * n + q]);
+        t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+        c = 1 / sqrt(t * t + 1);
+        s = t * c;
+        for (k = 0; k < n; k++){
+          g = a[k * n + p];
+          h = a[k * n + q];
+          a[k * n + p] = c * g - s * h;
+          a[k * n + q] = s * g + c * h;
+        }
+        for (k = 0; k < n; k++){
+          g = a[p * n + k];
+          h = a[q * n + k];
+          a[p * n + k] = c * g - s * h;
+          a[q * n + k] = s * g + c * h;
+        }
+        for (k = 0; k < n; k++){
+          g = v[k * n + p];
+          h = v[k * n + q];
+          v[k * n + p] = c * g - s * h;
+          v[k * n + q] = s * g + c * h;
+        }
+      }
+  }
+  for (p = 1; p < n; p++)
+    if (a[p * n + p] < a[min * n + min])
+      min = p;
+  for (k = 0; k < n; k++)
+    vec[k] = v[k * n + min];
+}
+
+// Solves a x = b in place for symmetric positive definite a, by Cholesky.
+static int choleskySolve(double *a, double *b, int n){
+  double s;
+  int i, j, k;
+
+  for (j = 0; j < n; j++){
+    s = a[j * n + j];
+    for (k = 0; k < j; k++)
+      s -= a[j * n + k] * a[j * n + k];
+    if (s <= 0)
+      return 1;
+    a[j * n + j] = sqrt(s);
+    for (i = j + 1; i < n; i++){
+      s = a[i * n + j];
+      for (k = 0; k < j; k++)
+        s -= a[i * n + k] * a[j * n + k];
+      a[i * n + j] = s / a[j * n + j];
+    }
+  }
+  for (i = 0; i < n; i++){
+    s = b[i];
+    for (k = 0; k < i; k++)
+      s -= a[i * n + k] * b[k];
+    b[i] = s / a[i * n + i];
+  }
+  for (i = n - 1; i >= 0; i--){
+    s = b[i];
+    for (k = i + 1; k < n; k++)
+      s -= a[k * n + i] * b[k];
+    b[i] = s / a[i * n + i];
+  }
+  return 0;
+}
+
+// Board plane to image, normalized DLT. H is row major with H[8] = 1.
+static int homography(calibrator *cal, const calib_view *v, double *H){
+  double ata[81], h[9], row[2][9], mu = 0, mv = 0, su = 0, mx, my, sx, X, Y, u, vv, hn[9], t[9];
+  int i, j, k, l, n = v->count;
+
+  for (i = 0; i < n; i++){
+    mu += v->u[i];
+    mv += v->v[i];
+  }
+  mu /= n;
+  mv /= n;
+  for (i = 0; i < n; i++)
+    su += hypot(v->u[i] - mu, v->v[i] - mv);
+  su = sqrt(2) * n / su;
+  mx = (cal->cols - 1) * cal->square_mm / 2;
+  my = (cal->rows - 1) * cal->square_mm / 2;
+  sx = sqrt(2) / (cal->square_mm * sqrt(((cal->cols * cal->cols - 1) + (cal->rows * cal->rows - 1)) / 12.0));
+
+  memset(ata, 0, sizeof(ata));
+  for (i = 0; i < n; i++){
+    X = ((i % cal->cols) * cal->square_mm - mx) * sx;
+    Y = ((i / cal->cols) * cal->square_mm - my) * sx;
+    u = (v->u[i] - mu) * su;
+    vv = (v->v[i] - mv) * su;
+    memset(row, 0, sizeof(row));
+    row[0][0] = row[1][3] = X;
+    row[0][1] = row[1][4] = Y;
+    row[0][2] = row[1][5] = 1;
+    row[0][6] = -u * X;
+    row[0][7] = -u * Y;
+    row[0][8] = -u;
+    row[1][6] = -vv * X;
+    row[1][7] = -vv * Y;
+    row[1][8] = -vv;
+    for (k = 0; k < 2; k++)
+      for (j = 0; j < 9; j++)
+        for (l = j; l < 9; l++)
+          ata[j * 9 + l] += row[k][j] * row[k][l];
+  }
+  for (j = 0; j < 9; j++)
+    for (k = 0; k < j; k++)
+      ata[j * 9 + k] = ata[k * 9 + j];
+  smallestEigenvector(ata, 9, h);
+
+  // H = inverse(Tu) hn Tx
+  for (i = 0; i < 3; i++){
+    hn[i * 3 + 0] = h[i * 3 + 0] * sx;
+    hn[i * 3 + 1] = h[i * 3 + 1] * sx;
+    hn[i * 3 + 2] = h[i * 3 + 2] - h[i * 3 + 0] * sx * mx - h[i * 3 + 1] * sx * my;
+  }
+  for (j = 0; j < 3; j++){
+    t[0 * 3 + j] = hn[0 * 3 + j] / su + mu * hn[2 * 3 + j];
+    t[1 * 3 + j] = hn[1 * 3 + j] / su + mv * hn[2 * 3 + j];
+    t[2 * 3 + j] = hn[2 * 3 + j];
+  }
+  if (fabs(t[8]) < 1e-12)
+    return 1;
+  for (i = 0; i < 9; i++)
+    H[i] = t[i] / t[8];
+  return 0;
+}
+
+/*
+  Zhang's closed form for the intrinsics, with zero skew, from the image
+  of the absolute conic. Pixels are first scaled by the image width about
+  its center, which keeps the system well conditioned.
+*/
+static int closedFormIntrinsics(const double *Hs, int views, int w, int h, double *q){
+  double vtv[36], b[6], H[9], vrow[3][6], v11[6], v22[6], norm, B11, B12, B22, B13, B23, B33, den, v0, lam, alpha, beta, u0;
+  const double *G;
+  int i, j, k, c;
+
+  memset(vtv, 0, sizeof(vtv));
+  for (i = 0; i < views; i++){
+    G = Hs + 9 * i;
+    norm = 0;
+    for (j = 0; j < 3; j++){
+      H[0 * 3 + j] = (G[0 * 3 + j] - 0.5 * w * G[2 * 3 + j]) / w;
+      H[1 * 3 + j] = (G[1 * 3 + j] - 0.5 * h * G[2 * 3 + j]) / w;
+      H[2 * 3 + j] = G[2 * 3 + j];
+    }
+    for (j = 0; j < 9; j++)
+      norm += H[j] * H[j];
+    for (j = 0; j < 9; j++)
+      H[j] /= sqrt(norm);
+    // v_ij of columns i, j; rows v12, v11 - v22 and the zero skew constraint.
+#define VIJ(a, b, out) \
+    do { \
+      out[0] = H[0 + a] * H[0 + b]; \
+      out[1] = H[0 + a] * H[3 + b] + H[3 + a] * H[0 + b]; \
+      out[2] = H[3 + a] * H[3 + b]; \
+      out[3] = H[6 + a] * H[0 + b] + H[0 + a] * H[6 + b]; \
+      out[4] = H[6 + a] * H[3 + b] + H[3 + a] * H[6 + b]; \
+      out[5] = H[6 + a] * H[6 + b]; \
+    } while (0)
+    VIJ(0, 1, vrow[0]);
+    VIJ(0, 0, v11);
+    VIJ(1, 1, v22);
+#undef VIJ
+    for (j = 0; j < 6; j++){
+      vrow[1][j] = v11[j] - v22[j];
+      vrow[2][j] = j == 1;
+    }
+    for (c = 0; c < 3; c++)
+      for (j = 0; j < 6; j++)
+        for (k = 0; k < 6; k++)
+          vtv[j * 6 + k] += vrow[c][j] * vrow[c][k];
+  }
+  smallestEigenvector(vtv, 6, b);
+  B11 = b[0];
+  B12 = b[1];
+  B22 = b[2];
+  B13 = b[3];
+  B23 = b[4];
+  B33 = b[5];
+  den = B11 * B22 - B12 * B12;
+  if (fabs(B11) < 1e-300 || fabs(den) < 1e-300)
+    return 1;
+  v0 = (B12 * B13 - B11 * B23) / den;
+  lam = B33 - (B13 * B13 + v0 * (B12 * B13 - B11 * B23)) / B11;
+  if (lam / B11 <= 0 || lam * B11 / den <= 0)
+    return 1;
+  alpha = sqrt(lam / B11);
+  beta = sqrt(lam * B11 / den);
+  u0 = -B13 * alpha * alpha / lam;
+  memset(q, 0, CALIB_INTRINSICS * sizeof(double));
+  q[0] = alpha * w;
+  q[1] = beta * w;
+  q[2] = u0 * w + 0.5 * w;
+  q[3] = v0 * w + 0.5 * h;
+  return q[0] < 0.2 * w || q[0] > 5.0 * w || q[1] < 0.2 * w || q[1] > 5.0 * w ||
+         q[2] < 0 || q[2] > w || q[3] < 0 || q[3] > h;
+}
+
+// The board's pose from its homography: R = [r1 r2 r1 x r2], in front of the camera.
+static void poseFromHomography(const double *q, const double *H, calib_pose *p){
+  double k[3][3], lam, n, d;
+  int c, i;
+
+  for (c = 0; c < 3; c++){
+    k[c][0] = (H[0 * 3 + c] - q[2] * H[2 * 3 + c]) / q[0];
+    k[c][1] = (H[1 * 3 + c] - q[3] * H[2 * 3 + c]) / q[1];
+    k[c][2] = H[2 * 3 + c];
+  }
+  lam = 2 / (sqrt(k[0][0] * k[0][0] + k[0][1] * k[0][1] + k[0][2] * k[0][2]) +
+             sqrt(k[1][0] * k[1][0] + k[1][1] * k[1][1] + k[1][2] * k[1][2]));
+  if (lam * k[2][2] < 0)
+    lam = -lam;
+  for (i = 0; i < 3; i++)
+    p->t[i] = lam * k[2][i];
+  n = sqrt(k[0][0] * k[0][0] + k[0][1] * k[0][1] + k[0][2] * k[0][2]);
+  for (i = 0; i < 3; i++)
+    k[0][i] /= n;
+  d = k[0][0] * k[1][0] + k[0][1] * k[1][1] + k[0][2] * k[1][2];
+  for (i = 0; i < 3; i++)
+    k[1][i] -= d * k[0][i];
+  n = sqrt(k[1][0] * k[1][0] + k[1][1] * k[1][1] + k[1][2] * k[1][2]);
+  for (i = 0; i < 3; i++)
+    k[1][i] /= n;
+  if (lam < 0)
+    for (i = 0; i < 3; i++){
+      k[0][i] = -k[0][i];
+      k[1][i] = -k[1][i];
+    }
+  for (i = 0; i < 3; i++){
+    p->R[i * 3 + 0] = k[0][i];
+    p->R[i * 3 + 1] = k[1][i];
+  }
+  p->R[2] = k[0][1] * k[1][2] - k[0][2] * k[1][1];
+  p->R[5] = k[0][2] * k[1][0] - k[0][0] * k[1][2];
+  p->R[8] = k[0][0] * k[1][1] - k[0][1] * k[1][0];
+}
+
+// R = exp([w]x) R, a rotation of the pose in the camera frame.
+static void rotate(double *R, const double *w){
+  double th = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]), a[3] = { 0, 0, 0 }, c, s, m[9], out[9];
+  int i, j;
+
+  if (th < 1e-15)
+    return;
+  for (i = 0; i < 3; i++)
+    a[i] = w[i] / th;
+  c = cos(th);
+  s = sin(th);
+  m[0] = c + a[0] * a[0] * (1 - c);
+  m[1] = a[0] * a[1] * (1 - c) - a[2] * s;
+  m[2] = a[0] * a[2] * (1 - c) + a[1] * s;
+  m[3] = a[1] * a[0] * (1 - c) + a[2] * s;
+  m[4] = c + a[1] * a[1] * (1 - c);
+  m[5] = a[1] * a[2] * (1 - c) - a[0] * s;
+  m[6] = a[2] * a[0] * (1 - c) - a[1] * s;
+  m[7] = a[2] * a[1] * (1 - c) + a[0] * s;
+  m[8] = c + a[2] * a[2] * (1 - c);
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++)
+      out[i * 3 + j] = m[i * 3] * R[j] + m[i * 3 + 1] * R[3 + j] + m[i * 3 + 2] * R[6 + j];
+  memcpy(R, out, sizeof(out));
+}
+
+static void project(const double *q, const calib_pose *p, double X, double Y, double *u, double *v){
+  double x = p->R[0] * X + p->R[1] * Y + p->t[0];
+  double y = p->R[3] * X + p->R[4] * Y + p->t[1];
+  double z = p->R[6] * X + p->R[7] * Y + p->t[2];
+  double r2, radial, xd, yd;
+
+  x /= z;
+  y /= z;
+  r2 = x * x + y * y;
+  radial = 1 + r2 * (q[4] + r2 * q[5]);
+  xd = x * radial + 2 * q[6] * x * y + q[7] * (r2 + 2 * x * x);
+  yd = y * radial + q[6] * (r2 + 2 * y * y) + 2 * q[7] * x * y;
+  *u = q[0] * xd + q[2];
+  *v = q[1] * yd + q[3];
+}
+
+// Sum of squared reprojection errors of one view.
+static double viewCost(calibrator *cal, const double *q, const calib_pose *p, const calib_view *v){
+  double cost = 0, u, w;
+  int i;
+
+  for (i = 0; i < v->count; i++){
+    project(q, p, (i % cal->cols) * cal->square_mm, (i / cal->cols) * cal->square_mm, &u, &w);
+    cost += (u - v->u[i]) * (u - v->u[i]) + (w - v->v[i]) * (w - v->v[i]);
+  }
+  return cost;
+}
+
+// Moves a copy of the parameters by `step`: intrinsics, then rotation and translation of each view.
+static void applyStep(const double *q, const calib_pose *poses, int views, const double *step, double *q2, calib_pose *poses2){
+  int i, k;
+
+  for (k = 0; k < CALIB_INTRINSICS; k++)
+    q2[k] = q[k] + step[k];
+  for (i = 0; i < views; i++){
+    poses2[i] = poses[i];
+    rotate(poses2[i].R, step + CALIB_INTRINSICS + 6 * i);
+    for (k = 0; k < 3; k++)
+      poses2[i].t[k] += step[CALIB_INTRINSICS + 6 * i + 3 + k];
+  }
+}
+
+/*
+  Levenberg-Marquardt over every corner of every view. Each view's
+  residuals depend only on the intrinsics and its own pose, so its
+  Jacobian is 14 columns, taken by forward differences, and the normal
+  equations are filled block by block.
+*/
+static int refine(calibrator *cal, int views, double *q, calib_pose *poses, double *view_rms){
+  int n = CALIB_INTRINSICS + 6 * views, i, j, k, l, v, it, tries, col[CALIB_PARAMS], pts;
+  double *jtj, *a, *g, *step, *jac, *base, *mem;
+  double q2[CALIB_INTRINSICS], h, u, w, cost = 0, trial = 0, mu = 1e-3, X, Y, dq[CALIB_INTRINSICS], rw[3];
+  calib_pose *trial_poses = NULL, pp;
+  const calib_view *cv;
+
+  // One block for the normal equations, their damped copy, and one view's Jacobian.
+  mem = malloc(((size_t) 2 * n * n + 2 * n + (CALIB_PARAMS + 1) * 2 * CALIB_MAX_CORNERS) * sizeof(double));
+  trial_poses = malloc(views * sizeof(calib_pose));
+  check_mem(mem && trial_poses);
+  jtj = mem;
+  a = jtj + (size_t) n * n;
+  g = a + (size_t) n * n;
+  step = g + n;
+  jac = step + n;
+  base = jac + CALIB_PARAMS * 2 * CALIB_MAX_CORNERS;
+
+  for (v = 0; v < views; v++)
+    cost += viewCost(cal, q, &poses[v], &cal->views[v]);
+  for (it = 0; it < CALIB_ITERATIONS; it++){
+    memset(jtj, 0, (size_t) n * n * sizeof(double));
+    memset(g, 0, n * sizeof(double));
+    for (v = 0; v < views; v++){
+      cv = &cal->views[v];
+      pts = cv->count;
+      for (k = 0; k < CALIB_INTRINSICS; k++)
+        col[k] = k;
+      for (k = 0; k < 6; k++)
+        col[CALIB_INTRINSICS + k] = CALIB_INTRINSICS + 6 * v + k;
+      for (i = 0; i < pts; i++){
+        project(q, &poses[v], (i % cal->cols) * cal->square_mm, (i / cal->cols) * cal->square_mm, &u, &w);
+        base[2 * i] = u - cv->u[i];
+        base[2 * i + 1] = w - cv->v[i];
+      }
+      for (k = 0; k < CALIB_PARAMS; k++){
+        memcpy(dq, q, sizeof(dq));
+        pp = poses[v];
+        if (k < CALIB_INTRINSICS){
+          h = 1e-6 * (fabs(q[k]) + 1e-2);
+          dq[k] += h;
+        }
+        else if (k < CALIB_INTRINSICS + 3){
+          h = 1e-7;
+          rw[0] = rw[1] = rw[2] = 0;
+          rw[k - CALIB_INTRINSICS] = h;
+          rotate(pp.R, rw);
+        }
+        else{
+          h = 1e-6 * (fabs(pp.t[k - CALIB_INTRINSICS - 3]) + 1);
+          pp.t[k - CALIB_INTRINSICS - 3] += h;
+        }
+        for (i = 0; i < pts; i++){
+          X = (i % cal->cols) * cal->square_mm;
+          Y = (i / cal->cols) * cal->square_mm;
+          project(dq, &pp, X, Y, &u, &w);
+          jac[k * 2 * pts + 2 * i] = (u - cv->u[i] - base[2 * i]) / h;
+          jac[k * 2 * pts + 2 * i + 1] = (w - cv->v[i] - base[2 * i + 1]) / h;
+        }
+      }
+      for (k = 0; k < CALIB_PARAMS; k++){
+        for (l = k; l < CALIB_PARAMS; l++){
+          h = 0;
+          for (i = 0; i < 2 * pts; i++)
+            h += jac[k * 2 * pts + i] * jac[l * 2 * pts + i];
+          jtj[col[k] * n + col[l]] += h;
+          if (col[k] != col[l])
+            jtj[col[l] * n + col[k]] += h;
+        }
+        h = 0;
+        for (i = 0; i < 2 * pts; i++)
+          h += jac[k * 2 * pts + i] * base[i];
+        g[col[k]] += h;
+      }
+    }
+
+    for (tries = 0; tries < 10; tries++){
+      memcpy(a, jtj, (size_t) n * n * sizeof(double));
+      for (j = 0; j < n; j++){
+        a[j * n + j] += mu * (jtj[j * n + j] + 1e-9);
+        step[j] = -g[j];
+      }
+      if (choleskySolve(a, step, n) == 0){
+        applyStep(q, poses, views, step, q2, trial_poses);
+        trial = 0;
+        for (v = 0; v < views; v++)
+          trial += viewCost(cal, q2, &trial_poses[v], &cal->views[v]);
+        if (trial < cost)
+          break;
+      }
+      mu *= 10;
+    }
+    if (tries == 10)
+      break;
+    memcpy(q, q2, sizeof(q2));
+    memcpy(poses, trial_poses, views * sizeof(calib_pose));
+    mu = mu / 10 > 1e-12 ? mu / 10 : 1e-12;
+    h = (cost - trial) / cost;
+    cost = trial;
+    if (h < 1e-10)
+      break;
+  }
+  for (v = 0; v < views; v++)
+    view_rms[v] = sqrt(viewCost(cal, q, &poses[v], &cal->views[v]) / cal->views[v].count);
+  free (mem);
+  free (trial_poses);
+  return q[0] > 0 && q[1] > 0 ? 0 : 1;
+
+ error:
+  free (USER_ERR_MSG);
+  free (mem);
+  free (trial_poses);
+  return 1;
+}
+
+/*
+  Calibrates on the kept views, all of `width` x `height`. The closed form
+  only seeds the refinement; should the views be too alike for it, the
+  usual Kinect focal length and the image center seed it instead.
+*/
+int calibSolve(calibrator *cal, int width, int height, calib_result *out){
+  double Hs[9 * CALIB_MAX_VIEWS], q[CALIB_INTRINSICS], rms[CALIB_MAX_VIEWS], sum = 0, worst = 0;
+  calib_pose poses[CALIB_MAX_VIEWS];
+  uint64_t start = nowNs();
+  int views, v, kept, pass, corners = 0;
+
+  pthread_mutex_lock(&cal->lock);
+  views = cal->nviews;
+  pthread_mutex_unlock(&cal->lock);
+  if (views < CALIB_MIN_VIEWS)
+    return 1;
+  memset(out, 0, sizeof(*out));
+  for (pass = 0; pass < 2; pass++){
+    for (v = 0; v < views; v++)
+      if (homography(cal, &cal->views[v], Hs + 9 * v) != 0)
+        return 1;
+    if (closedFormIntrinsics(Hs, views, width, height, q) != 0){
+      memset(q, 0, sizeof(q));
+      q[0] = q[1] = width * 594.21 / 640;
+      q[2] = width / 2.0;
+      q[3] = height / 2.0;
+    }
+    for (v = 0; v < views; v++)
+      poseFromHomography(q, Hs + 9 * v, &poses[v]);
+    if (refine(cal, views, q, poses, rms) != 0)
+      return 1;
+    sum = worst = 0;
+    corners = 0;
+    for (v = 0; v < views; v++){
+      sum += rms[v] * rms[v] * cal->views[v].count;
+      corners += cal->views[v].count;
+      worst = rms[v] > worst ? rms[v] : worst;
+    }
+    sum = sqrt(sum / corners);
+    if (pass == 1)
+      break;
+
+    // A view far off the others is most likely a board read in the wrong order.
+    for (v = kept = 0; v < views; v++)
+      kept += rms[v] <= 3 * sum || rms[v] <= 0.5;
+    if (kept == views || kept < CALIB_MIN_VIEWS)
+      break;
+    for (v = kept = 0; v < views; v++)
+      if (rms[v] <= 3 * sum || rms[v] <= 0.5)
+        cal->views[kept++] = cal->views[v];
+    out->dropped += views - kept;
+    views = kept;
+    pthread_mutex_lock(&cal->lock);
+    cal->nviews = kept;
+    pthread_mutex_unlock(&cal->lock);
+  }
+
+  out->k.fx = q[0];
+  out->k.fy = q[1];
+  out->k.cx = q[2];
+  out->k.cy = q[3];
+  out->k.k1 = q[4];
+  out->k.k2 = q[5];
+  out->k.p1 = q[6];
+  out->k.p2 = q[7];
+  out->width = width;
+  out->height = height;
+  out->ir = cal->frame_ir;
+  out->views = views;
+  out->rms = sum;
+  out->worst = worst;
+  stageTimerRecord(&cal->solve_timer, nowNs() - start);
+  return 0;
+}
+
+static int calibStage(void *ctx, frame *f){
+  calibrator *cal = ctx;
+  frame *old = NULL;
+
+  pthread_mutex_lock(&cal->lock);
+  if (cal->collecting && f->bytes == (size_t) cal->mode.bytes){
+    frameRef(f);
+    old = cal->latest;
+    cal->latest = f;
+    pthread_cond_signal(&cal->cond);
+  }
+  pthread_mutex_unlock(&cal->lock);
+  frameRelease(old);
+  return 0;
+}
+
+static void notifyLine(calibrator *cal, const char *line){
+  if (cal->notify)
+    cal->notify(line);
+}
+
+// One frame from the stream or a clip: find the board and keep the view if it is a new one.
+static void detectFrame(calibrator *cal, const uint8_t *data, const freenect_frame_mode *mode, uint64_t seq){
+  uint64_t start = nowNs();
+  int ir = mode->video_format == FREENECT_VIDEO_IR_8BIT || mode->video_format == FREENECT_VIDEO_IR_10BIT;
+  int found, still, kept = -1, views;
+  calib_view view;
+  char line[160];
+
+  if (calibGray(data, mode, cal->gray) != 0)
+    return;
+  if (cal->frame_w != mode->width || cal->frame_h != mode->height || cal->frame_ir != ir){
+    if (cal->nviews > 0)
+      notifyLine(cal, "The video mode changed, the calibration views so far are dropped.");
+    calibSetBoard(cal, cal->cols, cal->rows, cal->square_mm);
+    cal->frame_w = mode->width;
+    cal->frame_h = mode->height;
+    cal->frame_ir = ir;
+  }
+  found = calibDetect(cal, cal->gray, mode->width, mode->height, &view) > 0;
+  view.seq = seq;
+  stageTimerRecord(&cal->detect, nowNs() - start);
+
+  still = found && cal->prev.count > 0 &&
+          hypotf(view.shape[0] - cal->prev.shape[0], view.shape[1] - cal->prev.shape[1]) * mode->width < CALIB_STILL_PX &&
+          fabsf(view.shape[2] - cal->prev.shape[2]) * mode->width < CALIB_STILL_PX;
+  if (still)
+    kept = calibAddView(cal, &view);
+  if (found)
+    cal->prev = view;
+  else
+    cal->prev.count = 0;
+
+  pthread_mutex_lock(&cal->lock);
+  cal->frames++;
+  cal->found += found;
+  views = cal->nviews;
+  pthread_mutex_unlock(&cal->lock);
+  if (kept == 0){
+    snprintf(line, sizeof(line), "Calibration view %d kept, board at %d %d, frame %d.", views,
+             (int) (view.shape[0] * mode->width), (int) (view.shape[1] * mode->width), (int) seq);
+    notifyLine(cal, line);
+    if (views == CALIB_MIN_VIEWS)
+      notifyLine(cal, "Enough views to solve: calibrate solve. Boards tilted further and in the corners of the view make it better.");
+    if (views == CALIB_MAX_VIEWS)
+      notifyLine(cal, "Calibration has all the views it keeps: calibrate solve.");
+  }
+}
+
+// Every frame of a clip the video stream recorded, in order.
+static void replayClip(calibrator *cal, const char *path){
+  freenect_frame_mode mode;
+  krec_header hdr;
+  krec_frame meta;
+  uint8_t *buf = NULL;
+  FILE *in;
+  uint64_t frames = 0, found;
+  char line[CALIB_PATH_LEN + 100];
+  int views;
+
+  in = fopen(path, "rb");
+  check (in != NULL, "Could not open the clip.");
+  check (fread(&hdr, sizeof(hdr), 1, in) == 1 && memcmp(hdr.magic, "KREC", 4) == 0, "Not a .krec clip.");
+  check (hdr.stream == KREC_VIDEO, "Not a video clip, record it from the rgb or ir stream.");
+  memset(&mode, 0, sizeof(mode));
+  mode.video_format = (freenect_video_format) hdr.format;
+  mode.width = hdr.width;
+  mode.height = hdr.height;
+  mode.bytes = hdr.frame_bytes;
+  check (grayFormat(mode.video_format) && mode.width <= CALIB_MAX_WIDTH && mode.height <= CALIB_MAX_HEIGHT, "The clip's video format cannot be calibrated on.");
+  buf = malloc(hdr.frame_bytes);
+  check_mem(buf);
+  pthread_mutex_lock(&cal->lock);
+  found = cal->found;
+  pthread_mutex_unlock(&cal->lock);
+  while (!__atomic_load_n(&cal->quit, __ATOMIC_RELAXED) && fread(&meta, sizeof(meta), 1, in) == 1){
+    check (meta.bytes == hdr.frame_bytes && fread(buf, 1, meta.bytes, in) == meta.bytes, "The clip ends in the middle of a frame.");
+    detectFrame(cal, buf, &mode, meta.seq);
+    frames++;
+  }
+  pthread_mutex_lock(&cal->lock);
+  found = cal->found - found;
+  views = cal->nviews;
+  pthread_mutex_unlock(&cal->lock);
+  snprintf(line, sizeof(line), "Replayed %d frames of %s: board in %d, %d views kept.", (int) frames, path, (int) found, views);
+  notifyLine(cal, line);
+  free(buf);
+  fclose(in);
+  return;
+
+ error:
+  notifyLine(cal, USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  free (buf);
+  if (in)
+    fclose(in);
+}
+
+static void solveAndApply(calibrator *cal, const char *path){
+  calib_result res;
+  char line[CALIB_PATH_LEN + 200];
+  int views;
+
+  pthread_mutex_lock(&cal->lock);
+  views = cal->nviews;
+  pthread_mutex_unlock(&cal->lock);
+  if (views < CALIB_MIN_VIEWS){
+    snprintf(line, sizeof(line), "Calibration needs %d views, it has %d.", CALIB_MIN_VIEWS, views);
+    notifyLine(cal, line);
+    return;
+  }
+  if (calibSolve(cal, cal->frame_w, cal->frame_h, &res) != 0){
+    notifyLine(cal, "Calibration did not converge, collect views at other tilts and distances.");
+    return;
+  }
+  snprintf(line, sizeof(line), "Calibrated on %d views, %d dropped: fx %.2f fy %.2f cx %.2f cy %.2f k1 %.4f k2 %.4f, %.3f px rms, worst view %.3f.",
+           res.views, res.dropped, res.k.fx, res.k.fy, res.k.cx, res.k.cy, res.k.k1, res.k.k2, res.rms, res.worst);
+  notifyLine(cal, line);
+  if (calibWrite(path, &res) != 0){
+    snprintf(line, sizeof(line), "Could not write %s, the calibration is not applied.", path);
+    notifyLine(cal, line);
+    return;
+  }
+  pthread_mutex_lock(&cal->lock);
+  cal->last = res;
+  cal->calibrated = 1;
+  cal->solves++;
+  pthread_mutex_unlock(&cal->lock);
+  snprintf(line, sizeof(line), "Calibration written to %s.", path);
+  notifyLine(cal, line);
+  if (cal->apply)
+    cal->apply(&res);
+}
+
+static void *calibThread(void *arg){
+  calibrator *cal = arg;
+  freenect_frame_mode mode;
+  char path[CALIB_PATH_LEN];
+  frame *f;
+
+  pthread_mutex_lock(&cal->lock);
+  while (!cal->quit){
+    if (cal->reset){
+      cal->reset = 0;
+      pthread_mutex_unlock(&cal->lock);
+      calibSetBoard(cal, cal->req_cols, cal->req_rows, cal->req_square_mm);
+      cal->frame_w = cal->frame_h = 0;
+      pthread_mutex_lock(&cal->lock);
+    }
+    else if (cal->replay[0]){
+      strcpy(path, cal->replay);
+      cal->replay[0] = '\0';
+      pthread_mutex_unlock(&cal->lock);
+      replayClip(cal, path);
+      pthread_mutex_lock(&cal->lock);
+    }
+    else if (cal->solve){
+      cal->solve = 0;
+      strcpy(path, cal->path);
+      pthread_mutex_unlock(&cal->lock);
+      solveAndApply(cal, path);
+      pthread_mutex_lock(&cal->lock);
+    }
+    else if (cal->latest){
+      f = cal->latest;
+      cal->latest = NULL;
+      mode = cal->mode;
+      pthread_mutex_unlock(&cal->lock);
+      detectFrame(cal, f->data, &mode, f->seq);
+      frameRelease(f);
+      pthread_mutex_lock(&cal->lock);
+    }
+    else
+      pthread_cond_wait(&cal->cond, &cal->lock);
+  }
+  pthread_mutex_unlock(&cal->lock);
+  return NULL;
+}
+
+static int startThread(calibrator *cal){
+  if (cal->running)
+    return 0;
+  cal->quit = 0;
+  if (pthread_create(&cal->thread, NULL, calibThread, cal) != 0)
+    return 1;
+  cal->running = 1;
+  return 0;
+}
+
+/*
+  Starts collecting views from the video stream in `mode`, dropping any
+  kept so far. Returns 1 for a board out of range, 2 for a video format
+  without a gray image, 3 when the thread does not start.
+*/
+int calibStart(calibrator *cal, const freenect_frame_mode *mode, int cols, int rows, double square_mm){
+  if (!boardValid(cols, rows, square_mm))
+    return 1;
+  if (!grayFormat(mode->video_format) || mode->width > CALIB_MAX_WIDTH || mode->height > CALIB_MAX_HEIGHT)
+    return 2;
+  if (startThread(cal) != 0)
+    return 3;
+  pthread_mutex_lock(&cal->lock);
+  cal->mode = *mode;
+  cal->req_cols = cols;
+  cal->req_rows = rows;
+  cal->req_square_mm = square_mm;
+  cal->reset = 1;
+  cal->collecting = 1;
+  pthread_cond_signal(&cal->cond);
+  pthread_mutex_unlock(&cal->lock);
+  if (cal->pl)
+    pipelineEnable(cal->pl, "calibrate", 1);
+  return 0;
+}
+
+// Collects views from a .krec clip of the video stream instead, with the same returns.
+int calibReplay(calibrator *cal, const char *clip, int cols, int rows, double square_mm){
+  if (!boardValid(cols, rows, square_mm) || strlen(clip) >= CALIB_PATH_LEN)
+    return 1;
+  calibPause(cal);
+  if (startThread(cal) != 0)
+    return 3;
+  pthread_mutex_lock(&cal->lock);
+  cal->req_cols = cols;
+  cal->req_rows = rows;
+  cal->req_square_mm = square_mm;
+  cal->reset = 1;
+  strcpy(cal->replay, clip);
+  pthread_cond_signal(&cal->cond);
+  pthread_mutex_unlock(&cal->lock);
+  return 0;
+}
+
+// Stops taking frames from the stream; the views are kept for solving.
+void calibPause(calibrator *cal){
+  frame *old;
+
+  if (cal->pl)
+    pipelineEnable(cal->pl, "calibrate", 0);
+  pthread_mutex_lock(&cal->lock);
+  cal->collecting = 0;
+  old = cal->latest;
+  cal->latest = NULL;
+  pthread_mutex_unlock(&cal->lock);
+  frameRelease(old);
+}
+
+// Solves on the thread, which writes `path` and calls apply.
+int calibRequestSolve(calibrator *cal, const char *path){
+  if (strlen(path) >= CALIB_PATH_LEN || startThread(cal) != 0)
+    return 1;
+  pthread_mutex_lock(&cal->lock);
+  strcpy(cal->path, path);
+  cal->solve = 1;
+  pthread_cond_signal(&cal->cond);
+  pthread_mutex_unlock(&cal->lock);
+  return 0;
+}
+
+void calibStop(calibrator *cal){
+  calibPause(cal);
+  if (!cal->running)
+    return;
+  pthread_mutex_lock(&cal->lock);
+  cal->quit = 1;
+  pthread_cond_signal(&cal->cond);
+  pthread_mutex_unlock(&cal->lock);
+  pthread_join(cal->thread, NULL);
+  cal->running = 0;
+}
+
+// The last calibration, if there is one, and how collection is going.
+int calibRead(calibrator *cal, calib_result *out, int *views, int *collecting){
+  int res;
+
+  pthread_mutex_lock(&cal->lock);
+  *out = cal->last;
+  *views = cal->nviews;
+  *collecting = cal->collecting;
+  res = cal->calibrated;
+  pthread_mutex_unlock(&cal->lock);
+  return res;
+}
+
+// Written under a temporary name and renamed, so a crash never leaves half a file.
+int calibWrite(const char *path, const calib_result *res){
+  char tmp[CALIB_PATH_LEN + 8];
+  FILE *f;
+  int err;
+
+  if (strlen(path) >= CALIB_PATH_LEN)
+    return 1;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if (!f)
+    return 1;
+  fprintf(f, "# Kinect %s camera intrinsics, pixels of a %dx%d frame.\n", res->ir ? "IR" : "RGB", res->width, res->height);
+  fprintf(f, "camera %s\nwidth %d\nheight %d\n", res->ir ? "ir" : "rgb", res->width, res->height);
+  fprintf(f, "fx %.6f\nfy %.6f\ncx %.6f\ncy %.6f\n", res->k.fx, res->k.fy, res->k.cx, res->k.cy);
+  fprintf(f, "k1 %.8f\nk2 %.8f\np1 %.8f\np2 %.8f\n", res->k.k1, res->k.k2, res->k.p1, res->k.p2);
+  fprintf(f, "views %d\nrms %.4f\n", res->views, res->rms);
+  err = fflush(f) != 0 || ferror(f);
+  err |= fsync(fileno(f)) != 0;
+  err |= fclose(f) != 0;
+  if (err || rename(tmp, path) != 0){
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+// Returns 1 when the file does not open, 2 when it is not a whole calibration.
+int calibLoad(const char *path, calib_result *res){
+  struct { const char *key; double *val; } keys[] = {
+    { "fx", &res->k.fx }, { "fy", &res->k.fy }, { "cx", &res->k.cx }, { "cy", &res->k.cy },
+    { "k1", &res->k.k1 }, { "k2", &res->k.k2 }, { "p1", &res->k.p1 }, { "p2", &res->k.p2 }, { "rms", &res->rms } };
+  char line[128], key[32], val[64];
+  FILE *f;
+  int i, seen = 0;
+
+  f = fopen(path, "r");
+  if (!f)
+    return 1;
+  memset(res, 0, sizeof(*res));
+  while (fgets(line, sizeof(line), f)){
+    if (line[0] == '#' || sscanf(line, "%31s %63s", key, val) != 2)
+      continue;
+    if (strcmp(key, "camera") == 0)
+      res->ir = strcmp(val, "ir") == 0;
+    else if (strcmp(key, "width") == 0)
+      res->width = atoi(val);
+    else if (strcmp(key, "height") == 0)
+      res->height = atoi(val);
+    else if (strcmp(key, "views") == 0)
+      res->views = atoi(val);
+    for (i = 0; i < 9; i++)
+      if (strcmp(key, keys[i].key) == 0){
+        *keys[i].val = strtod(val, NULL);
+        seen |= 1 << i;
+      }
+  }
+  fclose(f);
+  return (seen & 0xF) == 0xF && res->k.fx > 0 && res->k.fy > 0 && res->width > 0 && res->height > 0 ? 0 : 2;
+}
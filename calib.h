@@ -0,0 +1,149 @@
+#ifndef __calib_h__
+#define __calib_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libfreenect.h"
+#include "framepool.h"
+#include "pipeline.h"
+#include "probe.h"
+#include "stats.h"
+
+#define CALIB_MAX_WIDTH 1280
+#define CALIB_MAX_HEIGHT 1024
+#define CALIB_MAX_SIDE 24           // Inner corners along a side of the board.
+#define CALIB_MAX_CORNERS 256
+#define CALIB_MAX_CANDIDATES 1024   // Corner responses considered per frame.
+#define CALIB_DEFAULT_COLS 9        // Inner corners, so a board of 10x7 squares.
+#define CALIB_DEFAULT_ROWS 6
+#define CALIB_DEFAULT_SQUARE_MM 25.0
+#define CALIB_MIN_VIEWS 6
+#define CALIB_MAX_VIEWS 40
+#define CALIB_MIN_CHANGE 0.06       // How far a new view has to be from every kept one, see viewDistance.
+#define CALIB_STILL_PX 2.0          // Board motion between two frames for a view to be kept.
+#define CALIB_PATH_LEN 200
+#define CALIB_DEFAULT_PATH "kinect_calib.txt"
+
+// Inner corners of one view of the board, row by row, in pixels.
+typedef struct {
+  int count;
+  float u[CALIB_MAX_CORNERS];
+  float v[CALIB_MAX_CORNERS];
+  float shape[5];          // Where and how tilted the board is, to tell views apart.
+  uint64_t seq;
+} calib_view;
+
+// A local maximum of the corner response.
+typedef struct {
+  int x, y;
+  int32_t r;
+} calib_candidate;
+
+typedef struct {
+  depth_intrinsics k;      // In pixels of the calibrated frames.
+  int width, height;
+  int ir;                  // Calibrated on IR frames, the depth camera's own.
+  int views;
+  int dropped;             // Views left out for not fitting the others.
+  double rms;              // Reprojection error over every corner, pixels.
+  double worst;            // Of the worst view.
+} calib_result;
+
+// Progress lines for the console, called on the calibration thread.
+typedef void (*calib_notify_fn)(const char *line);
+// Called on the calibration thread with every new calibration.
+typedef void (*calib_apply_fn)(const calib_result *res);
+
+/*
+  Intrinsic calibration of the video camera from a checkerboard, run on
+  its own thread. A sink stage of the video pipeline keeps a reference to
+  the latest frame, like the depth probe, so the thread always works on
+  the newest one and frames it is too slow for are simply never looked
+  at. Clips recorded from the video stream can be replayed through the
+  same detector instead.
+
+  Detection converts the frame to gray, scores every pixel with the ChESS
+  corner response, which only fires where four squares meet, and keeps
+  the local maxima. The board is then grown as a lattice from the
+  strongest of them, each corner predicted from its neighbours so the
+  perspective of a tilted board does not throw it off, and accepted only
+  when exactly cols x rows corners are found; those are refined to a
+  fraction of a pixel on the gradients around them. A view is kept when
+  the board holds still for two frames and sits somewhere, or at a tilt,
+  that no kept view already covers.
+
+  Solving follows Zhang: a homography per view gives the intrinsics in
+  closed form and the pose of every view, then Levenberg-Marquardt refines
+  the focal lengths, principal point, distortion and poses together over
+  every corner. Views that do not fit the others are dropped and the
+  solve repeated once.
+
+  `lock` guards the requests, the held frame and the counters; the views
+  and buffers belong to the thread, or to whoever calls calibDetect and
+  calibSolve on a calibrator without one.
+*/
+typedef struct {
+  pipeline *pl;
+  calib_notify_fn notify;
+  calib_apply_fn apply;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;
+  int quit;
+
+  // Requests for the thread.
+  int collecting;
+  freenect_frame_mode mode;
+  frame *latest;
+  int reset;               // Drop the views and take the req_ board.
+  int req_cols, req_rows;
+  double req_square_mm;
+  int solve;
+  char path[CALIB_PATH_LEN];
+  char replay[CALIB_PATH_LEN];
+
+  // Thread only.
+  int cols, rows;
+  double square_mm;
+  uint8_t *gray;
+  int32_t *resp;
+  int ncand;
+  calib_candidate cand[CALIB_MAX_CANDIDATES];
+  uint8_t used[CALIB_MAX_CANDIDATES];
+  int grid[(2 * CALIB_MAX_SIDE + 1) * (2 * CALIB_MAX_SIDE + 1)];
+  calib_view *views;
+  calib_view prev;         // Last frame's board, for the hold still check.
+  int frame_w, frame_h;    // Of the views.
+  int frame_ir;
+
+  // Under `lock`.
+  int nviews;
+  calib_result last;
+  int calibrated;
+  uint64_t frames;
+  uint64_t found;          // Frames with the whole board.
+  uint64_t solves;
+  stage_timer detect;
+  stage_timer solve_timer;
+} calibrator;
+
+int calibInit(calibrator *cal, pipeline *pl, calib_notify_fn notify, calib_apply_fn apply);
+void calibFree(calibrator *cal);
+int calibSetBoard(calibrator *cal, int cols, int rows, double square_mm);
+int calibStart(calibrator *cal, const freenect_frame_mode *mode, int cols, int rows, double square_mm);
+int calibReplay(calibrator *cal, const char *clip, int cols, int rows, double square_mm);
+void calibPause(calibrator *cal);
+int calibRequestSolve(calibrator *cal, const char *path);
+void calibStop(calibrator *cal);
+int calibRead(calibrator *cal, calib_result *out, int *views, int *collecting);
+
+int calibGray(const uint8_t *raw, const freenect_frame_mode *mode, uint8_t *gray);
+int calibDetect(calibrator *cal, const uint8_t *gray, int width, int height, calib_view *out);
+int calibAddView(calibrator *cal, const calib_view *view);
+int calibSolve(calibrator *cal, int width, int height, calib_result *out);
+int calibWrite(const char *path, const calib_result *res);
+int calibLoad(const char *path, calib_result *res);
+
+#endif
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "capture.h"
+#include "demosaic.h"
+#include "imgwrite.h"
+#include "modes.h"
+#include "unpack.h"
+#include "dbg.h"
+
+#define CAPTURE_IO_BUF (1 << 20)
+
+static int captureStage(void *ctx, frame *f);
+
+/*
+  Registers the stage, so before the pipeline starts. `work_bytes` must
+  hold the largest unpacked or demosaiced frame.
+*/
+int captureInit(capture_stream *c, const char *stream, pipeline *pl, size_t work_bytes, capture_notify_fn notify){
+  memset(c, 0, sizeof(*c));
+  c->stream = stream;
+  c->pl = pl;
+  c->notify = notify;
+  c->work_bytes = work_bytes;
+  stageTimerInit(&c->encode, "capture encode");
+  stageTimerInit(&c->sync, "capture sync");
+  c->work = malloc(work_bytes);
+  c->io_buf = malloc(CAPTURE_IO_BUF);
+  check_mem(c->work && c->io_buf);
+  check (pipelineAddAsync(pl, "capture", captureStage, c, CAPTURE_QUEUE) == 0, "No room for the capture stage.");
+  pipelineEnable(pl, "capture", 0);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  captureFree(c);
+  return 1;
+}
+
+void captureFree(capture_stream *c){
+  free (c->work);
+  free (c->io_buf);
+  c->work = NULL;
+  c->io_buf = NULL;
+}
+
+int captureFormatVideo(const freenect_frame_mode *mode, capture_format *fmt){
+  memset(fmt, 0, sizeof(*fmt));
+  fmt->width = mode->width;
+  fmt->height = mode->height;
+  fmt->maxval = 255;
+  switch (mode->video_format){
+  case FREENECT_VIDEO_RGB:
+  case FREENECT_VIDEO_YUV_RGB:
+    fmt->kind = CAPTURE_RGB8;
+    return 0;
+  case FREENECT_VIDEO_BAYER:
+    fmt->kind = CAPTURE_BAYER;
+    return 0;
+  case FREENECT_VIDEO_IR_8BIT:
+    fmt->kind = CAPTURE_GRAY8;
+    return 0;
+  case FREENECT_VIDEO_IR_10BIT:
+    fmt->kind = CAPTURE_GRAY16;
+    fmt->maxval = 1023;
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+int captureFormatDepth(const freenect_frame_mode *mode, capture_format *fmt){
+  memset(fmt, 0, sizeof(*fmt));
+  fmt->width = mode->width;
+  fmt->height = mode->height;
+  fmt->bits = modeDepthPackedBits(mode->depth_format);
+  fmt->kind = fmt->bits ? CAPTURE_PACKED : CAPTURE_GRAY16;
+  switch (mode->depth_format){
+  case FREENECT_DEPTH_MM:
+  case FREENECT_DEPTH_REGISTERED:
+    fmt->maxval = 10000;
+    break;
+  default:
+    fmt->maxval = modeDepthNoData(mode->depth_format);
+    break;
+  }
+  return 0;
+}
+
+static size_t workBytes(const capture_format *fmt){
+  size_t px = (size_t) fmt->width * fmt->height;
+  return fmt->kind == CAPTURE_BAYER ? px * 3 : (fmt->kind == CAPTURE_PACKED ? px * 2 : 0);
+}
+
+int captureBusy(capture_stream *c){
+  return __atomic_load_n(&c->remaining, __ATOMIC_ACQUIRE) > 0;
+}
+
+/*
+  Arm a burst of `frames` starting with the next frame. A path ending in
+  .png writes PNG, anything else PGM or PPM; the extension is replaced by
+  the stream name and frame sequence number.
+*/
+int captureStart(capture_stream *c, const capture_format *fmt, const char *path, int frames){
+  const char *dot, *slash;
+  size_t len;
+
+  check (!captureBusy(c), "A capture of this stream is still running.");
+  check (frames >= 1 && frames <= CAPTURE_MAX_FRAMES, "Capture 1 to 1000 frames.");
+  check (workBytes(fmt) <= c->work_bytes, "Frame too large to capture.");
+  dot = strrchr(path, '.');
+  slash = strrchr(path, '/');
+  if (dot && slash && dot < slash)
+    dot = NULL;
+  len = dot ? (size_t) (dot - path) : strlen(path);
+  check (len > 0 && len < CAPTURE_PATH_LEN, "Capture path too long.");
+
+  memcpy(c->prefix, path, len);
+  c->prefix[len] = '\0';
+  c->png = dot && strcmp(dot, ".png") == 0;
+  c->fmt = *fmt;
+  c->burst = frames;
+  c->last_seq = 0;
+  c->skipped = 0;
+  c->failed = 0;
+  c->first_ns = 0;
+  c->last_path[0] = '\0';
+  c->requested_ns = nowNs();
+  __atomic_store_n(&c->remaining, frames, __ATOMIC_RELEASE);
+  pipelineEnable(c->pl, "capture", 1);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+void captureCancel(capture_stream *c){
+  pipelineEnable(c->pl, "capture", 0);
+  __atomic_store_n(&c->remaining, 0, __ATOMIC_RELEASE);
+}
+
+// Pixels ready to write, converted into `work` when the raw layout needs it.
+static const void *capturePixels(capture_stream *c, const frame *f, int *channels, int *bits){
+  const capture_format *fmt = &c->fmt;
+
+  *channels = 1;
+  *bits = 16;
+  switch (fmt->kind){
+  case CAPTURE_GRAY8:
+    *bits = 8;
+    return f->data;
+  case CAPTURE_RGB8:
+    *channels = 3;
+    *bits = 8;
+    return f->data;
+  case CAPTURE_BAYER:
+    *channels = 3;
+    *bits = 8;
+    demosaicRows(f->data, c->work, fmt->width, fmt->height, 0, fmt->height);
+    return c->work;
+  case CAPTURE_PACKED:
+    unpackDepth(f->data, (uint16_t *) c->work, fmt->bits, fmt->width * fmt->height);
+    return c->work;
+  default:
+    return f->data;
+  }
+}
+
+// Durable once the data, the rename and the directory entry are on disk.
+static int writeFile(capture_stream *c, const frame *f, const char *path){
+  char tmp[sizeof(c->last_path) + 4];
+  const void *pixels;
+  int channels, bits, fd, err;
+  uint64_t start = nowNs(), mid;
+  FILE *out;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((out = fopen(tmp, "wb")) == NULL)
+    return 1;
+  setvbuf(out, c->io_buf, _IOFBF, CAPTURE_IO_BUF);
+  pixels = capturePixels(c, f, &channels, &bits);
+  if (c->png)
+    err = imageWritePng(out, pixels, c->fmt.width, c->fmt.height, channels, bits);
+  else
+    err = imageWritePnm(out, pixels, c->fmt.width, c->fmt.height, channels, bits, c->fmt.maxval);
+  err |= fflush(out) != 0;
+  mid = nowNs();
+  stageTimerRecord(&c->encode, mid - start);
+
+  err |= fsync(fileno(out)) != 0;
+  err |= fclose(out) != 0;
+  if (err || rename(tmp, path) != 0){
+    unlink(tmp);
+    return 1;
+  }
+  char dir[sizeof(tmp)];
+  snprintf(dir, sizeof(dir), "%s", path);
+  if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) >= 0){
+    fsync(fd);
+    close(fd);
+  }
+  stageTimerRecord(&c->sync, nowNs() - mid);
+  return 0;
+}
+
+static void captureReport(capture_stream *c, uint64_t last_ns){
+  char line[CAPTURE_PATH_LEN + 64];
+
+  if (!c->notify)
+    return;
+  snprintf(line, sizeof(line), "Capture %s: %d frames, %d skipped, %d failed, durable after %d to %d ms.",
+           c->stream, c->burst - c->failed, c->skipped, c->failed,
+           (int) (c->first_ns / 1000000), (int) (last_ns / 1000000));
+  c->notify(line);
+  if (c->last_path[0]){
+    snprintf(line, sizeof(line), "Last file: %s", c->last_path);
+    c->notify(line);
+  }
+}
+
+static int captureStage(void *ctx, frame *f){
+  capture_stream *c = ctx;
+  char path[sizeof(c->last_path)];
+  uint64_t done;
+
+  // Disabled with frames still queued, or frames from before the command.
+  if (__atomic_load_n(&c->remaining, __ATOMIC_ACQUIRE) <= 0 || f->host_ns < c->requested_ns)
+    return 0;
+
+  if (c->last_seq && f->seq != c->last_seq + 1)
+    c->skipped += (int) (f->seq - c->last_seq - 1);
+  c->last_seq = f->seq;
+
+  snprintf(path, sizeof(path), "%s-%s-%06llu.%s", c->prefix, c->stream, (unsigned long long) f->seq,
+           c->png ? "png" : (c->fmt.kind == CAPTURE_RGB8 || c->fmt.kind == CAPTURE_BAYER ? "ppm" : "pgm"));
+  if (writeFile(c, f, path) != 0)
+    c->failed++;
+  else{
+    memcpy(c->last_path, path, sizeof(path));
+    __atomic_add_fetch(&c->written, 1, __ATOMIC_RELAXED);
+  }
+  done = nowNs() - c->requested_ns;
+  if (c->first_ns == 0)
+    c->first_ns = done;
+
+  if (__atomic_sub_fetch(&c->remaining, 1, __ATOMIC_ACQ_REL) == 0){
+    pipelineEnable(c->pl, "capture", 0);
+    captureReport(c, done);
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __capture_h__
+#define __capture_h__
+
+#include <stdint.h>
+#include "libfreenect.h"
+#include "pipeline.h"
+#include "stats.h"
+
+#define CAPTURE_QUEUE 3
+#define CAPTURE_MAX_FRAMES 1000
+#define CAPTURE_PATH_LEN 200
+
+typedef enum {
+  CAPTURE_GRAY8,
+  CAPTURE_GRAY16,
+  CAPTURE_RGB8,
+  CAPTURE_BAYER,      // Demosaiced to RGB before writing.
+  CAPTURE_PACKED,     // Packed depth, unpacked to 16 bit gray.
+} capture_kind;
+
+// How the raw frames of a stream are laid out and what they are written as.
+typedef struct {
+  capture_kind kind;
+  int width, height;
+  int bits;           // Packed depth bits.
+  int maxval;         // Largest sample, for PNM.
+} capture_format;
+
+// Result lines for the console, called on the capture thread.
+typedef void (*capture_notify_fn)(const char *line);
+
+/*
+  Still capture of one stream, an async stage of its pipeline that stays
+  off until captureStart arms it for a burst. The stage thread gets each
+  frame by reference, so neither the frame callbacks nor the render loop
+  wait for it, and memory stays bounded by the stage queue however long
+  the burst is; frames the writer cannot keep up with are dropped by the
+  queue and reported as skipped.
+
+  Each file is written under a temporary name, fsynced, renamed into place
+  and the directory fsynced, and the time from the command to that point
+  is what gets reported.
+*/
+typedef struct {
+  const char *stream;
+  pipeline *pl;
+  capture_notify_fn notify;
+
+  // Set by captureStart before `remaining` is published.
+  capture_format fmt;
+  char prefix[CAPTURE_PATH_LEN];
+  int png;
+  int burst;
+  uint64_t requested_ns;
+
+  int remaining;      // Frames still to write, 0 when idle.
+  uint64_t last_seq;
+  int skipped;
+  int failed;
+  uint64_t first_ns;  // Command to the first durable file.
+  char last_path[CAPTURE_PATH_LEN + 32];
+
+  uint8_t *work;      // Unpacked or demosaiced frame.
+  size_t work_bytes;
+  char *io_buf;
+
+  uint64_t written;
+  stage_timer encode; // Encode and write.
+  stage_timer sync;   // fsync and rename.
+} capture_stream;
+
+int captureInit(capture_stream *c, const char *stream, pipeline *pl, size_t work_bytes, capture_notify_fn notify);
+void captureFree(capture_stream *c);
+int captureStart(capture_stream *c, const capture_format *fmt, const char *path, int frames);
+void captureCancel(capture_stream *c);
+int captureBusy(capture_stream *c);
+int captureFormatVideo(const freenect_frame_mode *mode, capture_format *fmt);
+int captureFormatDepth(const freenect_frame_mode *mode, capture_format *fmt);
+
+#endif
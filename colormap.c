@@ -0,0 +1,159 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "colormap.h"
+
+static const char *paletteNames[] = { "proximity", "rainbow", "gray", "clip", "jet" };
+
+static uint32_t rgb(int r, int g, int b){
+  return (uint32_t) r | ((uint32_t) g << 8) | ((uint32_t) b << 16);
+}
+
+// 0 at near, 255 at far, clamped.
+static int ramp(int raw, int near, int far){
+  if (raw <= near) return 0;
+  if (raw >= far) return 255;
+  return (raw - near) * 255 / (far - near);
+}
+
+static uint32_t jet(int t){
+  int r = 255 - abs(4 * t - 3 * 255) ;
+  int g = 255 - abs(4 * t - 2 * 255);
+  int b = 255 - abs(4 * t - 255);
+  r = r < 0 ? 0 : (r > 255 ? 255 : r);
+  g = g < 0 ? 0 : (g > 255 ? 255 : g);
+  b = b < 0 ? 0 : (b > 255 ? 255 : b);
+  return rgb(r, g, b);
+}
+
+static void buildTable(colormap *c, colormap_table *t){
+  int i;
+  for (i = 0; i < COLORMAP_ENTRIES; i++){
+    int pval = c->gamma[i];
+    int lb = pval & 0xff;
+    uint32_t v = 0;
+
+    if (i == COLORMAP_ENTRIES - 1){
+      t->lut[i] = 0;  // No data.
+      continue;
+    }
+
+    switch (c->palette){
+    case PALETTE_PROXIMITY:
+      switch (pval>>8){
+      case 0: v = rgb(255, 0, 0); break;
+      case 1: v = rgb(255, 255, 255); break;
+      default: v = 0; break;
+      }
+      break;
+
+    case PALETTE_RAINBOW:
+      switch (pval>>8){
+      case 0: v = rgb(255, 255-lb, 255-lb); break;
+      case 1: v = rgb(255, lb, 0); break;
+      case 2: v = rgb(255-lb, 255, 0); break;
+      case 3: v = rgb(0, 255, lb); break;
+      case 4: v = rgb(0, 255-lb, 255); break;
+      case 5: v = rgb(0, 0, 255-lb); break;
+      default: v = 0; break;
+      }
+      break;
+
+    case PALETTE_GRAY:
+      lb = 255 - ramp(i, c->near, c->far);
+      v = rgb(lb, lb, lb);
+      break;
+
+    case PALETTE_CLIP:
+      if (i >= c->near && i <= c->far){
+        lb = 255 - ramp(i, c->near, c->far);
+        v = rgb(lb, lb, lb);
+      }
+      break;
+
+    case PALETTE_JET:
+      v = jet(ramp(i, c->near, c->far));
+      break;
+    }
+    t->lut[i] = v;
+  }
+}
+
+void colormapInit(colormap *c){
+  int i;
+
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_init(&c->lock, NULL);
+  for (i = 0; i < COLORMAP_ENTRIES; i++){
+    float v = i/2048.0;
+    v = powf(v, 3)* 6;
+    c->gamma[i] = v*6*256;
+  }
+  // Raw depth grows with distance, so the alert band is a prefix.
+  c->near_limit = 0;
+  while (c->near_limit < COLORMAP_ENTRIES && (c->gamma[c->near_limit]>>8) == 0)
+    c->near_limit++;
+
+  c->palette = c->req_palette = PALETTE_PROXIMITY;
+  c->near = c->req_near = 400;
+  c->far = c->req_far = 1050;
+  stageTimerInit(&c->build, "colormap");
+  buildTable(c, &c->tables[0]);
+  c->active = &c->tables[0];
+}
+
+const colormap_table *colormapAcquire(colormap *c){
+  colormap_table *spare;
+  uint64_t start;
+
+  if (__atomic_load_n(&c->req_gen, __ATOMIC_ACQUIRE) == c->gen)
+    return c->active;
+
+  start = nowNs();
+  pthread_mutex_lock(&c->lock);
+  c->palette = c->req_palette;
+  c->near = c->req_near;
+  c->far = c->req_far;
+  c->gen = c->req_gen;
+  pthread_mutex_unlock(&c->lock);
+
+  spare = c->active == &c->tables[0] ? &c->tables[1] : &c->tables[0];
+  buildTable(c, spare);
+  __atomic_store_n(&c->active, spare, __ATOMIC_RELEASE);
+  stageTimerRecord(&c->build, nowNs() - start);
+  return spare;
+}
+
+// The published table as is, for readers other than the depth thread.
+const colormap_table *colormapActive(colormap *c){
+  return __atomic_load_n(&c->active, __ATOMIC_ACQUIRE);
+}
+
+int colormapSetPalette(colormap *c, const char *name){
+  size_t i;
+  for (i = 0; i < sizeof(paletteNames) / sizeof(paletteNames[0]); i++){
+    if (strcmp(name, paletteNames[i]) == 0){
+      pthread_mutex_lock(&c->lock);
+      c->req_palette = (PALETTE) i;
+      __atomic_add_fetch(&c->req_gen, 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&c->lock);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int colormapSetRange(colormap *c, int near, int far){
+  if (near < 0 || far >= COLORMAP_ENTRIES - 1 || near >= far)
+    return 1;
+  pthread_mutex_lock(&c->lock);
+  c->req_near = near;
+  c->req_far = far;
+  __atomic_add_fetch(&c->req_gen, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&c->lock);
+  return 0;
+}
+
+const char *colormapName(PALETTE palette){
+  return paletteNames[palette];
+}
@@ -0,0 +1,51 @@
+#ifndef __colormap_h__
+#define __colormap_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "stats.h"
+
+#define COLORMAP_ENTRIES 2048
+
+typedef enum { PALETTE_PROXIMITY, PALETTE_RAINBOW, PALETTE_GRAY, PALETTE_CLIP, PALETTE_JET } PALETTE;
+
+/*
+  Raw depth straight to RGB. Entries are 0x00BBGGRR so colorize stores a
+  pixel with a single 4 byte write; the spare byte is overwritten by the next
+  pixel.
+*/
+typedef struct {
+  uint32_t lut[COLORMAP_ENTRIES];
+} colormap_table;
+
+/*
+  Two tables, one published. Console commands only record a request and bump
+  `req_gen`; the depth thread rebuilds the spare table between frames in
+  colormapAcquire and then publishes it with an atomic pointer store, so a
+  frame never reads a table that is being written.
+*/
+typedef struct {
+  colormap_table tables[2];
+  colormap_table *active;
+  uint16_t gamma[COLORMAP_ENTRIES];
+  int near_limit;      // Raw values below this raise the proximity alert.
+
+  pthread_mutex_t lock;
+  PALETTE req_palette;
+  int req_near, req_far;
+  uint32_t req_gen;
+
+  PALETTE palette;
+  int near, far;       // Raw range the gray, clip and jet palettes stretch over.
+  uint32_t gen;
+  stage_timer build;
+} colormap;
+
+void colormapInit(colormap *c);
+const colormap_table *colormapAcquire(colormap *c);
+const colormap_table *colormapActive(colormap *c);
+int colormapSetPalette(colormap *c, const char *name);
+int colormapSetRange(colormap *c, int near, int far);
+const char *colormapName(PALETTE palette);
+
+#endif
@@ -0,0 +1,141 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "demosaic.h"
+
+/*
+  One output pixel from the rows above (u), at (c) and below (d). x0 and x1
+  are the left and right neighbor columns, already mirrored at the borders.
+*/
+static inline void demosaicPixel(const uint8_t *u, const uint8_t *c, const uint8_t *d,
+                                 int x, int x0, int x1, int odd_row, uint8_t *out){
+  int horiz = (c[x0] + c[x1] + 1) >> 1;
+  int vert = (u[x] + d[x] + 1) >> 1;
+  int cross = (horiz + vert + 1) >> 1;
+  int diag = (((u[x0] + u[x1] + 1) >> 1) + ((d[x0] + d[x1] + 1) >> 1) + 1) >> 1;
+
+  if (!odd_row){
+    if (!(x & 1)){ out[0] = horiz; out[1] = c[x]; out[2] = vert; }    // G on an R row
+    else { out[0] = c[x]; out[1] = cross; out[2] = diag; }           // R
+  }
+  else{
+    if (!(x & 1)){ out[0] = diag; out[1] = cross; out[2] = c[x]; }    // B
+    else { out[0] = vert; out[1] = c[x]; out[2] = horiz; }            // G on a B row
+  }
+}
+
+static inline void rowPointers(const uint8_t *bayer, int width, int height, int y,
+                               const uint8_t **u, const uint8_t **c, const uint8_t **d){
+  // Mirror one row out so the neighbor has the same parity as the missing one.
+  *c = bayer + (size_t) y * width;
+  *u = y > 0 ? *c - width : *c + width;
+  *d = y < height - 1 ? *c + width : *c - width;
+}
+
+void demosaicRowsScalar(const uint8_t *bayer, uint8_t *rgb, int width, int height, int y0, int y1){
+  const uint8_t *u, *c, *d;
+  int x, y;
+
+  for (y = y0; y < y1; y++){
+    uint8_t *out = rgb + (size_t) y * width * 3;
+    rowPointers(bayer, width, height, y, &u, &c, &d);
+    for (x = 0; x < width; x++)
+      demosaicPixel(u, c, d, x, x > 0 ? x - 1 : x + 1, x < width - 1 ? x + 1 : x - 1, y & 1, out + 3 * x);
+  }
+}
+
+#ifdef __SSE2__
+static inline __m128i select8(__m128i mask, __m128i a, __m128i b){
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/*
+  Sixteen pixels per step. All four neighbor averages are formed with pavgb
+  for every lane, then each lane keeps the ones its Bayer site needs. The
+  planes are interleaved to RGB through a small buffer, SSE2 has no byte
+  shuffle to do it in registers.
+*/
+static void demosaicRowSse2(const uint8_t *u, const uint8_t *c, const uint8_t *d,
+                            int width, int odd_row, uint8_t *out){
+  // x starts odd and steps by 16, so even lanes are odd columns.
+  const __m128i oddx = _mm_set1_epi16(0x00ff);
+  uint8_t r[16] __attribute__((aligned(16)));
+  uint8_t g[16] __attribute__((aligned(16)));
+  uint8_t b[16] __attribute__((aligned(16)));
+  int x, k;
+
+  // x = 0 needs the mirrored left neighbor, do it and the tail in scalar.
+  demosaicPixel(u, c, d, 0, 1, 1, odd_row, out);
+  for (x = 1; x + 16 < width; x += 16){
+    __m128i cl = _mm_loadu_si128((const __m128i *)(c + x - 1));
+    __m128i cc = _mm_loadu_si128((const __m128i *)(c + x));
+    __m128i cr = _mm_loadu_si128((const __m128i *)(c + x + 1));
+    __m128i ul = _mm_loadu_si128((const __m128i *)(u + x - 1));
+    __m128i uc = _mm_loadu_si128((const __m128i *)(u + x));
+    __m128i ur = _mm_loadu_si128((const __m128i *)(u + x + 1));
+    __m128i dl = _mm_loadu_si128((const __m128i *)(d + x - 1));
+    __m128i dc = _mm_loadu_si128((const __m128i *)(d + x));
+    __m128i dr = _mm_loadu_si128((const __m128i *)(d + x + 1));
+
+    __m128i horiz = _mm_avg_epu8(cl, cr);
+    __m128i vert = _mm_avg_epu8(uc, dc);
+    __m128i cross = _mm_avg_epu8(horiz, vert);
+    __m128i diag = _mm_avg_epu8(_mm_avg_epu8(ul, ur), _mm_avg_epu8(dl, dr));
+    __m128i vr, vg, vb;
+
+    if (!odd_row){
+      vr = select8(oddx, cc, horiz);
+      vg = select8(oddx, cross, cc);
+      vb = select8(oddx, diag, vert);
+    }
+    else{
+      vr = select8(oddx, vert, diag);
+      vg = select8(oddx, cc, cross);
+      vb = select8(oddx, horiz, cc);
+    }
+    _mm_store_si128((__m128i *) r, vr);
+    _mm_store_si128((__m128i *) g, vg);
+    _mm_store_si128((__m128i *) b, vb);
+
+    uint8_t *o = out + 3 * x;
+    for (k = 0; k < 16; k++){
+      o[3*k+0] = r[k];
+      o[3*k+1] = g[k];
+      o[3*k+2] = b[k];
+    }
+  }
+  for (; x < width; x++)
+    demosaicPixel(u, c, d, x, x - 1, x < width - 1 ? x + 1 : x - 1, odd_row, out + 3 * x);
+}
+#endif
+
+void demosaicRows(const uint8_t *bayer, uint8_t *rgb, int width, int height, int y0, int y1){
+#ifdef __SSE2__
+  const uint8_t *u, *c, *d;
+  int y;
+
+  for (y = y0; y < y1; y++){
+    rowPointers(bayer, width, height, y, &u, &c, &d);
+    demosaicRowSse2(u, c, d, width, y & 1, rgb + (size_t) y * width * 3);
+  }
+#else
+  demosaicRowsScalar(bayer, rgb, width, height, y0, y1);
+#endif
+}
+
+typedef struct {
+  const uint8_t *bayer;
+  uint8_t *rgb;
+  int width, height;
+} demosaic_job;
+
+static void demosaicBand(void *arg, int band, int y0, int y1){
+  demosaic_job *job = arg;
+  demosaicRows(job->bayer, job->rgb, job->width, job->height, y0, y1);
+}
+
+void demosaic(work_pool *pool, const uint8_t *bayer, uint8_t *rgb, int width, int height){
+  demosaic_job job = { bayer, rgb, width, height };
+  workPoolRun(pool, height, demosaicBand, &job);
+}
@@ -0,0 +1,17 @@
+#ifndef __demosaic_h__
+#define __demosaic_h__
+
+#include <stdint.h>
+#include "workpool.h"
+
+/*
+  Bilinear demosaic of the Kinect GRBG Bayer mosaic (rows alternate G R G R
+  and B G B G) into packed RGB. Borders mirror across one pixel of the same
+  color. demosaicRows is the SSE2 kernel, demosaicRowsScalar the plain loop
+  it is checked and benchmarked against.
+*/
+void demosaicRows(const uint8_t *bayer, uint8_t *rgb, int width, int height, int y0, int y1);
+void demosaicRowsScalar(const uint8_t *bayer, uint8_t *rgb, int width, int height, int y0, int y1);
+void demosaic(work_pool *pool, const uint8_t *bayer, uint8_t *rgb, int width, int height);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "depth_filter.h"
+#include "dbg.h"
+
+static const char *filterModeNames[] = { "none", "median3", "ema" };
+
+static void *alignedPlane(size_t bytes){
+  void *p = NULL;
+  if (posix_memalign(&p, 64, bytes) != 0)
+    return NULL;
+  return p;
+}
+
+int depthFilterInit(depth_filter *f, int width, int height){
+  size_t pix = (size_t) width * height;
+  int i;
+
+  memset(f, 0, sizeof(*f));
+  f->mode = f->req_mode = FILTER_NONE;
+  f->alpha = f->req_alpha = 64;
+  f->holes = f->req_holes = 0;
+  f->reset = 40;
+  f->hold = 15;
+  f->no_data = f->req_no_data = DEPTH_NO_DATA;
+  f->width = width;
+  f->height = height;
+  f->roi.w = width;
+  f->roi.h = height;
+  stageTimerInit(&f->timer, "filter");
+
+  for (i = 0; i < DEPTH_FILTER_HISTORY; i++){
+    f->history[i] = alignedPlane(pix * sizeof(uint16_t));
+    check_mem(f->history[i]);
+  }
+  f->ema = alignedPlane(pix * sizeof(uint32_t));
+  check_mem(f->ema);
+  f->age = alignedPlane(pix);
+  check_mem(f->age);
+  f->work = alignedPlane(pix * sizeof(uint16_t));
+  check_mem(f->work);
+  f->out = alignedPlane(pix * sizeof(uint16_t));
+  check_mem(f->out);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  depthFilterFree(f);
+  return 1;
+}
+
+void depthFilterFree(depth_filter *f){
+  int i;
+  for (i = 0; i < DEPTH_FILTER_HISTORY; i++){
+    free (f->history[i]);
+    f->history[i] = NULL;
+  }
+  free (f->ema);
+  free (f->age);
+  free (f->work);
+  free (f->out);
+  f->ema = NULL;
+  f->age = NULL;
+  f->work = f->out = NULL;
+}
+
+void depthFilterSetMode(depth_filter *f, FILTER_MODE mode){
+  __atomic_store_n(&f->req_mode, mode, __ATOMIC_RELEASE);
+}
+
+void depthFilterSetAlpha(depth_filter *f, int alpha){
+  if (alpha < 1) alpha = 1;
+  if (alpha > 256) alpha = 256;
+  __atomic_store_n(&f->req_alpha, alpha, __ATOMIC_RELEASE);
+}
+
+void depthFilterSetHoles(depth_filter *f, int on){
+  __atomic_store_n(&f->req_holes, on ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+void depthFilterSetNoData(depth_filter *f, uint16_t no_data){
+  __atomic_store_n(&f->req_no_data, no_data, __ATOMIC_RELEASE);
+}
+
+int depthFilterParseMode(const char *s, FILTER_MODE *mode){
+  size_t i;
+  for (i = 0; i < sizeof(filterModeNames) / sizeof(filterModeNames[0]); i++){
+    if (strcmp(s, filterModeNames[i]) == 0){
+      *mode = (FILTER_MODE) i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const char *depthFilterModeName(FILTER_MODE mode){
+  return filterModeNames[mode];
+}
+
+/*
+  Median of three planes. Holes are moved to the top of the range before the
+  min/max network so they lose against any valid sample, then mapped back.
+  Depth values fit in 15 bits, so the signed SSE2 min/max are safe.
+*/
+static void median3Row(const uint16_t *a, const uint16_t *b, const uint16_t *c, uint16_t *out, int n, uint16_t no_data){
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i nd = _mm_set1_epi16(no_data);
+  const __m128i top = _mm_set1_epi16(0x7fff);
+  for (; x + 8 <= n; x += 8){
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+    __m128i vc = _mm_loadu_si128((const __m128i *)(c + x));
+    __m128i h;
+    h = _mm_cmpeq_epi16(va, nd); va = _mm_or_si128(_mm_andnot_si128(h, va), _mm_and_si128(h, top));
+    h = _mm_cmpeq_epi16(vb, nd); vb = _mm_or_si128(_mm_andnot_si128(h, vb), _mm_and_si128(h, top));
+    h = _mm_cmpeq_epi16(vc, nd); vc = _mm_or_si128(_mm_andnot_si128(h, vc), _mm_and_si128(h, top));
+
+    __m128i lo = _mm_min_epi16(va, vb);
+    __m128i hi = _mm_max_epi16(va, vb);
+    __m128i m = _mm_max_epi16(lo, _mm_min_epi16(hi, vc));
+
+    h = _mm_cmpeq_epi16(m, top);
+    m = _mm_or_si128(_mm_andnot_si128(h, m), _mm_and_si128(h, nd));
+    _mm_storeu_si128((__m128i *)(out + x), m);
+  }
+#endif
+  for (; x < n; x++){
+    int va = a[x] == no_data ? 0x7fff : a[x];
+    int vb = b[x] == no_data ? 0x7fff : b[x];
+    int vc = c[x] == no_data ? 0x7fff : c[x];
+    int lo = va < vb ? va : vb;
+    int hi = va < vb ? vb : va;
+    int m = hi < vc ? hi : vc;
+    m = lo > m ? lo : m;
+    out[x] = m == 0x7fff ? no_data : m;
+  }
+}
+
+/*
+  Exponential filter in Q4, 32 bits wide so millimeter depth fits as well
+  as disparity. A pixel restarts from the new sample when it was empty or
+  jumped past the reset distance (something moved), and holds its last
+  value through up to `hold` frames of holes. Branch free so gcc
+  vectorizes it.
+*/
+static void emaRow(const uint16_t *in, uint32_t *ema, uint8_t *age, uint16_t *out, int n,
+                   int alpha, int reset, int hold, uint16_t no_data){
+  int x;
+  for (x = 0; x < n; x++){
+    int v = in[x];
+    uint32_t e = ema[x];
+    int hole = v == no_data;
+    int empty = e == DEPTH_FILTER_EMA_EMPTY;
+    int fresh = v << 4;
+    int d = fresh - (int) e;
+    int jump = d > (reset << 4) || d < -(reset << 4);
+    uint32_t ne = (int) e + ((d * alpha) >> 8);
+    int a = hole ? age[x] + (age[x] < 255) : 0;
+
+    ne = (empty || jump) ? fresh : ne;
+    ne = hole ? e : ne;
+    ne = (hole && a > hold) ? DEPTH_FILTER_EMA_EMPTY : ne;
+
+    ema[x] = ne;
+    age[x] = a;
+    out[x] = ne == DEPTH_FILTER_EMA_EMPTY ? no_data : (ne + 8) >> 4;
+  }
+}
+
+/*
+  Fill holes with the farthest valid 3x3 neighbor. Holes in Kinect depth are
+  mostly occlusion shadows next to a near edge, so the far side is the right
+  guess. Reads `src` only, so bands can share boundary rows, and never looks
+  outside the region since `src` is only valid there.
+*/
+static void holeFillRow(const uint16_t *src, uint16_t *out, int y, int stride, const depth_rect *r, uint16_t no_data){
+  const uint16_t *row = src + (size_t) y * stride;
+  const uint16_t *up = y > r->y ? row - stride : row;
+  const uint16_t *down = y < r->y + r->h - 1 ? row + stride : row;
+  int x, k, x1 = r->x + r->w;
+
+  memcpy(out + (size_t) y * stride + r->x, row + r->x, r->w * sizeof(uint16_t));
+  for (x = r->x; x < x1; x++){
+    if (row[x] != no_data)
+      continue;
+    int best = -1;
+    int xl = x > r->x ? x - 1 : x;
+    int xr = x < x1 - 1 ? x + 1 : x;
+    for (k = xl; k <= xr; k++){
+      if (up[k] != no_data && up[k] > best) best = up[k];
+      if (row[k] != no_data && row[k] > best) best = row[k];
+      if (down[k] != no_data && down[k] > best) best = down[k];
+    }
+    if (best >= 0)
+      out[(size_t) y * stride + x] = best;
+  }
+}
+
+static void temporalRow(depth_filter *f, size_t first, int count, uint16_t *dst){
+  switch (f->mode){
+  case FILTER_MEDIAN3:
+    memcpy(f->history[f->head] + first, f->in + first, count * sizeof(uint16_t));
+    if (f->frames < DEPTH_FILTER_HISTORY){
+      memcpy(dst + first, f->in + first, count * sizeof(uint16_t));
+    }
+    else{
+      median3Row(f->history[0] + first, f->history[1] + first, f->history[2] + first,
+                 dst + first, count, f->no_data);
+    }
+    break;
+
+  case FILTER_EMA:
+    emaRow(f->in + first, f->ema + first, f->age + first, dst + first, count,
+           f->alpha, f->reset, f->hold, f->no_data);
+    break;
+
+  case FILTER_NONE:
+    break;
+  }
+}
+
+static void temporalBand(void *arg, int band, int y0, int y1){
+  depth_filter *f = arg;
+  uint16_t *dst = f->holes ? f->work : f->out;
+  size_t w = f->width;
+  int y;
+
+  // A full width region is one contiguous run, let the row kernels see it whole.
+  if (f->roi.w == f->width){
+    temporalRow(f, (f->roi.y + y0) * w, (y1 - y0) * f->width, dst);
+    return;
+  }
+  for (y = f->roi.y + y0; y < f->roi.y + y1; y++)
+    temporalRow(f, y * w + f->roi.x, f->roi.w, dst);
+}
+
+static void holeBand(void *arg, int band, int y0, int y1){
+  depth_filter *f = arg;
+  const uint16_t *src = f->mode == FILTER_NONE ? f->in : f->work;
+  int y;
+  for (y = f->roi.y + y0; y < f->roi.y + y1; y++)
+    holeFillRow(src, f->out, y, f->width, &f->roi, f->no_data);
+}
+
+const uint16_t *depthFilterApply(depth_filter *f, work_pool *pool, const uint16_t *in, const depth_rect *roi){
+  FILTER_MODE mode = __atomic_load_n(&f->req_mode, __ATOMIC_ACQUIRE);
+  uint16_t no_data;
+  uint64_t start;
+
+  f->alpha = __atomic_load_n(&f->req_alpha, __ATOMIC_ACQUIRE);
+  f->holes = __atomic_load_n(&f->req_holes, __ATOMIC_ACQUIRE);
+  no_data = __atomic_load_n(&f->req_no_data, __ATOMIC_ACQUIRE);
+  // History outside a new region or in another depth format is stale, start
+  // over like a mode change.
+  if (mode != f->mode || no_data != f->no_data || memcmp(roi, &f->roi, sizeof(*roi)) != 0){
+    f->mode = mode;
+    f->no_data = no_data;
+    f->roi = *roi;
+    f->frames = 0;
+    f->head = 0;
+    memset(f->ema, 0xff, (size_t) f->width * f->height * sizeof(uint32_t));
+    memset(f->age, 0, (size_t) f->width * f->height);
+    stageTimerReset(&f->timer);
+  }
+
+  if (f->mode == FILTER_NONE && !f->holes)
+    return in;
+
+  start = nowNs();
+  f->in = in;
+  if (f->mode == FILTER_MEDIAN3){
+    f->head = (f->head + 1) % DEPTH_FILTER_HISTORY;
+    if (f->frames < DEPTH_FILTER_HISTORY)
+      f->frames++;
+  }
+
+  // The temporal pass only reads its own rows; hole filling reads one row
+  // across band edges, hence the separate join in between.
+  if (f->mode != FILTER_NONE)
+    workPoolRun(pool, f->roi.h, temporalBand, f);
+  if (f->holes)
+    workPoolRun(pool, f->roi.h, holeBand, f);
+
+  stageTimerRecord(&f->timer, nowNs() - start);
+  return f->out;
+}
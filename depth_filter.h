@@ -0,0 +1,67 @@
+#ifndef __depth_filter_h__
+#define __depth_filter_h__
+
+#include <stdint.h>
+#include "stats.h"
+#include "workpool.h"
+
+#define DEPTH_FILTER_HISTORY 3
+#define DEPTH_NO_DATA 2047
+#define DEPTH_FILTER_EMA_EMPTY 0xFFFFFFFFu
+
+typedef enum { FILTER_NONE, FILTER_MEDIAN3, FILTER_EMA } FILTER_MODE;
+
+// Region of a frame, in full frame pixels.
+typedef struct {
+  int x, y, w, h;
+} depth_rect;
+
+/*
+  Temporal depth filter, run before colorization.
+
+  History is planar: one full frame plane per slot, so a row band walks
+  contiguous memory in every plane and the per pixel work vectorizes across x.
+  The EMA plane is kept in 32 bit Q4 fixed point next to a per pixel hole age.
+
+  Settings are requested from the console thread with the Set functions and
+  picked up by the frame thread at the start of the next frame.
+*/
+typedef struct {
+  FILTER_MODE mode;
+  int alpha;        // EMA weight of the new sample, in 1/256.
+  int holes;        // Fill holes from valid 3x3 neighbors.
+  int reset;        // EMA restarts when a pixel jumps more than this (raw units).
+  int hold;         // Frames the EMA keeps a value through holes.
+  uint16_t no_data;
+
+  FILTER_MODE req_mode;
+  int req_alpha;
+  int req_holes;
+  uint16_t req_no_data;
+
+  int width, height;
+  int head;         // Newest history plane.
+  int frames;       // Planes filled since the last reset, up to DEPTH_FILTER_HISTORY.
+  uint16_t *history[DEPTH_FILTER_HISTORY];
+  uint32_t *ema;
+  uint8_t *age;
+  uint16_t *work;   // Temporal output when hole filling runs after it.
+  uint16_t *out;
+
+  const uint16_t *in;
+  depth_rect roi;   // Only this part of `out` is valid.
+  stage_timer timer;
+} depth_filter;
+
+int depthFilterInit(depth_filter *f, int width, int height);
+void depthFilterFree(depth_filter *f);
+const uint16_t *depthFilterApply(depth_filter *f, work_pool *pool, const uint16_t *in, const depth_rect *roi);
+
+void depthFilterSetMode(depth_filter *f, FILTER_MODE mode);
+void depthFilterSetAlpha(depth_filter *f, int alpha);
+void depthFilterSetHoles(depth_filter *f, int on);
+void depthFilterSetNoData(depth_filter *f, uint16_t no_data);
+int depthFilterParseMode(const char *s, FILTER_MODE *mode);
+const char *depthFilterModeName(FILTER_MODE mode);
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef __depth_proc_h__
+#define __depth_proc_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "colormap.h"
+#include "depth_filter.h"
+#include "framepool.h"
+#include "motion.h"
+#include "pipeline.h"
+#include "probe.h"
+#include "voxel.h"
+#include "stats.h"
+#include "workpool.h"
+
+#define DEPTH_HIST_BINS 2048
+
+// Products of the depth pipeline stages.
+#define DEPTH_RAW      1
+#define DEPTH_FILTERED 2
+#define DEPTH_IMAGE    4
+#define DEPTH_STATS    8
+
+/*
+  Raw depth statistics over the pixels a colorize pass touched, binned like
+  the colormap index. Values past the last bin land in it.
+*/
+typedef struct {
+  int min, max;
+  uint64_t sum;      // Over valid pixels.
+  int valid;
+  int total;
+  uint32_t hist[DEPTH_HIST_BINS];
+} depth_stats;
+
+/*
+  One colorize pass over a frame, split in row bands on a work pool. Reads
+  every `step`th pixel of the region at (x, y) and writes a packed
+  width x height RGB image through the colormap table. Pixels below
+  `near_limit` count for the proximity alert, `first` is reported as a full
+  frame index.
+
+  With `stats` set each band also fills its own depth_stats in the same pass,
+  and colorizeDepth merges them into `stats` once the bands joined.
+*/
+typedef struct {
+  const uint16_t *in;
+  const uint32_t *lut;
+  int near_limit;
+  uint8_t *out;
+  int stride;
+  int x, y;
+  int step;
+  int width;
+  uint16_t no_data;
+  int shift_left;    // (raw << shift_left) >> shift is the table index and histogram bin.
+  int shift;
+  depth_stats *stats;
+  int alert[WORK_POOL_MAX_THREADS + 1];
+  int first[WORK_POOL_MAX_THREADS + 1];
+  depth_stats band_stats[WORK_POOL_MAX_THREADS + 1];
+} colorize_job;
+
+void colorizeDepth(work_pool *pool, colorize_job *job, int height, int *alert, int *first);
+
+/*
+  Swap the freshly colorized width x height frame in `*out` with the
+  displayed back buffer. Runs on the depth processing thread.
+*/
+typedef void (*depth_publish_fn)(uint8_t **out, int width, int height);
+
+/*
+  Depth processing off the libfreenect thread.
+
+  depth_cb only publishes the frame libfreenect just filled as `ready` and
+  hands a free frame from the pool back with freenect_set_depth_buffer. The
+  processing thread takes the ready frame through the depth pipeline:
+  unpack, filter, colorize, stats and publish, the heavy ones in row bands
+  on the work pool. When frames arrive faster than they are processed the
+  older one is dropped and counted.
+*/
+typedef struct {
+  int width, height;
+  size_t frame_bytes;   // Size of one frame in the current depth format.
+  frame_handoff frames_in;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;
+  int quit;
+
+  work_pool *pool;
+  depth_filter *filter;
+  colormap *cmap;
+  uint8_t *out;
+  depth_publish_fn publish;
+
+  // Region and decimation, requested under `lock` and picked up per frame.
+  depth_rect req_roi;
+  int req_step;
+  depth_rect roi;
+  int step;
+  int out_w, out_h;
+
+  // Depth format, requested under `lock` like the region.
+  uint16_t req_no_data;
+  int req_shift_left, req_shift;
+  int req_packed_bits;
+  uint16_t no_data;
+  int shift_left, shift;
+
+  /*
+    Packed frames stay packed in the pool, 11/16 of the bytes through the
+    hand-off, and are unpacked once per frame into `unpacked`.
+  */
+  int packed_bits;
+  uint16_t *unpacked;
+
+  pipeline pipe;
+  motion_gate *motion;     // Scored by the motion stage when one was added.
+  depth_probe *probe;      // Holds the latest frame for depth queries.
+  voxel_grid *voxel;       // Downsampled by the voxel stage when one was added.
+  const uint16_t *raw;     // Unpacked input of the current frame.
+  const uint16_t *depth;   // Filtered, or `raw` with the filter off.
+
+  // Results of the latest frame.
+  int alert;
+  int first;
+
+  /*
+    Published statistics behind a sequence lock: odd while the depth thread
+    writes, readers copy and retry until they see the same even value.
+  */
+  uint32_t stats_seq;
+  depth_stats stats;
+  depth_stats stats_work;
+  colorize_job job;  // Large (per band histograms), kept off the stack.
+
+  uint64_t frames;
+  stream_meter meter;
+  stage_timer full;     // Pipeline cost of the last frames run on the whole frame.
+} depth_proc;
+
+int depthProcInit(depth_proc *p, int width, int height, frame_pool *frames, work_pool *pool, depth_filter *filter,
+                  colormap *cmap, depth_publish_fn publish);
+void depthProcFree(depth_proc *p);
+int depthProcStart(depth_proc *p);
+void depthProcStop(depth_proc *p);
+void *depthProcFillBuffer(depth_proc *p);
+void *depthProcPush(depth_proc *p, void *filled, uint32_t timestamp);
+int depthProcSetRoi(depth_proc *p, int x, int y, int w, int h);
+int depthProcSetDecimate(depth_proc *p, int step);
+int depthProcSetFormat(depth_proc *p, size_t frame_bytes, int packed_bits, uint16_t no_data, int shift_left, int shift);
+void depthProcReadStats(depth_proc *p, depth_stats *out, int with_hist);
+int depthProcAddMotion(depth_proc *p, motion_gate *g);
+int depthProcAddProbe(depth_proc *p, depth_probe *pr);
+int depthProcAddVoxel(depth_proc *p, voxel_grid *vg);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include "devqueue.h"
+
+void devQueueInit(dev_queue *q){
+  pthread_condattr_t attr;
+
+  memset(q, 0, sizeof(*q));
+  q->tilt_slot = -1;
+  q->led_last = -1;
+  pthread_mutex_init(&q->lock, NULL);
+  // Waiters pass CLOCK_MONOTONIC deadlines.
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&q->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  stageTimerInit(&q->latency, "device command");
+}
+
+static const char *ledName(int led){
+  switch (led){
+  case LED_OFF: return "off";
+  case LED_GREEN: return "green";
+  case LED_RED: return "red";
+  case LED_YELLOW: return "yellow";
+  case LED_BLINK_GREEN: return "blinking green";
+  case LED_BLINK_RED_YELLOW: return "blinking red and yellow";
+  default: return "unknown";
+  }
+}
+
+/*
+  Returns 0 when queued, 1 when folded into a waiting command or dropped as
+  redundant, -1 when the ring is full.
+*/
+int devQueuePost(dev_queue *q, dev_cmd_type type, int value){
+  dev_cmd *c;
+  int res = 0;
+
+  pthread_mutex_lock(&q->lock);
+  if (type == DEV_CMD_TILT && q->tilt_slot >= 0){
+    c = &q->ring[q->tilt_slot];
+    c->value = value;
+    c->posted_ns = nowNs();
+    q->coalesced++;
+    res = 1;
+  }
+  else if (type == DEV_CMD_LED && value == q->led_last){
+    q->coalesced++;
+    res = 1;
+  }
+  else if (q->count == DEV_QUEUE_SLOTS){
+    res = -1;
+  }
+  else{
+    int slot = (q->head + q->count++) % DEV_QUEUE_SLOTS;
+    c = &q->ring[slot];
+    c->type = type;
+    c->value = value;
+    c->posted_ns = nowNs();
+    if (type == DEV_CMD_TILT)
+      q->tilt_slot = slot;
+    else
+      q->led_last = value;
+    q->posted++;
+    pthread_cond_signal(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return res;
+}
+
+// The device was replaced, so the next LED request goes through even if it repeats the last.
+void devQueueForget(dev_queue *q){
+  pthread_mutex_lock(&q->lock);
+  q->led_last = -1;
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Until a command is waiting, devQueueWake is called or `deadline` passes.
+void devQueueWait(dev_queue *q, const struct timespec *deadline){
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->wake)
+    if (pthread_cond_timedwait(&q->cond, &q->lock, deadline) != 0)
+      break;
+  q->wake = 0;
+  pthread_mutex_unlock(&q->lock);
+}
+
+void devQueueWake(dev_queue *q){
+  pthread_mutex_lock(&q->lock);
+  q->wake = 1;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/*
+  Run every waiting command. The ring is emptied under the lock and the
+  transfers run without it, so posting never waits on USB.
+*/
+void devQueueService(dev_queue *q, freenect_device *dev){
+  dev_cmd batch[DEV_QUEUE_SLOTS];
+  char line[DEV_MSG_LEN];
+  int n, i, res;
+  uint64_t ns;
+
+  pthread_mutex_lock(&q->lock);
+  for (n = 0; n < q->count; n++)
+    batch[n] = q->ring[(q->head + n) % DEV_QUEUE_SLOTS];
+  q->head = (q->head + n) % DEV_QUEUE_SLOTS;
+  q->count = 0;
+  q->tilt_slot = -1;
+  pthread_mutex_unlock(&q->lock);
+
+  for (i = 0; i < n; i++){
+    if (batch[i].type == DEV_CMD_TILT)
+      res = freenect_set_tilt_degs(dev, batch[i].value);
+    else
+      res = freenect_set_led(dev, (freenect_led_options) batch[i].value);
+    ns = nowNs() - batch[i].posted_ns;
+    stageTimerRecord(&q->latency, ns);
+
+    if (res == 0){
+      __atomic_add_fetch(&q->applied, 1, __ATOMIC_RELAXED);
+      if (batch[i].type == DEV_CMD_TILT)
+        snprintf(line, sizeof(line), "Tilt moving to %d degrees, %d ms.", batch[i].value, (int) (ns / 1000000));
+      else
+        snprintf(line, sizeof(line), "LED is now %s, %d ms.", ledName(batch[i].value), (int) (ns / 1000000));
+    }
+    else{
+      __atomic_add_fetch(&q->failed, 1, __ATOMIC_RELAXED);
+      snprintf(line, sizeof(line), "Error setting %s, is the motor subdevice open?",
+               batch[i].type == DEV_CMD_TILT ? "tilt" : "LED");
+      // Let the same LED be asked for again.
+      if (batch[i].type == DEV_CMD_LED){
+        pthread_mutex_lock(&q->lock);
+        if (q->led_last == batch[i].value)
+          q->led_last = -1;
+        pthread_mutex_unlock(&q->lock);
+      }
+    }
+    devQueueMessage(q, line);
+  }
+}
+
+// Oldest line is dropped when the console has not drained in time.
+void devQueueMessage(dev_queue *q, const char *line){
+  pthread_mutex_lock(&q->lock);
+  if (q->msg_count == DEV_MSG_SLOTS){
+    q->msg_head = (q->msg_head + 1) % DEV_MSG_SLOTS;
+    q->msg_count--;
+    q->msgs_lost++;
+  }
+  snprintf(q->msgs[(q->msg_head + q->msg_count++) % DEV_MSG_SLOTS], DEV_MSG_LEN, "%s", line);
+  pthread_mutex_unlock(&q->lock);
+}
+
+int devQueueTakeMessage(dev_queue *q, char *line, size_t len){
+  int got = 0;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->msg_count > 0){
+    snprintf(line, len, "%s", q->msgs[q->msg_head]);
+    q->msg_head = (q->msg_head + 1) % DEV_MSG_SLOTS;
+    q->msg_count--;
+    got = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return got;
+}
@@ -0,0 +1,62 @@
+#ifndef __devqueue_h__
+#define __devqueue_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "libfreenect.h"
+#include "stats.h"
+
+#define DEV_QUEUE_SLOTS 32
+#define DEV_MSG_SLOTS 16
+#define DEV_MSG_LEN 96
+
+typedef enum {
+  DEV_CMD_TILT,
+  DEV_CMD_LED,
+} dev_cmd_type;
+
+typedef struct {
+  dev_cmd_type type;
+  int value;           // Degrees for tilt, freenect_led_options for LED.
+  uint64_t posted_ns;
+} dev_cmd;
+
+/*
+  Device commands posted from any thread and run by the one thread that
+  owns device control transfers, so the console never blocks on USB.
+
+  Posting coalesces: a tilt replaces a tilt still waiting, keeping its
+  place, and an LED write equal to the last one requested is dropped.
+  Results come back as console lines in `msgs`, drained by the GL thread.
+*/
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  dev_cmd ring[DEV_QUEUE_SLOTS];
+  int head, count;
+  int tilt_slot;       // Ring index of the waiting tilt, -1 if none.
+  int led_last;        // Last LED requested, -1 before the first.
+  int wake;
+
+  char msgs[DEV_MSG_SLOTS][DEV_MSG_LEN];
+  int msg_head, msg_count;
+
+  uint64_t posted;
+  uint64_t coalesced;  // Tilts replaced and LED writes dropped.
+  uint64_t applied;
+  uint64_t failed;
+  uint64_t msgs_lost;
+  stage_timer latency; // Post to transfer done.
+} dev_queue;
+
+void devQueueInit(dev_queue *q);
+int devQueuePost(dev_queue *q, dev_cmd_type type, int value);
+void devQueueWait(dev_queue *q, const struct timespec *deadline);
+void devQueueWake(dev_queue *q);
+void devQueueForget(dev_queue *q);
+void devQueueService(dev_queue *q, freenect_device *dev);
+void devQueueMessage(dev_queue *q, const char *line);
+int devQueueTakeMessage(dev_queue *q, char *line, size_t len);
+
+#endif
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "floor.h"
+#include "dbg.h"
+
+#define DEG(r) ((r) * 180.0 / M_PI)
+
+// Under fit_lock, or before anyone fits.
+static void buildRays(floor_estimator *fl){
+  int gx, gy, i = 0;
+
+  for (gy = 0; gy < fl->rows; gy++)
+    for (gx = 0; gx < fl->cols; gx++, i++)
+      depthIntrinsicsRay(&fl->k, gx * fl->step + fl->step / 2, gy * fl->step + fl->step / 2, &fl->ray_x[i], &fl->ray_y[i]);
+}
+
+int floorInit(floor_estimator *fl, depth_probe *probe, work_pool *pool, tilt_poller *tilt, floor_notify_fn notify){
+  pthread_condattr_t attr;
+  size_t n;
+
+  memset(fl, 0, sizeof(*fl));
+  fl->probe = probe;
+  fl->pool = pool;
+  fl->tilt = tilt;
+  fl->notify = notify;
+  fl->step = FLOOR_DEFAULT_STEP;
+  fl->rate_hz = FLOOR_DEFAULT_HZ;
+  fl->cos_slope = cos(FLOOR_MAX_SLOPE * M_PI / 180.0);
+  fl->cols = probe->width / fl->step;
+  fl->rows = probe->height / fl->step;
+  pthread_mutex_init(&fl->fit_lock, NULL);
+  pthread_mutex_init(&fl->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fl->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  stageTimerInit(&fl->timer, "floor fit");
+
+  n = (size_t) fl->cols * fl->rows;
+  fl->ray_x = malloc(n * sizeof(float));
+  fl->ray_y = malloc(n * sizeof(float));
+  fl->mm = malloc(n * sizeof(uint16_t));
+  fl->px = malloc(n * sizeof(float));
+  fl->py = malloc(n * sizeof(float));
+  fl->pz = malloc(n * sizeof(float));
+  fl->tol = malloc(n * sizeof(float));
+  fl->cell = malloc(n * sizeof(int));
+  fl->point_cell = malloc(n * sizeof(int));
+  check_mem(fl->ray_x && fl->ray_y && fl->mm && fl->px && fl->py && fl->pz && fl->tol && fl->cell && fl->point_cell);
+  depthIntrinsicsDefault(&fl->k);
+  buildRays(fl);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  floorFree(fl);
+  return 1;
+}
+
+void floorFree(floor_estimator *fl){
+  floorStop(fl);
+  free (fl->ray_x);
+  free (fl->ray_y);
+  free (fl->mm);
+  free (fl->px);
+  free (fl->py);
+  free (fl->pz);
+  free (fl->tol);
+  free (fl->cell);
+  free (fl->point_cell);
+  fl->ray_x = fl->ray_y = fl->px = fl->py = fl->pz = fl->tol = NULL;
+  fl->mm = NULL;
+  fl->cell = fl->point_cell = NULL;
+}
+
+// Rebuilds the ray table; the next fit uses it.
+int floorSetIntrinsics(floor_estimator *fl, const depth_intrinsics *k){
+  if (k->fx <= 0 || k->fy <= 0)
+    return 1;
+  pthread_mutex_lock(&fl->fit_lock);
+  fl->k = *k;
+  buildRays(fl);
+  pthread_mutex_unlock(&fl->fit_lock);
+  return 0;
+}
+
+static inline uint64_t splitMix(uint64_t *s){
+  uint64_t z = (*s += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static int countInliers(const floor_estimator *fl, const float *n, float d){
+  int j, count = 0;
+
+  for (j = 0; j < fl->count; j++)
+    count += fabsf(n[0] * fl->px[j] + n[1] * fl->py[j] + n[2] * fl->pz[j] + d) < fl->tol[j];
+  return count;
+}
+
+// A point within FLOOR_REACH cells of the cell of point `a`, -1 when that cell has none.
+static int nearPoint(const floor_estimator *fl, int a, uint64_t *s){
+  uint64_t r = splitMix(s);
+  int x = fl->point_cell[a] % fl->cols + (int) (r % (2 * FLOOR_REACH + 1)) - FLOOR_REACH;
+  int y = fl->point_cell[a] / fl->cols + (int) (r >> 32) % (2 * FLOOR_REACH + 1) - FLOOR_REACH;
+
+  if (x < 0 || y < 0 || x >= fl->cols || y >= fl->rows)
+    return -1;
+  return fl->cell[y * fl->cols + x];
+}
+
+// Hypotheses [h0, h1) through three points each, the best kept per band.
+static void ransacBand(void *arg, int band, int h0, int h1){
+  floor_estimator *fl = arg;
+  floor_plane best = { 0 };
+  uint64_t s;
+  int h, a, b, c, count;
+  float v1[3], v2[3], n[3], len, dot, d;
+
+  for (h = h0; h < h1; h++){
+    s = fl->seed + (uint64_t) h * 0xD1B54A32D192ED03ULL;
+    a = splitMix(&s) % fl->count;
+    b = nearPoint(fl, a, &s);
+    c = nearPoint(fl, a, &s);
+    if (b < 0 || c < 0 || a == b || b == c || a == c)
+      continue;
+    v1[0] = fl->px[b] - fl->px[a]; v1[1] = fl->py[b] - fl->py[a]; v1[2] = fl->pz[b] - fl->pz[a];
+    v2[0] = fl->px[c] - fl->px[a]; v2[1] = fl->py[c] - fl->py[a]; v2[2] = fl->pz[c] - fl->pz[a];
+    n[0] = v1[1] * v2[2] - v1[2] * v2[1];
+    n[1] = v1[2] * v2[0] - v1[0] * v2[2];
+    n[2] = v1[0] * v2[1] - v1[1] * v2[0];
+    if ((len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2])) < 1e-9f)
+      continue;
+    if ((dot = (n[0] * fl->up[0] + n[1] * fl->up[1] + n[2] * fl->up[2]) / len) < 0){
+      len = -len;
+      dot = -dot;
+    }
+    if (dot < fl->cos_slope)
+      continue;
+    n[0] /= len; n[1] /= len; n[2] /= len;
+    if ((d = -(n[0] * fl->px[a] + n[1] * fl->py[a] + n[2] * fl->pz[a])) < FLOOR_MIN_HEIGHT)
+      continue;
+    if ((count = countInliers(fl, n, d)) > best.count){
+      best.count = count;
+      memcpy(best.n, n, sizeof(n));
+      best.d = d;
+    }
+  }
+  fl->best[band] = best;
+}
+
+/*
+  Least squares y = a x + b z + c over the inliers of `pl`, the floor
+  being far from vertical in the camera. Leaves `pl` alone when the
+  inliers do not span a plane.
+*/
+static void refinePlane(const floor_estimator *fl, floor_plane *pl){
+  double sxx = 0, sxz = 0, szz = 0, sx = 0, sz = 0, sxy = 0, szy = 0, sy = 0, n = 0;
+  double det, a, b, c, len;
+  float x, y, z;
+  int j;
+
+  for (j = 0; j < fl->count; j++){
+    x = fl->px[j];
+    y = fl->py[j];
+    z = fl->pz[j];
+    if (fabsf(pl->n[0] * x + pl->n[1] * y + pl->n[2] * z + pl->d) >= FLOOR_INLIER_M)
+      continue;
+    sxx += x * x; sxz += x * z; szz += z * z;
+    sx += x; sz += z; n++;
+    sxy += x * y; szy += z * y; sy += y;
+  }
+  det = sxx * (szz * n - sz * sz) - sxz * (sxz * n - sz * sx) + sx * (sxz * sz - szz * sx);
+  if (n < 3 || fabs(det) < 1e-12)
+    return;
+  a = (sxy * (szz * n - sz * sz) - sxz * (szy * n - sz * sy) + sx * (szy * sz - szz * sy)) / det;
+  b = (sxx * (szy * n - sy * sz) - sxy * (sxz * n - sz * sx) + sx * (sxz * sy - szy * sx)) / det;
+  c = (sxx * (szz * sy - szy * sz) - sxz * (sxz * sy - szy * sx) + sxy * (sxz * sz - szz * sx)) / det;
+  len = sqrt(a * a + 1 + b * b);
+  if (c / len < FLOOR_MIN_HEIGHT)
+    return;
+  pl->n[0] = a / len;
+  pl->n[1] = -1 / len;
+  pl->n[2] = b / len;
+  pl->d = c / len;
+}
+
+/*
+  Fits the floor on the probe's latest frame. `accel`, when valid, points
+  the search along gravity; without it the camera is taken as level.
+  0 with a fit, 1 before the first frame, 2 when no plane was found.
+*/
+int floorFit(floor_estimator *fl, const tilt_state *accel, floor_fit *out){
+  uint64_t start = nowNs();
+  probe_result meta;
+  floor_plane pl = { 0 };
+  double g;
+  int i, bands = fl->pool ? fl->pool->bands : 1;
+  float z;
+
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&fl->fit_lock);
+  if (depthProbeSample(fl->probe, fl->step, fl->mm, &meta) != 0){
+    pthread_mutex_unlock(&fl->fit_lock);
+    return 1;
+  }
+  out->seq = meta.seq;
+
+  fl->up[0] = 0;
+  fl->up[1] = -1;
+  fl->up[2] = 0;
+  // The accelerometer's y points up, its x and z follow the camera.
+  if (accel && accel->valid && (g = sqrt(accel->ax * accel->ax + accel->ay * accel->ay + accel->az * accel->az)) > 1){
+    fl->up[0] = accel->ax / g;
+    fl->up[1] = -accel->ay / g;
+    fl->up[2] = accel->az / g;
+    out->accel_valid = 1;
+    out->accel_pitch = DEG(atan2(accel->az, accel->ay));
+  }
+
+  fl->count = 0;
+  for (i = 0; i < fl->cols * fl->rows; i++){
+    fl->cell[i] = -1;
+    if (fl->mm[i] == 0)
+      continue;
+    fl->cell[i] = fl->count;
+    fl->point_cell[fl->count] = i;
+    z = fl->mm[i] * 0.001f;
+    fl->px[fl->count] = fl->ray_x[i] * z;
+    fl->py[fl->count] = fl->ray_y[i] * z;
+    fl->pz[fl->count] = z;
+    fl->tol[fl->count] = FLOOR_INLIER_M + FLOOR_INLIER_Z2 * z * z;
+    fl->count++;
+  }
+  out->points = fl->count;
+
+  if (fl->count >= 3){
+    fl->seed = meta.seq * 0x9E3779B97F4A7C15ULL + 1;
+    if (fl->pool)
+      workPoolRun(fl->pool, FLOOR_ITERATIONS, ransacBand, fl);
+    else
+      ransacBand(fl, 0, 0, FLOOR_ITERATIONS);
+    for (i = 0; i < bands && i < WORK_POOL_MAX_THREADS + 1; i++)
+      if (fl->best[i].count > pl.count)
+        pl = fl->best[i];
+  }
+  // The floor has to be a fair share of what the camera sees.
+  if (pl.count < 3 || pl.count < fl->count / 20){
+    pthread_mutex_unlock(&fl->fit_lock);
+    __atomic_add_fetch(&fl->failed, 1, __ATOMIC_RELAXED);
+    stageTimerRecord(&fl->timer, nowNs() - start);
+    return 2;
+  }
+  refinePlane(fl, &pl);
+  refinePlane(fl, &pl);
+
+  out->valid = 1;
+  memcpy(out->n, pl.n, sizeof(pl.n));
+  out->height = pl.d;
+  out->pitch = DEG(atan2(pl.n[2], -pl.n[1]));
+  out->roll = DEG(atan2(pl.n[0], -pl.n[1]));
+  out->inliers = countInliers(fl, pl.n, pl.d);
+  pthread_mutex_unlock(&fl->fit_lock);
+
+  out->fit_ns = nowNs() - start;
+  __atomic_add_fetch(&fl->fits, 1, __ATOMIC_RELAXED);
+  stageTimerRecord(&fl->timer, out->fit_ns);
+  return 0;
+}
+
+/*
+  A fit with the current accelerometer reading, kept as `last`. After
+  autolevel, a pitch off the target by more than FLOOR_DRIFT_DEG while the
+  motor is still is reported once, and again once it came back.
+*/
+int floorUpdate(floor_estimator *fl, floor_fit *out){
+  tilt_state accel;
+  char line[128];
+  double off;
+  int res;
+
+  memset(&accel, 0, sizeof(accel));
+  if (fl->tilt)
+    tiltPollerRead(fl->tilt, &accel);
+  if ((res = floorFit(fl, &accel, out)) != 0)
+    return res;
+
+  line[0] = 0;
+  pthread_mutex_lock(&fl->lock);
+  fl->last = *out;
+  off = out->pitch - fl->target;
+  if (fl->leveled && accel.status != TILT_STATUS_MOVING){
+    if (!fl->drifting && fabs(off) > FLOOR_DRIFT_DEG){
+      fl->drifting = 1;
+      fl->drifts++;
+      snprintf(line, sizeof(line), "Floor pitch drifted %.1f degrees from level, autolevel to correct.", off);
+    }
+    else if (fl->drifting && fabs(off) < FLOOR_DRIFT_DEG / 2){
+      fl->drifting = 0;
+      snprintf(line, sizeof(line), "Floor pitch back within %.1f degrees of level.", off);
+    }
+  }
+  pthread_mutex_unlock(&fl->lock);
+  if (line[0] && fl->notify)
+    fl->notify(line);
+  return 0;
+}
+
+void floorRead(floor_estimator *fl, floor_fit *out){
+  pthread_mutex_lock(&fl->lock);
+  *out = fl->last;
+  pthread_mutex_unlock(&fl->lock);
+}
+
+/*
+  The motor angle that brings the camera to `target` degrees of pitch over
+  the floor from `motor`, the angle it is at, clamped to the motor's range.
+  Drift is watched against the target from then on. 1 without a fit.
+*/
+int floorLevelAngle(floor_estimator *fl, double target, const floor_fit *fit, double motor, int *angle){
+  double a = motor + target - fit->pitch;
+
+  if (!fit->valid)
+    return 1;
+  if (a > FLOOR_TILT_LIMIT) a = FLOOR_TILT_LIMIT;
+  if (a < -FLOOR_TILT_LIMIT) a = -FLOOR_TILT_LIMIT;
+  *angle = (int) lround(a);
+  pthread_mutex_lock(&fl->lock);
+  fl->leveled = 1;
+  fl->target = target;
+  fl->drifting = 0;
+  pthread_mutex_unlock(&fl->lock);
+  return 0;
+}
+
+static void *floorThread(void *arg){
+  floor_estimator *fl = arg;
+  struct timespec next;
+  floor_fit fit;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  pthread_mutex_lock(&fl->lock);
+  while (!fl->quit){
+    // Fixed period from the last deadline, like the tilt poller.
+    next.tv_nsec += 1000000000L / fl->rate_hz;
+    while (next.tv_nsec >= 1000000000L){
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while (!fl->quit && pthread_cond_timedwait(&fl->cond, &fl->lock, &next) == 0)
+      ;
+    if (fl->quit)
+      break;
+    pthread_mutex_unlock(&fl->lock);
+    floorUpdate(fl, &fit);
+    pthread_mutex_lock(&fl->lock);
+  }
+  pthread_mutex_unlock(&fl->lock);
+  return NULL;
+}
+
+int floorStart(floor_estimator *fl){
+  check (!fl->running, "Floor estimation already running.");
+  fl->quit = 0;
+  check (pthread_create(&fl->thread, NULL, floorThread, fl) == 0, "Could not create the floor thread.");
+  fl->running = 1;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+void floorStop(floor_estimator *fl){
+  if (!fl->running)
+    return;
+  pthread_mutex_lock(&fl->lock);
+  fl->quit = 1;
+  pthread_cond_signal(&fl->cond);
+  pthread_mutex_unlock(&fl->lock);
+  pthread_join(fl->thread, NULL);
+  fl->running = 0;
+}
+
+// Takes effect after the current period.
+int floorSetRate(floor_estimator *fl, int rate_hz){
+  if (rate_hz < 1 || rate_hz > FLOOR_MAX_HZ)
+    return 1;
+  pthread_mutex_lock(&fl->lock);
+  fl->rate_hz = rate_hz;
+  pthread_mutex_unlock(&fl->lock);
+  return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef __floor_h__
+#define __floor_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "probe.h"
+#include "stats.h"
+#include "tilt.h"
+#include "workpool.h"
+
+#define FLOOR_DEFAULT_STEP 8      // Sample every 8th pixel, 80x60 points at 640x480.
+#define FLOOR_DEFAULT_HZ 5
+#define FLOOR_MAX_HZ 30
+#define FLOOR_ITERATIONS 128      // RANSAC hypotheses per fit, split across the bands.
+#define FLOOR_REACH 6             // Grid cells the 2nd and 3rd point may be from the 1st.
+#define FLOOR_INLIER_M 0.02f      // Inlier band, widened by FLOOR_INLIER_Z2 per square meter of depth
+#define FLOOR_INLIER_Z2 0.003f    // as the Kinect's depth error grows with its square.
+#define FLOOR_MAX_SLOPE 30.0      // Degrees a hypothesis may lean from gravity.
+#define FLOOR_MIN_HEIGHT 0.2f     // Meters, planes closer to the camera are not the floor.
+#define FLOOR_DRIFT_DEG 2.0
+#define FLOOR_TILT_LIMIT 28
+
+/*
+  A floor plane n.p + height = 0 in camera coordinates: x right, y down,
+  z forward, meters, with n the unit normal pointing up. Pitch and roll
+  are the camera's relative to the floor in degrees, pitch up positive
+  like the tilt motor; accel_pitch is the same from gravity alone.
+*/
+typedef struct {
+  int valid;
+  float n[3];
+  float height;
+  double pitch, roll;
+  int accel_valid;
+  double accel_pitch;
+  int inliers, points;
+  uint64_t seq;          // Depth frame it was fitted on.
+  uint64_t fit_ns;
+} floor_fit;
+
+// Drift reports for the console, called on the estimator thread.
+typedef void (*floor_notify_fn)(const char *line);
+
+typedef struct {
+  int count;
+  float n[3];
+  float d;
+} floor_plane;
+
+/*
+  Floor estimator over the depth probe's latest frame. The rays of the
+  sample grid are computed once from the intrinsics, so a fit only reads
+  step x step spaced pixels, scales the rays by their depth and scores
+  RANSAC hypotheses across the work pool, each band a slice of the
+  hypotheses seeded by index so the result does not depend on the band
+  count. A hypothesis takes its other two points within FLOOR_REACH grid
+  cells of the first, so it only needs the first on the floor, however
+  little of the view the floor is. Hypotheses leaning more than
+  FLOOR_MAX_SLOPE from gravity, or passing closer than FLOOR_MIN_HEIGHT to
+  the camera, are rejected, which keeps walls and the ceiling out. The
+  winner is refined by least squares over its inliers.
+
+  `fit_lock` serializes fits, which share the scratch buffers; `lock`
+  guards `last` and the thread. The thread fits at rate_hz and, once
+  autolevel set a target, reports when the pitch drifts from it.
+*/
+typedef struct {
+  depth_probe *probe;
+  work_pool *pool;
+  tilt_poller *tilt;
+  floor_notify_fn notify;
+
+  pthread_mutex_t fit_lock;
+  depth_intrinsics k;
+  int step, cols, rows;
+  float *ray_x, *ray_y;
+  uint16_t *mm;
+  float *px, *py, *pz;
+  float *tol;            // Inlier band of each point.
+  int *cell;             // Point of each grid cell, -1 without a reading.
+  int *point_cell;
+  int count;
+  float up[3];
+  float cos_slope;
+  uint64_t seed;
+  floor_plane best[WORK_POOL_MAX_THREADS + 1];
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;
+  int quit;
+  int rate_hz;
+  floor_fit last;
+  int leveled;           // Target set by autolevel, drift is watched against it.
+  double target;
+  int drifting;
+
+  uint64_t fits;
+  uint64_t failed;
+  uint64_t drifts;
+  stage_timer timer;
+} floor_estimator;
+
+int floorInit(floor_estimator *fl, depth_probe *probe, work_pool *pool, tilt_poller *tilt, floor_notify_fn notify);
+void floorFree(floor_estimator *fl);
+int floorSetIntrinsics(floor_estimator *fl, const depth_intrinsics *k);
+int floorFit(floor_estimator *fl, const tilt_state *accel, floor_fit *out);
+int floorUpdate(floor_estimator *fl, floor_fit *out);
+void floorRead(floor_estimator *fl, floor_fit *out);
+int floorLevelAngle(floor_estimator *fl, double target, const floor_fit *fit, double motor, int *angle);
+int floorStart(floor_estimator *fl);
+void floorStop(floor_estimator *fl);
+int floorSetRate(floor_estimator *fl, int rate_hz);
+
+#endif
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "framepool.h"
+#include "stats.h"
+#include "dbg.h"
+
+#define CACHE_LINE 64
+#define HUGE_PAGE (2u << 20)
+
+/*
+  Huge pages when asked: explicit hugetlbfs pages if any are reserved,
+  otherwise a 2 MB aligned allocation advised for transparent huge pages,
+  and plain cache line aligned memory when that fails too.
+*/
+static uint8_t *poolAlloc(frame_pool *p, int huge){
+  void *mem = MAP_FAILED;
+
+  p->huge = 0;
+  if (huge){
+    size_t len = (p->mem_bytes + HUGE_PAGE - 1) & ~((size_t) HUGE_PAGE - 1);
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED){
+      p->mem_bytes = len;
+      p->huge = 2;
+      return mem;
+    }
+    if (posix_memalign(&mem, HUGE_PAGE, p->mem_bytes) == 0){
+      p->huge = madvise(mem, p->mem_bytes, MADV_HUGEPAGE) == 0 ? 1 : 0;
+      return mem;
+    }
+  }
+  if (posix_memalign(&mem, CACHE_LINE, p->mem_bytes) != 0)
+    return NULL;
+  return mem;
+}
+
+int framePoolInit(frame_pool *p, const char *name, int count, size_t frame_bytes, int huge){
+  int i;
+
+  memset(p, 0, sizeof(*p));
+  check (count > 0 && count <= FRAME_POOL_MAX, "Frame pool size out of range.");
+  p->name = name;
+  p->count = count;
+  p->frame_bytes = (frame_bytes + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+  p->mem_bytes = p->frame_bytes * count;
+  p->mem = poolAlloc(p, huge);
+  check_mem(p->mem);
+  // Touch every page now so the first frames do not fault them in.
+  memset(p->mem, 0, p->mem_bytes);
+
+  pthread_mutex_init(&p->lock, NULL);
+  for (i = 0; i < count; i++){
+    p->frames[i].data = p->mem + p->frame_bytes * i;
+    p->frames[i].pool = p;
+    p->free_list[i] = &p->frames[count - 1 - i];
+  }
+  p->free_count = count;
+  p->min_free = count;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+void framePoolFree(frame_pool *p){
+  if (!p->mem)
+    return;
+  if (p->huge == 2)
+    munmap(p->mem, p->mem_bytes);
+  else
+    free (p->mem);
+  p->mem = NULL;
+}
+
+// One reference for the caller, or NULL when every frame is in use.
+frame *frameAcquire(frame_pool *p){
+  frame *f = NULL;
+
+  pthread_mutex_lock(&p->lock);
+  if (p->free_count > 0){
+    f = p->free_list[--p->free_count];
+    if (p->free_count < p->min_free)
+      p->min_free = p->free_count;
+    p->acquired++;
+  }
+  else
+    p->exhausted++;
+  pthread_mutex_unlock(&p->lock);
+
+  if (f){
+    f->bytes = 0;
+    __atomic_store_n(&f->refs, 1, __ATOMIC_RELAXED);
+  }
+  return f;
+}
+
+void frameRef(frame *f){
+  __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Acquire-release on the count, so the last holder sees every read finished.
+void frameRelease(frame *f){
+  frame_pool *p;
+
+  if (!f || __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  p = f->pool;
+  pthread_mutex_lock(&p->lock);
+  p->free_list[p->free_count++] = f;
+  pthread_mutex_unlock(&p->lock);
+}
+
+int framePoolFreeCount(frame_pool *p){
+  int n;
+  pthread_mutex_lock(&p->lock);
+  n = p->free_count;
+  pthread_mutex_unlock(&p->lock);
+  return n;
+}
+
+void frameQueueInit(frame_queue *q, int size){
+  pthread_condattr_t attr;
+
+  memset(q, 0, sizeof(*q));
+  q->size = size < 1 ? 1 : (size > FRAME_QUEUE_MAX ? FRAME_QUEUE_MAX : size);
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&q->cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// Takes over the caller's reference to `f`.
+void frameQueuePush(frame_queue *q, frame *f){
+  frame *old = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->size){
+    old = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    q->dropped++;
+  }
+  q->items[(q->head + q->count++) % q->size] = f;
+  q->pushed++;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  frameRelease(old);
+}
+
+// Oldest frame and its reference, waiting up to `wait_ms`, or NULL.
+frame *frameQueuePop(frame_queue *q, int wait_ms){
+  struct timespec until;
+  frame *f = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &until);
+  until.tv_sec += wait_ms / 1000;
+  until.tv_nsec += (wait_ms % 1000) * 1000000L;
+  if (until.tv_nsec >= 1000000000L){
+    until.tv_nsec -= 1000000000L;
+    until.tv_sec++;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0)
+    if (pthread_cond_timedwait(&q->cond, &q->lock, &until) != 0)
+      break;
+  if (q->count > 0){
+    f = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return f;
+}
+
+void frameQueueClear(frame_queue *q){
+  frame *f;
+  while ((f = frameQueuePop(q, 0)) != NULL)
+    frameRelease(f);
+}
+
+int frameHandoffInit(frame_handoff *h, frame_pool *pool){
+  memset(h, 0, sizeof(*h));
+  h->pool = pool;
+  h->fill = frameAcquire(pool);
+  return h->fill == NULL;
+}
+
+void frameHandoffFree(frame_handoff *h){
+  frameRelease(h->fill);
+  frameRelease(h->ready);
+  h->fill = NULL;
+  h->ready = NULL;
+}
+
+/*
+  Publish the filled frame and return the buffer to fill next. When every
+  frame is held the oldest unprocessed one goes first; if consumers still
+  hold the rest the filled frame is not published and gets overwritten.
+*/
+void *frameHandoffPush(frame_handoff *h, void *filled, size_t bytes, uint32_t timestamp){
+  frame *f = h->fill;
+  frame *next;
+
+  // The driver fell back to its own buffer, take a copy.
+  if (filled != f->data)
+    memcpy(f->data, filled, bytes);
+  f->bytes = bytes;
+  f->seq = ++h->seq;
+  f->timestamp = timestamp;
+  f->host_ns = nowNs();
+
+  next = frameAcquire(h->pool);
+  if (!next && h->ready){
+    frameRelease(h->ready);
+    h->ready = NULL;
+    h->dropped++;
+    next = frameAcquire(h->pool);
+  }
+  if (!next){
+    h->dropped++;
+    return f->data;
+  }
+
+  if (h->ready){
+    frameRelease(h->ready);
+    h->dropped++;
+  }
+  h->ready = f;
+  h->fill = next;
+  return next->data;
+}
+
+// The ready frame and its reference, or NULL.
+frame *frameHandoffTake(frame_handoff *h){
+  frame *f = h->ready;
+  h->ready = NULL;
+  return f;
+}
+
+void frameHandoffDropReady(frame_handoff *h){
+  frameRelease(h->ready);
+  h->ready = NULL;
+}
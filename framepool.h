@@ -0,0 +1,97 @@
+#ifndef __framepool_h__
+#define __framepool_h__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_POOL_MAX 32
+#define FRAME_QUEUE_MAX 16
+
+struct frame_pool;
+
+/*
+  One captured frame. Whoever holds a reference may read `data`; the last
+  frameRelease hands it back to its pool. Only the holder of the single
+  reference a frame comes out of frameAcquire with may write it.
+*/
+typedef struct {
+  uint8_t *data;
+  size_t bytes;          // Valid bytes, at most the pool frame size.
+  uint64_t seq;
+  uint32_t timestamp;    // Device timestamp from the callback.
+  uint64_t host_ns;
+  uint32_t refs;
+  struct frame_pool *pool;
+} frame;
+
+/*
+  A fixed set of frames carved out of one allocation at startup, each
+  starting on a cache line, optionally backed by huge pages. Acquire and
+  release never allocate; when every frame is referenced acquire fails and
+  counts it, the producer decides what to drop.
+*/
+typedef struct frame_pool {
+  const char *name;
+  frame frames[FRAME_POOL_MAX];
+  int count;
+  size_t frame_bytes;    // Rounded up to the cache line.
+  uint8_t *mem;
+  size_t mem_bytes;
+  int huge;              // 2: hugetlbfs pages, 1: transparent huge pages advised, 0: plain.
+
+  pthread_mutex_t lock;
+  frame *free_list[FRAME_POOL_MAX];
+  int free_count;
+
+  uint64_t acquired;
+  uint64_t exhausted;
+  int min_free;          // Low water mark since the last reset.
+} frame_pool;
+
+/*
+  Bounded hand-off of frame references to one consumer. Pushing onto a full
+  queue drops and releases the oldest frame.
+*/
+typedef struct {
+  frame *items[FRAME_QUEUE_MAX];
+  int size;
+  int head, count;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t pushed;
+  uint64_t dropped;
+} frame_queue;
+
+/*
+  Producer side of one stream: the frame the driver is filling and the
+  latest one waiting for the processing thread. Callers serialize with
+  their own lock.
+*/
+typedef struct {
+  frame_pool *pool;
+  frame *fill;
+  frame *ready;
+  uint64_t seq;
+  uint64_t dropped;      // Ready frames replaced before they were taken, or overwritten with the pool dry.
+} frame_handoff;
+
+int framePoolInit(frame_pool *p, const char *name, int count, size_t frame_bytes, int huge);
+void framePoolFree(frame_pool *p);
+frame *frameAcquire(frame_pool *p);
+void frameRef(frame *f);
+void frameRelease(frame *f);
+int framePoolFreeCount(frame_pool *p);
+
+void frameQueueInit(frame_queue *q, int size);
+void frameQueuePush(frame_queue *q, frame *f);
+frame *frameQueuePop(frame_queue *q, int wait_ms);
+void frameQueueClear(frame_queue *q);
+
+int frameHandoffInit(frame_handoff *h, frame_pool *pool);
+void frameHandoffFree(frame_handoff *h);
+void *frameHandoffPush(frame_handoff *h, void *filled, size_t bytes, uint32_t timestamp);
+frame *frameHandoffTake(frame_handoff *h);
+void frameHandoffDropReady(frame_handoff *h);
+
+#endif
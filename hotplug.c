@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "hotplug.h"
+#include "dbg.h"
+
+#define HOTPLUG_SLICE_MS 50
+
+void hotplugInit(hotplug *h, const hotplug_backend *be, hotplug_notify_fn notify){
+  memset(h, 0, sizeof(*h));
+  h->be = *be;
+  h->notify = notify;
+  h->enabled = 1;
+  h->backoff_min = HOTPLUG_BACKOFF_MIN_MS;
+  h->backoff_max = HOTPLUG_BACKOFF_MAX_MS;
+  h->stall_ms = HOTPLUG_STALL_MS;
+  stageTimerInit(&h->recovery, "device recovery");
+}
+
+// The serial to look for after an outage, taken when the device is opened.
+void hotplugSetSerial(hotplug *h, const char *serial){
+  snprintf(h->serial, sizeof(h->serial), "%s", serial ? serial : "");
+}
+
+int hotplugRecovering(hotplug *h){
+  return __atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == HOTPLUG_RECOVERING;
+}
+
+static void report(hotplug *h, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+static void report(hotplug *h, const char *fmt, ...){
+  char line[128];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  debug ("%s", line);
+  if (h->notify)
+    h->notify(line);
+}
+
+// Sleeps in slices so quitting does not wait out a long backoff.
+static void backoffSleep(int ms, const volatile int *die){
+  struct timespec ts;
+  int slice;
+
+  while (ms > 0 && !*die){
+    slice = ms < HOTPLUG_SLICE_MS ? ms : HOTPLUG_SLICE_MS;
+    ts.tv_sec = 0;
+    ts.tv_nsec = slice * 1000000L;
+    nanosleep(&ts, NULL);
+    ms -= slice;
+  }
+}
+
+static int stalled(hotplug *h){
+  uint64_t last;
+
+  if (h->stall_ms <= 0 || !h->be.last_frame)
+    return 0;
+  last = h->be.last_frame(h->be.ctx);
+  return last != 0 && nowNs() - last > (uint64_t) h->stall_ms * 1000000ull;
+}
+
+/*
+  Scan and reopen until the device is back, `die` is set or recovery is
+  turned off. Returns 0 once the session is restored.
+*/
+static int recover(hotplug *h, const volatile int *die){
+  int backoff = __atomic_load_n(&h->backoff_min, __ATOMIC_RELAXED), most;
+  uint64_t ns;
+
+  h->attempts = 0;
+  while (!*die && __atomic_load_n(&h->enabled, __ATOMIC_RELAXED)){
+    backoffSleep(backoff, die);
+    if (*die)
+      break;
+    h->attempts++;
+    if (h->be.find(h->be.ctx, h->serial) == 1 && h->be.reopen(h->be.ctx, h->serial) == 0){
+      ns = nowNs() - h->lost_ns;
+      stageTimerRecord(&h->recovery, ns);
+      __atomic_store_n(&h->last_ms, ns / 1000000, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&h->recoveries, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&h->state, HOTPLUG_UP, __ATOMIC_RELEASE);
+      report(h, "Device %s back after %d ms, %d scans.", h->serial, (int) (ns / 1000000), h->attempts);
+      return 0;
+    }
+    __atomic_add_fetch(&h->failed, 1, __ATOMIC_RELAXED);
+    most = __atomic_load_n(&h->backoff_max, __ATOMIC_RELAXED);
+    backoff = backoff * 2 > most ? most : backoff * 2;
+  }
+  return 1;
+}
+
+/*
+  The device thread's loop. Returns 0 when `die` or the backend ended it,
+  1 when the device was lost and could not be brought back, its handle
+  released.
+*/
+int hotplugRun(hotplug *h, const volatile int *die){
+  int res;
+
+  while (!*die){
+    res = h->be.process(h->be.ctx);
+    if (res > 0)
+      return 0;
+    if (res == 0 && !stalled(h))
+      continue;
+    if (*die)
+      break;
+
+    __atomic_add_fetch(&h->disconnects, 1, __ATOMIC_RELAXED);
+    h->lost_ns = nowNs();
+    __atomic_store_n(&h->state, HOTPLUG_RECOVERING, __ATOMIC_RELEASE);
+    h->be.release(h->be.ctx);
+    if (!__atomic_load_n(&h->enabled, __ATOMIC_RELAXED) || h->serial[0] == '\0'){
+      report(h, "Device %s lost (%s), recovery is off.", h->serial[0] ? h->serial : "?",
+             res < 0 ? "bus error" : "no frames");
+      return 1;
+    }
+    report(h, "Device %s lost (%s), scanning.", h->serial, res < 0 ? "bus error" : "no frames");
+    if (recover(h, die) != 0)
+      return *die ? 0 : 1;
+  }
+  return 0;
+}
+
+static int simProcess(void *ctx){
+  hotplug_sim *s = ctx;
+  struct timespec ts = { 0, 1000000L };
+
+  // Roughly a libfreenect event timeout per call.
+  nanosleep(&ts, NULL);
+  if (s->down || s->stalled)
+    return 0;
+  if (++s->services % s->drop_every != 0){
+    s->frame_ns = nowNs();
+    return 0;
+  }
+  // Odd drops fail on the bus, even ones just go quiet.
+  if (++s->drops % 2)
+    s->down = 1;
+  else
+    s->stalled = 1;
+  return s->down ? -1 : 0;
+}
+
+static uint64_t simLastFrame(void *ctx){
+  hotplug_sim *s = ctx;
+  return s->frame_ns;
+}
+
+static int simFind(void *ctx, const char *serial){
+  hotplug_sim *s = ctx;
+  return ++s->probes > s->absent;
+}
+
+static int simReopen(void *ctx, const char *serial){
+  hotplug_sim *s = ctx;
+
+  s->down = s->stalled = 0;
+  s->probes = 0;
+  s->frame_ns = nowNs();
+  s->opens++;
+  if (s->max_drops && s->opens >= (uint64_t) s->max_drops && s->die)
+    *s->die = 1;
+  return 0;
+}
+
+static void simRelease(void *ctx){
+  hotplug_sim *s = ctx;
+  s->down = 1;
+  s->stalled = 0;
+}
+
+void hotplugSimInit(hotplug_sim *s, hotplug_backend *be, int drop_every, int absent){
+  memset(s, 0, sizeof(*s));
+  s->drop_every = drop_every < 1 ? 1 : drop_every;
+  s->absent = absent;
+  s->frame_ns = nowNs();
+  be->ctx = s;
+  be->process = simProcess;
+  be->last_frame = simLastFrame;
+  be->find = simFind;
+  be->reopen = simReopen;
+  be->release = simRelease;
+}
@@ -0,0 +1,85 @@
+#ifndef __hotplug_h__
+#define __hotplug_h__
+
+#include <stdint.h>
+#include "stats.h"
+
+#define HOTPLUG_SERIAL_LEN 32
+#define HOTPLUG_BACKOFF_MIN_MS 100
+#define HOTPLUG_BACKOFF_MAX_MS 5000
+#define HOTPLUG_STALL_MS 3000
+
+/*
+  What the supervisor needs from a device stack, all called on the
+  supervising thread. The freenect one lives with the device code; the
+  simulated one below drops out on cue.
+*/
+typedef struct {
+  void *ctx;
+  int (*process)(void *ctx);                    // Service streams once, < 0 when the bus reports the device gone, > 0 to stop.
+  uint64_t (*last_frame)(void *ctx);            // nowNs() of the last frame, 0 when no stream should run.
+  int (*find)(void *ctx, const char *serial);   // 1 if a device with `serial` is on the bus.
+  int (*reopen)(void *ctx, const char *serial); // Open it and restore the session, 0 on success.
+  void (*release)(void *ctx);                   // Drop the dead handle, stop what used it.
+} hotplug_backend;
+
+// Outage and recovery reports for the console, on the supervising thread.
+typedef void (*hotplug_notify_fn)(const char *line);
+
+#define HOTPLUG_UP         0
+#define HOTPLUG_RECOVERING 1
+
+/*
+  Runs the event loop of one device and brings it back when it drops out.
+  A device is lost when servicing fails or, with a stream on, no frame
+  came for `stall_ms`. The dead handle is released, then the bus is
+  scanned for the same serial with exponential backoff from `backoff_min`
+  to `backoff_max` ms until it shows up again and reopens. Recovery time
+  runs from detection to the restored session.
+*/
+typedef struct {
+  hotplug_backend be;
+  hotplug_notify_fn notify;
+  char serial[HOTPLUG_SERIAL_LEN];
+  int enabled;
+  int backoff_min, backoff_max;  // Set from the console, read atomically by recovery.
+  int stall_ms;
+
+  int state;
+  int attempts;           // In the current outage.
+  uint64_t lost_ns;
+
+  uint64_t disconnects;
+  uint64_t recoveries;
+  uint64_t failed;        // Scans that did not bring the device back.
+  uint64_t last_ms;
+  stage_timer recovery;
+} hotplug;
+
+void hotplugInit(hotplug *h, const hotplug_backend *be, hotplug_notify_fn notify);
+void hotplugSetSerial(hotplug *h, const char *serial);
+int hotplugRun(hotplug *h, const volatile int *die);
+int hotplugRecovering(hotplug *h);
+
+/*
+  A device that fails every `drop_every` services, alternately by error
+  and by silently stopping frames, and stays off the bus for `absent`
+  scans.
+*/
+typedef struct {
+  int drop_every;
+  int absent;
+  int services;
+  int drops;
+  int down;
+  int probes;
+  int stalled;
+  int max_drops;          // Sets `die` once this many recoveries are done.
+  volatile int *die;
+  uint64_t frame_ns;
+  uint64_t opens;
+} hotplug_sim;
+
+void hotplugSimInit(hotplug_sim *s, hotplug_backend *be, int drop_every, int absent);
+
+#endif
@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imgwrite.h"
+
+#define STORED_MAX 65535
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552   // Bytes summed before the 32 bit sums could overflow.
+
+// Slicing by four: table k advances a byte k positions further.
+static uint32_t crc_table[4][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crcInit(){
+  uint32_t c;
+  int n, k;
+
+  for (n = 0; n < 256; n++){
+    c = n;
+    for (k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[0][n] = c;
+  }
+  for (n = 0; n < 256; n++)
+    for (k = 1; k < 4; k++)
+      crc_table[k][n] = crc_table[0][crc_table[k - 1][n] & 0xFF] ^ (crc_table[k - 1][n] >> 8);
+}
+
+uint32_t imageCrc32(uint32_t crc, const uint8_t *p, size_t len){
+  pthread_once(&crc_once, crcInit);
+  crc = ~crc;
+  while (len >= 4){
+    crc ^= (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+    crc = crc_table[3][crc & 0xFF] ^ crc_table[2][(crc >> 8) & 0xFF] ^
+          crc_table[1][(crc >> 16) & 0xFF] ^ crc_table[0][crc >> 24];
+    p += 4;
+    len -= 4;
+  }
+  while (len--)
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+uint32_t imageAdler32(uint32_t adler, const uint8_t *p, size_t len){
+  uint32_t a = adler & 0xFFFF, b = adler >> 16;
+  size_t n;
+
+  while (len > 0){
+    n = len < ADLER_NMAX ? len : ADLER_NMAX;
+    len -= n;
+    while (n--){
+      a += *p++;
+      b += a;
+    }
+    a %= ADLER_MOD;
+    b %= ADLER_MOD;
+  }
+  return b << 16 | a;
+}
+
+static void putBe32(uint8_t *p, uint32_t v){
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// Samples of one row, 16 bit ones swapped to big endian.
+static const uint8_t *rowBytes(const void *pixels, int y, int samples, int bits, uint8_t *swap){
+  int i;
+
+  if (bits == 8)
+    return (const uint8_t *) pixels + (size_t) y * samples;
+  const uint16_t *row = (const uint16_t *) pixels + (size_t) y * samples;
+  for (i = 0; i < samples; i++){
+    swap[2 * i] = row[i] >> 8;
+    swap[2 * i + 1] = row[i];
+  }
+  return swap;
+}
+
+int imageWritePnm(FILE *f, const void *pixels, int width, int height, int channels, int bits, int maxval){
+  int samples = width * channels, rowlen = samples * bits / 8;
+  uint8_t *swap = NULL;
+  int y, err = 0;
+
+  fprintf(f, "P%d\n%d %d\n%d\n", channels == 3 ? 6 : 5, width, height, maxval);
+  if (bits == 16 && (swap = malloc(rowlen)) == NULL)
+    return 1;
+  for (y = 0; y < height && !err; y++)
+    err = fwrite(rowBytes(pixels, y, samples, bits, swap), 1, rowlen, f) != (size_t) rowlen;
+  free (swap);
+  return err || ferror(f);
+}
+
+/*
+  The zlib stream inside IDAT: stored blocks cut wherever the 64 KB limit
+  falls, rows run across them. Lengths are known up front, so the chunk is
+  written in one pass with the sums kept running.
+*/
+typedef struct {
+  FILE *f;
+  uint32_t crc;
+  uint32_t adler;
+  size_t left;          // Raw bytes not written yet.
+  size_t block_left;
+  int err;
+} stored_writer;
+
+static void storedRaw(stored_writer *w, const uint8_t *p, size_t n){
+  if (fwrite(p, 1, n, w->f) != n)
+    w->err = 1;
+  w->crc = imageCrc32(w->crc, p, n);
+}
+
+static void storedPut(stored_writer *w, const uint8_t *p, size_t n){
+  uint8_t hdr[5];
+  size_t len;
+
+  while (n > 0){
+    if (w->block_left == 0){
+      len = w->left < STORED_MAX ? w->left : STORED_MAX;
+      hdr[0] = len == w->left;   // BFINAL, BTYPE 00
+      hdr[1] = len;
+      hdr[2] = len >> 8;
+      hdr[3] = ~len;
+      hdr[4] = ~len >> 8;
+      storedRaw(w, hdr, 5);
+      w->block_left = len;
+    }
+    len = n < w->block_left ? n : w->block_left;
+    storedRaw(w, p, len);
+    w->adler = imageAdler32(w->adler, p, len);
+    w->block_left -= len;
+    w->left -= len;
+    p += len;
+    n -= len;
+  }
+}
+
+static int pngChunk(FILE *f, const char *type, const uint8_t *data, uint32_t len){
+  uint8_t hdr[8];
+  uint8_t tail[4];
+  uint32_t crc;
+
+  putBe32(hdr, len);
+  memcpy(hdr + 4, type, 4);
+  crc = imageCrc32(0, hdr + 4, 4);
+  crc = imageCrc32(crc, data, len);
+  putBe32(tail, crc);
+  return fwrite(hdr, 1, 8, f) != 8 || (len && fwrite(data, 1, len, f) != len) || fwrite(tail, 1, 4, f) != 4;
+}
+
+int imageWritePng(FILE *f, const void *pixels, int width, int height, int channels, int bits){
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  static const uint8_t zlib_hdr[2] = { 0x78, 0x01 };
+  int samples = width * channels, rowlen = samples * bits / 8;
+  size_t raw = (size_t) height * (rowlen + 1);
+  size_t blocks = (raw + STORED_MAX - 1) / STORED_MAX;
+  uint8_t ihdr[13], hdr[8], tail[4], filter = 0;
+  uint8_t *swap = NULL;
+  stored_writer w;
+  int y;
+
+  if (bits == 16 && (swap = malloc(rowlen)) == NULL)
+    return 1;
+  memset(&w, 0, sizeof(w));
+  w.f = f;
+  w.adler = 1;
+  w.left = raw;
+
+  putBe32(ihdr, width);
+  putBe32(ihdr + 4, height);
+  ihdr[8] = bits;
+  ihdr[9] = channels == 3 ? 2 : 0;   // Truecolor or grayscale.
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  w.err = fwrite(signature, 1, 8, f) != 8 || pngChunk(f, "IHDR", ihdr, 13);
+
+  putBe32(hdr, 2 + blocks * 5 + raw + 4);
+  memcpy(hdr + 4, "IDAT", 4);
+  if (fwrite(hdr, 1, 8, f) != 8)
+    w.err = 1;
+  w.crc = imageCrc32(0, hdr + 4, 4);
+  storedRaw(&w, zlib_hdr, 2);
+  for (y = 0; y < height && !w.err; y++){
+    storedPut(&w, &filter, 1);
+    storedPut(&w, rowBytes(pixels, y, samples, bits, swap), rowlen);
+  }
+  putBe32(tail, w.adler);
+  storedRaw(&w, tail, 4);
+  putBe32(tail, w.crc);
+  if (fwrite(tail, 1, 4, f) != 4)
+    w.err = 1;
+  free (swap);
+
+  return w.err || pngChunk(f, "IEND", NULL, 0) || ferror(f);
+}
@@ -0,0 +1,22 @@
+#ifndef __imgwrite_h__
+#define __imgwrite_h__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+  Still image writers for captured frames. `channels` is 1 (gray) or 3
+  (RGB), `bits` 8 or 16; 16 bit samples are in host order and written big
+  endian as both formats require. `maxval` is the largest sample, for the
+  PNM header.
+
+  PNG is written uncompressed, stored deflate blocks behind one IDAT chunk:
+  every reader takes it, and the cost is the CRC and Adler sums over the
+  bytes rather than compression. Both return nonzero on a write error.
+*/
+int imageWritePnm(FILE *f, const void *pixels, int width, int height, int channels, int bits, int maxval);
+int imageWritePng(FILE *f, const void *pixels, int width, int height, int channels, int bits);
+uint32_t imageCrc32(uint32_t crc, const uint8_t *p, size_t len);
+uint32_t imageAdler32(uint32_t adler, const uint8_t *p, size_t len);
+
+#endif
@@ -27,6 +27,32 @@
  */
 
 #include "kinect_cli.h"
+#include <sys/sysinfo.h>
+#include <time.h>
+#include "libfreenect_audio.h"
+#include "depth_filter.h"
+#include "depth_proc.h"
+#include "video_proc.h"
+#include "devqueue.h"
+#include "tilt.h"
+#include "audio.h"
+#include "rtsched.h"
+#include "bench.h"
+#include "floor.h"
+#include "voxel.h"
+#include "calib.h"
+#include "imgwrite.h"
+#include "modes.h"
+#include "textatlas.h"
+#include "capture.h"
+#include "motion.h"
+#include "recorder.h"
+#include "metrics.h"
+#include "log.h"
+#include "hotplug.h"
+#include "registry.h"
+
+char *USER_ERR_MSG;
 
 int depth;
 char *display_name;
@@ -48,10 +74,19 @@ float tmprot = 1;
 pthread_mutex_t gl_backbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 uint8_t gl_depth_front[640*480*4];
-uint8_t gl_depth_back[640*480*4];
-
-uint8_t gl_rgb_front[640*480*4];
-uint8_t gl_rgb_back[640*480*4];
+uint8_t gl_depth_back_buf[640*480*4];
+uint8_t *gl_depth_back = gl_depth_back_buf; // Swapped with the depth processor output.
+int gl_depth_back_w = 640, gl_depth_back_h = 480;
+int gl_depth_front_w = 640, gl_depth_front_h = 480;
+
+// Sized once for the largest upload frame by allocVideoBuffers, 64 byte
+// aligned. gl_rgb_back is swapped with the video processor output.
+uint8_t *gl_rgb_front = NULL;
+uint8_t *gl_rgb_back = NULL;
+freenect_frame_mode video_mode;
+freenect_frame_mode gl_rgb_front_mode;
+freenect_frame_mode gl_rgb_back_mode;
+freenect_frame_mode depth_mode;
 
 GLuint gl_depth_tex;
 GLuint gl_rgb_tex;
@@ -76,7 +111,58 @@ int pusx = 0, pusy = 0;
 pthread_cond_t gl_frame_cond = PTHREAD_COND_INITIALIZER;
 int got_frames = 0;
 
-uint16_t t_gamma[2048];
+colormap cmap;
+
+work_pool band_pool;
+// Every captured frame lives in these, allocated once at startup.
+frame_pool depth_frames;
+frame_pool video_frames;
+depth_filter dfilter;
+depth_proc dproc;
+video_proc vproc;
+tilt_poller tilt;
+dev_queue devq;
+audio_capture audio;
+
+pthread_t render_thread;
+jitter_monitor video_jitter;
+jitter_monitor depth_jitter;
+
+capture_stream cap_depth;
+capture_stream cap_video;
+// Recording of both streams is gated on motion in the depth.
+motion_gate motion;
+recorder rec_depth;
+recorder rec_video;
+int record_preroll = 15;
+metrics_server metrics;
+// Supervises the device thread's loop, reopens the device after an outage.
+hotplug hp;
+device_registry registry;
+// Millimeter readings from the latest depth frame, for the probe command.
+depth_probe probe;
+// Floor plane from the probe, for autolevel and drift reports.
+floor_estimator floor_est;
+// Voxel centroids and the occupancy map, for the voxel command.
+voxel_grid voxels;
+// Checkerboard calibration of the video camera, which rebuilds the depth rays.
+calibrator calib;
+pthread_mutex_t depth_calib_lock = PTHREAD_MUTEX_INITIALIZER;
+calib_result depth_calib;      // Last calibration solved or loaded, under depth_calib_lock.
+int depth_calib_set;
+int depth_calib_used;          // The depth rays are built from it rather than the nominal intrinsics.
+uint64_t streams_started_ns;   // Last stream start, the stall check counts from it.
+int device_lost;               // Set by the device thread once recovery gives up, cleared by the console.
+
+/*
+  Console text is drawn from a glyph atlas as a cached batch of quads,
+  rebuilt when con_gen moved past the generation it was built from. Every
+  change to con.OutBuf, con.Buf or the status rows bumps it.
+*/
+
+text_atlas con_text;
+uint64_t con_gen = 1;
+int con_text_bitmap = 0;   // Draw with glutBitmapString instead, for comparison.
 
 console con;
 MYKINECT myKinect;
@@ -92,294 +178,200 @@ const char *commandsList[] = { "set",
                                "listSupportedSubDevices",
                                "listSelectedSubDevices",
                                "selectSubDevices",
+                               "stats",
+                               "bench",
+                               "get",
+                               "capture",
+                               "record",
+                               "metrics",
+                               "probe",
+                               "autolevel",
+                               "voxel",
+                               "calibrate",
                                "help"};
 
 const char *commandsHelp[]  = { "Set properties.",
-                                "Trigger feeds on/off.",
+                                "Trigger feeds on/off: rgb, depth, audio [synth].",
                                 "Exit KinectCLI.",
                                 "Get and display Kinect Serial #.",
-                                "Open selected subdevices, all by default.",
+                                "Open selected subdevices of the first Kinect, or of the one with [serial].",
                                 "Close all opensubdevices.",
                                 "Scan for connected Kinect.",
                                 "List supported subDevices by libFreenect.",
                                 "List subdevices that will be activated by next open call.",
                                 "Choose which subdevices will be activated by next open call. Angle -> 1 Camera -> 2 Audio -> 3",
+                                "Show per frame processing cost, hist for the raw depth histogram, sched for thread scheduling, pipeline for stages.",
+                                "Run a benchmark on synthetic frames: threads, stats, demosaic, unpack, motion, console [frames], audio [seconds], log [messages], hotplug [drops], probe [queries], floor [clip.krec], voxel [frames], calib [views].",
+                                "Show cached device state: tilt, accel, floor.",
+                                "Write stills in the background: depth, rgb, both [path, .png for PNG] [frames].",
+                                "Record clips while the depth shows motion: on [path prefix], off.",
+                                "Serve Prometheus metrics: on [port, host:port, unix:path], off, check [scrapes].",
+                                "Millimeter depth from the latest frame: x y, roi x y w h (640x480 coordinates).",
+                                "Tilt until the camera is [pitch] degrees over the floor, 0 by default.",
+                                "Voxel grid of the depth: on, off, size <mm>, save <prefix> for prefix.ply and prefix.pgm.",
+                                "Checkerboard calibration of the video camera: start, replay <clip.krec> [cols rows square_mm], stop, solve [path], load [path], status.",
                                 "Display this message."};
 
 
-// This need to be better understood and fixed.
-int DrawGLSceneY = 480;
-int ReSizeGLSceneY = 480;
-int gl_threadfunY1 = 480;
-int gl_threadfunY2 = 480;
+// Console on top, both feeds below it. Feed textures are scaled to their quads.
+int gl_window_h = 480;
 
 void listSelectedSubDevices(){
-  if (myKinect.kinect_selected_devices_count == -1){
-    pushToOutBuffer ("Getting selected Subdevices.");
-    int res;
-    res = freenect_enabled_subdevices(f_ctx);
-
-    // FREENECT_DEVICE_MOTOR = 1
-    // FREENECT_DEVICE_CAMERA = 2
-    // FREENECT_DEVICE_AUDIO = 4
-    switch (res){
-    case 1:
-      myKinect.kinect_selected_devices[1] = FREENECT_DEVICE_MOTOR;
-      myKinect.kinect_selected_devices_count = 1;
-      break;
-
-    case 2:
-      myKinect.kinect_selected_devices[1] = FREENECT_DEVICE_CAMERA;
-      myKinect.kinect_selected_devices_count = 1;
-      break;
-
-    case 4:
-      myKinect.kinect_selected_devices[1] = FREENECT_DEVICE_AUDIO;
-      myKinect.kinect_selected_devices_count = 1;
-      break;
-
-    case 3:
-      ;
-      freenect_device_flags tmpArray3[3] = {FREENECT_DEVICE_MOTOR, FREENECT_DEVICE_CAMERA};
-      memcpy(myKinect.kinect_selected_devices, tmpArray3, sizeof(tmpArray3));
-      myKinect.kinect_selected_devices_count = 2;
-      break;
-
-    case 5:
-      ;
-      freenect_device_flags tmpArray5[3] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_MOTOR};
-      memcpy(myKinect.kinect_selected_devices, tmpArray5, sizeof(tmpArray5));
-      myKinect.kinect_selected_devices_count = 2;
-      break;
-
-    case 6:
-      ;
-      freenect_device_flags tmpArray6[3] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_CAMERA};
-      memcpy(myKinect.kinect_selected_devices, tmpArray6, sizeof(tmpArray6));
-      myKinect.kinect_selected_devices_count = 2;
-      break;
-
-    case 7:
-      ;
-      freenect_device_flags tmpArray7[3] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_CAMERA, FREENECT_DEVICE_MOTOR};
-      memcpy(myKinect.kinect_selected_devices, tmpArray7, sizeof(tmpArray7));
-      myKinect.kinect_selected_devices_count = 3;
-      break;
-
-    default:
-      pushToOutBuffer ("Unknown results from selected subdevices: %d", res);
-      debug ("Unknown results from selected subdevices: %d", res);
-    }
-  }
-
   int i;
-  for ( i = 0; i < myKinect.kinect_selected_devices_count; i++){
-    switch (myKinect.kinect_selected_devices[i]){
-    case FREENECT_DEVICE_MOTOR:
-      pushToOutBuffer ("Angle Motor is selected.");
-      break;
-    case FREENECT_DEVICE_CAMERA:
-      pushToOutBuffer ("Camera is selected.");
-      break;
-    case FREENECT_DEVICE_AUDIO:
-      pushToOutBuffer ("Audio is selected.");
-      break;
 
-    default:
-      pushToOutBuffer ("I should not be printing this.");
-    }
+  if (myKinect.kinect_selected_devices_count == -1){
+    pushToOutBuffer ("Getting selected Subdevices.");
+    myKinect.kinect_selected_devices_flag = freenect_enabled_subdevices(f_ctx);
+    myKinect.kinect_selected_devices_count = subdeviceList(myKinect.kinect_selected_devices_flag, myKinect.kinect_selected_devices);
   }
-  return;
 
- error:
-  debug ("%s", USER_ERR_MSG);
-  pushToOutBuffer (USER_ERR_MSG);
-  free (USER_ERR_MSG);
+  for (i = 0; i < myKinect.kinect_selected_devices_count; i++)
+    pushToOutBuffer ("%s is selected.", subdeviceName(myKinect.kinect_selected_devices[i]));
 }
 
 void selectSubDevices(int subDevs){
+  int i;
+
   pushToOutBuffer ("selecting Subdevices.");
   // FREENECT_DEVICE_MOTOR = 1
   // FREENECT_DEVICE_CAMERA = 2
   // FREENECT_DEVICE_AUDIO = 4
-  myKinect.kinect_selected_devices_flag = subDevs;
-
-  switch (subDevs){
-  case 1:
-    myKinect.kinect_selected_devices[0] = FREENECT_DEVICE_MOTOR;
-    myKinect.kinect_selected_devices_count = 1;
-    break;
-
-  case 2:
-    myKinect.kinect_selected_devices[0] = FREENECT_DEVICE_CAMERA;
-    myKinect.kinect_selected_devices_count = 1;
-    break;
-
-  case 4:
-    myKinect.kinect_selected_devices[0] = FREENECT_DEVICE_AUDIO;
-    myKinect.kinect_selected_devices_count = 1;
-    break;
-
-  case 3:
-    ;
-    freenect_device_flags tmpArray3[2] = {FREENECT_DEVICE_CAMERA, FREENECT_DEVICE_MOTOR};
-    memcpy(myKinect.kinect_selected_devices, tmpArray3, sizeof(tmpArray3));
-    myKinect.kinect_selected_devices_count = 2;
-    break;
-
-  case 5:
-    ;
-    freenect_device_flags tmpArray5[2] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_MOTOR};
-    memcpy(myKinect.kinect_selected_devices, tmpArray5, sizeof(tmpArray5));
-    myKinect.kinect_selected_devices_count = 2;
-    break;
-
-  case 6:
-    ;
-    freenect_device_flags tmpArray6[2] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_CAMERA};
-    memcpy(myKinect.kinect_selected_devices, tmpArray6, sizeof(tmpArray6));
-    myKinect.kinect_selected_devices_count = 2;
-    break;
-
-  case 7:
-    ;
-    freenect_device_flags tmpArray7[3] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_CAMERA, FREENECT_DEVICE_MOTOR};
-    memcpy(myKinect.kinect_selected_devices, tmpArray7, sizeof(tmpArray7));
-    myKinect.kinect_selected_devices_count = 3;
-    break;
-
-  default:
+  if (subDevs < 1 || subDevs > 7)
     debug ("Unknown sub devices flag: %d", subDevs);
-    check (1 == 2, "Sub Devices flags: 1(Motor), 2(Camera), 3, 4(Audio), 5, 6, 7");
-  }
+  check (subDevs >= 1 && subDevs <= 7, "Sub Devices flags: 1(Motor), 2(Camera), 3, 4(Audio), 5, 6, 7");
+  myKinect.kinect_selected_devices_flag = subDevs;
+  myKinect.kinect_selected_devices_count = subdeviceList(subDevs, myKinect.kinect_selected_devices);
   freenect_select_subdevices(f_ctx, subDevs);
 
-  int i;
-  pushToOutBuffer ("The following subdevices are not selected :");
-  for ( i = 0; i < myKinect.kinect_selected_devices_count; i++){
-    switch (myKinect.kinect_selected_devices[i]){
-    case FREENECT_DEVICE_MOTOR:
-      pushToOutBuffer ("Angle Motor.");
-      break;
-  case FREENECT_DEVICE_CAMERA:
-      pushToOutBuffer ("Camera.");
-      break;
-  case FREENECT_DEVICE_AUDIO:
-      pushToOutBuffer ("Audio.");
-      break;
-
-    default:
-      pushToOutBuffer ("I should not be printing this.");
-    }
-  }
+  pushToOutBuffer ("The following subdevices are selected :");
+  for (i = 0; i < myKinect.kinect_selected_devices_count; i++)
+    pushToOutBuffer ("%s.", subdeviceName(myKinect.kinect_selected_devices[i]));
   pushToOutBuffer("Note: Only selected subdevices will be activated by the next open call");
   return;
 
  error:
-  debug ("%s", USER_ERR_MSG);
   pushToOutBuffer (USER_ERR_MSG);
   free (USER_ERR_MSG);
 }
 
+// Supported subdevices are a property of the libfreenect build, cached with the device list.
 void listSupportedSubDevices(){
+  int i;
+
   pushToOutBuffer ("Getting Subdevices.");
-  int res;
-  res = freenect_supported_subdevices();
-  // FREENECT_DEVICE_MOTOR = 1
-  // FREENECT_DEVICE_CAMERA = 2
-  // FREENECT_DEVICE_AUDIO = 4
-  switch (res){
-  case 1:
-    myKinect.kinect_supported_devices[0] = FREENECT_DEVICE_MOTOR;
-    myKinect.kinect_supported_devices_count = 1;
-    break;
+  registryEnsure(&registry, f_ctx);
+  myKinect.kinect_supported_devices_count = subdeviceList(registry.supported, myKinect.kinect_supported_devices);
+  for (i = 0; i < myKinect.kinect_supported_devices_count; i++)
+    pushToOutBuffer ("%s is supported.", subdeviceName(myKinect.kinect_supported_devices[i]));
+}
 
-  case 2:
-    myKinect.kinect_supported_devices[0] = FREENECT_DEVICE_CAMERA;
-    myKinect.kinect_supported_devices_count = 1;
-    break;
+void listKinectAttribute(){
+    char serial[REGISTRY_SERIAL_LEN];
+    int i;
 
-  case 4:
-    myKinect.kinect_supported_devices[0] = FREENECT_DEVICE_AUDIO;
-    myKinect.kinect_supported_devices_count = 1;
-    break;
+    pushToOutBuffer ("Getting attributes.");
+    myKinect.nr_devices = registryEnsure(&registry, f_ctx);
+    check (myKinect.nr_devices > 0 , "I do not see any Kinect.");
+    for (i = 0; registrySerial(&registry, f_ctx, i, serial, sizeof(serial)) == 0; i++)
+      pushToOutBuffer ("Kinect %d serial: %s", i, serial);
+    return;
 
-  case 3:
-    ;
-    freenect_device_flags tmpArray3[2] = {FREENECT_DEVICE_CAMERA, FREENECT_DEVICE_MOTOR};
-    memcpy(myKinect.kinect_supported_devices, tmpArray3, sizeof(tmpArray3));
-    myKinect.kinect_supported_devices_count = 2;
-    break;
+   error:
+    pushToOutBuffer (USER_ERR_MSG);
+    free (USER_ERR_MSG);
+  }
 
-  case 5:
-    ;
-    freenect_device_flags tmpArray5[2] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_MOTOR};
-    memcpy(myKinect.kinect_supported_devices, tmpArray5, sizeof(tmpArray5));
-    myKinect.kinect_supported_devices_count = 2;
+/*
+  Apply the configured scheduling of `role` to its threads running now.
+  Threads started later get it where they are created.
+*/
+int applySched(thread_role role){
+  const thread_sched *s = rtSchedGet(role);
+  int res = 0, i, cpu;
+
+  switch (role){
+  case ROLE_CAPTURE:
+    if (myKinect.kinect_is_open == 0)
+      res = rtSchedApply(freenect_thread, s, s->cpu);
     break;
-
-  case 6:
-    ;
-    freenect_device_flags tmpArray6[2] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_CAMERA};
-    memcpy(myKinect.kinect_supported_devices, tmpArray6, sizeof(tmpArray6));
-    myKinect.kinect_supported_devices_count = 2;
+  case ROLE_RENDER:
+    res = rtSchedApply(render_thread, s, s->cpu);
     break;
-
-  case 7:
-    ;
-    freenect_device_flags tmpArray7[3] = {FREENECT_DEVICE_AUDIO, FREENECT_DEVICE_CAMERA, FREENECT_DEVICE_MOTOR};
-    memcpy(myKinect.kinect_supported_devices, tmpArray7, sizeof(tmpArray7));
-    myKinect.kinect_supported_devices_count = 3;
+  case ROLE_DEPTH:
+    if (dproc.running)
+      res = rtSchedApply(dproc.thread, s, s->cpu);
+    break;
+  case ROLE_VIDEO:
+    if (vproc.running)
+      res = rtSchedApply(vproc.thread, s, s->cpu);
+    break;
+  case ROLE_WORKERS:
+    // Without a cpu the workers keep the pinning the pool gave them.
+    for (i = 0; i < band_pool.nthreads && res == 0; i++){
+      cpu = s->cpu >= 0 ? s->cpu + i : (band_pool.first_cpu >= 0 ? band_pool.first_cpu + i : -1);
+      res = rtSchedApply(band_pool.threads[i], s, cpu >= get_nprocs() ? -1 : cpu);
+    }
+    break;
+  case ROLE_AUDIO:
+    if (audio.running)
+      res = rtSchedApply(audio.thread, s, s->cpu);
+    break;
+  case ROLE_DEVICE:
+    if (tilt.running)
+      res = rtSchedApply(tilt.thread, s, s->cpu);
     break;
-
   default:
-    pushToOutBuffer ("Unknown results from supported subdevices: %d", res);
-    debug ("Unknown results from supported subdevices: %d", res);
+    break;
   }
+  if (res != 0)
+    pushToOutBuffer ("Could not apply %s to the %s thread: %s", rtSchedPolicyName(s->policy),
+                     rtSchedRoleName(role), strerror(res));
+  return res;
+}
 
-  int i;
-  for ( i = 0; i < myKinect.kinect_supported_devices_count; i++){
-    switch (myKinect.kinect_supported_devices[i]){
-    case FREENECT_DEVICE_MOTOR:
-      pushToOutBuffer ("Angle Motor is supported.");
-      break;
-    case FREENECT_DEVICE_CAMERA:
-      pushToOutBuffer ("Camera is supported.");
-      break;
-    case FREENECT_DEVICE_AUDIO:
-      pushToOutBuffer ("Audio is supported.");
-      break;
+void audio_cb(freenect_device *dev, int num_samples, int32_t *mic1, int32_t *mic2,
+              int32_t *mic3, int32_t *mic4, int16_t *cancelled, void *unknown)
+{
+	audioPush(&audio, num_samples, mic1, mic2, mic3, mic4);
+}
 
-    default:
-      pushToOutBuffer ("I should not be printing this.");
+/*
+  Toggle mic array capture into a WAV file named after the start time. The
+  synthetic source needs no device and feeds the same ring as the callback.
+*/
+int triggerAudio(int synthetic){
+  char path[64];
+  time_t now = time(NULL);
+
+  if (audio.running){
+    if (!audio.synthetic)
+      check (freenect_stop_audio(f_dev) == 0, "Error stopping audio stream.");
+    audioStop(&audio);
+    pushToOutBuffer ("Audio stopped, %d frames in %s.", (int) audio.written, audio.path);
+    return 0;
+  }
+
+  check (synthetic || myKinect.kinect_is_open == 0, "Kinect is not open.");
+  strftime(path, sizeof(path), "audio-%Y%m%d-%H%M%S.wav", localtime(&now));
+  check (audioStart(&audio, path, synthetic) == 0, "Could not start audio capture.");
+  if (!synthetic){
+    freenect_set_audio_in_callback(f_dev, audio_cb);
+    if (freenect_start_audio(f_dev) != 0){
+      audioStop(&audio);
+      check (0, "Error starting audio stream, is the audio subdevice open?");
     }
   }
-  return;
+  if (!rtSchedIsDefault(ROLE_AUDIO))
+    applySched(ROLE_AUDIO);
+  pushToOutBuffer ("Audio capture%s to %s.", synthetic ? " from the synthetic source" : "", path);
+  return 0;
 
  error:
-  debug ("%s", USER_ERR_MSG);
   pushToOutBuffer (USER_ERR_MSG);
   free (USER_ERR_MSG);
+  return 1;
 }
 
-void listKinectAttribute(){
-    pushToOutBuffer ("Getting attributes.");
-    if (myKinect.nr_devices < 1)
-      scan();
-
-    check (myKinect.nr_devices > 0 , "I do not see any Kinect.");
-    check (freenect_list_device_attributes(f_ctx, &myKinect.kinect_attributes) == myKinect.nr_devices, "Error in getting Kinect attributes.");
-    pushToOutBuffer ("Kinect serial: %s", myKinect.kinect_attributes->camera_serial);
-    myKinect.kinect_serial = myKinect.kinect_attributes->camera_serial;
-//    freenect_free_device_attributes(&myKinect.kinect_attributes); //this caused seg fault.
-    return;
-
-   error:
-    debug ("%s", USER_ERR_MSG);
-    pushToOutBuffer (USER_ERR_MSG);
-    free (USER_ERR_MSG);
-  }
-
 void closeKinect(){
   if (myKinect.kinect_is_open == 0){
     pushToOutBuffer("Shutting Down Streams...");
@@ -396,6 +388,9 @@ void closeKinect(){
       triggerFeed(RGB);
     }
 
+    tiltPollerStop(&tilt);
+    if (audio.running && !audio.synthetic)
+      triggerAudio(0);
     pushToOutBuffer("Closing device.");
     check (freenect_close_device(f_dev) == 0 , "Error closing device");
     myKinect.kinect_is_open = 1;
@@ -411,70 +406,934 @@ void closeKinect(){
   }
 }
 
-void openKinect(){
-  if (myKinect.kinect_is_open == 1){
-    int res;
-    pushToOutBuffer ("Opening Device.");
-    // Should open_device use nr_devices? No, won't work, maybe with multiple Kinect it would be nr_devices - 1
-    check (freenect_open_device(f_ctx, &f_dev, myKinect.user_device_number) >= 0, "Could not locate Kinect");
+/*
+  Open the Kinect with `serial`, or the one at user_device_number, looked
+  up in the device cache. A device that is cached but gone makes the next
+  lookup scan again.
+*/
+void openDevice(const char *serial){
+  if (hotplugRecovering(&hp)){
+    pushToOutBuffer ("Device %s is being recovered, set hotplug off to give up.", hp.serial);
+  }
+  else if (myKinect.kinect_is_open == 1){
+    int res, index = myKinect.user_device_number, opened;
+    char found[REGISTRY_SERIAL_LEN];
+
+    if (serial){
+      index = registryFind(&registry, f_ctx, serial);
+      check (index >= 0, "No Kinect with that serial, try scan.");
+    }
+    check (registrySerial(&registry, f_ctx, index, found, sizeof(found)) == 0, "Could not locate Kinect");
+    pushToOutBuffer ("Opening Device %s.", found[0] ? found : "without a serial");
+    // Some models report no serial, those only open by index.
+    opened = found[0] ? freenect_open_device_by_camera_serial(f_ctx, &f_dev, found) : freenect_open_device(f_ctx, &f_dev, index);
+    if (opened < 0)
+      registryInvalidate(&registry);
+    check (opened >= 0, "Could not open Kinect, scan again if it was unplugged.");
+    myKinect.user_device_number = index;
     myKinect.kinect_is_open = 0;
+    hotplugSetSerial(&hp, found);
+    if (found[0] == '\0')
+      pushToOutBuffer ("No serial for this device, it will not be recovered if it drops out.");
     pushToOutBuffer ("Starting Thread.");
     res = pthread_create(&freenect_thread, NULL, freenect_threadfunc, NULL);
     check (!res, "Could not create thread.");
+    if (!rtSchedIsDefault(ROLE_CAPTURE))
+      applySched(ROLE_CAPTURE);
+  }
+  else{
+    pushToOutBuffer ("Kinect is open.");
+  }
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  if (myKinect.kinect_is_open == 0)
+    closeKinect();
+}
+
+void openKinect(){
+  openDevice(NULL);
+}
+
+// The one command that always walks the bus, refreshing the device cache.
+void scan(){
+    pushToOutBuffer ("Scannning for devices.");
+    myKinect.nr_devices = registryScan(&registry, f_ctx);
+    pushToOutBuffer ("Number of Devices Found: %d", myKinect.nr_devices);
+
+    myKinect.user_device_number = 0;
+/*    if (argc > 1)
+      user_device_number = atoi(argv[1]);
+*/
+    check (myKinect.nr_devices >= 1, "No Kinect found.");
+
+    return;
+
+   error:
+    pushToOutBuffer (USER_ERR_MSG);
+    free (USER_ERR_MSG);
+
+  }
+
+// libfreenect messages go through our rings too, tagged as its own.
+void freenectLog(freenect_context *dev, freenect_loglevel level, const char *msg){
+  if ((int) level <= log_level)
+    logWrite(level, "libfreenect", 0, "%s", msg);
+}
+
+void initFreenect(){
+  debug ("Initializing freenect.");
+  check (myKinect.freenect_is_init == 1, "Freenect already initialized.");
+  check(freenect_init(&f_ctx, NULL) == 0,"freenect_init failed.");
+  myKinect.freenect_is_init = 0;
+  debug ("Freenect init is good.");
+
+  debug ("Set freenect log level %s", logLevelName(log_level));
+  freenect_set_log_callback(f_ctx, freenectLog);
+  freenect_set_log_level(f_ctx, (freenect_loglevel) log_level);
+
+ error:
+  debug ("%s", USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+void displayHelp(){
+  size_t i = 0;
+  for ( i = 0; i < sizeof(commandsList) / sizeof(commandsList[0]); i++){
+    pushToOutBuffer("%s : %s", commandsList[i], commandsHelp[i]);
+  }
+}
+
+void displayStream(const char *label, const char *mode, stream_meter *m){
+  pushToOutBuffer("%s %s: %d.%d fps, %d KB/s", label, mode,
+                  (int) (m->fps_x100 / 100), (int) (m->fps_x100 % 100 / 10), (int) (m->bytes_per_sec / 1024));
+}
+
+void displayTimer(const char *label, stage_timer *t){
+  if (__atomic_load_n(&t->count, __ATOMIC_ACQUIRE) == 0){
+    pushToOutBuffer("%s: idle", label);
+    return;
+  }
+  pushToOutBuffer("%s last: %d us avg: %d us max: %d us", label,
+                  (int) (t->last_ns / 1000), (int) (t->avg_ns / 1000), (int) (t->max_ns / 1000));
+}
+
+void displayJitter(const char *label, jitter_monitor *j){
+  if (__atomic_load_n(&j->frames, __ATOMIC_ACQUIRE) < 2){
+    pushToOutBuffer("%s jitter: no frames", label);
+    return;
+  }
+  pushToOutBuffer("%s jitter max: %d us late: %d gaps: %d drift: %d ppm over %d frames", label,
+                  (int) (j->max_jitter_ns / 1000), (int) j->late, (int) j->gaps, (int) j->drift_ppm, (int) j->frames);
+}
+
+void displaySched(){
+  int r;
+  for (r = 0; r < ROLE_COUNT; r++){
+    const thread_sched *s = rtSchedGet((thread_role) r);
+    if (s->cpu >= 0)
+      pushToOutBuffer("%s: %s priority %d on cpu %d", rtSchedRoleName(r), rtSchedPolicyName(s->policy), s->priority, s->cpu);
+    else
+      pushToOutBuffer("%s: %s priority %d, any cpu", rtSchedRoleName(r), rtSchedPolicyName(s->policy), s->priority);
+  }
+}
+
+void displayFramePool(frame_pool *p){
+  static const char *backing[] = {"plain pages", "transparent huge pages", "huge pages"};
+  pushToOutBuffer("%s frames: %d x %d bytes on %s", p->name, p->count, (int) p->frame_bytes, backing[p->huge]);
+  pushToOutBuffer("%s free: %d lowest: %d acquired: %d exhausted: %d", p->name, framePoolFreeCount(p),
+                  p->min_free, (int) p->acquired, (int) p->exhausted);
+}
+
+void displayPipeline(pipeline *pl){
+  int i;
+  pushToOutBuffer("%s pipeline: %d frames, avg %d us", pl->name, (int) pl->frames, (int) (pl->total.avg_ns / 1000));
+  for (i = 0; i < pl->count; i++){
+    pipeline_stage *s = &pl->stages[i];
+    pushToOutBuffer("  %s %s%s runs: %d skipped: %d avg: %d us max: %d us", s->name, s->enabled ? "on" : "off",
+                    s->async ? " async" : "", (int) s->runs, (int) s->skipped,
+                    (int) (s->timer.avg_ns / 1000), (int) (s->timer.max_ns / 1000));
+  }
+}
+
+/*
+  Console drawing cost per frame, submit and glFinish, with the feeds off:
+  glutBitmapString, the cached atlas batch, and the batch rebuilt every
+  frame as when text changes constantly. Runs on the GL thread.
+*/
+void benchConsole(int frames){
+  const char *names[] = { "bitmap", "atlas", "atlas rebuilt" };
+  uint64_t ns[3];
+  int saved = con_text_bitmap;
+  int m, n;
+
+  if (frames < 1)
+    frames = 1;
+  for (m = 0; m < 3; m++){
+    if (m > 0 && !con_text.ready)
+      break;
+    con_text_bitmap = m == 0;
+    con_gen++;
+    uint64_t start = nowNs();
+    for (n = 0; n < frames; n++){
+      if (m == 2)
+        con_gen++;
+      glClear(GL_COLOR_BUFFER_BIT);
+      glLoadIdentity();
+      glTranslated(1280, 0, 0);
+      glScalef(-1, 1, 1);
+      updateConsole();
+      glFinish();
+    }
+    ns[m] = (nowNs() - start) / frames;
+  }
+  con_text_bitmap = saved;
+  for (n = 0; n < m; n++)
+    pushToOutBuffer("Console %s: %d us per frame", names[n], (int) (ns[n] / 1000));
+  if (m == 3 && ns[1] > 0)
+    pushToOutBuffer("Atlas speedup: %fx", (double) ns[0] / ns[1]);
+  if (m < 3)
+    pushToOutBuffer("No text atlas, only the bitmap path was measured.");
+}
+
+// Recorded against skipped, frames dropped by the full stage queue not included.
+void displayRecorder(recorder *r){
+  uint64_t seen = r->recorded + r->skipped;
+  pushToOutBuffer("Record %s %s: %d frames in %d clips, %d skipped (%d% kept), %d failed", r->stream,
+                  recorderArmed(r) ? "on" : "off", (int) r->recorded, (int) r->clips, (int) r->skipped,
+                  seen ? (int) (r->recorded * 100 / seen) : 0, (int) r->failed);
+  displayTimer("Record write", &r->write);
+}
+
+void displayStats(){
+  uint64_t log_written, log_dropped;
+
+  pushToOutBuffer("Band workers: %d", band_pool.nthreads);
+  displayStream("Video", modeVideoName(video_mode.video_format), &vproc.meter);
+  displayJitter("Video", &video_jitter);
+  pushToOutBuffer("Video frames: %d dropped: %d", (int) vproc.frames, (int) vproc.frames_in.dropped);
+  displayFramePool(&video_frames);
+  displayTimer("Video copy", &vproc.copy);
+  displayTimer("Demosaic", &vproc.demosaic);
+  displayStream("Depth", modeDepthName(depth_mode.depth_format), &dproc.meter);
+  displayJitter("Depth", &depth_jitter);
+  pushToOutBuffer("Depth frames: %d dropped: %d", (int) dproc.frames, (int) dproc.frames_in.dropped);
+  displayFramePool(&depth_frames);
+  pushToOutBuffer("Filter: %s, holes %s", depthFilterModeName(dfilter.mode), dfilter.holes ? "on" : "off");
+  pushToOutBuffer("Colormap: %s, range %d to %d", colormapName(cmap.palette), cmap.near, cmap.far);
+  displayTimer("Colormap build", &cmap.build);
+  displayTimer("Depth pipeline", &dproc.pipe.total);
+  pushToOutBuffer("Tilt polls: %d errors: %d at %d Hz", (int) tilt.polls, (int) tilt.errors, tilt.rate_hz);
+  displayTimer("Tilt poll", &tilt.poll);
+  pushToOutBuffer("Device commands: %d applied: %d failed: %d coalesced: %d", (int) devq.posted,
+                  (int) devq.applied, (int) devq.failed, (int) devq.coalesced);
+  displayTimer("Command latency", &devq.latency);
+  pushToOutBuffer("Audio %s: %d callbacks, %d frames written, overruns: %d underruns: %d",
+                  audio.running ? "on" : "off", (int) audio.callbacks, (int) audio.written,
+                  (int) audio.overruns, (int) audio.underruns);
+  displayTimer("Audio write", &audio.write);
+  pushToOutBuffer("Captured depth: %d rgb: %d", (int) cap_depth.written, (int) cap_video.written);
+  displayTimer("Depth capture write", &cap_depth.encode);
+  displayTimer("RGB capture write", &cap_video.encode);
+  pushToOutBuffer("Motion gate %s, score %d of %d, %d events", motionGateOpen(&motion) ? "open" : "closed",
+                  (int) motion.score, motion.threshold, (int) motion.events);
+  displayTimer("Motion gate", &motion.timer);
+  displayRecorder(&rec_depth);
+  displayRecorder(&rec_video);
+  if (metrics.running){
+    pushToOutBuffer("Metrics on %s: %d scrapes, %d rejected", metrics.addr, (int) metrics.scrapes, (int) metrics.rejected);
+    displayTimer("Metrics render", &metrics.render);
+  }
+  pushToOutBuffer("Devices: %d cached, %d scans, %d lookups", registry.count, (int) registry.scans, (int) registry.lookups);
+  displayTimer("Device scan", &registry.scan);
+  pushToOutBuffer("Hotplug %s: %s, %d lost, %d recovered, %d failed scans, last %d ms", hp.serial[0] ? hp.serial : "-",
+                  !hp.enabled ? "off" : hotplugRecovering(&hp) ? "recovering" : "on", (int) hp.disconnects,
+                  (int) hp.recoveries, (int) hp.failed, (int) hp.last_ms);
+  displayTimer("Device recovery", &hp.recovery);
+  pushToOutBuffer("Depth probes: %d", (int) probe.probes);
+  displayTimer("Depth probe", &probe.timer);
+  pushToOutBuffer("Floor estimation %s at %d Hz: %d fits, %d without a floor, %d drifts", floor_est.running ? "on" : "off",
+                  floor_est.rate_hz, (int) floor_est.fits, (int) floor_est.failed, (int) floor_est.drifts);
+  displayTimer("Floor fit", &floor_est.timer);
+  pushToOutBuffer("Voxels of %d mm: %d from %d points, %d frames, %d dropped", voxels.size_mm, voxels.count[voxels.front],
+                  (int) voxels.in_points, (int) voxels.frames, (int) voxels.overflow);
+  displayTimer("Voxel insert", &voxels.insert);
+  displayTimer("Voxel merge", &voxels.merge);
+  pushToOutBuffer("Calibration %s: %d views, board in %d of %d frames, %d solves", calib.collecting ? "collecting" : "idle",
+                  calib.nviews, (int) calib.found, (int) calib.frames, (int) calib.solves);
+  displayTimer("Calib detect", &calib.detect);
+  displayTimer("Calib solve", &calib.solve_timer);
+  logCounts(&log_written, &log_dropped);
+  pushToOutBuffer("Log level %s: %d written, %d dropped", logLevelName(log_level), (int) log_written, (int) log_dropped);
+  pushToOutBuffer("Console text: %s, %d quads", con_text_bitmap || !con_text.ready ? "bitmap" : "atlas", con_text.quads);
+  displayTimer("Text build", &con_text.build);
+  displayTimer("Text draw", &con_text.draw);
+
+  int touched = dproc.out_w * dproc.out_h;
+  int full = dproc.width * dproc.height;
+  pushToOutBuffer("Region %dx%d at %d,%d step %d: %d of %d px (%d%)", dproc.roi.w, dproc.roi.h,
+                  dproc.roi.x, dproc.roi.y, dproc.step, touched, full, touched * 100 / full);
+  if (dproc.full.count > 0 && dproc.pipe.total.count > 0)
+    pushToOutBuffer("Cost against full frame: %d%", (int) (dproc.pipe.total.avg_ns * 100 / dproc.full.avg_ns));
+}
+
+/*
+  Scrape for the metrics thread. Everything here is published lock free by
+  its writer, or behind a sequence lock; the pool free counts are read
+  without the pool lock the frame paths take.
+*/
+// Both streams' samples of one family, `what` picks it, so they follow its metricsFamily line.
+void metricsStreams(metrics_buf *b, int what){
+  static const char *names[2] = { "depth", "video" };
+  stream_meter *meters[2] = { &dproc.meter, &vproc.meter };
+  jitter_monitor *jitters[2] = { &depth_jitter, &video_jitter };
+  uint64_t processed[2], dropped[2];
+  char labels[64];
+  int i;
+
+  processed[0] = __atomic_load_n(&dproc.frames, __ATOMIC_RELAXED);
+  processed[1] = __atomic_load_n(&vproc.frames, __ATOMIC_RELAXED);
+  dropped[0] = __atomic_load_n(&dproc.frames_in.dropped, __ATOMIC_RELAXED);
+  dropped[1] = __atomic_load_n(&vproc.frames_in.dropped, __ATOMIC_RELAXED);
+  for (i = 0; i < 2; i++){
+    snprintf(labels, sizeof(labels), "stream=\"%s\"", names[i]);
+    switch (what){
+    case 0:
+      metricsPrintf(b, "kcli_stream_fps{%s} %.2f\n", labels, __atomic_load_n(&meters[i]->fps_x100, __ATOMIC_RELAXED) / 100.0);
+      break;
+    case 1:
+      metricsPrintf(b, "kcli_stream_bytes_per_second{%s} %llu\n", labels,
+                    (unsigned long long) __atomic_load_n(&meters[i]->bytes_per_sec, __ATOMIC_RELAXED));
+      break;
+    case 2:
+      metricsPrintf(b, "kcli_frames_received_total{%s} %llu\n", labels,
+                    (unsigned long long) __atomic_load_n(&meters[i]->frames, __ATOMIC_RELAXED));
+      break;
+    case 3:
+      metricsPrintf(b, "kcli_frames_processed_total{%s} %llu\n", labels, (unsigned long long) processed[i]);
+      break;
+    case 4:
+      metricsPrintf(b, "kcli_frames_dropped_total{%s} %llu\n", labels, (unsigned long long) dropped[i]);
+      break;
+    case 5:
+      metricsPrintf(b, "kcli_frames_late_total{%s} %llu\n", labels,
+                    (unsigned long long) __atomic_load_n(&jitters[i]->late, __ATOMIC_RELAXED));
+      break;
+    case 6:
+      metricsPrintf(b, "kcli_frames_gaps_total{%s} %llu\n", labels,
+                    (unsigned long long) __atomic_load_n(&jitters[i]->gaps, __ATOMIC_RELAXED));
+      break;
+    default:
+      metricsPrintf(b, "kcli_frame_jitter_max_seconds{%s} %.9g\n", labels,
+                    __atomic_load_n(&jitters[i]->max_jitter_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+  }
+}
+
+void metricsPipeline(metrics_buf *b, pipeline *pl, int what){
+  char labels[96];
+  int i;
+
+  for (i = 0; i < pl->count; i++){
+    pipeline_stage *s = &pl->stages[i];
+    snprintf(labels, sizeof(labels), "pipeline=\"%s\",stage=\"%s\"", pl->name, s->name);
+    if (what == 0)
+      metricsTimer(b, "kcli_stage_latency_seconds", labels, &s->timer);
+    else if (what == 1)
+      metricsSample(b, "kcli_stage_enabled", labels, __atomic_load_n(&s->enabled, __ATOMIC_RELAXED));
+    else if (what == 2 && s->async)
+      metricsSample(b, "kcli_stage_queue_depth", labels, __atomic_load_n(&s->queue.count, __ATOMIC_RELAXED));
+    else if (what == 3 && s->async)
+      metricsSample(b, "kcli_stage_queue_dropped_total", labels, __atomic_load_n(&s->queue.dropped, __ATOMIC_RELAXED));
+  }
+}
+
+void collectMetrics(metrics_buf *b){
+  static const char *axes[3] = { "x", "y", "z" };
+  tilt_state ts;
+  floor_fit fit;
+  frame_pool *pools[2] = { &depth_frames, &video_frames };
+  uint64_t log_written, log_dropped;
+  char labels[64];
+  int i;
+
+  metricsFamily(b, "kcli_device_open", "gauge", "Kinect device open.");
+  metricsSample(b, "kcli_device_open", NULL, myKinect.kinect_is_open == 0);
+  metricsFamily(b, "kcli_device_scans_total", "counter", "USB enumerations, on scan and hotplug only.");
+  metricsSample(b, "kcli_device_scans_total", NULL, __atomic_load_n(&registry.scans, __ATOMIC_RELAXED));
+  metricsFamily(b, "kcli_depth_probes_total", "counter", "Probe queries answered.");
+  metricsSample(b, "kcli_depth_probes_total", NULL, __atomic_load_n(&probe.probes, __ATOMIC_RELAXED));
+  floorRead(&floor_est, &fit);
+  if (fit.valid){
+    metricsFamily(b, "kcli_floor_pitch_degrees", "gauge", "Camera pitch over the floor from the last fit, up positive.");
+    metricsSample(b, "kcli_floor_pitch_degrees", NULL, fit.pitch);
+  }
+  metricsFamily(b, "kcli_floor_fit_seconds", "summary", "Floor plane fit time.");
+  metricsTimer(b, "kcli_floor_fit_seconds", NULL, &floor_est.timer);
+  metricsFamily(b, "kcli_calib_detect_seconds", "summary", "Checkerboard detection time per video frame.");
+  metricsTimer(b, "kcli_calib_detect_seconds", NULL, &calib.detect);
+  metricsFamily(b, "kcli_voxels", "gauge", "Occupied voxels in the last depth frame.");
+  metricsSample(b, "kcli_voxels", NULL, __atomic_load_n(&voxels.count[voxels.front], __ATOMIC_RELAXED));
+  metricsFamily(b, "kcli_voxel_dropped_total", "counter", "Depth points that found the voxel tables full.");
+  metricsSample(b, "kcli_voxel_dropped_total", NULL, __atomic_load_n(&voxels.overflow, __ATOMIC_RELAXED));
+  metricsFamily(b, "kcli_device_recovering", "gauge", "Device lost and being scanned for.");
+  metricsSample(b, "kcli_device_recovering", NULL, hotplugRecovering(&hp));
+  metricsFamily(b, "kcli_device_disconnects_total", "counter", "Times the device dropped out.");
+  metricsSample(b, "kcli_device_disconnects_total", NULL, __atomic_load_n(&hp.disconnects, __ATOMIC_RELAXED));
+  metricsFamily(b, "kcli_device_recoveries_total", "counter", "Times the device was reopened after dropping out.");
+  metricsSample(b, "kcli_device_recoveries_total", NULL, __atomic_load_n(&hp.recoveries, __ATOMIC_RELAXED));
+  metricsFamily(b, "kcli_device_recovery_seconds", "summary", "Time from losing the device to the restored session.");
+  metricsTimer(b, "kcli_device_recovery_seconds", NULL, &hp.recovery);
+  metricsFamily(b, "kcli_freenect_initialized", "gauge", "libfreenect context initialized.");
+  metricsSample(b, "kcli_freenect_initialized", NULL, myKinect.freenect_is_init == 0);
+
+  metricsFamily(b, "kcli_stream_fps", "gauge", "Frames per second over the last complete second.");
+  metricsStreams(b, 0);
+  metricsFamily(b, "kcli_stream_bytes_per_second", "gauge", "Bytes per second over the last complete second.");
+  metricsStreams(b, 1);
+  metricsFamily(b, "kcli_frames_received_total", "counter", "Frames delivered by libfreenect.");
+  metricsStreams(b, 2);
+  metricsFamily(b, "kcli_frames_processed_total", "counter", "Frames run through the stream pipeline.");
+  metricsStreams(b, 3);
+  metricsFamily(b, "kcli_frames_dropped_total", "counter", "Frames replaced before the pipeline took them.");
+  metricsStreams(b, 4);
+  metricsFamily(b, "kcli_frames_late_total", "counter", "Frames arriving over half a period late.");
+  metricsStreams(b, 5);
+  metricsFamily(b, "kcli_frames_gaps_total", "counter", "Device timestamp gaps, frames lost before the host.");
+  metricsStreams(b, 6);
+  metricsFamily(b, "kcli_frame_jitter_max_seconds", "gauge", "Largest frame arrival jitter since the last reset.");
+  metricsStreams(b, 7);
+
+  metricsFamily(b, "kcli_frame_pool_free", "gauge", "Frames free in the pool.");
+  for (i = 0; i < 2; i++){
+    snprintf(labels, sizeof(labels), "pool=\"%s\"", pools[i]->name);
+    metricsSample(b, "kcli_frame_pool_free", labels, __atomic_load_n(&pools[i]->free_count, __ATOMIC_RELAXED));
+  }
+  metricsFamily(b, "kcli_frame_pool_exhausted_total", "counter", "Acquires that found the pool empty.");
+  for (i = 0; i < 2; i++){
+    snprintf(labels, sizeof(labels), "pool=\"%s\"", pools[i]->name);
+    metricsSample(b, "kcli_frame_pool_exhausted_total", labels, __atomic_load_n(&pools[i]->exhausted, __ATOMIC_RELAXED));
+  }
+
+  metricsFamily(b, "kcli_stage_latency_seconds", "summary", "Time per frame in a pipeline stage.");
+  metricsPipeline(b, &dproc.pipe, 0);
+  metricsPipeline(b, &vproc.pipe, 0);
+  metricsFamily(b, "kcli_stage_enabled", "gauge", "Stage switched on.");
+  metricsPipeline(b, &dproc.pipe, 1);
+  metricsPipeline(b, &vproc.pipe, 1);
+  metricsFamily(b, "kcli_stage_queue_depth", "gauge", "Frames waiting for an async stage.");
+  metricsPipeline(b, &dproc.pipe, 2);
+  metricsPipeline(b, &vproc.pipe, 2);
+  metricsFamily(b, "kcli_stage_queue_dropped_total", "counter", "Frames an async stage queue dropped when full.");
+  metricsPipeline(b, &dproc.pipe, 3);
+  metricsPipeline(b, &vproc.pipe, 3);
+  metricsFamily(b, "kcli_pipeline_latency_seconds", "summary", "Time per frame through a whole pipeline.");
+  metricsTimer(b, "kcli_pipeline_latency_seconds", "pipeline=\"depth\"", &dproc.pipe.total);
+  metricsTimer(b, "kcli_pipeline_latency_seconds", "pipeline=\"video\"", &vproc.pipe.total);
+
+  tiltPollerRead(&tilt, &ts);
+  if (ts.valid){
+    metricsFamily(b, "kcli_tilt_degrees", "gauge", "Tilt angle reported by the motor.");
+    metricsSample(b, "kcli_tilt_degrees", NULL, ts.angle);
+    metricsFamily(b, "kcli_accel_mps2", "gauge", "Accelerometer reading.");
+    metricsSample(b, "kcli_accel_mps2", "axis=\"x\"", ts.ax);
+    metricsSample(b, "kcli_accel_mps2", "axis=\"y\"", ts.ay);
+    metricsSample(b, "kcli_accel_mps2", "axis=\"z\"", ts.az);
+    metricsFamily(b, "kcli_accel_raw", "gauge", "Raw accelerometer counts.");
+    for (i = 0; i < 3; i++){
+      snprintf(labels, sizeof(labels), "axis=\"%s\"", axes[i]);
+      metricsSample(b, "kcli_accel_raw", labels, ts.raw[i]);
+    }
+    metricsFamily(b, "kcli_tilt_state_age_seconds", "gauge", "Age of the last tilt poll.");
+    metricsSample(b, "kcli_tilt_state_age_seconds", NULL, (nowNs() - ts.stamp_ns) / 1e9);
+  }
+  metricsFamily(b, "kcli_tilt_poll_errors_total", "counter", "Tilt polls that failed.");
+  metricsSample(b, "kcli_tilt_poll_errors_total", NULL, __atomic_load_n(&tilt.errors, __ATOMIC_RELAXED));
+
+  metricsFamily(b, "kcli_motion_gate_open", "gauge", "Motion gate open.");
+  metricsSample(b, "kcli_motion_gate_open", NULL, motionGateOpen(&motion));
+  metricsFamily(b, "kcli_motion_score", "gauge", "Motion score of the last depth frame, 1/100 raw units.");
+  metricsSample(b, "kcli_motion_score", NULL, __atomic_load_n(&motion.score, __ATOMIC_RELAXED));
+  metricsFamily(b, "kcli_audio_overruns_total", "counter", "Audio ring overruns.");
+  metricsSample(b, "kcli_audio_overruns_total", NULL, __atomic_load_n(&audio.overruns, __ATOMIC_RELAXED));
+  logCounts(&log_written, &log_dropped);
+  metricsFamily(b, "kcli_log_written_total", "counter", "Log messages written out.");
+  metricsSample(b, "kcli_log_written_total", NULL, log_written);
+  metricsFamily(b, "kcli_log_dropped_total", "counter", "Log messages dropped on a full ring.");
+  metricsSample(b, "kcli_log_dropped_total", NULL, log_dropped);
+  metricsFamily(b, "kcli_metrics_scrapes_total", "counter", "Scrapes served.");
+  metricsSample(b, "kcli_metrics_scrapes_total", NULL, __atomic_load_n(&metrics.scrapes, __ATOMIC_RELAXED));
+}
+
+void startMetrics(const char *addr){
+  check (!metrics.running, "Metrics already on, turn them off first.");
+  check (metricsStart(&metrics, addr, collectMetrics) == 0, "Could not serve metrics there: <port>, <host:port> or unix:<path>.");
+  pushToOutBuffer ("Serving metrics on %s.", addr);
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+// Scrape our own endpoint like Prometheus would, from the console thread.
+void checkMetrics(int scrapes){
+  static char body[1 << 17];
+  uint64_t ns, total = 0, worst = 0;
+  int n, status = 0, samples = 0;
+  char *line;
+
+  check (metrics.running, "Metrics are off.");
+  if (scrapes < 1) scrapes = 1;
+  if (scrapes > 100) scrapes = 100;
+  for (n = 0; n < scrapes; n++){
+    status = metricsScrape(metrics.addr, body, sizeof(body), &ns);
+    check (status == 200, "Scrape failed.");
+    total += ns;
+    if (ns > worst) worst = ns;
+  }
+  for (line = body; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+    if (*line != '#' && *line != '\n')
+      samples++;
+  pushToOutBuffer ("Scraped %d times: %d samples, %d bytes, avg %d us max %d us.", scrapes, samples,
+                   (int) strlen(body), (int) (total / scrapes / 1000), (int) (worst / 1000));
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+// The stall check gives a stream that just started time for its first frame.
+void streamsStarted(){
+  __atomic_store_n(&streams_started_ns, nowNs(), __ATOMIC_RELAXED);
+}
+
+/*
+  Both video buffers hold any mode, the back buffer trades places with the
+  video processor output so they can never be resized on a mode switch.
+*/
+int allocVideoBuffers(size_t bytes){
+  uint8_t *front = NULL, *back = NULL;
+
+  check (posix_memalign((void **) &front, 64, bytes) == 0, "Could not allocate video front buffer.");
+  check (posix_memalign((void **) &back, 64, bytes) == 0, "Could not allocate video back buffer.");
+  memset(front, 0, bytes);
+  memset(back, 0, bytes);
+  gl_rgb_front = front;
+  gl_rgb_back = back;
+  return 0;
+
+ error:
+  debug ("%s", USER_ERR_MSG);
+  free (USER_ERR_MSG);
+  free (front);
+  free (back);
+  return 1;
+}
+
+/*
+  Switch video mode, live if the stream runs: stop it, tell the video
+  processor and libfreenect, and start it again. Frames already published
+  carry their own mode, so the display never reads one in the wrong layout.
+*/
+void setVideoMode(freenect_frame_mode mode){
+  int running = myKinect.kinect_is_open == 0 && con.Rgb == 0;
+
+  if (running)
+    check (freenect_stop_video(f_dev) == 0, "Error stopping RGB stream.");
+
+  check (videoProcSetMode(&vproc, &mode) == 0, "Video mode does not fit the video buffers.");
+  captureCancel(&cap_video);
+  recorderStop(&rec_video);
+  calibPause(&calib);
+  video_mode = mode;
+
+  if (myKinect.kinect_is_open == 0){
+    check (freenect_set_video_mode(f_dev, mode) == 0, "Error setting video mode.");
+    freenect_set_video_buffer(f_dev, videoProcFillBuffer(&vproc));
+  }
+  if (running){
+    check (freenect_start_video(f_dev) == 0, "Error starting RGB stream.");
+    streamsStarted();
+  }
+
+  pushToOutBuffer ("Video mode is now %s %s, %dx%d.", modeVideoName(mode.video_format),
+                   modeResolutionName(mode.resolution), mode.width, mode.height);
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+void setDepthMode(freenect_frame_mode mode){
+  int running = myKinect.kinect_is_open == 0 && con.Depth == 0;
+  int shift_left, shift;
+
+  if (running)
+    check (freenect_stop_depth(f_dev) == 0, "Error stopping depth stream.");
+
+  modeDepthIndex(mode.depth_format, &shift_left, &shift);
+  check (depthProcSetFormat(&dproc, mode.bytes, modeDepthPackedBits(mode.depth_format), modeDepthNoData(mode.depth_format), shift_left, shift) == 0,
+         "Depth mode does not fit the depth buffers.");
+  captureCancel(&cap_depth);
+  recorderStop(&rec_depth);
+  depth_mode = mode;
+
+  if (myKinect.kinect_is_open == 0){
+    check (freenect_set_depth_mode(f_dev, mode) == 0, "Error setting depth mode.");
+    freenect_set_depth_buffer(f_dev, depthProcFillBuffer(&dproc));
+  }
+  if (running){
+    check (freenect_start_depth(f_dev) == 0, "Error starting depth stream.");
+    streamsStarted();
+  }
+
+  pushToOutBuffer ("Depth mode is now %s.", modeDepthName(mode.depth_format));
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+// Capture threads report through the device message ring the console drains.
+void captureNotify(const char *line){
+  devQueueMessage(&devq, line);
+}
+
+void startCapture(capture_stream *cap, const char *feed, int off, const capture_format *fmt, const char *path, int frames){
+  check (off == 0, "Start the feed first.");
+  check (captureStart(cap, fmt, path, frames) == 0, "Capture is busy or the path is invalid, 1 to 1000 frames.");
+  pushToOutBuffer ("Capturing %d %s frames.", frames, feed);
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+/*
+  Arm the recorders of the running feeds and start scoring motion from a
+  fresh background. The depth feed has to run, it drives the gate.
+*/
+void startRecording(const char *prefix){
+  krec_header hdr;
+
+  check (con.Depth == 0, "Start the depth feed first, it drives the motion gate.");
+  check (!recorderArmed(&rec_depth), "Already recording.");
+  recorderHeaderDepth(&depth_mode, &hdr);
+  check (recorderStart(&rec_depth, &hdr, prefix, record_preroll) == 0, "Could not start recording, path too long or out of memory.");
+  if (con.Rgb == 0){
+    recorderHeaderVideo(&video_mode, &hdr);
+    if (recorderStart(&rec_video, &hdr, prefix, record_preroll) != 0)
+      pushToOutBuffer ("Could not record rgb, depth only.");
+  }
+  motionGateReset(&motion);
+  pipelineEnable(&dproc.pipe, "motion", 1);
+  pushToOutBuffer ("Recording on motion to %s, %d frames of pre-roll.", prefix, record_preroll);
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+void stopRecording(){
+  recorderStop(&rec_depth);
+  recorderStop(&rec_video);
+  pipelineEnable(&dproc.pipe, "motion", 0);
+  pushToOutBuffer ("Recording off.");
+}
+
+// A pixel, or with `roi` the median, min and max over a region of the latest depth frame.
+void probeDepth(int x, int y, int w, int h, int roi){
+  probe_result r;
+  int res = roi ? depthProbeRoi(&probe, x, y, w, h, &r) : depthProbePoint(&probe, x, y, &r);
+
+  check (res != 1, "No depth frame yet, start the depth feed.");
+  check (res != 2, "Outside the 640x480 depth frame.");
+  check (res == 0, "Out of memory.");
+  if (r.valid == 0)
+    pushToOutBuffer ("No reading at %d %d, frame %d, %d ms old.", r.x, r.y, (int) r.seq, (int) (r.age_ns / 1000000));
+  else if (!roi)
+    pushToOutBuffer ("Depth at %d %d: %d mm, frame %d, %d ms old.", r.x, r.y, r.mm, (int) r.seq, (int) (r.age_ns / 1000000));
+  else
+    pushToOutBuffer ("Depth over %dx%d at %d %d: median %d mm, min %d, max %d, %d of %d pixels, frame %d.",
+                     r.w, r.h, r.x, r.y, r.mm, r.min, r.max, r.valid, r.total, (int) r.seq);
+  return;
+
+ error:
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+/*
+  Queue a tilt or LED change for the device thread, which reports back on
+  the console once the transfer is done.
+*/
+void postDeviceCommand(dev_cmd_type type, int value){
+  int res = devQueuePost(&devq, type, value);
+  if (res < 0)
+    pushToOutBuffer ("Device command queue is full, dropped.");
+  else if (res > 0 && type == DEV_CMD_LED)
+    pushToOutBuffer ("LED already requested.");
+}
+
+// The last floor fit, from the estimator thread or autolevel.
+void showFloor(){
+  floor_fit fit;
+  char line[160];
+
+  floorRead(&floor_est, &fit);
+  if (!fit.valid){
+    pushToOutBuffer ("No floor fitted yet: set floor on, or autolevel.");
+    return;
   }
-  else{
-    pushToOutBuffer ("Kinect is open.");
+  snprintf(line, sizeof(line), "Floor %.2f m below, pitch %.1f roll %.1f degrees, %d of %d points, frame %d.", fit.height,
+           fit.pitch, fit.roll, fit.inliers, fit.points, (int) fit.seq);
+  pushToOutBuffer ("%s", line);
+  if (fit.accel_valid){
+    snprintf(line, sizeof(line), "Gravity gives pitch %.1f, the floor slopes %.1f degrees from it.", fit.accel_pitch,
+             fit.pitch - fit.accel_pitch);
+    pushToOutBuffer ("%s", line);
   }
+}
+
+/*
+  Fits the floor on the spot and tilts by what is left to `target` degrees
+  of pitch, from where the accelerometer says the motor is.
+*/
+void autoLevel(double target){
+  tilt_state ts;
+  floor_fit fit;
+  char line[160];
+  int res, angle;
+
+  tiltPollerRead(&tilt, &ts);
+  check (!ts.valid || ts.status != TILT_STATUS_MOVING, "The tilt motor is moving, try again when it stops.");
+  res = floorUpdate(&floor_est, &fit);
+  check (res != 1, "No depth frame yet, start the depth feed.");
+  check (res == 0, "No floor in view.");
+  floorLevelAngle(&floor_est, target, &fit, ts.valid ? ts.angle : freenect_angle, &angle);
+  con.Angle = freenect_angle = angle;
+  postDeviceCommand(DEV_CMD_TILT, angle);
+  snprintf(line, sizeof(line), "Floor %.2f m below, camera at %.1f degrees over it, tilting to %d.", fit.height, fit.pitch, angle);
+  pushToOutBuffer ("%s", line);
   return;
 
  error:
   pushToOutBuffer (USER_ERR_MSG);
   free (USER_ERR_MSG);
-  if (myKinect.kinect_is_open == 0)
-    closeKinect();
 }
 
-void scan(){
-    pushToOutBuffer ("Scannning for devices.");
-    /* 
-       I am confused here, we set nr_devices but we do not use it...
-    */
-    myKinect.nr_devices = freenect_num_devices (f_ctx);
-    pushToOutBuffer ("Number of Devices Found: %d", myKinect.nr_devices);
+/*
+  Writes the latest voxel centroids to prefix.ply and the occupancy map to
+  prefix.pgm, one byte per cell with the camera at the middle of the top row
+  and rows going away from it.
+*/
+void saveVoxels(const char *prefix){
+  char path[256];
+  voxel_point *pts = NULL;
+  uint8_t *map = NULL;
+  FILE *f = NULL;
+  uint64_t seq;
+  int count, res;
+
+  check (strlen(prefix) < sizeof(path) - 4, "Path prefix too long.");
+  pts = malloc(VOXEL_MAX * sizeof(voxel_point));
+  map = malloc(VOXEL_MAP_SIZE * VOXEL_MAP_SIZE);
+  check (pts != NULL && map != NULL, "Out of memory.");
+  count = voxelCopyPoints(&voxels, pts, VOXEL_MAX, &seq);
+  voxelCopyMap(&voxels, map);
+  check (seq > 0, "No voxels yet: voxel on, with the depth feed started.");
+
+  snprintf(path, sizeof(path), "%s.ply", prefix);
+  f = fopen(path, "wb");
+  check (f != NULL, "Could not open the PLY file.");
+  res = voxelWritePly(f, pts, count);
+  res |= fclose(f);
+  f = NULL;
+  check (res == 0, "Could not write the PLY file.");
+  snprintf(path, sizeof(path), "%s.pgm", prefix);
+  f = fopen(path, "wb");
+  check (f != NULL, "Could not open the PGM file.");
+  res = imageWritePnm(f, map, VOXEL_MAP_SIZE, VOXEL_MAP_SIZE, 1, 8, 255);
+  res |= fclose(f);
+  f = NULL;
+  check (res == 0, "Could not write the PGM file.");
+  pushToOutBuffer ("Wrote %d voxels of frame %d to %s.ply and the map to %s.pgm.", count, (int) seq, prefix, prefix);
+  free(pts);
+  free(map);
+  return;
 
-    myKinect.user_device_number = 0;
-/*    if (argc > 1)
-      user_device_number = atoi(argv[1]);
+ error:
+  if (f)
+    fclose(f);
+  free(pts);
+  free(map);
+  pushToOutBuffer (USER_ERR_MSG);
+  free (USER_ERR_MSG);
+}
+
+/*
+  The depth rays follow the calibration kept: an IR one always, an RGB
+  one only while depth is registered to the RGB camera, and the nominal
+  intrinsics otherwise. Runs on the calibration thread with every new
+  calibration and on the console thread after set depth; `fresh`
+  rebuilds the rays even when the choice did not change.
 */
-    check (myKinect.nr_devices >= 1, "No Kinect found.");
+void updateDepthRays(int fresh){
+  depth_intrinsics k;
+  int use;
+  char line[160];
+
+  pthread_mutex_lock(&depth_calib_lock);
+  use = depth_calib_set && (depth_calib.ir || depth_mode.depth_format == FREENECT_DEPTH_REGISTERED);
+  if (use != depth_calib_used || (fresh && use)){
+    if (use)
+      k = depth_calib.k;
+    else
+      depthIntrinsicsDefault(&k);
+    // Both only refuse a missing focal length, which applyCalibration rules out.
+    floorSetIntrinsics(&floor_est, &k);
+    voxelSetIntrinsics(&voxels, &k);
+    if (use){
+      snprintf(line, sizeof(line), "Depth rays rebuilt: fx %.2f fy %.2f cx %.2f cy %.2f k1 %.4f k2 %.4f.", k.fx, k.fy, k.cx, k.cy, k.k1, k.k2);
+      captureNotify(line);
+    }
+    else
+      captureNotify("Depth rays back to the nominal intrinsics, the RGB calibration waits for registered depth.");
+    depth_calib_used = use;
+  }
+  else if (fresh && !use)
+    captureNotify("An RGB calibration only applies to registered depth, it is kept for set depth registered.");
+  pthread_mutex_unlock(&depth_calib_lock);
+}
 
+/*
+  Keep a new calibration for the depth rays. Depth frames are 640x480
+  and the IR camera's 640x488 has the same pixels with 8 more rows, so
+  only those sizes fit; the high resolution modes are cropped and binned
+  differently and are refused.
+*/
+void applyCalibration(const calib_result *res){
+  if (res->width != 640 || (res->height != 480 && res->height != 488)){
+    captureNotify("Only 640x480 and 640x488 calibrations fit the depth frame, the depth rays are unchanged.");
     return;
+  }
+  if (res->k.fx <= 0 || res->k.fy <= 0){
+    captureNotify("The calibration has no focal length, the depth rays are unchanged.");
+    return;
+  }
+  pthread_mutex_lock(&depth_calib_lock);
+  depth_calib = *res;
+  depth_calib_set = 1;
+  pthread_mutex_unlock(&depth_calib_lock);
+  updateDepthRays(1);
+}
 
-   error:
-    pushToOutBuffer (USER_ERR_MSG);
-    free (USER_ERR_MSG);
+// Collection and the last calibration.
+void showCalibration(){
+  calib_result res;
+  char line[200];
+  int views, collecting;
 
+  if (calibRead(&calib, &res, &views, &collecting)){
+    snprintf(line, sizeof(line), "Calibrated %s %dx%d on %d views: fx %.2f fy %.2f cx %.2f cy %.2f k1 %.4f k2 %.4f, %.3f px rms.",
+             res.ir ? "IR" : "RGB", res.width, res.height, res.views, res.k.fx, res.k.fy, res.k.cx, res.k.cy, res.k.k1, res.k.k2, res.rms);
+    pushToOutBuffer ("%s", line);
   }
+  else
+    pushToOutBuffer ("Not calibrated this session.");
+  pushToOutBuffer ("%s, %d views of %d needed, board in %d of %d frames.", collecting ? "Collecting" : "Not collecting",
+                   views, CALIB_MIN_VIEWS, (int) calib.found, (int) calib.frames);
+}
 
-void initFreenect(){
-  debug ("Initializing freenect.");
-  check (myKinect.freenect_is_init == 1, "Freenect already initialized.");
-  check(freenect_init(&f_ctx, NULL) == 0,"freenect_init failed.");
-  myKinect.freenect_is_init = 0;
-  debug ("Freenect init is good.");
-
-  debug ("Set freenect log level %d", FREENECT_LOG_DEBUG);
-  freenect_set_log_level(f_ctx, FREENECT_LOG_DEBUG);
+/*
+  calibrate start|replay <clip.krec> [cols rows square_mm]: the board
+  follows the verb, or the clip for a replay, and defaults to 9x6 inner
+  corners of 25 mm.
+*/
+void calibrateCommand(char **sections, int count){
+  calib_result res;
+  const char *path;
+  int first, cols = CALIB_DEFAULT_COLS, rows = CALIB_DEFAULT_ROWS, replay, err;
+  double square = CALIB_DEFAULT_SQUARE_MM;
+
+  if (count < 2 || strcmp(sections[1], "status") == 0){
+    showCalibration();
+    return;
+  }
+  replay = strcmp(sections[1], "replay") == 0;
+  if (strcmp(sections[1], "start") == 0 || replay){
+    check (!replay || count > 2, "Calibrate replay needs a .krec clip of the video stream.");
+    first = replay ? 3 : 2;
+    if (count > first + 2){
+      cols = atoi(sections[first]);
+      rows = atoi(sections[first + 1]);
+      square = atof(sections[first + 2]);
+    }
+    err = replay ? calibReplay(&calib, sections[2], cols, rows, square) : calibStart(&calib, &video_mode, cols, rows, square);
+    check (err != 1, "Board: 3 to 24 inner corners a side, 256 at most, and the square size in mm.");
+    check (err != 2, "Calibration needs the rgb, bayer, yuv, ir8 or ir10 video mode.");
+    check (err == 0, "Could not start the calibration thread.");
+    if (replay)
+      pushToOutBuffer ("Replaying %s for a %dx%d board.", sections[2], cols, rows);
+    else
+      pushToOutBuffer ("Collecting views of a %dx%d board from the %s stream; hold it still at a new place or tilt for each.",
+                       cols, rows, modeVideoName(video_mode.video_format));
+  }
+  else if (strcmp(sections[1], "stop") == 0){
+    calibPause(&calib);
+    pushToOutBuffer ("Calibration stopped, %d views kept for solving.", calib.nviews);
+  }
+  else if (strcmp(sections[1], "solve") == 0){
+    check (calibRequestSolve(&calib, count > 2 ? sections[2] : CALIB_DEFAULT_PATH) == 0, "Could not start the calibration thread.");
+    pushToOutBuffer ("Solving.");
+  }
+  else if (strcmp(sections[1], "load") == 0){
+    path = count > 2 ? sections[2] : CALIB_DEFAULT_PATH;
+    err = calibLoad(path, &res);
+    check (err != 1, "Could not open the calibration file.");
+    check (err == 0, "Not a calibration file.");
+    applyCalibration(&res);
+  }
+  else
+    pushToOutBuffer ("Calibrate options: start [cols rows square_mm], replay <clip.krec> [cols rows square_mm], stop, solve [path], load [path], status");
+  return;
 
  error:
-  debug ("%s", USER_ERR_MSG);
+  pushToOutBuffer (USER_ERR_MSG);
   free (USER_ERR_MSG);
 }
 
-void displayHelp(){
-  size_t i = 0;
-  for ( i = 0; i < sizeof(commandsList) / sizeof(commandsList[0]); i++){
-    pushToOutBuffer("%s : %s", commandsList[i], commandsHelp[i]);
+void benchPrint(const char *line){
+  pushToOutBuffer("%s", line);
+}
+
+// Raw depth histogram folded into 16 rows of 128 values.
+void displayHistogram(){
+  static depth_stats ds;
+  char bar[41];
+  uint32_t rows[16] = { 0 }, peak = 1;
+  int i, n;
+
+  depthProcReadStats(&dproc, &ds, 1);
+  for (i = 0; i < DEPTH_HIST_BINS; i++)
+    rows[i * 16 / DEPTH_HIST_BINS] += ds.hist[i];
+  for (i = 0; i < 16; i++)
+    if (rows[i] > peak) peak = rows[i];
+
+  pushToOutBuffer("Raw depth histogram, %d pixels:", ds.total);
+  for (i = 0; i < 16; i++){
+    n = (int) ((uint64_t) rows[i] * 40 / peak);
+    memset(bar, '#', n);
+    bar[n] = '\0';
+    pushToOutBuffer("%d-%d |%s", i * 128, i * 128 + 127, bar);
   }
 }
 
@@ -494,7 +1353,17 @@ void timeToQuit(){
   die = 1;
 
   pthread_join(freenect_thread, NULL);
+  recorderStop(&rec_depth);
+  recorderStop(&rec_video);
+  metricsStop(&metrics);
+  floorStop(&floor_est);
+  calibStop(&calib);
+  depthProcStop(&dproc);
+  videoProcStop(&vproc);
+  audioStop(&audio);
+  workPoolShutdown(&band_pool);
   glutDestroyWindow(window);
+  logStop();
   pthread_exit(NULL);
   return;
 
@@ -506,6 +1375,7 @@ void timeToQuit(){
 
   pthread_join(freenect_thread, NULL);
   glutDestroyWindow(window);
+  logStop();
   pthread_exit(NULL);
   return;
 
@@ -732,6 +1602,7 @@ void pushToOutBuffer (char *M, ...){
   }
   //Push in new output.
   con.OutBuf[MAX_OUT_BUFFER_ROWS - 1] = output;
+  con_gen++;
   return;
 
  error:
@@ -768,37 +1639,32 @@ void processCmd(){
       }
       con.Angle = angle;
       freenect_angle = con.Angle;
-      freenect_set_tilt_degs(f_dev,freenect_angle);
-      pushToOutBuffer ("Setting angle to %d", angle);
+      postDeviceCommand(DEV_CMD_TILT, freenect_angle);
     }
 
 
     else if (strcmp(sections[1], "led") == 0){
       // OFF
       if (strcmp(sections[2], "off") == 0){
-        check (freenect_set_led(f_dev,LED_OFF) == 0, "Error setting LED to off.");
-        pushToOutBuffer("LED is now OFF.");
+        postDeviceCommand(DEV_CMD_LED, LED_OFF);
         con.LED = LED_OFF;
       }
 
       //GREEN
       else if (strcmp(sections[2], "green") == 0){
-        check (freenect_set_led(f_dev,LED_GREEN) == 0, "Error setting LED to green.");
-        pushToOutBuffer("LED is now Green.");
+        postDeviceCommand(DEV_CMD_LED, LED_GREEN);
         con.LED = LED_GREEN;
       }
 
       //Red
       else if (strcmp(sections[2], "red") == 0){
-        check (freenect_set_led(f_dev,LED_RED) == 0, "Error setting LED to red.");
-        pushToOutBuffer("LED is now Red.");
+        postDeviceCommand(DEV_CMD_LED, LED_RED);
         con.LED = LED_RED;
       }
 
       //Yellow
       else if (strcmp(sections[2], "yellow") == 0){
-        check(freenect_set_led(f_dev,LED_YELLOW) == 0, "Error setting LED to yellow.");
-        pushToOutBuffer("LED is now Yellow.");
+        postDeviceCommand(DEV_CMD_LED, LED_YELLOW);
         con.LED = LED_YELLOW;
       }
 
@@ -806,14 +1672,12 @@ void processCmd(){
       else if (strcmp(sections[2], "blink") == 0){
         //green
         if (strcmp(sections[3], "green") == 0){
-          check (freenect_set_led(f_dev,LED_BLINK_GREEN) == 0, "Error setting LED to blinking green.");
-          pushToOutBuffer("LED is now blinking Green.");
+          postDeviceCommand(DEV_CMD_LED, LED_BLINK_GREEN);
           con.LED = LED_BLINK_GREEN;
         }
         //Red-Yellow
         else if (strcmp(sections[3], "red") == 0){
-          check (freenect_set_led(f_dev,LED_BLINK_RED_YELLOW) == 0, "Error setting LED to blinking red and yellow.");
-          pushToOutBuffer("LED is now blinking Red and Yellow.");
+          postDeviceCommand(DEV_CMD_LED, LED_BLINK_RED_YELLOW);
           con.LED = LED_BLINK_RED_YELLOW;
         }
         else{
@@ -826,34 +1690,179 @@ void processCmd(){
     }
 
     else if (strcmp(sections[1], "log") == 0){
-      //LEVEL
-      //Can we do a check on this?
-      if (strcmp(sections[2], "level") == 0){
-        //FATAL
-        if (strcmp(sections[3], "fatal") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_FATAL);
-        //ERROR
-        else if (strcmp(sections[3], "error") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_ERROR);
-        //WARNING
-        else if (strcmp(sections[3], "warning") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_WARNING);
-        //NOTICE
-        else if (strcmp(sections[3], "notice") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_NOTICE);
-        //INFO
-        else if (strcmp(sections[3], "info") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_INFO);
-        //DEBUG
-        else if (strcmp(sections[3], "debug") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_DEBUG);
-        //SPEW
-        else if (strcmp(sections[3], "spew") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_SPEW);
-        //FLOOD
-        else if (strcmp(sections[3], "flood") == 0) freenect_set_log_level(f_ctx, FREENECT_LOG_FLOOD);
-        //UNKNOWN
-        else 
-          pushToOutBuffer ("Unknown log level, please select between fatal, error, warning, notice, info, debug, spew, flood"); // this should not be hardcoded, can we derive from libfreenect information
+      int level;
+      check (i > 3 && strcmp(sections[2], "level") == 0, "Log levels: fatal, error, warning, notice, info, debug, spew, flood");
+      level = logLevelByName(sections[3]);
+      check (level >= 0, "Log levels: fatal, error, warning, notice, info, debug, spew, flood");
+      logSetLevel(level);
+      if (myKinect.freenect_is_init == 0)
+        freenect_set_log_level(f_ctx, (freenect_loglevel) level);
+      pushToOutBuffer ("Log level %s.", logLevelName(level));
+    }
+
+    else if (strcmp(sections[1], "filter") == 0){
+      FILTER_MODE mode;
+      check (i > 2, "Filter options: none, median3, ema [alpha 1-256], holes {on, off}");
+
+      if (strcmp(sections[2], "holes") == 0){
+        check (i > 3, "Filter holes: on, off");
+        depthFilterSetHoles(&dfilter, strcmp(sections[3], "on") == 0);
+        pushToOutBuffer ("Hole filling is now %s.", strcmp(sections[3], "on") == 0 ? "on" : "off");
+      }
+      else if (depthFilterParseMode(sections[2], &mode) == 0){
+        if (mode == FILTER_EMA && i > 3)
+          depthFilterSetAlpha(&dfilter, atoi(sections[3]));
+        depthFilterSetMode(&dfilter, mode);
+        pushToOutBuffer ("Depth filter is now %s.", depthFilterModeName(mode));
+      }
+      else{
+        pushToOutBuffer ("Invalid filter option: none, median3, ema [alpha], holes {on, off}.");
+      }
+    }
+
+    else if (strcmp(sections[1], "video") == 0){
+      freenect_frame_mode mode;
+      check (i > 3, "Video options: <rgb, bayer, ir8, ir10, yuv> <medium, high>");
+      check (modeParseVideo(sections[2], sections[3], &mode) == 0, "Unsupported video mode, yuv is medium only.");
+      setVideoMode(mode);
+    }
+
+    else if (strcmp(sections[1], "depth") == 0){
+      freenect_frame_mode mode;
+      check (i > 2, "Depth options: 11bit, 10bit, mm, registered, 11packed, 10packed");
+      check (modeParseDepth(sections[2], &mode) == 0, "Depth options: 11bit, 10bit, mm, registered, 11packed, 10packed");
+      setDepthMode(mode);
+      // An RGB calibration only holds for registered depth.
+      updateDepthRays(0);
+    }
+
+    else if (strcmp(sections[1], "sched") == 0){
+      thread_role role;
+      int policy;
+      check (i > 3, "Sched options: <capture, render, depth, video, workers, audio, device> <other, fifo, rr> [priority] [cpu]");
+      check (rtSchedParseRole(sections[2], &role) == 0, "Roles: capture, render, depth, video, workers, audio, device");
+      check (rtSchedParsePolicy(sections[3], &policy) == 0, "Policies: other, fifo, rr");
+      check (rtSchedSet(role, policy, i > 4 ? atoi(sections[4]) : 0, i > 5 ? atoi(sections[5]) : -1) == 0,
+             "Priority is 0 for other and 1-99 for fifo and rr, cpu -1 or an online cpu.");
+      if (applySched(role) == 0)
+        pushToOutBuffer ("Scheduling of %s is now %s.", rtSchedRoleName(role), rtSchedPolicyName(policy));
+      // Fresh jitter figures for the new configuration.
+      jitterReset(&video_jitter);
+      jitterReset(&depth_jitter);
+    }
+
+    else if (strcmp(sections[1], "text") == 0){
+      check (i > 2 && (strcmp(sections[2], "atlas") == 0 || strcmp(sections[2], "bitmap") == 0), "Text options: atlas, bitmap");
+      con_text_bitmap = strcmp(sections[2], "bitmap") == 0;
+      pushToOutBuffer ("Console text is now drawn as %s.", sections[2]);
+    }
+
+    else if (strcmp(sections[1], "stage") == 0){
+      pipeline *pl;
+      int res;
+      check (i > 4, "Stage options: <depth, video> <stage> <on, off>, see stats pipeline");
+      check (strcmp(sections[2], "depth") == 0 || strcmp(sections[2], "video") == 0, "Stage streams: depth, video");
+      pl = strcmp(sections[2], "depth") == 0 ? &dproc.pipe : &vproc.pipe;
+      res = pipelineEnable(pl, sections[3], strcmp(sections[4], "on") == 0);
+      check (res != 1, "Unknown stage, see stats pipeline.");
+      check (res != 2, "That stage cannot be turned off.");
+      pushToOutBuffer ("Stage %s of %s is now %s.", sections[3], pl->name, strcmp(sections[4], "on") == 0 ? "on" : "off");
+    }
+
+    else if (strcmp(sections[1], "motion") == 0){
+      check (i > 3, "Motion options: threshold <score>, hold <frames>");
+      check (atoi(sections[3]) >= 0, "Motion settings cannot be negative.");
+      if (strcmp(sections[2], "threshold") == 0)
+        motionGateSet(&motion, atoi(sections[3]), -1);
+      else if (strcmp(sections[2], "hold") == 0)
+        motionGateSet(&motion, -1, atoi(sections[3]));
+      else
+        check (0, "Motion options: threshold <score>, hold <frames>");
+      pushToOutBuffer ("Motion %s is now %s.", sections[2], sections[3]);
+    }
+
+    else if (strcmp(sections[1], "record") == 0){
+      check (i > 3 && strcmp(sections[2], "preroll") == 0, "Record options: preroll <0-90 frames>");
+      check (atoi(sections[3]) >= 0 && atoi(sections[3]) <= RECORD_MAX_PREROLL, "Record options: preroll <0-90 frames>");
+      record_preroll = atoi(sections[3]);
+      pushToOutBuffer ("Pre-roll is now %d frames, from the next record on.", record_preroll);
+    }
+
+    else if (strcmp(sections[1], "hotplug") == 0){
+      check (i > 2, "Hotplug options: on, off, backoff <min ms> <max ms>");
+      if (strcmp(sections[2], "backoff") == 0){
+        check (i > 4 && atoi(sections[3]) >= 10 && atoi(sections[4]) >= atoi(sections[3]) && atoi(sections[4]) <= 60000,
+               "Backoff is 10 ms <= min <= max <= 60000 ms.");
+        __atomic_store_n(&hp.backoff_min, atoi(sections[3]), __ATOMIC_RELAXED);
+        __atomic_store_n(&hp.backoff_max, atoi(sections[4]), __ATOMIC_RELAXED);
+        pushToOutBuffer ("Rescanning after %s ms, doubling up to %s ms.", sections[3], sections[4]);
+      }
+      else{
+        check (strcmp(sections[2], "on") == 0 || strcmp(sections[2], "off") == 0, "Hotplug options: on, off, backoff <min ms> <max ms>");
+        __atomic_store_n(&hp.enabled, strcmp(sections[2], "on") == 0, __ATOMIC_RELAXED);
+        pushToOutBuffer ("Device recovery is now %s.", sections[2]);
+      }
+    }
+
+    else if (strcmp(sections[1], "floor") == 0){
+      check (i > 2, "Floor options: on, off, rate <1-30 Hz>");
+      if (strcmp(sections[2], "on") == 0){
+        check (floorStart(&floor_est) == 0, "Could not start floor estimation.");
+        pushToOutBuffer ("Fitting the floor at %d Hz.", floor_est.rate_hz);
+      }
+      else if (strcmp(sections[2], "off") == 0){
+        floorStop(&floor_est);
+        pushToOutBuffer ("Floor estimation off.");
+      }
+      else{
+        check (i > 3 && strcmp(sections[2], "rate") == 0, "Floor options: on, off, rate <1-30 Hz>");
+        check (floorSetRate(&floor_est, atoi(sections[3])) == 0, "Floor options: rate <1-30 Hz>");
+        pushToOutBuffer ("Fitting the floor at %d Hz when on.", floor_est.rate_hz);
+      }
+    }
+
+    else if (strcmp(sections[1], "tilt") == 0){
+      check (i > 3 && strcmp(sections[2], "rate") == 0, "Tilt options: rate <1-100 Hz>");
+      check (tiltPollerSetRate(&tilt, atoi(sections[3])) == 0, "Tilt options: rate <1-100 Hz>");
+      pushToOutBuffer ("Polling tilt state at %d Hz.", tilt.rate_hz);
+    }
+
+    else if (strcmp(sections[1], "colormap") == 0){
+      check (i > 2, "Colormap options: proximity, rainbow, gray, clip, jet, range <near> <far>");
+      if (strcmp(sections[2], "range") == 0){
+        check (i > 4, "Colormap range: <near> <far> in raw depth units.");
+        check (colormapSetRange(&cmap, atoi(sections[3]), atoi(sections[4])) == 0, "Colormap range must satisfy 0 <= near < far < 2047.");
+        pushToOutBuffer ("Colormap range is now %s to %s.", sections[3], sections[4]);
+      }
+      else if (colormapSetPalette(&cmap, sections[2]) == 0){
+        pushToOutBuffer ("Colormap is now %s.", sections[2]);
+      }
+      else{
+        pushToOutBuffer ("Invalid colormap: proximity, rainbow, gray, clip, jet, range <near> <far>.");
+      }
+    }
+
+    else if (strcmp(sections[1], "roi") == 0){
+      if (i > 2 && strcmp(sections[2], "full") == 0){
+        depthProcSetRoi(&dproc, 0, 0, dproc.width, dproc.height);
+        pushToOutBuffer ("Processing the full depth frame.");
       }
+      else{
+        check (i > 5, "Roi options: x y w h, full");
+        check (depthProcSetRoi(&dproc, atoi(sections[2]), atoi(sections[3]), atoi(sections[4]), atoi(sections[5])) == 0,
+               "Roi must start inside the 640x480 frame and be at least one step wide.");
+        pushToOutBuffer ("Processing depth region %s %s %s %s.", sections[2], sections[3], sections[4], sections[5]);
+      }
+    }
 
+    else if (strcmp(sections[1], "decimate") == 0){
+      check (i > 2, "Decimate options: 1, 2, 4");
+      check (depthProcSetDecimate(&dproc, atoi(sections[2])) == 0, "Decimate options: 1, 2, 4");
+      pushToOutBuffer ("Depth decimation is now %s.", sections[2]);
     }
 
     else {
-      pushToOutBuffer ("Invalid set command: angle <int> led <{off, green, red, yellow, blink green, blink red}>");
+      pushToOutBuffer ("Invalid set command: angle <int> led <{off, green, red, yellow, blink green, blink red}> filter <{none, median3, ema, holes}> video <format> <resolution> depth <format> colormap <{proximity, rainbow, gray, clip, jet, range}> roi <{x y w h, full}> decimate <{1, 2, 4}> tilt rate <hz> sched <role> <policy> [priority] [cpu] stage <stream> <stage> <{on, off}> text <{atlas, bitmap}> motion <{threshold, hold}> <n> record preroll <frames> log level <level> hotplug <{on, off, backoff <min> <max>}>");
     }
   }
 
@@ -866,8 +1875,12 @@ void processCmd(){
       triggerFeed(RGB);
     }
 
+    else if (strcmp(sections[1], "audio") == 0){
+      triggerAudio(i > 2 && strcmp(sections[2], "synth") == 0);
+    }
+
     else{
-      pushToOutBuffer ("Invalid trigger option: depth, rgb.");
+      pushToOutBuffer ("Invalid trigger option: depth, rgb, audio [synth].");
     }
   }
 
@@ -887,7 +1900,7 @@ void processCmd(){
   }
 
   else if (strcmp(sections[0], "open") == 0){
-    openKinect();
+    openDevice(i > 1 ? sections[1] : NULL);
   }
 
   else if (strcmp(sections[0], "close") == 0){
@@ -907,6 +1920,156 @@ void processCmd(){
     selectSubDevices(flag);
   }
 
+  else if (strcmp(sections[0], "get") == 0){
+    tilt_state ts;
+    check (i > 1, "Get options: tilt, accel, floor");
+    if (strcmp(sections[1], "floor") == 0){
+      showFloor();
+      return;
+    }
+    tiltPollerRead(&tilt, &ts);
+    check (ts.valid, "No tilt state yet, is the motor subdevice open?");
+    if (strcmp(sections[1], "tilt") == 0)
+      pushToOutBuffer ("Tilt %f degrees, motor %s, %d ms old.", ts.angle, tiltStatusName(ts.status),
+                       (int) ((nowNs() - ts.stamp_ns) / 1000000));
+    else if (strcmp(sections[1], "accel") == 0)
+      pushToOutBuffer ("Accel x %f y %f z %f m/s2, raw %d %d %d, %d ms old.", ts.ax, ts.ay, ts.az,
+                       ts.raw[0], ts.raw[1], ts.raw[2], (int) ((nowNs() - ts.stamp_ns) / 1000000));
+    else
+      pushToOutBuffer ("Invalid get option: tilt, accel, floor.");
+  }
+
+  else if (strcmp(sections[0], "capture") == 0){
+    capture_format fmt;
+    const char *path = i > 2 ? sections[2] : "capture";
+    int frames = i > 3 ? atoi(sections[3]) : 1;
+    int depth = 0, rgb = 0;
+    check (i > 1, "Capture options: <depth, rgb, both> [path] [frames]");
+    depth = strcmp(sections[1], "depth") == 0 || strcmp(sections[1], "both") == 0;
+    rgb = strcmp(sections[1], "rgb") == 0 || strcmp(sections[1], "both") == 0;
+    check (depth || rgb, "Capture options: <depth, rgb, both> [path] [frames]");
+    if (depth){
+      captureFormatDepth(&depth_mode, &fmt);
+      startCapture(&cap_depth, "depth", con.Depth, &fmt, path, frames);
+    }
+    if (rgb){
+      if (captureFormatVideo(&video_mode, &fmt) == 0)
+        startCapture(&cap_video, "rgb", con.Rgb, &fmt, path, frames);
+      else
+        pushToOutBuffer ("Video mode %s cannot be captured.", modeVideoName(video_mode.video_format));
+    }
+  }
+
+  else if (strcmp(sections[0], "record") == 0){
+    check (i > 1, "Record options: on [path prefix], off");
+    if (strcmp(sections[1], "on") == 0)
+      startRecording(i > 2 ? sections[2] : "record");
+    else if (strcmp(sections[1], "off") == 0)
+      stopRecording();
+    else
+      pushToOutBuffer ("Invalid record option: on [path prefix], off.");
+  }
+
+  else if (strcmp(sections[0], "metrics") == 0){
+    char addr[16];
+    check (i > 1, "Metrics options: on [port, host:port, unix:path], off, check [scrapes]");
+    if (strcmp(sections[1], "on") == 0){
+      snprintf(addr, sizeof(addr), "%d", METRICS_DEFAULT_PORT);
+      startMetrics(i > 2 ? sections[2] : addr);
+    }
+    else if (strcmp(sections[1], "off") == 0){
+      metricsStop(&metrics);
+      pushToOutBuffer ("Metrics off.");
+    }
+    else if (strcmp(sections[1], "check") == 0)
+      checkMetrics(i > 2 ? atoi(sections[2]) : 10);
+    else
+      pushToOutBuffer ("Invalid metrics option: on [address], off, check [scrapes].");
+  }
+
+  else if (strcmp(sections[0], "probe") == 0){
+    if (i > 5 && strcmp(sections[1], "roi") == 0)
+      probeDepth(atoi(sections[2]), atoi(sections[3]), atoi(sections[4]), atoi(sections[5]), 1);
+    else if (i > 2 && strcmp(sections[1], "roi") != 0)
+      probeDepth(atoi(sections[1]), atoi(sections[2]), 1, 1, 0);
+    else
+      pushToOutBuffer ("Probe options: x y, roi x y w h");
+  }
+
+  else if (strcmp(sections[0], "autolevel") == 0){
+    autoLevel(i > 1 ? atof(sections[1]) : 0);
+  }
+
+  else if (strcmp(sections[0], "voxel") == 0){
+    if (i > 1 && strcmp(sections[1], "on") == 0){
+      pipelineEnable(&dproc.pipe, "voxel", 1);
+      pushToOutBuffer ("Voxel grid on, %d mm voxels.", voxels.size_mm);
+    }
+    else if (i > 1 && strcmp(sections[1], "off") == 0){
+      pipelineEnable(&dproc.pipe, "voxel", 0);
+      pushToOutBuffer ("Voxel grid off.");
+    }
+    else if (i > 2 && strcmp(sections[1], "size") == 0){
+      if (voxelSetSize(&voxels, atoi(sections[2])) == 0)
+        pushToOutBuffer ("Voxels of %d mm from the next frame.", voxels.size_mm);
+      else
+        pushToOutBuffer ("Voxel size: %d to %d mm.", VOXEL_MIN_MM, VOXEL_MAX_MM);
+    }
+    else if (i > 2 && strcmp(sections[1], "save") == 0)
+      saveVoxels(sections[2]);
+    else
+      pushToOutBuffer ("Voxel options: on, off, size <mm>, save <prefix>");
+  }
+
+  else if (strcmp(sections[0], "calibrate") == 0){
+    calibrateCommand(sections, i);
+  }
+
+  else if (strcmp(sections[0], "stats") == 0){
+    if (i > 1 && strcmp(sections[1], "hist") == 0)
+      displayHistogram();
+    else if (i > 1 && strcmp(sections[1], "sched") == 0)
+      displaySched();
+    else if (i > 1 && strcmp(sections[1], "pipeline") == 0){
+      displayPipeline(&dproc.pipe);
+      displayPipeline(&vproc.pipe);
+    }
+    else
+      displayStats();
+  }
+
+  else if (strcmp(sections[0], "bench") == 0){
+    check (i > 1, "Bench options: threads, stats, demosaic, unpack, motion, console [frames], audio [seconds], log [messages], hotplug [drops], probe [queries], floor [clip.krec], voxel [frames], calib [views]");
+    if (strcmp(sections[1], "threads") == 0)
+      benchThreads(&cmap, i > 2 ? atoi(sections[2]) : 30, benchPrint);
+    else if (strcmp(sections[1], "stats") == 0)
+      benchStats(&cmap, i > 2 ? atoi(sections[2]) : 30, benchPrint);
+    else if (strcmp(sections[1], "demosaic") == 0)
+      benchDemosaic(i > 2 ? atoi(sections[2]) : 30, benchPrint);
+    else if (strcmp(sections[1], "unpack") == 0)
+      benchUnpack(i > 2 ? atoi(sections[2]) : 30, benchPrint);
+    else if (strcmp(sections[1], "audio") == 0)
+      benchAudio(i > 2 ? atoi(sections[2]) : 10, benchPrint);
+    else if (strcmp(sections[1], "motion") == 0)
+      benchMotion(i > 2 ? atoi(sections[2]) : 30, benchPrint);
+    else if (strcmp(sections[1], "console") == 0)
+      benchConsole(i > 2 ? atoi(sections[2]) : 100);
+    else if (strcmp(sections[1], "log") == 0)
+      benchLog(i > 2 ? atoi(sections[2]) : 200, benchPrint);
+    else if (strcmp(sections[1], "hotplug") == 0)
+      benchHotplug(i > 2 ? atoi(sections[2]) : 6, benchPrint);
+    else if (strcmp(sections[1], "probe") == 0)
+      benchProbe(i > 2 ? atoi(sections[2]) : 100000, benchPrint);
+    else if (strcmp(sections[1], "floor") == 0)
+      benchFloor(i > 2 ? sections[2] : NULL, benchPrint);
+    else if (strcmp(sections[1], "voxel") == 0)
+      benchVoxel(i > 2 ? atoi(sections[2]) : 20, benchPrint);
+    else if (strcmp(sections[1], "calib") == 0)
+      benchCalib(i > 2 ? atoi(sections[2]) : 20, benchPrint);
+    else
+      pushToOutBuffer ("Invalid bench option: threads, stats, demosaic, unpack, motion, audio, console, log, hotplug, probe, floor, voxel, calib.");
+  }
+
 
   else {
     pushToOutBuffer ("Invalid command: set, trigger");
@@ -921,6 +2084,8 @@ void processCmd(){
 
 int triggerFeed (FEED f){
   debug ("Triggering feed");
+  // Also while the device is being recovered, f_dev is closed then.
+  check (myKinect.kinect_is_open == 0, "Kinect is not open.");
   switch (f){
   case DEPTH:
     debug ("Target feed: Depth.");
@@ -928,6 +2093,7 @@ int triggerFeed (FEED f){
       debug ("Starting Depth feed.");
       check (freenect_start_depth(f_dev) == 0, "Error starting depth stream");
       con.Depth = 0;
+      streamsStarted();
       debug ("Depth feed started.");
       pushToOutBuffer ("Depth feed started");
     }
@@ -947,6 +2113,7 @@ int triggerFeed (FEED f){
       debug ("Starting RGB feed.");
       check (freenect_start_video(f_dev) == 0, "Error starting RGB stream.");
       con.Rgb = 0;
+      streamsStarted();
       debug ("RGB feed started");
       pushToOutBuffer ("RGB feed started.");
     }
@@ -994,18 +2161,86 @@ void initConsole(){
   pushToOutBuffer ("Console is ready.");
 }
 
-void updateConsole(){
+/*
+  Everything the status rows show, compared frame to frame to tell when
+  they changed. Cleared first so padding compares equal.
+*/
+typedef struct {
+  int rgb, depth, led, angle;
+  FILTER_MODE filter;
+  int min, max, mean, valid_pct;
+  int tilt_valid, tilt_angle, motor;
+  int audio;
+  int levels[4];
+} console_status;
+
+console_status con_status;
+
+void readConsoleStatus(console_status *st){
+  memset(st, 0, sizeof(*st));
+  st->rgb = con.Rgb;
+  st->depth = con.Depth;
+  st->led = con.LED;
+  st->angle = con.Angle;
+  st->filter = dfilter.mode;
+  if (con.Depth == 0){
+    depth_stats ds;
+    depthProcReadStats(&dproc, &ds, 0);
+    st->min = ds.min;
+    st->max = ds.max;
+    st->mean = ds.valid ? (int) (ds.sum / ds.valid) : 0;
+    st->valid_pct = ds.total ? ds.valid * 100 / ds.total : 0;
+  }
+  tilt_state ts;
+  tiltPollerRead(&tilt, &ts);
+  st->tilt_valid = ts.valid;
+  st->tilt_angle = (int) ts.angle;
+  st->motor = ts.status;
+  st->audio = audio.running;
+  if (audio.running)
+    memcpy(st->levels, audio.level_db, sizeof(st->levels));
+}
 
+void drawConsoleText(const console_status *st){
   // Status bar on the left
-  renderString (150.0, con.Rows[0], ( con.Rgb == 1 ? 200 : 0 ), ( con.Rgb == 0 ? 200 : 0 ), 0, GLUT_BITMAP_HELVETICA_12, "RGB");
+  renderString (150.0, con.Rows[0], ( st->rgb == 1 ? 200 : 0 ), ( st->rgb == 0 ? 200 : 0 ), 0, GLUT_BITMAP_HELVETICA_12, "RGB");
 
-  renderString (100.0, con.Rows[0],  ( con.Depth == 1 ? 200 : 0 ), ( con.Depth == 0 ? 200 : 0 ), 0, GLUT_BITMAP_HELVETICA_12, "DEPTH");
+  renderString (100.0, con.Rows[0],  ( st->depth == 1 ? 200 : 0 ), ( st->depth == 0 ? 200 : 0 ), 0, GLUT_BITMAP_HELVETICA_12, "DEPTH");
 
   renderString (150.0, con.Rows[1], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "LED: ");
-  renderInt (100.0, con.Rows[1], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, con.LED);
+  renderInt (100.0, con.Rows[1], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->led);
 
   renderString (150.0, con.Rows[2], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Angle: ");
-  renderInt (100.0, con.Rows[2], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, con.Angle);
+  renderInt (100.0, con.Rows[2], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->angle);
+
+  renderString (150.0, con.Rows[3], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Filter: ");
+  renderString (100.0, con.Rows[3], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, depthFilterModeName(st->filter));
+
+  if (st->depth == 0){
+    renderString (150.0, con.Rows[4], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Min: ");
+    renderInt (100.0, con.Rows[4], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->min);
+    renderString (150.0, con.Rows[5], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Max: ");
+    renderInt (100.0, con.Rows[5], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->max);
+    renderString (150.0, con.Rows[6], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Mean: ");
+    renderInt (100.0, con.Rows[6], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->mean);
+    renderString (150.0, con.Rows[7], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Valid %: ");
+    renderInt (100.0, con.Rows[7], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->valid_pct);
+  }
+
+  if (st->tilt_valid){
+    renderString (150.0, con.Rows[8], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Tilt: ");
+    renderInt (100.0, con.Rows[8], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, st->tilt_angle);
+    renderString (150.0, con.Rows[9], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Motor: ");
+    renderString (100.0, con.Rows[9], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, tiltStatusName(st->motor));
+  }
+
+  if (st->audio){
+    char levels[32];
+    snprintf(levels, sizeof(levels), "%d %d %d %d", st->levels[0], st->levels[1],
+             st->levels[2], st->levels[3]);
+    renderString (150.0, con.Rows[10], 200, 0, 0, GLUT_BITMAP_HELVETICA_12, "Mic dB: ");
+    renderString (100.0, con.Rows[10], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, levels);
+  }
 
   // INPUT
   renderString (1270.0, con.Rows[CONSOLE_MAX_ROWS - 1], 0, 200, 0, GLUT_BITMAP_HELVETICA_12, con.Buf);
@@ -1017,7 +2252,55 @@ void updateConsole(){
   }
 }
 
+// The device thread gave up on the Kinect, its streams and audio end on this thread.
+void deviceLost(){
+  con.Depth = con.Rgb = 1;
+  if (audio.running && !audio.synthetic){
+    audioStop(&audio);
+    pushToOutBuffer ("Audio stopped, %d frames in %s.", (int) audio.written, audio.path);
+  }
+  myKinect.kinect_selected_devices_count = -1;
+}
+
+void updateConsole(){
+  char line[DEV_MSG_LEN];
+  console_status st;
+
+  if (__atomic_exchange_n(&device_lost, 0, __ATOMIC_ACQ_REL))
+    deviceLost();
+
+  // Device thread results, printed here since only this thread owns the console.
+  while (devQueueTakeMessage(&devq, line, sizeof(line)))
+    pushToOutBuffer ("%s", line);
+
+  readConsoleStatus(&st);
+  if (memcmp(&st, &con_status, sizeof(st)) != 0){
+    con_status = st;
+    con_gen++;
+  }
+
+  if (con_text_bitmap || !con_text.ready){
+    drawConsoleText(&con_status);
+    return;
+  }
+  if (con_text.built_gen != con_gen){
+    textAtlasBegin(&con_text);
+    drawConsoleText(&con_status);
+    textAtlasEnd(&con_text, con_gen);
+  }
+  textAtlasDraw(&con_text);
+}
+
+/*
+  While the console batch is built the text goes to the atlas. The scene
+  is mirrored around x = 640 and bitmaps are not, so the atlas gets the
+  window position the raster position lands on.
+*/
 void renderString(float x, float y, int r, int g, int b, void *font, const char* string){
+  if (con_text.building){
+    textAtlasAdd(&con_text, 1280 - x, y, r, g, b, font, string);
+    return;
+  }
   glColor3f(r, g, b);
   glRasterPos2f(x, y);
   glutBitmapString(font, string);
@@ -1026,6 +2309,10 @@ void renderString(float x, float y, int r, int g, int b, void *font, const char*
 void renderInt(float x, float y, int r, int g, int b, void *font, int val){
   char buf[sizeof(int)*3+2];
   snprintf(buf, sizeof(buf), "%d", val);
+  if (con_text.building){
+    textAtlasAdd(&con_text, 1280 - x, y, r, g, b, font, buf);
+    return;
+  }
   glColor3f(r, g, b);
   glRasterPos2f(x, y);
   glutBitmapString(font, buf);
@@ -1035,6 +2322,9 @@ void keyPressed(unsigned char key, int x, int y)
 {
   char *tmpBuf = NULL;
 
+  // Every key edits con.Buf or runs a command.
+  con_gen++;
+
   switch(key) {
   case 27: //ESC
     debug ("Quitting on ESC key.");
@@ -1128,8 +2418,35 @@ void keyPressed(unsigned char key, int x, int y)
   pushToOutBuffer ("Looks like we did not.");
 }
 
+// Upload a video frame in whatever layout its mode delivers.
+void uploadVideoTexture(const freenect_frame_mode *mode, const uint8_t *frame)
+{
+	switch (mode->video_format) {
+		case FREENECT_VIDEO_IR_8BIT:
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, mode->width, mode->height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, frame);
+			break;
+		case FREENECT_VIDEO_IR_10BIT:
+			// 10 significant bits in 16, scale up to the full range.
+			glPixelTransferf(GL_RED_SCALE, 64.0f);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, mode->width, mode->height, 0, GL_LUMINANCE, GL_UNSIGNED_SHORT, frame);
+			glPixelTransferf(GL_RED_SCALE, 1.0f);
+			break;
+		default:
+			// RGB, YUV converted by libfreenect and Bayer demosaiced by the video processor.
+			glTexImage2D(GL_TEXTURE_2D, 0, 3, mode->width, mode->height, 0, GL_RGB, GL_UNSIGNED_BYTE, frame);
+			break;
+	}
+}
+
 void DrawGLScene()
 {
+  // The window has to be up to capture the glyphs, so on the first frame.
+  if (!con_text.ready && !con_text.failed){
+    void *fonts[] = { GLUT_BITMAP_HELVETICA_12, GLUT_BITMAP_8_BY_13 };
+    if (textAtlasInit(&con_text, fonts, 2, gl_window_h) != 0)
+      pushToOutBuffer ("No text atlas, drawing console text as bitmaps.");
+  }
+
   if (con.Rgb == 0 || con.Depth == 0){
     pthread_mutex_lock(&gl_backbuf_mutex);
 
@@ -1138,10 +2455,16 @@ void DrawGLScene()
     }
 
 
-    if (con.Depth == 0)
-      memcpy(gl_depth_front, gl_depth_back, sizeof(gl_depth_back));
-    if (con.Rgb == 0)
-      memcpy(gl_rgb_front, gl_rgb_back, sizeof(gl_rgb_back));
+    if (con.Depth == 0){
+      // Only the region the depth processor produced, ROI and decimation shrink it.
+      gl_depth_front_w = gl_depth_back_w;
+      gl_depth_front_h = gl_depth_back_h;
+      memcpy(gl_depth_front, gl_depth_back, gl_depth_front_w * gl_depth_front_h * 3);
+    }
+    if (con.Rgb == 0){
+      gl_rgb_front_mode = gl_rgb_back_mode;
+      memcpy(gl_rgb_front, gl_rgb_back, modeVideoUploadBytes(&gl_rgb_front_mode));
+    }
     got_frames = 0;
     pthread_mutex_unlock(&gl_backbuf_mutex);
   }
@@ -1156,7 +2479,7 @@ void DrawGLScene()
 
   if (con.Depth == 0){
     glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, DrawGLSceneY, 0, GL_RGB, GL_UNSIGNED_BYTE, gl_depth_front);
+    glTexImage2D(GL_TEXTURE_2D, 0, 3, gl_depth_front_w, gl_depth_front_h, 0, GL_RGB, GL_UNSIGNED_BYTE, gl_depth_front);
 
     glBegin(GL_TRIANGLE_FAN);
     glColor4f(255.0f, 255.0f, 255.0f, 255.0f);
@@ -1169,7 +2492,7 @@ void DrawGLScene()
 
   if (con.Rgb == 0){
     glBindTexture(GL_TEXTURE_2D, gl_rgb_tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, 3, 640, DrawGLSceneY, 0, GL_RGB, GL_UNSIGNED_BYTE, gl_rgb_front);
+    uploadVideoTexture(&gl_rgb_front_mode, gl_rgb_front);
 
     glBegin(GL_TRIANGLE_FAN);
     glColor4f(255.0f, 255.0f, 255.0f, 255.0f);
@@ -1193,7 +2516,7 @@ void ReSizeGLScene(int Width, int Height)
 	glViewport(0,0,Width,Height);
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
-	glOrtho (0, 1280, ReSizeGLSceneY, 0, -1.0f, 1.0f);
+	glOrtho (0, 1280, gl_window_h, 0, -1.0f, 1.0f);
 	glMatrixMode(GL_MODELVIEW);
 }
 
@@ -1206,6 +2529,8 @@ void InitGL(int Width, int Height)
 	glEnable(GL_BLEND);
 	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glShadeModel(GL_SMOOTH);
+	// Region widths are not a multiple of 4 bytes per row.
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glGenTextures(1, &gl_depth_tex);
 	glBindTexture(GL_TEXTURE_2D, gl_depth_tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -1224,7 +2549,7 @@ void *gl_threadfunc(void *arg)
 	glutInit(&g_argc, g_argv);
 
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH);
-	glutInitWindowSize(1280, gl_threadfunY1);
+	glutInitWindowSize(1280, gl_window_h);
 	glutInitWindowPosition(0, 0);
 
 	window = glutCreateWindow("Kinect Control");
@@ -1233,57 +2558,32 @@ void *gl_threadfunc(void *arg)
 	glutReshapeFunc(&ReSizeGLScene);
 	glutKeyboardFunc(&keyPressed);
 
-	InitGL(1280, gl_threadfunY2);
+	InitGL(1280, gl_window_h);
  
 	glutMainLoop();
 
 	return NULL;
 }
 
-void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp)
+/*
+  Called on the depth processing thread once a frame is colorized. The finished
+  frame becomes the back buffer and its old storage is handed back to be
+  drawn into next.
+*/
+void publishDepth(uint8_t **out, int width, int height)
 {
-	int i;
-	int first = 0;
-	int px = 0 , py = 0;
-	int tx = 0 , ty = 0;
-	int alert = 0;
-	uint16_t *depth = v_depth;
-	pthread_mutex_lock(&gl_backbuf_mutex);
-	for (i=0; i<FREENECT_IR_FRAME_PIX; i++) {
-		int pval = t_gamma[depth[i]];
-		int lb = pval & 0xff;
-
-		tx++;
-		if(tx >= 640) {
-			tx = 0;
-			ty++;
-		}
-		/*case 0-5*/
-		switch (pval>>8) {
-			case 0:
-				gl_depth_back[3*i+0] = 255;
-				gl_depth_back[3*i+1] = 0;
-				gl_depth_back[3*i+2] = 0;
-				alert++;
-				if (!first) { 
-					first = i;
-					px = tx;
-					py = ty;
-				}
-				break;
-			case 1:
-				gl_depth_back[3*i+0] = 255;
-				gl_depth_back[3*i+1] = 255;
-				gl_depth_back[3*i+2] = 255;
-				break;
-			default:
-				gl_depth_back[3*i+0] = 0;
-				gl_depth_back[3*i+1] = 0;
-				gl_depth_back[3*i+2] = 0;
-				break;
-		}
-	}
+	int alert = dproc.alert;
+	int px = dproc.first >= 0 ? dproc.first % 640 : 0;
+	int py = dproc.first >= 0 ? dproc.first / 640 : 0;
+	int first = dproc.first > 0;
+	uint8_t *tmp;
 
+	pthread_mutex_lock(&gl_backbuf_mutex);
+	tmp = gl_depth_back;
+	gl_depth_back = *out;
+	*out = tmp;
+	gl_depth_back_w = width;
+	gl_depth_back_h = height;
   /*
 	if(alert > snstvty) {	
 		debug("!!!TOO CLOSE!!!");
@@ -1334,45 +2634,157 @@ void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp)
 	pthread_mutex_unlock(&gl_backbuf_mutex);
 }
 
-void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp)
+void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp)
+{
+	jitterRecord(&depth_jitter, timestamp, nowNs());
+	// Only rotate buffers here, this thread also services USB.
+	freenect_set_depth_buffer(dev, depthProcPush(&dproc, v_depth, timestamp));
+}
+
+void publishVideo(uint8_t **out, const freenect_frame_mode *mode)
 {
+	uint8_t *tmp;
+
 	pthread_mutex_lock(&gl_backbuf_mutex);
+	tmp = gl_rgb_back;
+	gl_rgb_back = *out;
+	*out = tmp;
+	gl_rgb_back_mode = *mode;
 	got_frames++;
-	memcpy(gl_rgb_back, rgb, FREENECT_VIDEO_RGB_SIZE);
 	pthread_cond_signal(&gl_frame_cond);
 	pthread_mutex_unlock(&gl_backbuf_mutex);
+}
+
+void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp)
+{
+	jitterRecord(&video_jitter, timestamp, nowNs());
+	// Same as depth, demosaic and copies run on the video thread.
+	freenect_set_video_buffer(dev, videoProcPush(&vproc, rgb, timestamp));
+}
+
+/*
+  Callbacks, buffers and modes of a freshly opened f_dev, and the thread
+  that owns its control transfers. On the device thread.
+*/
+int setupDevice(){
+  // A new device has no LED set yet, whatever the last one was asked for.
+  devQueueForget(&devq);
+  freenect_set_depth_callback(f_dev, depth_cb);
+  freenect_set_depth_buffer(f_dev, depthProcFillBuffer(&dproc));
+  freenect_set_video_callback(f_dev, rgb_cb);
+  freenect_set_video_buffer(f_dev, videoProcFillBuffer(&vproc));
+
+  // Modes picked with set video / set depth before the device was opened.
+  check (freenect_set_video_mode(f_dev, video_mode) == 0, "Error setting video mode.");
+  check (freenect_set_depth_mode(f_dev, depth_mode) == 0, "Error setting depth mode.");
+
+  // Tilt, accelerometer and device commands run on their own thread, the loop only services streams.
+  if (tiltPollerStart(&tilt, f_dev, &devq) != 0)
+    debug ("Could not start tilt poller, tilt state will not update.");
+  else if (!rtSchedIsDefault(ROLE_DEVICE))
+    applySched(ROLE_DEVICE);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+/*
+  The freenect backend of the supervisor, all on the device thread. A
+  device closed from the console ends the loop rather than counting as
+  lost.
+*/
+int deviceProcess(void *ctx){
+  if (myKinect.kinect_is_open != 0)
+    return 1;
+  return freenect_process_events(f_ctx);
+}
+
+// Frames arrive on this thread, so the jitter monitors are read as written.
+uint64_t deviceLastFrame(void *ctx){
+  uint64_t last = __atomic_load_n(&streams_started_ns, __ATOMIC_RELAXED);
+
+  if (con.Depth != 0 && con.Rgb != 0)
+    return 0;
+  if (con.Depth == 0 && depth_jitter.last_host > last)
+    last = depth_jitter.last_host;
+  if (con.Rgb == 0 && video_jitter.last_host > last)
+    last = video_jitter.last_host;
+  return last;
+}
+
+// Only called while the device is away, so the cache is stale by definition.
+int deviceFind(void *ctx, const char *serial){
+  registryScan(&registry, f_ctx);
+  return registryFind(&registry, f_ctx, serial) >= 0;
+}
+
+void deviceRelease(void *ctx){
+  // Closed before the handle is freed, so console commands stop using it first.
+  __atomic_store_n(&myKinect.kinect_is_open, 1, __ATOMIC_SEQ_CST);
+  tiltPollerStop(&tilt);
+  // The handle is dead, closing it only frees it.
+  freenect_close_device(f_dev);
+  registryInvalidate(&registry);
+}
+
+/*
+  Reopen by serial and put the session back as the console left it: modes,
+  tilt, LED and every stream that was on, audio included.
+*/
+int deviceReopen(void *ctx, const char *serial){
+  int opened = 0;
+
+  check (freenect_open_device_by_camera_serial(f_ctx, &f_dev, serial) >= 0, "Could not reopen the device.");
+  opened = 1;
+  check (setupDevice() == 0, "Could not set the device up again.");
+  devQueuePost(&devq, DEV_CMD_TILT, freenect_angle);
+  devQueuePost(&devq, DEV_CMD_LED, con.LED);
+  if (con.Depth == 0)
+    check (freenect_start_depth(f_dev) == 0, "Could not restart the depth stream.");
+  if (con.Rgb == 0)
+    check (freenect_start_video(f_dev) == 0, "Could not restart the rgb stream.");
+  if (audio.running && !audio.synthetic){
+    freenect_set_audio_in_callback(f_dev, audio_cb);
+    if (freenect_start_audio(f_dev) != 0)
+      captureNotify("Audio did not come back, the WAV file stops here.");
+  }
+  streamsStarted();
+  myKinect.kinect_is_open = 0;
+  return 0;
 
+ error:
+  free (USER_ERR_MSG);
+  if (opened){
+    tiltPollerStop(&tilt);
+    freenect_close_device(f_dev);
+  }
+  return 1;
 }
 
 void *freenect_threadfunc(void *arg)
 {
   debug ("Init freenect thread function.");
-  freenect_video_format fvf;
-	freenect_set_tilt_degs(f_dev,freenect_angle);
-	check (freenect_set_led(f_dev,LED_GREEN) == 0, "Error setting led to green.");
-	freenect_set_depth_callback(f_dev, depth_cb);
-	freenect_set_video_callback(f_dev, rgb_cb);
+  // Not postDeviceCommand, the console buffer belongs to the GL thread.
+  if (devQueuePost(&devq, DEV_CMD_TILT, freenect_angle) < 0 || devQueuePost(&devq, DEV_CMD_LED, LED_GREEN) < 0)
+    devQueueMessage(&devq, "Device command queue is full, tilt or LED dropped.");
 
   int vmCount =  freenect_get_video_mode_count();
   debug("Video mode count: %d", vmCount);
 
-  /*
-    freenect_frame_mode myMode = freenect_get_video_mode(FREENECT_VIDEO_RGB);
-    freenect_set_video_mode(f_dev, myMode);
-    freenect_set_depth_format(f_dev, FREENECT_DEPTH_11BIT);
-  */
+  check (setupDevice() == 0, "Could not set the device up.");
 
   debug ("Entering freenect main loop.");
-	while(!die && freenect_process_events(f_ctx) >= 0 )
-	{
-    //		freenect_raw_tilt_state* state;
-		freenect_update_tilt_state(f_dev);
-    //		state = freenect_get_tilt_state(f_dev);;
-		//double dx,dy,dz;
-		//freenect_get_mks_accel(state, &dx, &dy, &dz);
-		//fflush(stdout);
-	}
-  closeKinect();
+  // Returns 1 when the device was lost for good, its handle already released.
+  if (hotplugRun(&hp, &die) != 0){
+    // The console goes on; its thread resets the streams and audio it owns.
+    __atomic_store_n(&device_lost, 1, __ATOMIC_RELEASE);
+    debug ("-- device lost.");
+    return NULL;
+  }
+  if (myKinect.kinect_is_open == 0)
+    closeKinect();
 
   debug("Free command buffer");
   free(con.Buf);
@@ -1383,10 +2795,18 @@ void *freenect_threadfunc(void *arg)
 
  error:
   debug ("Error in freenect_threadfunc.");
+  free (USER_ERR_MSG);
+  return NULL;
 }
 
+const hotplug_backend device_backend = { NULL, deviceProcess, deviceLastFrame, deviceFind, deviceReopen, deviceRelease };
+
 int main(int argc, char **argv)
 {
+  calib_result saved_calib;
+  int stream_frames;
+
+  logStart();
   debug("Let's get started");
 
 
@@ -1404,16 +2824,59 @@ int main(int argc, char **argv)
 	screenw += 200;
 	screenh += 200;
 
-	int i;
-	for (i=0; i<2048; i++) {
-		float v = i/2048.0;
-		v = powf(v, 3)* 6;
-		t_gamma[i] = v*6*256;
-	}
+  colormapInit(&cmap);
+  tiltPollerInit(&tilt);
+  render_thread = pthread_self();
+  jitterInit(&video_jitter, "video");
+  jitterInit(&depth_jitter, "depth");
+  devQueueInit(&devq);
+  check (audioInit(&audio) == 0, "Could not allocate audio capture.");
+  video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB);
+  depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT);
+  gl_rgb_front_mode = gl_rgb_back_mode = video_mode;
+  check (allocVideoBuffers(modeMaxVideoBytes(1)) == 0, "Could not allocate video buffers.");
 
 	g_argc = argc;
 	g_argv = argv;
 
+  // One band runs on the depth thread, so leave one core out of the pool.
+  workPoolInit(&band_pool, get_nprocs() - 1, 1);
+  check (depthFilterInit(&dfilter, 640, 480) == 0, "Could not allocate depth filter.");
+  /*
+    A frame being filled, one waiting and one being processed, plus all
+    the later consumers can hold at once: a full queue and the frame in
+    hand for capture and for record, then on depth the probe's latest and
+    an older one a query still reads, on video the calibration's latest
+    and the one it is detecting on. Short of that the driver overwrites
+    frames before they are published. Huge pages when the system has them.
+  */
+  stream_frames = 3 + CAPTURE_QUEUE + 1 + RECORD_QUEUE + 1;
+  check (framePoolInit(&depth_frames, "Depth", stream_frames + 2, modeMaxDepthBytes(), 1) == 0, "Could not allocate depth frames.");
+  check (framePoolInit(&video_frames, "Video", stream_frames + 2, modeMaxVideoBytes(0), 1) == 0, "Could not allocate video frames.");
+  check (depthProcInit(&dproc, 640, 480, &depth_frames, &band_pool, &dfilter, &cmap, publishDepth) == 0, "Could not allocate depth processing.");
+  check (captureInit(&cap_depth, "depth", &dproc.pipe, 640 * 480 * 2, captureNotify) == 0, "Could not allocate depth capture.");
+  check (motionGateInit(&motion, 640, 480) == 0, "Could not allocate the motion gate.");
+  check (depthProcAddMotion(&dproc, &motion) == 0, "Could not add the motion stage.");
+  depthProbeInit(&probe, 640, 480);
+  check (depthProcAddProbe(&dproc, &probe) == 0, "Could not add the probe stage.");
+  check (floorInit(&floor_est, &probe, &band_pool, &tilt, captureNotify) == 0, "Could not allocate the floor estimator.");
+  check (voxelGridInit(&voxels, &probe, &floor_est, band_pool.bands) == 0, "Could not allocate the voxel grid.");
+  check (depthProcAddVoxel(&dproc, &voxels) == 0, "Could not add the voxel stage.");
+  check (recorderInit(&rec_depth, "depth", &dproc.pipe, &motion, captureNotify) == 0, "Could not set up depth recording.");
+  check (depthProcStart(&dproc) == 0, "Could not start depth processing.");
+  check (videoProcInit(&vproc, &video_frames, modeMaxVideoBytes(1), &band_pool, publishVideo) == 0,
+         "Could not allocate video processing.");
+  videoProcSetMode(&vproc, &video_mode);
+  check (captureInit(&cap_video, "rgb", &vproc.pipe, modeMaxVideoBytes(1), captureNotify) == 0, "Could not allocate video capture.");
+  check (recorderInit(&rec_video, "rgb", &vproc.pipe, &motion, captureNotify) == 0, "Could not set up rgb recording.");
+  check (calibInit(&calib, &vproc.pipe, captureNotify, applyCalibration) == 0, "Could not allocate the calibration.");
+  if (calibLoad(CALIB_DEFAULT_PATH, &saved_calib) == 0)
+    applyCalibration(&saved_calib);
+  check (videoProcStart(&vproc) == 0, "Could not start video processing.");
+
+  metrics.listen_fd = -1;
+  hotplugInit(&hp, &device_backend, captureNotify);
+  registryInit(&registry);
   debug ("Init console");
   initConsole();
 
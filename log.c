@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "stats.h"
+
+#define LOG_FLUSH_MS 20
+
+int log_level = LOG_DEBUG;
+
+static const char *level_names[] = { "fatal", "error", "warning", "notice", "info", "debug", "spew", "flood" };
+static const char *level_tags[] = { "FATAL", "ERROR", "WARN", "NOTICE", "INFO", "DEBUG", "SPEW", "FLOOD" };
+
+// About 2 MB of address space, only the rings threads claim get touched.
+static log_ring rings[LOG_MAX_THREADS];
+static __thread log_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t reported[LOG_MAX_THREADS];   // Drops already reported, under flush_lock.
+static uint64_t start_ns;
+static uint64_t written;
+static uint64_t lost;       // Messages from threads past LOG_MAX_THREADS.
+static pthread_t flusher;
+static int running;
+static int quit;
+
+// Runs as the thread exits; the flusher frees the ring once it is drained.
+static void ringRetire(void *arg){
+  log_ring *r = arg;
+  __atomic_store_n(&r->state, LOG_RING_RETIRED, __ATOMIC_RELEASE);
+}
+
+static void keyInit(){
+  pthread_key_create(&ring_key, ringRetire);
+}
+
+/*
+  A free ring, or one whose thread exited and which the flusher already
+  drained. head and tail keep counting across owners, so nothing is reset
+  under the flusher's feet.
+*/
+static log_ring *findRing(){
+  log_ring *r;
+  int i, expect;
+
+  for (i = 0; i < 2 * LOG_MAX_THREADS; i++){
+    r = &rings[i % LOG_MAX_THREADS];
+    expect = i < LOG_MAX_THREADS ? LOG_RING_FREE : LOG_RING_RETIRED;
+    if (expect == LOG_RING_RETIRED && __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != r->head)
+      continue;
+    if (!__atomic_compare_exchange_n(&r->state, &expect, LOG_RING_USED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      continue;
+    __atomic_store_n(&r->tid, (int) syscall(SYS_gettid), __ATOMIC_RELAXED);
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+  }
+  return NULL;
+}
+
+/*
+  First message of a thread. When every ring is taken by threads that
+  exited moments ago it drains them on the spot, the one time a producer
+  waits on the flusher.
+*/
+static log_ring *claimRing(){
+  uint64_t zero = 0;
+  log_ring *r;
+
+  pthread_once(&key_once, keyInit);
+  __atomic_compare_exchange_n(&start_ns, &zero, nowNs(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  if ((r = findRing()) == NULL){
+    logFlush();
+    r = findRing();
+  }
+  return r;
+}
+
+void logWrite(int level, const char *file, int line, const char *fmt, ...){
+  log_ring *r = my_ring ? my_ring : claimRing();
+  log_record *rec;
+  uint64_t head;
+  va_list ap;
+
+  if (!r){
+    __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS){
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  rec = &r->slots[head & (LOG_RING_SLOTS - 1)];
+  rec->ns = nowNs();
+  rec->file = file;
+  rec->line = line;
+  rec->level = level;
+  va_start(ap, fmt);
+  vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+  va_end(ap);
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  // Without a flusher, before logStart or in tools, write it out now.
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    logFlush();
+}
+
+static void printRecord(const log_ring *r, log_record *rec){
+  size_t len = strlen(rec->msg);
+  double t = (double) (rec->ns - __atomic_load_n(&start_ns, __ATOMIC_RELAXED)) / 1e9;
+  int level = rec->level >= LOG_FATAL && rec->level <= LOG_FLOOD ? rec->level : LOG_DEBUG;
+
+  // libfreenect ends its messages with a newline.
+  while (len > 0 && rec->msg[len - 1] == '\n')
+    rec->msg[--len] = '\0';
+  if (rec->line > 0)
+    fprintf(stdout, "[%11.6f] %-5s %d (%s:%d) %s\n", t, level_tags[level],
+            r->tid, rec->file, rec->line, rec->msg);
+  else
+    fprintf(stdout, "[%11.6f] %-5s %d (%s) %s\n", t, level_tags[level],
+            r->tid, rec->file, rec->msg);
+}
+
+/*
+  Drain every ring, merged in timestamp order, then hand back the rings of
+  threads that exited. Callers serialize on flush_lock; producers never
+  take it.
+*/
+void logFlush(){
+  log_ring *best, *r;
+  uint64_t best_ns = 0, tail, dropped;
+  int i, expect;
+
+  pthread_mutex_lock(&flush_lock);
+  while (1){
+    best = NULL;
+    for (i = 0; i < LOG_MAX_THREADS; i++){
+      r = &rings[i];
+      if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == LOG_RING_FREE)
+        continue;
+      tail = r->tail;
+      if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+        continue;
+      if (!best || r->slots[tail & (LOG_RING_SLOTS - 1)].ns < best_ns){
+        best = r;
+        best_ns = r->slots[tail & (LOG_RING_SLOTS - 1)].ns;
+      }
+    }
+    if (!best)
+      break;
+    printRecord(best, &best->slots[best->tail & (LOG_RING_SLOTS - 1)]);
+    __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&written, written + 1, __ATOMIC_RELAXED);
+  }
+
+  for (i = 0; i < LOG_MAX_THREADS; i++){
+    r = &rings[i];
+    if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == LOG_RING_FREE)
+      continue;
+    dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != reported[i]){
+      fprintf(stdout, "[log] %d messages dropped on thread %d\n", (int) (dropped - reported[i]),
+              __atomic_load_n(&r->tid, __ATOMIC_RELAXED));
+      reported[i] = dropped;
+    }
+    expect = LOG_RING_RETIRED;
+    if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+      __atomic_compare_exchange_n(&r->state, &expect, LOG_RING_FREE, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&flush_lock);
+}
+
+static void *flusherThread(void *arg){
+  struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+  while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE)){
+    nanosleep(&ts, NULL);
+    logFlush();
+  }
+  return NULL;
+}
+
+int logStart(){
+  uint64_t zero = 0;
+
+  if (running)
+    return 0;
+  __atomic_compare_exchange_n(&start_ns, &zero, nowNs(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  quit = 0;
+  if (pthread_create(&flusher, NULL, flusherThread, NULL) != 0)
+    return 1;
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Joins the flusher and writes what is left; later messages are written synchronously.
+void logStop(){
+  if (!running)
+    return;
+  __atomic_store_n(&quit, 1, __ATOMIC_RELEASE);
+  pthread_join(flusher, NULL);
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  logFlush();
+}
+
+void logSetLevel(int level){
+  if (level < LOG_FATAL) level = LOG_FATAL;
+  if (level > LOG_FLOOD) level = LOG_FLOOD;
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int logLevelByName(const char *name){
+  int i;
+  for (i = LOG_FATAL; i <= LOG_FLOOD; i++)
+    if (strcmp(name, level_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+const char *logLevelName(int level){
+  return level >= LOG_FATAL && level <= LOG_FLOOD ? level_names[level] : "unknown";
+}
+
+void logCounts(uint64_t *out_written, uint64_t *out_dropped){
+  uint64_t d = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+  int i;
+
+  for (i = 0; i < LOG_MAX_THREADS; i++)
+    d += __atomic_load_n(&rings[i].dropped, __ATOMIC_RELAXED);
+  *out_written = __atomic_load_n(&written, __ATOMIC_RELAXED);
+  *out_dropped = d;
+}
@@ -0,0 +1,78 @@
+#ifndef __log_h__
+#define __log_h__
+
+#include <stdint.h>
+
+// Same numbering as freenect_loglevel, so one level drives both.
+#define LOG_FATAL   0
+#define LOG_ERROR   1
+#define LOG_WARNING 2
+#define LOG_NOTICE  3
+#define LOG_INFO    4
+#define LOG_DEBUG   5
+#define LOG_SPEW    6
+#define LOG_FLOOD   7
+
+// Messages above this level are compiled out, -DLOG_COMPILE_LEVEL=2 keeps warnings and worse.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RING_SLOTS 256    // Per thread, a power of two.
+#define LOG_SLOT_BYTES 256
+#define LOG_MAX_THREADS 32
+
+#define LOG_RING_FREE    0
+#define LOG_RING_USED    1
+#define LOG_RING_RETIRED 2
+
+extern int log_level;
+
+/*
+  Formats into the calling thread's ring and returns: no lock, no system
+  call, nothing shared with other threads but the ring indices. A full ring
+  drops the message and counts it. The level test is inline, so a message
+  below the runtime level costs one load and above the compile time level
+  nothing.
+*/
+#define LOG(L, M, ...) do{ \
+    if ((L) <= LOG_COMPILE_LEVEL && (L) <= log_level) \
+      logWrite((L), __FILE__, __LINE__, M, ##__VA_ARGS__); \
+  } while (0)
+
+/*
+  One message in a ring, stamped with the raw monotonic clock; the flusher
+  turns it into text.
+*/
+typedef struct {
+  uint64_t ns;
+  const char *file;
+  int line;
+  int level;
+  char msg[LOG_SLOT_BYTES - 24];
+} log_record;
+
+/*
+  Single producer, single consumer: the owning thread moves `head`, the
+  flusher `tail`. A ring is claimed by a thread on its first message and
+  handed back when the thread exits and the flusher has drained it.
+*/
+typedef struct {
+  int state;              // LOG_RING_FREE, _USED or _RETIRED.
+  int tid;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  log_record slots[LOG_RING_SLOTS];
+} log_ring;
+
+void logWrite(int level, const char *file, int line, const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
+int logStart();
+void logStop();
+void logFlush();
+void logSetLevel(int level);
+int logLevelByName(const char *name);
+const char *logLevelName(int level);
+void logCounts(uint64_t *written, uint64_t *dropped);
+
+#endif
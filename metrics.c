@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "dbg.h"
+
+#define METRICS_TIMEOUT_NS 5000000000ull   // Idle clients are dropped after 5 s.
+
+void metricsPrintf(metrics_buf *b, const char *fmt, ...){
+  va_list ap;
+  int n;
+  char *grown;
+
+  if (b->err)
+    return;
+  while (1){
+    va_start(ap, fmt);
+    n = vsnprintf(b->data ? b->data + b->len : NULL, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0){
+      b->err = 1;
+      return;
+    }
+    if (b->len + n < b->cap){
+      b->len += n;
+      return;
+    }
+    if ((grown = realloc(b->data, b->cap * 2 + n + 1)) == NULL){
+      b->err = 1;
+      return;
+    }
+    b->data = grown;
+    b->cap = b->cap * 2 + n + 1;
+  }
+}
+
+void metricsFamily(metrics_buf *b, const char *name, const char *type, const char *help){
+  metricsPrintf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// `labels` is the inside of the braces, NULL or empty for none.
+void metricsSample(metrics_buf *b, const char *name, const char *labels, double value){
+  if (labels && labels[0])
+    metricsPrintf(b, "%s{%s} %.9g\n", name, labels, value);
+  else
+    metricsPrintf(b, "%s %.9g\n", name, value);
+}
+
+/*
+  A stage timer as summary samples in seconds: the median, 90th and 99th
+  percentile from its histogram, the sum and the count.
+*/
+void metricsTimer(metrics_buf *b, const char *name, const char *labels, const stage_timer *t){
+  static const double quantiles[3] = { 0.5, 0.9, 0.99 };
+  const char *sep = labels && labels[0] ? "," : "";
+  int i;
+
+  if (!labels)
+    labels = "";
+  for (i = 0; i < 3; i++)
+    metricsPrintf(b, "%s{%s%squantile=\"%g\"} %.9g\n", name, labels, sep, quantiles[i],
+                  stageTimerQuantile(t, quantiles[i]) / 1e9);
+  metricsPrintf(b, "%s_sum{%s} %.9g\n", name, labels, __atomic_load_n(&t->sum_ns, __ATOMIC_RELAXED) / 1e9);
+  metricsPrintf(b, "%s_count{%s} %llu\n", name, labels,
+                (unsigned long long) __atomic_load_n(&t->count, __ATOMIC_RELAXED));
+}
+
+static int setNonBlocking(int fd){
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+  "9464" and "host:9464" are TCP, the host defaulting to 127.0.0.1, and
+  "unix:/path" a Unix socket. Returns a socket not yet bound or connected
+  and its address.
+*/
+static int metricsSocket(const char *addr, struct sockaddr_storage *sa, socklen_t *len){
+  struct sockaddr_in *in = (struct sockaddr_in *) sa;
+  struct sockaddr_un *un = (struct sockaddr_un *) sa;
+  const char *colon;
+  char host[64];
+  int port;
+
+  memset(sa, 0, sizeof(*sa));
+  if (strncmp(addr, "unix:", 5) == 0){
+    if (strlen(addr + 5) == 0 || strlen(addr + 5) >= sizeof(un->sun_path))
+      return -1;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, addr + 5);
+    *len = sizeof(*un);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+  }
+
+  colon = strrchr(addr, ':');
+  snprintf(host, sizeof(host), "%.*s", colon ? (int) (colon - addr) : 0, addr);
+  port = atoi(colon ? colon + 1 : addr);
+  if (port <= 0 || port > 65535)
+    return -1;
+  in->sin_family = AF_INET;
+  in->sin_port = htons(port);
+  if (inet_pton(AF_INET, host[0] ? host : "127.0.0.1", &in->sin_addr) != 1)
+    return -1;
+  *len = sizeof(*in);
+  return socket(AF_INET, SOCK_STREAM, 0);
+}
+
+static void clientClose(metrics_client *c){
+  close(c->fd);
+  free (c->out);
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+}
+
+// Render the whole response up front; the client then only drains it.
+static void clientRespond(metrics_server *m, metrics_client *c){
+  metrics_buf body = { NULL, 0, 0, 0 };
+  metrics_buf resp = { NULL, 0, 0, 0 };
+  uint64_t start = nowNs();
+  int found = strncmp(c->in, "GET /metrics ", 13) == 0 || strncmp(c->in, "GET / ", 6) == 0;
+
+  if (found){
+    m->collect(&body);
+    __atomic_add_fetch(&m->scrapes, 1, __ATOMIC_RELAXED);
+  }
+  else
+    metricsPrintf(&body, "Not found, try /metrics\n");
+  if (body.err)
+    found = -1;
+  metricsPrintf(&resp, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                found > 0 ? "200 OK" : (found == 0 ? "404 Not Found" : "500 Internal Server Error"),
+                found > 0 ? "text/plain; version=0.0.4" : "text/plain",
+                found >= 0 ? (int) body.len : 0);
+  if (found >= 0 && body.len)
+    metricsPrintf(&resp, "%.*s", (int) body.len, body.data);
+  free (body.data);
+  if (found > 0)
+    stageTimerRecord(&m->render, nowNs() - start);
+
+  c->out = resp.data;
+  c->out_len = resp.err ? 0 : resp.len;
+  c->out_off = 0;
+}
+
+static void clientRead(metrics_server *m, metrics_client *c){
+  ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+    clientClose(c);
+    return;
+  }
+  if (n < 0)
+    return;
+  c->in_len += n;
+  c->in[c->in_len] = '\0';
+  // Only the request line matters, headers are read and ignored.
+  if (strstr(c->in, "\r\n\r\n") || strstr(c->in, "\n\n") || c->in_len == sizeof(c->in) - 1)
+    clientRespond(m, c);
+}
+
+static void clientWrite(metrics_client *c){
+  ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0){
+    clientClose(c);
+    return;
+  }
+  c->out_off += n;
+  if (c->out_off == c->out_len)
+    clientClose(c);
+}
+
+static void acceptClients(metrics_server *m){
+  metrics_client *c;
+  int fd, i;
+
+  while ((fd = accept(m->listen_fd, NULL, NULL)) >= 0){
+    for (i = 0, c = NULL; i < METRICS_MAX_CLIENTS && !c; i++)
+      if (m->clients[i].fd < 0)
+        c = &m->clients[i];
+    if (!c || setNonBlocking(fd) != 0){
+      __atomic_add_fetch(&m->rejected, 1, __ATOMIC_RELAXED);
+      close(fd);
+      continue;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->deadline_ns = nowNs() + METRICS_TIMEOUT_NS;
+  }
+}
+
+static void *metricsThread(void *arg){
+  metrics_server *m = arg;
+  struct pollfd fds[METRICS_MAX_CLIENTS + 2];
+  metrics_client *owner[METRICS_MAX_CLIENTS + 2];
+  uint64_t now;
+  int i, n;
+
+  while (!__atomic_load_n(&m->quit, __ATOMIC_ACQUIRE)){
+    fds[0].fd = m->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = m->listen_fd;
+    fds[1].events = POLLIN;
+    n = 2;
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++){
+      if (m->clients[i].fd < 0)
+        continue;
+      fds[n].fd = m->clients[i].fd;
+      fds[n].events = m->clients[i].out ? POLLOUT : POLLIN;
+      owner[n++] = &m->clients[i];
+    }
+    if (poll(fds, n, 1000) < 0 && errno != EINTR)
+      break;
+
+    if (fds[1].revents & POLLIN)
+      acceptClients(m);
+    now = nowNs();
+    for (i = 2; i < n; i++){
+      metrics_client *c = owner[i];
+      if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL) && !(fds[i].revents & POLLIN))
+        clientClose(c);
+      else if (fds[i].revents & POLLIN && !c->out)
+        clientRead(m, c);
+      else if (fds[i].revents & POLLOUT && c->out)
+        clientWrite(c);
+      else if (now > c->deadline_ns)
+        clientClose(c);
+    }
+  }
+
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+    if (m->clients[i].fd >= 0)
+      clientClose(&m->clients[i]);
+  return NULL;
+}
+
+// Returns nonzero when already running or the address cannot be served.
+int metricsStart(metrics_server *m, const char *addr, metrics_collect_fn collect){
+  struct sockaddr_storage sa;
+  socklen_t len;
+  int i, one = 1;
+
+  if (m->running)
+    return 1;
+  m->listen_fd = -1;
+  m->wake[0] = m->wake[1] = -1;
+  check (strlen(addr) < sizeof(m->addr), "Metrics address too long.");
+  snprintf(m->addr, sizeof(m->addr), "%s", addr);
+  m->collect = collect;
+  m->quit = 0;
+  stageTimerInit(&m->render, "metrics render");
+  for (i = 0; i < METRICS_MAX_CLIENTS; i++){
+    memset(&m->clients[i], 0, sizeof(m->clients[i]));
+    m->clients[i].fd = -1;
+  }
+
+  m->listen_fd = metricsSocket(addr, &sa, &len);
+  check (m->listen_fd >= 0, "Metrics address: <port>, <host:port> or unix:<path>.");
+  setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (sa.ss_family == AF_UNIX)
+    unlink(((struct sockaddr_un *) &sa)->sun_path);
+  check (bind(m->listen_fd, (struct sockaddr *) &sa, len) == 0, "Could not bind the metrics address.");
+  check (listen(m->listen_fd, METRICS_MAX_CLIENTS) == 0, "Could not listen on the metrics address.");
+  check (setNonBlocking(m->listen_fd) == 0, "Could not make the metrics socket non-blocking.");
+  check (pipe(m->wake) == 0, "Could not create the metrics wake pipe.");
+  check (pthread_create(&m->thread, NULL, metricsThread, m) == 0, "Could not create metrics thread.");
+  m->running = 1;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  if (m->listen_fd >= 0)
+    close(m->listen_fd);
+  if (m->wake[0] >= 0){
+    close(m->wake[0]);
+    close(m->wake[1]);
+  }
+  m->listen_fd = -1;
+  return 1;
+}
+
+void metricsStop(metrics_server *m){
+  if (!m->running)
+    return;
+  __atomic_store_n(&m->quit, 1, __ATOMIC_RELEASE);
+  if (write(m->wake[1], "", 1) < 0)
+    debug ("Metrics wake write failed.");
+  pthread_join(m->thread, NULL);
+  close(m->wake[0]);
+  close(m->wake[1]);
+  close(m->listen_fd);
+  if (strncmp(m->addr, "unix:", 5) == 0)
+    unlink(m->addr + 5);
+  m->running = 0;
+}
+
+/*
+  A blocking client for checking the endpoint from the console: GET
+  /metrics from `addr` into `body`, NUL terminated and cut to fit. `ns` is
+  the time to the last byte. Returns the HTTP status, -1 when the request
+  could not be made.
+*/
+int metricsScrape(const char *addr, char *body, size_t len, uint64_t *ns){
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  uint64_t start = nowNs();
+  size_t got = 0;
+  ssize_t n;
+  char chunk[4096];
+  char *head_end;
+  int fd, status = -1;
+  const char *req = "GET /metrics HTTP/1.0\r\nHost: localhost\r\n\r\n";
+
+  if ((fd = metricsSocket(addr, &sa, &salen)) < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *) &sa, salen) != 0 || send(fd, req, strlen(req), MSG_NOSIGNAL) != (ssize_t) strlen(req)){
+    close(fd);
+    return -1;
+  }
+  body[0] = '\0';
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0){
+    if (got + 1 < len){
+      size_t take = (size_t) n < len - 1 - got ? (size_t) n : len - 1 - got;
+      memcpy(body + got, chunk, take);
+      got += take;
+      body[got] = '\0';
+    }
+  }
+  close(fd);
+  *ns = nowNs() - start;
+
+  if (sscanf(body, "HTTP/%*d.%*d %d", &status) != 1)
+    return -1;
+  if ((head_end = strstr(body, "\r\n\r\n")) != NULL)
+    memmove(body, head_end + 4, strlen(head_end + 4) + 1);
+  return status;
+}
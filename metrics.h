@@ -0,0 +1,69 @@
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_ADDR_LEN 108
+#define METRICS_DEFAULT_PORT 9464
+
+/*
+  A scrape in Prometheus text format, grown as it is written. Samples of
+  one family must follow its metricsFamily line.
+*/
+typedef struct {
+  char *data;
+  size_t len, cap;
+  int err;
+} metrics_buf;
+
+void metricsPrintf(metrics_buf *b, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void metricsFamily(metrics_buf *b, const char *name, const char *type, const char *help);
+void metricsSample(metrics_buf *b, const char *name, const char *labels, double value);
+void metricsTimer(metrics_buf *b, const char *name, const char *labels, const stage_timer *t);
+
+/*
+  Fills a scrape from the live counters, on the metrics thread. It may
+  only read what the hot paths publish with atomic stores or sequence
+  locks, never take a lock a frame path holds.
+*/
+typedef void (*metrics_collect_fn)(metrics_buf *b);
+
+typedef struct {
+  int fd;
+  char in[1024];
+  size_t in_len;
+  char *out;
+  size_t out_len, out_off;
+  uint64_t deadline_ns;
+} metrics_client;
+
+/*
+  HTTP endpoint on localhost or a Unix socket, served by one thread doing
+  non-blocking I/O around poll, so a slow or stuck scraper only holds its
+  own connection. GET /metrics renders a fresh scrape, anything else is a
+  404. The thread never touches frame data.
+*/
+typedef struct {
+  char addr[METRICS_ADDR_LEN];
+  int listen_fd;
+  int wake[2];
+  pthread_t thread;
+  int running;
+  int quit;
+  metrics_collect_fn collect;
+  metrics_client clients[METRICS_MAX_CLIENTS];
+
+  uint64_t scrapes;
+  uint64_t rejected;
+  stage_timer render;
+} metrics_server;
+
+int metricsStart(metrics_server *m, const char *addr, metrics_collect_fn collect);
+void metricsStop(metrics_server *m);
+int metricsScrape(const char *addr, char *body, size_t len, uint64_t *ns);
+
+#endif
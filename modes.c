@@ -0,0 +1,161 @@
+#include <string.h>
+#include "modes.h"
+
+typedef struct {
+  const char *name;
+  int value;
+} mode_name;
+
+static const mode_name videoNames[] = {
+  { "rgb", FREENECT_VIDEO_RGB },
+  { "bayer", FREENECT_VIDEO_BAYER },
+  { "ir8", FREENECT_VIDEO_IR_8BIT },
+  { "ir10", FREENECT_VIDEO_IR_10BIT },
+  { "yuv", FREENECT_VIDEO_YUV_RGB },
+};
+
+static const mode_name depthNames[] = {
+  { "11bit", FREENECT_DEPTH_11BIT },
+  { "10bit", FREENECT_DEPTH_10BIT },
+  { "mm", FREENECT_DEPTH_MM },
+  { "registered", FREENECT_DEPTH_REGISTERED },
+  { "11packed", FREENECT_DEPTH_11BIT_PACKED },
+  { "10packed", FREENECT_DEPTH_10BIT_PACKED },
+};
+
+static const mode_name resolutionNames[] = {
+  { "low", FREENECT_RESOLUTION_LOW },
+  { "medium", FREENECT_RESOLUTION_MEDIUM },
+  { "high", FREENECT_RESOLUTION_HIGH },
+};
+
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+static int lookup(const mode_name *names, size_t count, const char *name, int *value){
+  size_t i;
+  for (i = 0; i < count; i++){
+    if (strcmp(names[i].name, name) == 0){
+      *value = names[i].value;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static const char *nameOf(const mode_name *names, size_t count, int value){
+  size_t i;
+  for (i = 0; i < count; i++)
+    if (names[i].value == value)
+      return names[i].name;
+  return "unknown";
+}
+
+int modeParseVideo(const char *format, const char *resolution, freenect_frame_mode *mode){
+  int f, r;
+  if (lookup(videoNames, COUNT(videoNames), format, &f) != 0)
+    return 1;
+  if (lookup(resolutionNames, COUNT(resolutionNames), resolution, &r) != 0)
+    return 1;
+  *mode = freenect_find_video_mode((freenect_resolution) r, (freenect_video_format) f);
+  return mode->is_valid ? 0 : 1;
+}
+
+int modeParseDepth(const char *format, freenect_frame_mode *mode){
+  int f;
+  if (lookup(depthNames, COUNT(depthNames), format, &f) != 0)
+    return 1;
+  *mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, (freenect_depth_format) f);
+  return mode->is_valid ? 0 : 1;
+}
+
+const char *modeVideoName(freenect_video_format format){
+  return nameOf(videoNames, COUNT(videoNames), format);
+}
+
+const char *modeDepthName(freenect_depth_format format){
+  return nameOf(depthNames, COUNT(depthNames), format);
+}
+
+const char *modeResolutionName(freenect_resolution resolution){
+  return nameOf(resolutionNames, COUNT(resolutionNames), resolution);
+}
+
+// Depth slots are sized once for the largest mode so switching never reallocates them.
+int modeMaxDepthBytes(){
+  int i, n = freenect_get_depth_mode_count(), bytes = 0;
+  for (i = 0; i < n; i++){
+    freenect_frame_mode m = freenect_get_depth_mode(i);
+    if (m.is_valid && m.bytes > bytes)
+      bytes = m.bytes;
+  }
+  return bytes;
+}
+
+// Bytes the display needs for a frame of `mode`, Bayer is demosaiced to RGB.
+size_t modeVideoUploadBytes(const freenect_frame_mode *mode){
+  if (mode->video_format == FREENECT_VIDEO_BAYER)
+    return (size_t) mode->width * mode->height * 3;
+  return mode->bytes;
+}
+
+// Largest raw frame, or largest upload frame, over all video modes.
+size_t modeMaxVideoBytes(int upload){
+  int i, n = freenect_get_video_mode_count();
+  size_t bytes = 0, b;
+  for (i = 0; i < n; i++){
+    freenect_frame_mode m = freenect_get_video_mode(i);
+    if (!m.is_valid)
+      continue;
+    b = upload ? modeVideoUploadBytes(&m) : (size_t) m.bytes;
+    if (b > bytes)
+      bytes = b;
+  }
+  return bytes;
+}
+
+uint16_t modeDepthNoData(freenect_depth_format format){
+  switch (format){
+  case FREENECT_DEPTH_10BIT:
+  case FREENECT_DEPTH_10BIT_PACKED:
+    return 1023;
+  case FREENECT_DEPTH_MM:
+  case FREENECT_DEPTH_REGISTERED:
+    return 0;
+  default:
+    return 2047;
+  }
+}
+
+// Bits per pixel of a packed depth format, 0 when it is not packed.
+int modeDepthPackedBits(freenect_depth_format format){
+  switch (format){
+  case FREENECT_DEPTH_11BIT_PACKED:
+    return 11;
+  case FREENECT_DEPTH_10BIT_PACKED:
+    return 10;
+  default:
+    return 0;
+  }
+}
+
+/*
+  Colormap index for a depth value is (value << shift_left) >> shift. The
+  tables are laid out for 11 bit disparity: 10 bit is scaled up to it and
+  millimeters are binned by 8 mm, which covers 16 m.
+*/
+void modeDepthIndex(freenect_depth_format format, int *shift_left, int *shift){
+  *shift_left = 0;
+  *shift = 0;
+  switch (format){
+  case FREENECT_DEPTH_10BIT:
+  case FREENECT_DEPTH_10BIT_PACKED:
+    *shift_left = 1;
+    break;
+  case FREENECT_DEPTH_MM:
+  case FREENECT_DEPTH_REGISTERED:
+    *shift = 3;
+    break;
+  default:
+    break;
+  }
+}
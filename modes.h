@@ -0,0 +1,25 @@
+#ifndef __modes_h__
+#define __modes_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libfreenect.h"
+
+/*
+  Console names for the libfreenect video and depth modes, and what the depth
+  pipeline needs to know about each depth format.
+*/
+int modeParseVideo(const char *format, const char *resolution, freenect_frame_mode *mode);
+int modeParseDepth(const char *format, freenect_frame_mode *mode);
+const char *modeVideoName(freenect_video_format format);
+const char *modeDepthName(freenect_depth_format format);
+const char *modeResolutionName(freenect_resolution resolution);
+int modeMaxDepthBytes();
+size_t modeVideoUploadBytes(const freenect_frame_mode *mode);
+size_t modeMaxVideoBytes(int upload);
+
+uint16_t modeDepthNoData(freenect_depth_format format);
+int modeDepthPackedBits(freenect_depth_format format);
+void modeDepthIndex(freenect_depth_format format, int *shift_left, int *shift);
+
+#endif
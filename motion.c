@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "motion.h"
+#include "dbg.h"
+
+#define MOTION_DEFAULT_THRESHOLD 300
+#define MOTION_DEFAULT_HOLD 30
+
+int motionGateInit(motion_gate *g, int width, int height){
+  memset(g, 0, sizeof(*g));
+  g->width = width;
+  g->height = height;
+  g->rows = height / MOTION_ROW_STEP;
+  g->threshold = MOTION_DEFAULT_THRESHOLD;
+  g->hold = MOTION_DEFAULT_HOLD;
+  g->reset = 1;
+  stageTimerInit(&g->timer, "motion gate");
+  check (posix_memalign((void **) &g->bg, 64, (size_t) g->rows * width * sizeof(int16_t)) == 0,
+         "Could not allocate the motion background.");
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+void motionGateFree(motion_gate *g){
+  free (g->bg);
+  g->bg = NULL;
+}
+
+static inline void sadRow(const uint16_t *cur, int16_t *back, int x, int width, uint16_t no_data,
+                          uint64_t *sad, uint32_t *valid){
+  for (; x < width; x++){
+    int c = cur[x], b = back[x];
+    int d = c > b ? c - b : b - c, step;
+    if (c == no_data)
+      continue;
+    if (b == (int16_t) no_data){
+      back[x] = c;
+      continue;
+    }
+    *sad += d < MOTION_CLAMP ? d : MOTION_CLAMP;
+    (*valid)++;
+    step = (c - b) >> (d >= MOTION_CLAMP ? MOTION_SLOW_SHIFT : MOTION_FAST_SHIFT);
+    back[x] = b + (step == 0 && c > b ? 1 : step);
+  }
+}
+
+/*
+  Depth values fit in 15 bits, so the differences fit a signed 16 bit lane
+  and the signed min/max give the absolute value. The background moves by
+  an arithmetic shift of the difference, slow where the difference reached
+  the clamp and at least one unit so it settles on a still scene exactly,
+  which the scalar loop repeats bit for bit: where one side has no
+  data nothing is counted, an empty background takes the sample and a hole
+  leaves the background alone.
+*/
+void motionSad(const uint16_t *in, int16_t *bg, int width, int rows, int stride, uint16_t no_data,
+               uint64_t *sad, uint32_t *valid){
+  uint64_t s = 0;
+  uint32_t v = 0;
+  int x, y;
+
+  for (y = 0; y < rows; y++){
+    const uint16_t *cur = in + (size_t) y * stride;
+    int16_t *back = bg + (size_t) y * width;
+    x = 0;
+#ifdef __SSE2__
+    const __m128i nd = _mm_set1_epi16(no_data);
+    const __m128i clamp = _mm_set1_epi16(MOTION_CLAMP);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i fast = _mm_cvtsi32_si128(MOTION_FAST_SHIFT);
+    const __m128i slow = _mm_cvtsi32_si128(MOTION_SLOW_SHIFT);
+    __m128i acc = _mm_setzero_si128(), cnt = _mm_setzero_si128();
+    for (; x + 8 <= width; x += 8){
+      __m128i c = _mm_loadu_si128((const __m128i *)(cur + x));
+      __m128i b = _mm_loadu_si128((const __m128i *)(back + x));
+      __m128i c_nd = _mm_cmpeq_epi16(c, nd);
+      __m128i b_nd = _mm_cmpeq_epi16(b, nd);
+      __m128i hole = _mm_or_si128(c_nd, b_nd);
+      __m128i d = _mm_sub_epi16(_mm_max_epi16(c, b), _mm_min_epi16(c, b));
+      __m128i fg = _mm_cmpgt_epi16(d, _mm_sub_epi16(clamp, ones));
+      __m128i diff = _mm_sub_epi16(c, b);
+
+      d = _mm_andnot_si128(hole, _mm_min_epi16(d, clamp));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(d, ones));
+      cnt = _mm_sub_epi16(cnt, _mm_andnot_si128(hole, _mm_set1_epi16(-1)));
+
+      __m128i step = _mm_or_si128(_mm_andnot_si128(fg, _mm_sra_epi16(diff, fast)),
+                                  _mm_and_si128(fg, _mm_sra_epi16(diff, slow)));
+      step = _mm_sub_epi16(step, _mm_and_si128(_mm_cmpeq_epi16(step, _mm_setzero_si128()),
+                                               _mm_cmpgt_epi16(diff, _mm_setzero_si128())));
+      __m128i upd = _mm_add_epi16(b, step);
+      upd = _mm_or_si128(_mm_andnot_si128(c_nd, upd), _mm_and_si128(c_nd, b));
+      upd = _mm_or_si128(_mm_andnot_si128(b_nd, upd), _mm_and_si128(b_nd, c));
+      _mm_storeu_si128((__m128i *)(back + x), upd);
+    }
+    // At most width / 8 per lane, so the 16 bit counts cannot wrap.
+    cnt = _mm_madd_epi16(cnt, ones);
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    cnt = _mm_add_epi32(cnt, _mm_shuffle_epi32(cnt, _MM_SHUFFLE(1, 0, 3, 2)));
+    cnt = _mm_add_epi32(cnt, _mm_shuffle_epi32(cnt, _MM_SHUFFLE(2, 3, 0, 1)));
+    s += (uint32_t) _mm_cvtsi128_si32(acc);
+    v += (uint32_t) _mm_cvtsi128_si32(cnt);
+#endif
+    sadRow(cur, back, x, width, no_data, &s, &v);
+  }
+  *sad = s;
+  *valid = v;
+}
+
+void motionSadScalar(const uint16_t *in, int16_t *bg, int width, int rows, int stride, uint16_t no_data,
+                     uint64_t *sad, uint32_t *valid){
+  uint64_t s = 0;
+  uint32_t v = 0;
+  int y;
+
+  for (y = 0; y < rows; y++)
+    sadRow(in + (size_t) y * stride, bg + (size_t) y * width, 0, width, no_data, &s, &v);
+  *sad = s;
+  *valid = v;
+}
+
+static void motionBand(void *arg, int band, int y0, int y1){
+  motion_gate *g = arg;
+  motionSad(g->in + (size_t) y0 * MOTION_ROW_STEP * g->width, g->bg + (size_t) y0 * g->width, g->width, y1 - y0,
+            g->width * MOTION_ROW_STEP, g->no_data, &g->band_sad[band], &g->band_valid[band]);
+}
+
+static void fillNoData(int16_t *bg, size_t n, uint16_t no_data){
+  size_t i;
+  for (i = 0; i < n; i++)
+    bg[i] = no_data;
+}
+
+// Score one full depth frame and move the gate. Runs on the depth thread.
+void motionGateUpdate(motion_gate *g, work_pool *pool, const uint16_t *depth, uint16_t no_data){
+  uint64_t start = nowNs(), sad = 0;
+  uint32_t valid = 0;
+  int b, y0, y1, hold;
+
+  if (__atomic_exchange_n(&g->reset, 0, __ATOMIC_ACQ_REL) || no_data != g->no_data){
+    fillNoData(g->bg, (size_t) g->rows * g->width, no_data);
+    g->moving = 0;
+    g->since_motion = 0;
+    __atomic_store_n(&g->open, 0, __ATOMIC_RELEASE);
+  }
+  g->in = depth;
+  g->no_data = no_data;
+  workPoolRun(pool, g->rows, motionBand, g);
+
+  for (b = 0; b < pool->bands; b++){
+    workPoolBand(g->rows, pool->bands, b, &y0, &y1);
+    if (y1 <= y0)
+      continue;
+    sad += g->band_sad[b];
+    valid += g->band_valid[b];
+  }
+  g->score = valid ? (uint32_t) (sad * 100 / valid) : 0;
+  g->moving = g->score > (uint32_t) __atomic_load_n(&g->threshold, __ATOMIC_RELAXED);
+  hold = __atomic_load_n(&g->hold, __ATOMIC_RELAXED);
+
+  if (g->moving){
+    g->since_motion = 0;
+    if (!g->open)
+      __atomic_add_fetch(&g->events, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&g->open, 1, __ATOMIC_RELEASE);
+  }
+  else if (g->open && ++g->since_motion > hold)
+    __atomic_store_n(&g->open, 0, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&g->frames, 1, __ATOMIC_RELAXED);
+  if (g->open)
+    __atomic_add_fetch(&g->open_frames, 1, __ATOMIC_RELAXED);
+  stageTimerRecord(&g->timer, nowNs() - start);
+}
+
+int motionGateOpen(motion_gate *g){
+  return __atomic_load_n(&g->open, __ATOMIC_ACQUIRE);
+}
+
+// Picked up at the next frame; negative values leave a setting as it is.
+void motionGateSet(motion_gate *g, int threshold, int hold){
+  if (threshold >= 0)
+    __atomic_store_n(&g->threshold, threshold, __ATOMIC_RELAXED);
+  if (hold >= 0)
+    __atomic_store_n(&g->hold, hold, __ATOMIC_RELAXED);
+}
+
+// Forget the background and close the gate at the next frame.
+void motionGateReset(motion_gate *g){
+  __atomic_store_n(&g->reset, 1, __ATOMIC_RELEASE);
+}
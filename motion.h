@@ -0,0 +1,67 @@
+#ifndef __motion_h__
+#define __motion_h__
+
+#include <stdint.h>
+#include "stats.h"
+#include "workpool.h"
+
+#define MOTION_ROW_STEP 4     // Rows sampled, one in four.
+#define MOTION_CLAMP 64       // Largest difference one pixel contributes, raw units.
+#define MOTION_FAST_SHIFT 4   // Background follows 1/16 of the difference,
+#define MOTION_SLOW_SHIFT 7   // and 1/128 where it reached the clamp, so a parked object fades in.
+
+/*
+  Motion gate on depth. Every MOTION_ROW_STEPth row is compared with a
+  background of the same rows: the sum of absolute differences, each
+  clamped so a few flying pixels cannot open the gate, over the pixels
+  valid in both. The score is that sum per valid pixel, in 1/100 raw units.
+
+  The same SSE2 pass moves the background towards the frame, slowly where
+  something stands out of it so a person walking through is not absorbed
+  before they leave, so the gate costs one read of a quarter of the frame
+  and runs in row bands on the work pool. The gate opens when the score passes `threshold` and closes
+  `hold` frames after the last frame over it. Settings are requested from
+  the console and read once per frame; `open` is read by the recorders.
+*/
+typedef struct {
+  int width, height;
+  int rows;              // Sampled rows.
+  int16_t *bg;           // rows x width, no data where nothing was seen yet.
+
+  int threshold;
+  int hold;
+  int reset;             // Start the background over at the next frame.
+
+  int open;
+  int moving;            // Last frame was over the threshold.
+  int since_motion;
+  uint32_t score;
+  uint64_t frames;
+  uint64_t open_frames;
+  uint64_t events;       // Times the gate opened.
+  stage_timer timer;
+
+  // The frame being scored and the per band partial sums.
+  const uint16_t *in;
+  uint16_t no_data;
+  uint64_t band_sad[WORK_POOL_MAX_THREADS + 1];
+  uint32_t band_valid[WORK_POOL_MAX_THREADS + 1];
+} motion_gate;
+
+int motionGateInit(motion_gate *g, int width, int height);
+void motionGateFree(motion_gate *g);
+void motionGateUpdate(motion_gate *g, work_pool *pool, const uint16_t *depth, uint16_t no_data);
+int motionGateOpen(motion_gate *g);
+void motionGateSet(motion_gate *g, int threshold, int hold);
+void motionGateReset(motion_gate *g);
+
+/*
+  The kernel, for `rows` sampled rows `stride` pixels apart in `in`.
+  motionSadScalar is the plain loop it is checked and benchmarked against.
+*/
+void motionSad(const uint16_t *in, int16_t *bg, int width, int rows, int stride, uint16_t no_data,
+               uint64_t *sad, uint32_t *valid);
+void motionSadScalar(const uint16_t *in, int16_t *bg, int width, int rows, int stride, uint16_t no_data,
+                     uint64_t *sad, uint32_t *valid);
+
+#endif
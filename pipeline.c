@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+#include "dbg.h"
+
+void pipelineInit(pipeline *pl, const char *name){
+  memset(pl, 0, sizeof(*pl));
+  pl->name = name;
+  stageTimerInit(&pl->total, name);
+}
+
+static pipeline_stage *addStage(pipeline *pl, const char *name, stage_fn run, void *ctx){
+  pipeline_stage *s;
+
+  if (pl->count == PIPELINE_MAX_STAGES || pl->running)
+    return NULL;
+  s = &pl->stages[pl->count++];
+  memset(s, 0, sizeof(*s));
+  s->name = name;
+  s->run = run;
+  s->ctx = ctx;
+  s->enabled = 1;
+  s->pl = pl;
+  stageTimerInit(&s->timer, name);
+  return s;
+}
+
+int pipelineAdd(pipeline *pl, const char *name, stage_fn run, void *ctx, uint32_t needs, uint32_t makes, int flags){
+  pipeline_stage *s = addStage(pl, name, run, ctx);
+
+  if (!s)
+    return 1;
+  s->needs = needs;
+  s->makes = makes;
+  s->flags = flags;
+  return 0;
+}
+
+int pipelineAddAsync(pipeline *pl, const char *name, stage_fn run, void *ctx, int queue_size){
+  pipeline_stage *s = addStage(pl, name, run, ctx);
+
+  if (!s)
+    return 1;
+  s->async = 1;
+  frameQueueInit(&s->queue, queue_size);
+  return 0;
+}
+
+static void *asyncStageThread(void *arg){
+  pipeline_stage *s = arg;
+  frame *f;
+  uint64_t start;
+
+  while (!__atomic_load_n(&s->pl->quit, __ATOMIC_ACQUIRE)){
+    // Wake up now and then to see quit.
+    if ((f = frameQueuePop(&s->queue, 100)) == NULL)
+      continue;
+    start = nowNs();
+    s->run(s->ctx, f);
+    stageTimerRecord(&s->timer, nowNs() - start);
+    frameRelease(f);
+  }
+  return NULL;
+}
+
+int pipelineStart(pipeline *pl){
+  int i, j;
+
+  check (!pl->running, "Pipeline already running.");
+  pl->quit = 0;
+  for (i = 0; i < pl->count; i++){
+    if (!pl->stages[i].async)
+      continue;
+    if (pthread_create(&pl->stages[i].thread, NULL, asyncStageThread, &pl->stages[i]) != 0)
+      break;
+  }
+  if (i < pl->count){
+    __atomic_store_n(&pl->quit, 1, __ATOMIC_RELEASE);
+    for (j = 0; j < i; j++)
+      if (pl->stages[j].async)
+        pthread_join(pl->stages[j].thread, NULL);
+  }
+  check (i == pl->count, "Could not create pipeline stage thread.");
+  pl->running = 1;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+// Joins the async stages and drops the frames still queued for them.
+void pipelineStop(pipeline *pl){
+  int i;
+
+  __atomic_store_n(&pl->quit, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < pl->count; i++){
+    if (!pl->stages[i].async)
+      continue;
+    if (pl->running)
+      pthread_join(pl->stages[i].thread, NULL);
+    frameQueueClear(&pl->stages[i].queue);
+  }
+  pl->running = 0;
+}
+
+/*
+  Decide which stages run on this frame. Backwards, an enabled stage is
+  needed when it is a sink or makes something wanted further down, and then
+  wants its own inputs; a disabled passthrough stage forwards the wants to
+  its input. Forwards, a stage only runs when its inputs were made.
+*/
+static void planFrame(pipeline *pl){
+  uint32_t wanted = 0, made = 0;
+  pipeline_stage *s;
+  int i, on;
+
+  for (i = pl->count - 1; i >= 0; i--){
+    s = &pl->stages[i];
+    on = __atomic_load_n(&s->enabled, __ATOMIC_RELAXED);
+    s->active = 0;
+    if (s->async)
+      s->active = on;
+    else if (on && (s->makes == 0 || (s->makes & wanted))){
+      s->active = 1;
+      wanted |= s->needs;
+    }
+    else if (!on && (s->flags & STAGE_PASSTHROUGH) && (s->makes & wanted))
+      wanted |= s->needs;
+  }
+  pl->wanted = wanted;
+
+  for (i = 0; i < pl->count; i++){
+    s = &pl->stages[i];
+    if (s->async)
+      continue;
+    if ((s->needs & ~made) != 0)
+      s->active = 0;
+    if (s->active || (!__atomic_load_n(&s->enabled, __ATOMIC_RELAXED) && (s->flags & STAGE_PASSTHROUGH)
+                      && (s->needs & ~made) == 0))
+      made |= s->makes;
+  }
+}
+
+/*
+  Run one frame through the stages. Async stages get a reference to it in
+  their queue; the caller keeps its own reference.
+*/
+void pipelineRun(pipeline *pl, frame *f){
+  uint64_t start = nowNs(), t;
+  pipeline_stage *s;
+  int i, stop = 0;
+
+  planFrame(pl);
+  for (i = 0; i < pl->count; i++){
+    s = &pl->stages[i];
+    if (stop || !s->active){
+      __atomic_store_n(&s->skipped, s->skipped + 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    __atomic_store_n(&s->runs, s->runs + 1, __ATOMIC_RELAXED);
+    if (s->async){
+      frameRef(f);
+      frameQueuePush(&s->queue, f);
+      continue;
+    }
+    t = nowNs();
+    stop = s->run(s->ctx, f);
+    stageTimerRecord(&s->timer, nowNs() - t);
+  }
+  stageTimerRecord(&pl->total, nowNs() - start);
+  __atomic_store_n(&pl->frames, pl->frames + 1, __ATOMIC_RELAXED);
+}
+
+// For stages with optional outputs, during pipelineRun.
+int pipelineWants(const pipeline *pl, uint32_t products){
+  return (pl->wanted & products) != 0;
+}
+
+pipeline_stage *pipelineFind(pipeline *pl, const char *name){
+  int i;
+  for (i = 0; i < pl->count; i++)
+    if (strcmp(pl->stages[i].name, name) == 0)
+      return &pl->stages[i];
+  return NULL;
+}
+
+// Picked up at the next frame. Returns 1 for an unknown stage, 2 for a required one.
+int pipelineEnable(pipeline *pl, const char *name, int on){
+  pipeline_stage *s = pipelineFind(pl, name);
+
+  if (!s)
+    return 1;
+  if (!on && (s->flags & STAGE_REQUIRED))
+    return 2;
+  __atomic_store_n(&s->enabled, on, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void pipelineResetTimers(pipeline *pl){
+  int i;
+  for (i = 0; i < pl->count; i++)
+    stageTimerReset(&pl->stages[i].timer);
+  stageTimerReset(&pl->total);
+}
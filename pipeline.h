@@ -0,0 +1,87 @@
+#ifndef __pipeline_h__
+#define __pipeline_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "framepool.h"
+#include "stats.h"
+
+#define PIPELINE_MAX_STAGES 12
+
+// Stage flags.
+#define STAGE_PASSTHROUGH 1   // Disabled, its products still count: they are its input unchanged.
+#define STAGE_REQUIRED    2   // Cannot be disabled from the console.
+
+/*
+  Runs one stage on the frame moving through the pipeline, with the context
+  it was registered with. Returns nonzero to stop the frame there.
+*/
+typedef int (*stage_fn)(void *ctx, frame *f);
+
+struct pipeline;
+
+/*
+  One step of a stream. Inline stages run in order on the thread calling
+  pipelineRun and pass their results through the stream context; `needs`
+  and `makes` name those results as bits the stream defines. A stage with
+  nothing in `makes` is a sink.
+
+  Async stages get their own thread and a bounded queue of frame
+  references; a full queue drops its oldest frame. They only read the
+  frame itself.
+
+  Inline stages are deliberately not given threads and queues of their
+  own: their products live once in the stream context rather than per
+  frame, and each already splits its loops over the band pool, so a
+  frame gets every core in one pass. Queues between them would need a
+  copy of every product per frame in flight and add a frame of latency
+  per stage, for no more throughput than the pool gives.
+*/
+typedef struct {
+  const char *name;
+  stage_fn run;
+  void *ctx;
+  uint32_t needs;
+  uint32_t makes;
+  int flags;
+  int enabled;          // Set by the console, read once per frame.
+  int active;           // Runs on the current frame.
+  uint64_t runs;
+  uint64_t skipped;     // Frames it was not needed for, or disabled on.
+  stage_timer timer;
+
+  int async;
+  frame_queue queue;
+  pthread_t thread;
+  struct pipeline *pl;
+} pipeline_stage;
+
+/*
+  Ordered stages of one stream, evaluated lazily: before every frame a
+  backwards pass marks what the enabled sinks need, so a stage whose
+  products nobody consumes is skipped, and a forward pass skips stages
+  whose inputs were not made.
+*/
+typedef struct pipeline {
+  const char *name;
+  pipeline_stage stages[PIPELINE_MAX_STAGES];
+  int count;
+  uint32_t wanted;      // Products needed downstream on the current frame.
+  int running;
+  int quit;
+  uint64_t frames;
+  stage_timer total;
+} pipeline;
+
+void pipelineInit(pipeline *pl, const char *name);
+int pipelineAdd(pipeline *pl, const char *name, stage_fn run, void *ctx, uint32_t needs, uint32_t makes, int flags);
+int pipelineAddAsync(pipeline *pl, const char *name, stage_fn run, void *ctx, int queue_size);
+int pipelineStart(pipeline *pl);
+void pipelineStop(pipeline *pl);
+void pipelineRun(pipeline *pl, frame *f);
+int pipelineWants(const pipeline *pl, uint32_t products);
+pipeline_stage *pipelineFind(pipeline *pl, const char *name);
+int pipelineEnable(pipeline *pl, const char *name, int on);
+void pipelineResetTimers(pipeline *pl);
+
+#endif
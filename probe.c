@@ -0,0 +1,253 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "probe.h"
+#include "unpack.h"
+
+/*
+  11 bit disparity to millimeters, the tangent fit commonly used for the
+  Kinect (Magnenat). It diverges near raw 1092, past the sensor's range.
+*/
+int probeDisparityMm(int raw11){
+  double mm;
+
+  if (raw11 < 0 || raw11 >= 1084)
+    return 0;
+  mm = 123.6 * tan(raw11 / 2842.5 + 1.1863);
+  return mm > 0 && mm <= PROBE_MAX_MM ? (int) (mm + 0.5) : 0;
+}
+
+// The usual calibration of the Kinect depth camera, without distortion.
+void depthIntrinsicsDefault(depth_intrinsics *k){
+  memset(k, 0, sizeof(*k));
+  k->fx = 594.21;
+  k->fy = 591.04;
+  k->cx = 339.5;
+  k->cy = 242.7;
+}
+
+/*
+  The ray through pixel u, v as x/z and y/z. The distortion is undone by
+  fixed point iteration, which converges in a few steps for a lens as mild
+  as the Kinect's.
+*/
+void depthIntrinsicsRay(const depth_intrinsics *k, double u, double v, float *x, float *y){
+  double xd = (u - k->cx) / k->fx, yd = (v - k->cy) / k->fy;
+  double xu = xd, yu = yd, r2, radial;
+  int i;
+
+  if (k->k1 != 0 || k->k2 != 0 || k->p1 != 0 || k->p2 != 0)
+    for (i = 0; i < 10; i++){
+      r2 = xu * xu + yu * yu;
+      radial = 1 + r2 * (k->k1 + r2 * k->k2);
+      xu = (xd - 2 * k->p1 * xu * yu - k->p2 * (r2 + 2 * xu * xu)) / radial;
+      yu = (yd - k->p1 * (r2 + 2 * yu * yu) - 2 * k->p2 * xu * yu) / radial;
+    }
+  *x = (float) xu;
+  *y = (float) yu;
+}
+
+void depthProbeInit(depth_probe *pr, int width, int height){
+  int i;
+
+  memset(pr, 0, sizeof(*pr));
+  pr->width = width;
+  pr->height = height;
+  pthread_mutex_init(&pr->lock, NULL);
+  stageTimerInit(&pr->timer, "depth probe");
+  for (i = 0; i < PROBE_LUT_SIZE; i++)
+    pr->lut11[i] = probeDisparityMm(i);
+  // 10 bit is the same disparity with the low bit dropped.
+  for (i = 0; i < PROBE_LUT_SIZE / 2; i++)
+    pr->lut10[i] = probeDisparityMm(i << 1);
+}
+
+void depthProbeFree(depth_probe *pr){
+  depthProbeHold(pr, NULL, 0, 0);
+}
+
+// On the depth thread, once per frame: keep `f`, let the previous one go.
+void depthProbeHold(depth_probe *pr, frame *f, int packed_bits, uint16_t no_data){
+  frame *old;
+
+  if (f)
+    frameRef(f);
+  pthread_mutex_lock(&pr->lock);
+  old = pr->latest;
+  pr->latest = f;
+  pr->packed_bits = packed_bits;
+  pr->no_data = no_data;
+  pthread_mutex_unlock(&pr->lock);
+  frameRelease(old);
+}
+
+typedef struct {
+  frame *f;
+  int packed_bits;
+  uint16_t no_data;
+  const uint16_t *lut;
+  int lut_size;
+} probe_view;
+
+// Raw to millimeters for the format with this no-data code, NULL when it already is in millimeters.
+const uint16_t *depthProbeTable(const depth_probe *pr, uint16_t no_data, int *size){
+  *size = no_data == 2047 ? PROBE_LUT_SIZE : PROBE_LUT_SIZE / 2;
+  return no_data == 2047 ? pr->lut11 : no_data == 1023 ? pr->lut10 : NULL;
+}
+
+static int takeLatest(depth_probe *pr, probe_view *v){
+  pthread_mutex_lock(&pr->lock);
+  v->f = pr->latest;
+  if (v->f)
+    frameRef(v->f);
+  v->packed_bits = pr->packed_bits;
+  v->no_data = pr->no_data;
+  pthread_mutex_unlock(&pr->lock);
+  v->lut = depthProbeTable(pr, v->no_data, &v->lut_size);
+  return v->f ? 0 : 1;
+}
+
+static inline int pixelMm(const probe_view *v, int index){
+  uint16_t raw = v->packed_bits ? unpackDepthPixel(v->f->data, v->packed_bits, index)
+                                : ((const uint16_t *) v->f->data)[index];
+
+  if (raw == v->no_data)
+    return 0;
+  if (!v->lut)
+    return raw;
+  return raw < v->lut_size ? v->lut[raw] : 0;
+}
+
+static uint64_t release(const probe_view *v, probe_result *out){
+  uint64_t now = nowNs();
+
+  out->seq = v->f->seq;
+  out->age_ns = now > v->f->host_ns ? now - v->f->host_ns : 0;
+  frameRelease(v->f);
+  return now;
+}
+
+// Counts a query answered; the floor fit's samples are not queries.
+static void finish(depth_probe *pr, const probe_view *v, probe_result *out, uint64_t start){
+  uint64_t now = release(v, out);
+
+  __atomic_add_fetch(&pr->probes, 1, __ATOMIC_RELAXED);
+  stageTimerRecord(&pr->timer, now - start);
+}
+
+// 0 with a result, 1 before the first frame, 2 outside the frame.
+int depthProbePoint(depth_probe *pr, int x, int y, probe_result *out){
+  uint64_t start = nowNs();
+  probe_view v;
+
+  if (x < 0 || y < 0 || x >= pr->width || y >= pr->height)
+    return 2;
+  if (takeLatest(pr, &v) != 0)
+    return 1;
+  memset(out, 0, sizeof(*out));
+  out->x = x;
+  out->y = y;
+  out->w = out->h = out->total = 1;
+  out->mm = out->min = out->max = pixelMm(&v, y * pr->width + x);
+  out->valid = out->mm != 0;
+  finish(pr, &v, out, start);
+  return 0;
+}
+
+// k-th smallest of `n` values, reordering them.
+static int selectKth(uint16_t *a, int n, int k){
+  int lo = 0, hi = n - 1, i, j;
+  uint16_t pivot, t;
+
+  while (lo < hi){
+    pivot = a[lo + (hi - lo) / 2];
+    i = lo;
+    j = hi;
+    while (i <= j){
+      while (a[i] < pivot) i++;
+      while (a[j] > pivot) j--;
+      if (i <= j){
+        t = a[i]; a[i] = a[j]; a[j] = t;
+        i++;
+        j--;
+      }
+    }
+    if (k <= j) hi = j;
+    else if (k >= i) lo = i;
+    else break;
+  }
+  return a[k];
+}
+
+/*
+  Median, min and max over the pixels of the region with a reading; the
+  region is clipped to the frame. Same returns as depthProbePoint, and 3
+  when out of memory.
+*/
+int depthProbeRoi(depth_probe *pr, int x, int y, int w, int h, probe_result *out){
+  uint64_t start = nowNs();
+  probe_view v;
+  uint16_t *vals;
+  int row, col, mm, n = 0;
+
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > pr->width) w = pr->width - x;
+  if (y + h > pr->height) h = pr->height - y;
+  if (w <= 0 || h <= 0)
+    return 2;
+  if ((vals = malloc((size_t) w * h * sizeof(uint16_t))) == NULL)
+    return 3;
+  if (takeLatest(pr, &v) != 0){
+    free (vals);
+    return 1;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->x = x;
+  out->y = y;
+  out->w = w;
+  out->h = h;
+  out->total = w * h;
+  out->min = 1 << 16;
+  for (row = y; row < y + h; row++)
+    for (col = x; col < x + w; col++){
+      if ((mm = pixelMm(&v, row * pr->width + col)) == 0)
+        continue;
+      vals[n++] = mm;
+      if (mm < out->min) out->min = mm;
+      if (mm > out->max) out->max = mm;
+    }
+  out->valid = n;
+  if (n)
+    out->mm = selectKth(vals, n, n / 2);
+  else
+    out->min = 0;
+  free (vals);
+  finish(pr, &v, out, start);
+  return 0;
+}
+
+/*
+  Millimeters at every `step`th pixel of the latest frame, the center of
+  each step x step cell, row by row into `mm`; 0 where there is no
+  reading. `meta` gets the frame and the count of readings. Not counted
+  as a query, the floor fit calls it.
+*/
+int depthProbeSample(depth_probe *pr, int step, uint16_t *mm, probe_result *meta){
+  probe_view v;
+  int gx, gy, cols = pr->width / step, rows = pr->height / step, n = 0;
+
+  if (takeLatest(pr, &v) != 0)
+    return 1;
+  memset(meta, 0, sizeof(*meta));
+  meta->w = cols;
+  meta->h = rows;
+  meta->total = cols * rows;
+  for (gy = 0; gy < rows; gy++)
+    for (gx = 0; gx < cols; gx++)
+      n += (*mm++ = pixelMm(&v, (gy * step + step / 2) * pr->width + gx * step + step / 2)) != 0;
+  meta->valid = n;
+  release(&v, meta);
+  return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef __probe_h__
+#define __probe_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "framepool.h"
+#include "stats.h"
+
+#define PROBE_LUT_SIZE 2048
+#define PROBE_MAX_MM 10000     // Disparity past this range is reported as no reading.
+
+/*
+  Pinhole model of the depth camera, in pixels of a 640x480 frame, with
+  Brown's lens distortion: k1 and k2 radial, p1 and p2 tangential, zero
+  for an ideal lens.
+*/
+typedef struct {
+  double fx, fy;
+  double cx, cy;
+  double k1, k2;
+  double p1, p2;
+} depth_intrinsics;
+
+// One query: the pixel, or the median, min and max over a region.
+typedef struct {
+  int x, y, w, h;
+  int mm;                // 0 when no pixel had a reading.
+  int min, max;
+  int valid, total;
+  uint64_t seq;          // Frame it was read from.
+  uint64_t age_ns;       // Since that frame arrived.
+} probe_result;
+
+/*
+  Millimeter queries against the latest depth frame. The probe stage keeps
+  a reference to the frame and its format instead of copying it, so a
+  query reads only the pixels it asks for, unpacking packed formats one
+  pixel at a time, and converts them through a table built once per
+  format. `lock` is held to swap or take a reference to `latest`, never
+  while reading it; queries never touch the display buffers.
+
+  The no-data code tells the formats apart: 2047 is 11 bit disparity,
+  1023 is 10 bit, and 0 is one of the millimeter formats, which need no
+  table.
+*/
+typedef struct {
+  int width, height;
+  pthread_mutex_t lock;
+  frame *latest;
+  int packed_bits;
+  uint16_t no_data;
+
+  uint16_t lut11[PROBE_LUT_SIZE];
+  uint16_t lut10[PROBE_LUT_SIZE / 2];
+
+  uint64_t probes;
+  stage_timer timer;
+} depth_probe;
+
+void depthProbeInit(depth_probe *pr, int width, int height);
+void depthProbeFree(depth_probe *pr);
+void depthProbeHold(depth_probe *pr, frame *f, int packed_bits, uint16_t no_data);
+int depthProbePoint(depth_probe *pr, int x, int y, probe_result *out);
+int depthProbeRoi(depth_probe *pr, int x, int y, int w, int h, probe_result *out);
+int depthProbeSample(depth_probe *pr, int step, uint16_t *mm, probe_result *meta);
+int probeDisparityMm(int raw11);
+const uint16_t *depthProbeTable(const depth_probe *pr, uint16_t no_data, int *size);
+void depthIntrinsicsDefault(depth_intrinsics *k);
+void depthIntrinsicsRay(const depth_intrinsics *k, double u, double v, float *x, float *y);
+
+#endif
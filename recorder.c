@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "recorder.h"
+#include "dbg.h"
+
+#define RECORD_IO_BUF (1 << 20)
+
+static int recordStage(void *ctx, frame *f);
+
+// Registers the stage, so before the pipeline starts.
+int recorderInit(recorder *r, const char *stream, pipeline *pl, motion_gate *gate, record_notify_fn notify){
+  memset(r, 0, sizeof(*r));
+  r->stream = stream;
+  r->pl = pl;
+  r->gate = gate;
+  r->notify = notify;
+  pthread_mutex_init(&r->lock, NULL);
+  stageTimerInit(&r->write, "record write");
+  r->io_buf = malloc(RECORD_IO_BUF);
+  check_mem(r->io_buf);
+  check (pipelineAddAsync(pl, "record", recordStage, r, RECORD_QUEUE) == 0, "No room for the record stage.");
+  pipelineEnable(pl, "record", 0);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  recorderFree(r);
+  return 1;
+}
+
+void recorderFree(recorder *r){
+  recorderStop(r);
+  free (r->io_buf);
+  r->io_buf = NULL;
+}
+
+void recorderHeaderDepth(const freenect_frame_mode *mode, krec_header *hdr){
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, "KREC", 4);
+  hdr->version = KREC_VERSION;
+  hdr->stream = KREC_DEPTH;
+  hdr->format = mode->depth_format;
+  hdr->width = mode->width;
+  hdr->height = mode->height;
+  hdr->frame_bytes = mode->bytes;
+}
+
+void recorderHeaderVideo(const freenect_frame_mode *mode, krec_header *hdr){
+  recorderHeaderDepth(mode, hdr);
+  hdr->stream = KREC_VIDEO;
+  hdr->format = mode->video_format;
+}
+
+int recorderArmed(recorder *r){
+  return __atomic_load_n(&r->armed, __ATOMIC_ACQUIRE);
+}
+
+/*
+  Arm the recorder; clips are named `<prefix>-<stream>-<seq>.krec` after
+  the first frame in them. `preroll` may be 0.
+*/
+int recorderStart(recorder *r, const krec_header *hdr, const char *prefix, int preroll){
+  check (preroll >= 0 && preroll <= RECORD_MAX_PREROLL, "Pre-roll is 0 to 90 frames.");
+  check (strlen(prefix) > 0 && strlen(prefix) < RECORD_PATH_LEN, "Record path too long.");
+
+  pthread_mutex_lock(&r->lock);
+  if (r->armed){
+    pthread_mutex_unlock(&r->lock);
+    check (0, "Already recording this stream.");
+  }
+  r->ring = preroll ? malloc((size_t) preroll * hdr->frame_bytes) : NULL;
+  r->ring_meta = preroll ? malloc(preroll * sizeof(krec_frame)) : NULL;
+  if (preroll && (!r->ring || !r->ring_meta)){
+    free (r->ring);
+    free (r->ring_meta);
+    r->ring = NULL;
+    r->ring_meta = NULL;
+    pthread_mutex_unlock(&r->lock);
+    check (0, "Not enough memory for the pre-roll.");
+  }
+  r->hdr = *hdr;
+  snprintf(r->prefix, sizeof(r->prefix), "%s", prefix);
+  r->preroll = preroll;
+  r->ring_head = r->ring_count = 0;
+  __atomic_store_n(&r->armed, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&r->lock);
+  pipelineEnable(r->pl, "record", 1);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+static int writeFrame(recorder *r, const krec_frame *meta, const uint8_t *data){
+  uint64_t start = nowNs();
+  int err = fwrite(meta, sizeof(*meta), 1, r->out) != 1 || fwrite(data, 1, meta->bytes, r->out) != meta->bytes;
+
+  stageTimerRecord(&r->write, nowNs() - start);
+  if (err)
+    return 1;
+  r->clip_frames++;
+  __atomic_add_fetch(&r->recorded, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void clipReport(recorder *r, const char *what){
+  char line[RECORD_PATH_LEN + 128];
+
+  if (!r->notify)
+    return;
+  snprintf(line, sizeof(line), "Record %s: %d frames, %d pre-roll, %s %s", r->stream, (int) r->clip_frames,
+           r->clip_preroll, what, r->path);
+  r->notify(line);
+}
+
+/*
+  Under `lock`. The clip is durable once the data is synced; `err` reports
+  a clip that already failed, or one that could not be opened.
+*/
+static void closeClip(recorder *r, int err){
+  if (!r->out && !err)
+    return;
+  if (r->out){
+    err |= fflush(r->out) != 0;
+    err |= fsync(fileno(r->out)) != 0;
+    err |= fclose(r->out) != 0;
+    r->out = NULL;
+  }
+  if (err)
+    __atomic_add_fetch(&r->failed, 1, __ATOMIC_RELAXED);
+  clipReport(r, err ? "failed writing" : "saved to");
+}
+
+// Opens a clip and flushes the ring into it, oldest frame first.
+static int openClip(recorder *r, const frame *f){
+  uint64_t first = r->ring_count ? r->ring_meta[(r->ring_head + r->preroll - r->ring_count) % r->preroll].seq : f->seq;
+  int i, slot;
+
+  snprintf(r->path, sizeof(r->path), "%s-%s-%06llu.krec", r->prefix, r->stream, (unsigned long long) first);
+  if ((r->out = fopen(r->path, "wb")) == NULL)
+    return 1;
+  setvbuf(r->out, r->io_buf, _IOFBF, RECORD_IO_BUF);
+  r->clip_frames = 0;
+  r->clip_preroll = r->ring_count;
+  if (fwrite(&r->hdr, sizeof(r->hdr), 1, r->out) != 1)
+    return 1;
+  for (i = r->ring_count; i > 0; i--){
+    slot = (r->ring_head + r->preroll - i) % r->preroll;
+    if (writeFrame(r, &r->ring_meta[slot], r->ring + (size_t) slot * r->hdr.frame_bytes) != 0)
+      return 1;
+  }
+  r->ring_count = 0;
+  __atomic_add_fetch(&r->clips, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void ringPush(recorder *r, const frame *f, const krec_frame *meta){
+  if (r->preroll == 0){
+    __atomic_add_fetch(&r->skipped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  memcpy(r->ring + (size_t) r->ring_head * r->hdr.frame_bytes, f->data, meta->bytes);
+  r->ring_meta[r->ring_head] = *meta;
+  r->ring_head = (r->ring_head + 1) % r->preroll;
+  if (r->ring_count == r->preroll)
+    __atomic_add_fetch(&r->skipped, 1, __ATOMIC_RELAXED);
+  else
+    r->ring_count++;
+}
+
+// Under `lock`. Frames still in the ring were never recorded.
+static void disarm(recorder *r){
+  __atomic_add_fetch(&r->skipped, r->ring_count, __ATOMIC_RELAXED);
+  free (r->ring);
+  free (r->ring_meta);
+  r->ring = NULL;
+  r->ring_meta = NULL;
+  r->ring_count = 0;
+  __atomic_store_n(&r->armed, 0, __ATOMIC_RELEASE);
+}
+
+void recorderStop(recorder *r){
+  pipelineEnable(r->pl, "record", 0);
+  pthread_mutex_lock(&r->lock);
+  if (r->armed){
+    closeClip(r, 0);
+    disarm(r);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+// A write error stops recording rather than retrying on every frame.
+static int recordStage(void *ctx, frame *f){
+  recorder *r = ctx;
+  krec_frame meta;
+  int open = motionGateOpen(r->gate);
+
+  pthread_mutex_lock(&r->lock);
+  // Stopped with frames still queued, or a frame of another mode.
+  if (!r->armed || f->bytes != r->hdr.frame_bytes){
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+  }
+  meta.seq = f->seq;
+  meta.host_ns = f->host_ns;
+  meta.timestamp = f->timestamp;
+  meta.bytes = f->bytes;
+
+  if (!r->out && open && openClip(r, f) != 0)
+    goto fail;
+  if (!r->out)
+    ringPush(r, f, &meta);
+  else if (writeFrame(r, &meta, f->data) != 0)
+    goto fail;
+  else if (!open)
+    closeClip(r, 0);
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+
+ fail:
+  closeClip(r, 1);
+  disarm(r);
+  pipelineEnable(r->pl, "record", 0);
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
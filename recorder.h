@@ -0,0 +1,95 @@
+#ifndef __recorder_h__
+#define __recorder_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "libfreenect.h"
+#include "motion.h"
+#include "pipeline.h"
+#include "stats.h"
+
+#define RECORD_QUEUE 4
+#define RECORD_MAX_PREROLL 90
+#define RECORD_PATH_LEN 200
+
+#define KREC_VERSION 1
+#define KREC_DEPTH 0
+#define KREC_VIDEO 1
+
+/*
+  A .krec file is this header and then every frame as a krec_frame followed
+  by `bytes` of raw data exactly as the driver delivered it, packed depth
+  still packed. Fields are in host byte order.
+*/
+typedef struct {
+  char magic[4];        // "KREC"
+  uint32_t version;
+  uint32_t stream;      // KREC_DEPTH or KREC_VIDEO
+  uint32_t format;      // freenect_depth_format or freenect_video_format
+  uint32_t width, height;
+  uint32_t frame_bytes;
+  uint32_t reserved;
+} krec_header;
+
+typedef struct {
+  uint64_t seq;
+  uint64_t host_ns;
+  uint32_t timestamp;
+  uint32_t bytes;
+} krec_frame;
+
+// Clip reports for the console, called on the record thread.
+typedef void (*record_notify_fn)(const char *line);
+
+/*
+  Motion gated recording of one stream, an async stage of its pipeline.
+  While the gate is closed every frame is copied into a ring of the last
+  `preroll` frames and goes no further; when the gate opens a clip file is
+  started with the ring and then takes the live frames until the gate
+  closes again, when it is synced and reported.
+
+  The ring is a copy so it does not hold pool frames the stream needs, and
+  is allocated when recording starts, `preroll` frames and no more. `lock`
+  is held by the stage for each frame and by start and stop, so stopping
+  closes the clip on the spot even with the stream paused.
+*/
+typedef struct {
+  const char *stream;
+  pipeline *pl;
+  motion_gate *gate;
+  record_notify_fn notify;
+  pthread_mutex_t lock;
+
+  // Set by recorderStart.
+  int armed;
+  krec_header hdr;
+  char prefix[RECORD_PATH_LEN];
+  int preroll;
+
+  uint8_t *ring;        // preroll frames of hdr.frame_bytes.
+  krec_frame *ring_meta;
+  int ring_head, ring_count;
+
+  FILE *out;
+  char path[RECORD_PATH_LEN + 32];
+  char *io_buf;
+  uint64_t clip_frames;
+  int clip_preroll;
+
+  uint64_t recorded;    // Written to clips.
+  uint64_t skipped;     // Aged out of the ring without motion.
+  uint64_t clips;
+  uint64_t failed;
+  stage_timer write;
+} recorder;
+
+int recorderInit(recorder *r, const char *stream, pipeline *pl, motion_gate *gate, record_notify_fn notify);
+void recorderFree(recorder *r);
+int recorderStart(recorder *r, const krec_header *hdr, const char *prefix, int preroll);
+void recorderStop(recorder *r);
+int recorderArmed(recorder *r);
+void recorderHeaderDepth(const freenect_frame_mode *mode, krec_header *hdr);
+void recorderHeaderVideo(const freenect_frame_mode *mode, krec_header *hdr);
+
+#endif
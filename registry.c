@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include "registry.h"
+
+// In the order they are listed.
+static const struct {
+  freenect_device_flags flag;
+  const char *name;
+} subdevices[REGISTRY_SUBDEVICES] = {
+  { FREENECT_DEVICE_MOTOR, "Angle Motor" },
+  { FREENECT_DEVICE_CAMERA, "Camera" },
+  { FREENECT_DEVICE_AUDIO, "Audio" },
+};
+
+void registryInit(device_registry *r){
+  memset(r, 0, sizeof(*r));
+  pthread_mutex_init(&r->lock, NULL);
+  stageTimerInit(&r->scan, "device scan");
+}
+
+/*
+  Walk the bus once and keep the serials, freeing the attribute list.
+  Returns the number of devices, -1 when enumeration failed and the cache
+  was left as it was.
+*/
+int registryScan(device_registry *r, freenect_context *ctx){
+  struct freenect_device_attributes *list = NULL, *a;
+  uint64_t start = nowNs();
+  int n, count = 0;
+
+  n = freenect_list_device_attributes(ctx, &list);
+  pthread_mutex_lock(&r->lock);
+  if (n >= 0){
+    for (a = list; a && count < REGISTRY_MAX_DEVICES; a = a->next, count++){
+      snprintf(r->devices[count].serial, REGISTRY_SERIAL_LEN, "%s", a->camera_serial ? a->camera_serial : "");
+      r->devices[count].index = count;
+    }
+    r->count = count;
+    r->supported = freenect_supported_subdevices();
+    r->valid = 1;
+  }
+  r->scans++;
+  pthread_mutex_unlock(&r->lock);
+  if (list)
+    freenect_free_device_attributes(list);
+  stageTimerRecord(&r->scan, nowNs() - start);
+  return n >= 0 ? count : -1;
+}
+
+// Scans only when nothing is cached; returns the device count.
+int registryEnsure(device_registry *r, freenect_context *ctx){
+  int count;
+
+  pthread_mutex_lock(&r->lock);
+  count = r->valid ? r->count : -1;
+  pthread_mutex_unlock(&r->lock);
+  return count >= 0 ? count : registryScan(r, ctx);
+}
+
+// The bus changed under us, the next lookup scans again.
+void registryInvalidate(device_registry *r){
+  pthread_mutex_lock(&r->lock);
+  r->valid = 0;
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Index of the device with `serial`, -1 when the cache does not have it.
+int registryFind(device_registry *r, freenect_context *ctx, const char *serial){
+  int i, index = -1;
+
+  registryEnsure(r, ctx);
+  pthread_mutex_lock(&r->lock);
+  r->lookups++;
+  for (i = 0; i < r->count; i++)
+    if (strcmp(r->devices[i].serial, serial) == 0){
+      index = r->devices[i].index;
+      break;
+    }
+  pthread_mutex_unlock(&r->lock);
+  return index;
+}
+
+// Copies the serial of device `index`, returns 1 when there is none.
+int registrySerial(device_registry *r, freenect_context *ctx, int index, char *serial, size_t len){
+  int res = 1;
+
+  registryEnsure(r, ctx);
+  pthread_mutex_lock(&r->lock);
+  r->lookups++;
+  serial[0] = '\0';
+  if (index >= 0 && index < r->count){
+    snprintf(serial, len, "%s", r->devices[index].serial);
+    res = 0;
+  }
+  pthread_mutex_unlock(&r->lock);
+  return res;
+}
+
+// Splits freenect subdevice flags into `out`, which holds REGISTRY_SUBDEVICES; returns how many.
+int subdeviceList(int flags, freenect_device_flags *out){
+  int i, n = 0;
+
+  for (i = 0; i < REGISTRY_SUBDEVICES; i++)
+    if (flags & subdevices[i].flag)
+      out[n++] = subdevices[i].flag;
+  return n;
+}
+
+const char *subdeviceName(freenect_device_flags flag){
+  int i;
+
+  for (i = 0; i < REGISTRY_SUBDEVICES; i++)
+    if (subdevices[i].flag == flag)
+      return subdevices[i].name;
+  return "Unknown subdevice";
+}
@@ -0,0 +1,47 @@
+#ifndef __registry_h__
+#define __registry_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libfreenect.h"
+#include "stats.h"
+
+#define REGISTRY_MAX_DEVICES 16
+#define REGISTRY_SERIAL_LEN 32
+#define REGISTRY_SUBDEVICES 3
+
+typedef struct {
+  char serial[REGISTRY_SERIAL_LEN];
+  int index;              // For freenect_open_device.
+} registry_device;
+
+/*
+  The Kinects on the bus as of the last scan, so lookups and listings do
+  not walk USB. A scan runs on first use, on `scan`, and when the
+  device thread loses or looks for a device; everything else reads the
+  cache. `lock` covers the table, the console and the device thread both
+  use it.
+*/
+typedef struct {
+  pthread_mutex_t lock;
+  int valid;
+  int count;
+  registry_device devices[REGISTRY_MAX_DEVICES];
+  int supported;          // freenect_supported_subdevices(), fixed for the build.
+
+  uint64_t scans;
+  uint64_t lookups;
+  stage_timer scan;
+} device_registry;
+
+void registryInit(device_registry *r);
+int registryScan(device_registry *r, freenect_context *ctx);
+int registryEnsure(device_registry *r, freenect_context *ctx);
+void registryInvalidate(device_registry *r);
+int registryFind(device_registry *r, freenect_context *ctx, const char *serial);
+int registrySerial(device_registry *r, freenect_context *ctx, int index, char *serial, size_t len);
+
+int subdeviceList(int flags, freenect_device_flags *out);
+const char *subdeviceName(freenect_device_flags flag);
+
+#endif
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#include "rtsched.h"
+
+static thread_sched config[ROLE_COUNT] = {
+  { SCHED_OTHER, 0, -1 }, { SCHED_OTHER, 0, -1 }, { SCHED_OTHER, 0, -1 }, { SCHED_OTHER, 0, -1 },
+  { SCHED_OTHER, 0, -1 }, { SCHED_OTHER, 0, -1 }, { SCHED_OTHER, 0, -1 },
+};
+
+static const char *roleNames[ROLE_COUNT] = {
+  "capture", "render", "depth", "video", "workers", "audio", "device",
+};
+
+int rtSchedParseRole(const char *name, thread_role *role){
+  int i;
+  for (i = 0; i < ROLE_COUNT; i++){
+    if (strcmp(roleNames[i], name) == 0){
+      *role = (thread_role) i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const char *rtSchedRoleName(thread_role role){
+  return role < ROLE_COUNT ? roleNames[role] : "unknown";
+}
+
+int rtSchedParsePolicy(const char *name, int *policy){
+  if (strcmp(name, "other") == 0)
+    *policy = SCHED_OTHER;
+  else if (strcmp(name, "fifo") == 0)
+    *policy = SCHED_FIFO;
+  else if (strcmp(name, "rr") == 0)
+    *policy = SCHED_RR;
+  else
+    return 1;
+  return 0;
+}
+
+const char *rtSchedPolicyName(int policy){
+  switch (policy){
+  case SCHED_FIFO:
+    return "fifo";
+  case SCHED_RR:
+    return "rr";
+  default:
+    return "other";
+  }
+}
+
+int rtSchedSet(thread_role role, int policy, int priority, int cpu){
+  if (role >= ROLE_COUNT)
+    return 1;
+  if (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy))
+    return 1;
+  if (cpu < -1 || cpu >= get_nprocs())
+    return 1;
+  config[role].policy = policy;
+  config[role].priority = priority;
+  config[role].cpu = cpu;
+  return 0;
+}
+
+const thread_sched *rtSchedGet(thread_role role){
+  return &config[role];
+}
+
+// Untouched roles are left alone so threads keep what they were started with.
+int rtSchedIsDefault(thread_role role){
+  return config[role].policy == SCHED_OTHER && config[role].priority == 0 && config[role].cpu == -1;
+}
+
+/*
+  Apply `s` to a live thread, pinned to `cpu` (the caller resolves worker
+  offsets), -1 for every online CPU. Returns 0 or the errno of the first
+  call that failed: EPERM means no CAP_SYS_NICE and no rtprio limit.
+*/
+int rtSchedApply(pthread_t thread, const thread_sched *s, int cpu){
+  struct sched_param param;
+  cpu_set_t set;
+  int i, res;
+
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = s->priority;
+  if ((res = pthread_setschedparam(thread, s->policy, &param)) != 0)
+    return res;
+
+  CPU_ZERO(&set);
+  if (cpu >= 0)
+    CPU_SET(cpu, &set);
+  else
+    for (i = 0; i < get_nprocs(); i++)
+      CPU_SET(i, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
@@ -0,0 +1,37 @@
+#ifndef __rtsched_h__
+#define __rtsched_h__
+
+#include <pthread.h>
+
+/*
+  Scheduling policy, priority and CPU per thread role. Roles describe what
+  a thread does, the caller maps them to its live threads. A cpu of -1
+  lets the thread float over every online CPU.
+*/
+typedef enum {
+  ROLE_CAPTURE,   // libfreenect event loop, services USB.
+  ROLE_RENDER,
+  ROLE_DEPTH,
+  ROLE_VIDEO,
+  ROLE_WORKERS,   // Band pool, cpu is the first of consecutive CPUs.
+  ROLE_AUDIO,     // Audio writer.
+  ROLE_DEVICE,    // Tilt poller and device commands.
+  ROLE_COUNT
+} thread_role;
+
+typedef struct {
+  int policy;     // SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+  int priority;   // 0 for SCHED_OTHER, 1-99 otherwise.
+  int cpu;
+} thread_sched;
+
+int rtSchedParseRole(const char *name, thread_role *role);
+const char *rtSchedRoleName(thread_role role);
+int rtSchedParsePolicy(const char *name, int *policy);
+const char *rtSchedPolicyName(int policy);
+int rtSchedSet(thread_role role, int policy, int priority, int cpu);
+const thread_sched *rtSchedGet(thread_role role);
+int rtSchedIsDefault(thread_role role);
+int rtSchedApply(pthread_t thread, const thread_sched *s, int cpu);
+
+#endif
@@ -0,0 +1,166 @@
+#include <time.h>
+#include "stats.h"
+
+uint64_t nowNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stageTimerInit(stage_timer *t, const char *name){
+  t->name = name;
+  stageTimerReset(t);
+}
+
+void stageTimerReset(stage_timer *t){
+  int i;
+
+  __atomic_store_n(&t->last_ns, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->avg_ns, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->max_ns, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->sum_ns, 0, __ATOMIC_RELAXED);
+  for (i = 0; i < STAGE_TIMER_BINS; i++)
+    __atomic_store_n(&t->hist[i], 0, __ATOMIC_RELAXED);
+}
+
+// Bin 1 starts at 1024 ns, every octave after that is split in two.
+static int timerBin(uint64_t ns){
+  int msb, bin;
+
+  if (ns < 1024)
+    return 0;
+  msb = 63 - __builtin_clzll(ns);
+  bin = 1 + (msb - 10) * 2 + (int) ((ns >> (msb - 1)) & 1);
+  return bin < STAGE_TIMER_BINS ? bin : STAGE_TIMER_BINS - 1;
+}
+
+static uint64_t binStart(int bin){
+  if (bin == 0)
+    return 0;
+  bin--;
+  return (1ull << (10 + bin / 2)) + (bin & 1 ? 1ull << (9 + bin / 2) : 0);
+}
+
+/*
+  Interpolated inside the bin the quantile falls in, the last one reaching
+  up to the largest sample seen. 0 without samples.
+*/
+uint64_t stageTimerQuantile(const stage_timer *t, double q){
+  uint64_t counts[STAGE_TIMER_BINS], total = 0, seen = 0, lo, hi;
+  double rank;
+  int i;
+
+  for (i = 0; i < STAGE_TIMER_BINS; i++){
+    counts[i] = __atomic_load_n(&t->hist[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total == 0)
+    return 0;
+  rank = q * total;
+  for (i = 0; i < STAGE_TIMER_BINS - 1 && seen + counts[i] < rank; i++)
+    seen += counts[i];
+  lo = binStart(i);
+  hi = i < STAGE_TIMER_BINS - 1 ? binStart(i + 1) : __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED);
+  if (hi < lo)
+    hi = lo;
+  if (counts[i] == 0)
+    return lo;
+  return lo + (uint64_t) ((hi - lo) * ((rank - seen) / counts[i]));
+}
+
+void streamMeterTick(stream_meter *m, uint64_t bytes){
+  uint64_t now = nowNs();
+  uint64_t elapsed;
+
+  __atomic_store_n(&m->frames, m->frames + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->bytes, m->bytes + bytes, __ATOMIC_RELAXED);
+  if (m->window_start == 0)
+    m->window_start = now;
+  m->window_frames++;
+  m->window_bytes += bytes;
+
+  elapsed = now - m->window_start;
+  if (elapsed >= 1000000000ull){
+    __atomic_store_n(&m->fps_x100, m->window_frames * 100000000000ull / elapsed, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->bytes_per_sec, m->window_bytes * 1000000000ull / elapsed, __ATOMIC_RELAXED);
+    m->window_start = now;
+    m->window_frames = 0;
+    m->window_bytes = 0;
+  }
+}
+
+void stageTimerRecord(stage_timer *t, uint64_t ns){
+  uint64_t avg = __atomic_load_n(&t->avg_ns, __ATOMIC_RELAXED);
+  uint64_t count = __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+  int bin = timerBin(ns);
+
+  // First sample seeds the average so it does not ramp up from zero.
+  if (count == 0)
+    avg = ns;
+  else
+    avg = avg - (avg >> 4) + (ns >> 4);
+
+  __atomic_store_n(&t->last_ns, ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->avg_ns, avg, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->sum_ns, t->sum_ns + ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->hist[bin], t->hist[bin] + 1, __ATOMIC_RELAXED);
+  if (ns > __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED))
+    __atomic_store_n(&t->max_ns, ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void jitterInit(jitter_monitor *j, const char *name){
+  j->name = name;
+  j->reset = 1;
+}
+
+void jitterReset(jitter_monitor *j){
+  __atomic_store_n(&j->reset, 1, __ATOMIC_RELEASE);
+}
+
+void jitterRecord(jitter_monitor *j, uint32_t timestamp, uint64_t host_ns){
+  uint64_t dev_ns, host_d, period, jitter, elapsed_dev;
+  uint32_t ticks;
+
+  if (__atomic_load_n(&j->reset, __ATOMIC_ACQUIRE)){
+    j->first_host = host_ns;
+    j->dev_ticks = 0;
+    j->period_ns = 0;
+    __atomic_store_n(&j->frames, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->max_jitter_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->drift_ppm, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->late, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->gaps, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->reset, 0, __ATOMIC_RELAXED);
+  }
+  else{
+    ticks = timestamp - j->last_ts;   // Unsigned, survives the wrap.
+    dev_ns = ticks * 1000000000ull / JITTER_TICK_HZ;
+    host_d = host_ns - j->last_host;
+    period = j->period_ns;
+
+    if (period && dev_ns > period + period / 2)
+      __atomic_add_fetch(&j->gaps, 1, __ATOMIC_RELAXED);
+    else
+      period = period ? period - (period >> 4) + (dev_ns >> 4) : dev_ns;
+    j->period_ns = period;
+
+    jitter = host_d > dev_ns ? host_d - dev_ns : dev_ns - host_d;
+    if (jitter > j->max_jitter_ns)
+      __atomic_store_n(&j->max_jitter_ns, jitter, __ATOMIC_RELAXED);
+    if (host_d > dev_ns + period / 2)
+      __atomic_add_fetch(&j->late, 1, __ATOMIC_RELAXED);
+
+    j->dev_ticks += ticks;
+    // Split so the product stays in 64 bits for long runs.
+    elapsed_dev = j->dev_ticks / JITTER_TICK_HZ * 1000000000ull
+                + j->dev_ticks % JITTER_TICK_HZ * 1000000000ull / JITTER_TICK_HZ;
+    if (elapsed_dev > 1000000000ull)
+      __atomic_store_n(&j->drift_ppm, (int64_t) ((host_ns - j->first_host) - elapsed_dev) * 1000000 / (int64_t) elapsed_dev,
+                       __ATOMIC_RELAXED);
+  }
+  j->last_ts = timestamp;
+  j->last_host = host_ns;
+  __atomic_store_n(&j->frames, j->frames + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,81 @@
+#ifndef __stats_h__
+#define __stats_h__
+
+#include <stdint.h>
+
+#define STAGE_TIMER_BINS 40
+
+/*
+  Per stage timing, written by the thread running the stage and read by the
+  console without a lock. Every field is a 64 bit word updated with atomic
+  stores, so a reader may mix two frames but never sees a torn value.
+
+  `hist` counts samples in half octave bins from 1 us up to about 1 s, the
+  first bin holding everything shorter, for quantiles within 20%.
+*/
+typedef struct {
+  const char *name;
+  uint64_t last_ns;
+  uint64_t avg_ns;   // Exponential average, 1/16 weight for the newest frame.
+  uint64_t max_ns;
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t hist[STAGE_TIMER_BINS];
+} stage_timer;
+
+/*
+  Frame and byte rate of a stream over one second windows. Ticked by the
+  thread that receives the stream, read lock free like stage_timer.
+*/
+typedef struct {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t window_start;
+  uint64_t window_frames;
+  uint64_t window_bytes;
+  uint64_t fps_x100;      // Last complete window.
+  uint64_t bytes_per_sec;
+} stream_meter;
+
+/*
+  Frame timing of a stream: the device timestamp passed to the frame
+  callback against host arrival time. The Kinect stamps frames with a
+  counter at about JITTER_TICK_HZ, 32 bits wide, so it wraps every 71 s.
+
+  Jitter is how far the host spacing of two frames is from their device
+  spacing. A frame is late when it arrives more than half a period after
+  the device spacing predicts, and a gap is a device spacing over one and a
+  half periods, frames lost before the host saw them. Drift compares host
+  and device elapsed time since the first frame.
+
+  Written by the callback thread only; jitterReset asks it to start over
+  at the next frame.
+*/
+#define JITTER_TICK_HZ 60000000ull
+
+typedef struct {
+  const char *name;
+  uint32_t last_ts;
+  uint64_t last_host;
+  uint64_t first_host;
+  uint64_t dev_ticks;      // Since the first frame, unwrapped.
+  uint64_t frames;
+  uint64_t period_ns;      // Average device spacing.
+  uint64_t max_jitter_ns;
+  int64_t drift_ppm;
+  uint64_t late;
+  uint64_t gaps;
+  int reset;
+} jitter_monitor;
+
+uint64_t nowNs();
+void stageTimerInit(stage_timer *t, const char *name);
+void stageTimerRecord(stage_timer *t, uint64_t ns);
+void stageTimerReset(stage_timer *t);
+uint64_t stageTimerQuantile(const stage_timer *t, double q);
+void streamMeterTick(stream_meter *m, uint64_t bytes);
+void jitterInit(jitter_monitor *j, const char *name);
+void jitterReset(jitter_monitor *j);
+void jitterRecord(jitter_monitor *j, uint32_t timestamp, uint64_t host_ns);
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include "textatlas.h"
+#include "dbg.h"
+
+#define GLYPHS (TEXT_ATLAS_LAST - TEXT_ATLAS_FIRST + 1)
+#define FONT_ROWS ((GLYPHS + TEXT_ATLAS_COLS - 1) / TEXT_ATLAS_COLS)
+
+static int pow2(int n){
+  int p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+static void glyphCell(int font, int c, int *x, int *y){
+  int i = c - TEXT_ATLAS_FIRST;
+  *x = (i % TEXT_ATLAS_COLS) * TEXT_ATLAS_CELL_W;
+  *y = (font * FONT_ROWS + i / TEXT_ATLAS_COLS) * TEXT_ATLAS_CELL_H;
+}
+
+/*
+  Needs the GL context current and the scene projection set, top down with
+  one unit per pixel, in a window at least as large as the atlas. Leaves the
+  back buffer cleared.
+*/
+int textAtlasInit(text_atlas *t, void **fonts, int nfonts, int window_h){
+  int w = TEXT_ATLAS_COLS * TEXT_ATLAS_CELL_W;
+  int h = nfonts * FONT_ROWS * TEXT_ATLAS_CELL_H;
+  uint8_t *read = NULL, *pixels = NULL;
+  int f, c, x, y;
+
+  memset(t, 0, sizeof(*t));
+  stageTimerInit(&t->build, "text build");
+  stageTimerInit(&t->draw, "text draw");
+  check (nfonts > 0 && nfonts <= TEXT_ATLAS_FONTS && h <= window_h, "Text atlas does not fit the window.");
+  t->nfonts = nfonts;
+  t->tex_w = pow2(w);
+  t->tex_h = pow2(h);
+  t->verts = malloc(sizeof(float) * 16 * TEXT_ATLAS_MAX_QUADS);
+  t->colors = malloc(16 * TEXT_ATLAS_MAX_QUADS);
+  read = malloc((size_t) w * h);
+  pixels = calloc((size_t) t->tex_w * t->tex_h, 1);
+  check_mem(t->verts && t->colors && read && pixels);
+
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glPushMatrix();
+  glLoadIdentity();
+  glDisable(GL_TEXTURE_2D);
+  glColor3f(1.0f, 1.0f, 1.0f);
+  for (f = 0; f < nfonts; f++){
+    t->fonts[f] = fonts[f];
+    for (c = TEXT_ATLAS_FIRST; c <= TEXT_ATLAS_LAST; c++){
+      glyphCell(f, c, &x, &y);
+      glRasterPos2f(x + TEXT_ATLAS_PAD, y + TEXT_ATLAS_ASCENT);
+      glutBitmapCharacter(fonts[f], c);
+      t->advance[f][c] = glutBitmapWidth(fonts[f], c);
+    }
+  }
+  glPopMatrix();
+
+  // Window rows count from the bottom, atlas rows from the top.
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadBuffer(GL_BACK);
+  glReadPixels(0, window_h - h, w, h, GL_RED, GL_UNSIGNED_BYTE, read);
+  glClear(GL_COLOR_BUFFER_BIT);
+  check (glGetError() == GL_NO_ERROR, "Could not read the glyphs back.");
+  for (y = 0; y < h; y++)
+    memcpy(pixels + (size_t) y * t->tex_w, read + (size_t) (h - 1 - y) * w, w);
+
+  glGenTextures(1, &t->tex);
+  glBindTexture(GL_TEXTURE_2D, t->tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, t->tex_w, t->tex_h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, pixels);
+  check (glGetError() == GL_NO_ERROR, "Could not upload the text atlas.");
+
+  free (read);
+  free (pixels);
+  t->ready = 1;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  free (read);
+  free (pixels);
+  textAtlasFree(t);
+  t->failed = 1;
+  return 1;
+}
+
+void textAtlasFree(text_atlas *t){
+  if (t->tex)
+    glDeleteTextures(1, &t->tex);
+  t->tex = 0;
+  free (t->verts);
+  free (t->colors);
+  t->verts = NULL;
+  t->colors = NULL;
+  t->ready = 0;
+}
+
+void textAtlasBegin(text_atlas *t){
+  t->quads = 0;
+  t->building = 1;
+  __atomic_store_n(&t->build.last_ns, nowNs(), __ATOMIC_RELAXED);
+}
+
+static uint8_t colorByte(float v){
+  return v <= 0.0f ? 0 : (v >= 1.0f ? 255 : (uint8_t) (v * 255.0f + 0.5f));
+}
+
+/*
+  Text with its baseline at (x, y) in window pixels, y down, colors
+  clamped to [0, 1] like glColor3f.
+*/
+void textAtlasAdd(text_atlas *t, float x, float y, float r, float g, float b, void *font, const char *s){
+  uint8_t rgba[4] = { colorByte(r), colorByte(g), colorByte(b), 255 };
+  float pen = x, x0, y0, u0, v0, du, dv;
+  int f, c, gx, gy, k;
+
+  if (!s)
+    return;
+  for (f = 0; f < t->nfonts && t->fonts[f] != font; f++)
+    ;
+  if (f == t->nfonts)
+    return;
+
+  du = (float) TEXT_ATLAS_CELL_W / t->tex_w;
+  dv = (float) TEXT_ATLAS_CELL_H / t->tex_h;
+  for (; *s && t->quads < TEXT_ATLAS_MAX_QUADS; s++){
+    c = (unsigned char) *s;
+    if (c < TEXT_ATLAS_FIRST || c > TEXT_ATLAS_LAST)
+      c = ' ';
+    if (c != ' '){
+      float *v = t->verts + t->quads * 16;
+      glyphCell(f, c, &gx, &gy);
+      x0 = pen - TEXT_ATLAS_PAD;
+      y0 = y - TEXT_ATLAS_ASCENT;
+      u0 = (float) gx / t->tex_w;
+      v0 = (float) gy / t->tex_h;
+      v[0] = x0;                     v[1] = y0;                     v[2] = u0;      v[3] = v0;
+      v[4] = x0 + TEXT_ATLAS_CELL_W; v[5] = y0;                     v[6] = u0 + du; v[7] = v0;
+      v[8] = x0 + TEXT_ATLAS_CELL_W; v[9] = y0 + TEXT_ATLAS_CELL_H; v[10] = u0 + du; v[11] = v0 + dv;
+      v[12] = x0;                    v[13] = y0 + TEXT_ATLAS_CELL_H; v[14] = u0;     v[15] = v0 + dv;
+      for (k = 0; k < 4; k++)
+        memcpy(t->colors + t->quads * 16 + k * 4, rgba, 4);
+      t->quads++;
+    }
+    pen += t->advance[f][c];
+  }
+}
+
+void textAtlasEnd(text_atlas *t, uint64_t gen){
+  t->building = 0;
+  t->built_gen = gen;
+  stageTimerRecord(&t->build, nowNs() - t->build.last_ns);
+}
+
+// Draws in window pixels whatever the modelview matrix is.
+void textAtlasDraw(text_atlas *t){
+  uint64_t start = nowNs();
+
+  if (!t->ready || t->quads == 0)
+    return;
+  glPushMatrix();
+  glLoadIdentity();
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, t->tex);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(2, GL_FLOAT, 4 * sizeof(float), t->verts);
+  glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(float), t->verts + 2);
+  glColorPointer(4, GL_UNSIGNED_BYTE, 0, t->colors);
+  glDrawArrays(GL_QUADS, 0, t->quads * 4);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisable(GL_TEXTURE_2D);
+  glPopMatrix();
+  stageTimerRecord(&t->draw, nowNs() - start);
+}
@@ -0,0 +1,58 @@
+#ifndef __textatlas_h__
+#define __textatlas_h__
+
+#include <stdint.h>
+#include <GL/freeglut.h>
+#include "stats.h"
+
+#define TEXT_ATLAS_FONTS 2
+#define TEXT_ATLAS_FIRST 32    // Printable ASCII only, anything else draws as a space.
+#define TEXT_ATLAS_LAST 126
+#define TEXT_ATLAS_COLS 16
+#define TEXT_ATLAS_CELL_W 16
+#define TEXT_ATLAS_CELL_H 20
+#define TEXT_ATLAS_ASCENT 15   // Baseline from the top of a cell.
+#define TEXT_ATLAS_PAD 2       // Left of the pen, for glyphs drawn before their origin.
+#define TEXT_ATLAS_MAX_QUADS 4096
+
+/*
+  GLUT bitmap fonts rasterized once into an alpha texture, and text drawn
+  from it as textured quads.
+
+  glutBitmapString issues one glBitmap per glyph every frame, which on
+  software GL costs more than uploading the feeds. Here the console builds
+  its text into a batch of quads only when it changed, and every frame is
+  one glDrawArrays over client side vertex arrays.
+
+  The fonts are captured by drawing every glyph with glutBitmapCharacter
+  into the back buffer and reading it back, so the atlas matches the
+  bitmap path pixel for pixel. Everything runs on the GL thread.
+*/
+typedef struct {
+  void *fonts[TEXT_ATLAS_FONTS];
+  int nfonts;
+  uint8_t advance[TEXT_ATLAS_FONTS][TEXT_ATLAS_LAST + 1];
+  GLuint tex;
+  int tex_w, tex_h;
+  int ready;
+  int failed;
+
+  // The batch: per vertex x, y, u, v and RGBA, four vertices a quad.
+  float *verts;
+  uint8_t *colors;
+  int quads;
+  int building;
+  uint64_t built_gen;   // Console generation the batch was built from.
+
+  stage_timer build;
+  stage_timer draw;
+} text_atlas;
+
+int textAtlasInit(text_atlas *t, void **fonts, int nfonts, int window_h);
+void textAtlasFree(text_atlas *t);
+void textAtlasBegin(text_atlas *t);
+void textAtlasAdd(text_atlas *t, float x, float y, float r, float g, float b, void *font, const char *s);
+void textAtlasEnd(text_atlas *t, uint64_t gen);
+void textAtlasDraw(text_atlas *t);
+
+#endif
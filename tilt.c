@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tilt.h"
+#include "dbg.h"
+
+void tiltPollerInit(tilt_poller *p){
+  memset(p, 0, sizeof(*p));
+  p->rate_hz = TILT_DEFAULT_HZ;
+  stageTimerInit(&p->poll, "tilt poll");
+}
+
+static void tiltPollOnce(tilt_poller *p){
+  uint64_t start = nowNs();
+  tilt_state s;
+  freenect_raw_tilt_state *raw;
+
+  memset(&s, 0, sizeof(s));
+  if (freenect_update_tilt_state(p->dev) == 0 && (raw = freenect_get_tilt_state(p->dev)) != NULL){
+    s.angle = freenect_get_tilt_degs(raw);
+    s.status = freenect_get_tilt_status(raw);
+    freenect_get_mks_accel(raw, &s.ax, &s.ay, &s.az);
+    s.raw[0] = raw->accelerometer_x;
+    s.raw[1] = raw->accelerometer_y;
+    s.raw[2] = raw->accelerometer_z;
+    s.valid = 1;
+  }
+  else
+    __atomic_add_fetch(&p->errors, 1, __ATOMIC_RELAXED);
+  s.stamp_ns = nowNs();
+
+  __atomic_add_fetch(&p->seq, 1, __ATOMIC_ACQ_REL);
+  p->state = s;
+  __atomic_add_fetch(&p->seq, 1, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&p->polls, 1, __ATOMIC_RELAXED);
+  stageTimerRecord(&p->poll, s.stamp_ns - start);
+}
+
+static void *tiltPollerThread(void *arg){
+  tilt_poller *p = arg;
+  struct timespec next, now;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!__atomic_load_n(&p->quit, __ATOMIC_ACQUIRE)){
+    devQueueService(p->queue, p->dev);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)){
+      tiltPollOnce(p);
+      // Fixed period from the last deadline, a slow transfer does not add drift.
+      next.tv_nsec += 1000000000L / __atomic_load_n(&p->rate_hz, __ATOMIC_RELAXED);
+      while (next.tv_nsec >= 1000000000L){
+        next.tv_nsec -= 1000000000L;
+        next.tv_sec++;
+      }
+    }
+    devQueueWait(p->queue, &next);
+  }
+  return NULL;
+}
+
+int tiltPollerStart(tilt_poller *p, freenect_device *dev, dev_queue *queue){
+  check (!p->running, "Tilt poller already running.");
+  p->dev = dev;
+  p->queue = queue;
+  p->quit = 0;
+  check (pthread_create(&p->thread, NULL, tiltPollerThread, p) == 0, "Could not create tilt poller thread.");
+  p->running = 1;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+// Commands still queued run before the thread exits.
+void tiltPollerStop(tilt_poller *p){
+  if (!p->running)
+    return;
+  __atomic_store_n(&p->quit, 1, __ATOMIC_RELEASE);
+  devQueueWake(p->queue);
+  pthread_join(p->thread, NULL);
+  devQueueService(p->queue, p->dev);
+  p->running = 0;
+}
+
+// Takes effect after the current period.
+int tiltPollerSetRate(tilt_poller *p, int rate_hz){
+  if (rate_hz < 1 || rate_hz > TILT_MAX_HZ)
+    return 1;
+  __atomic_store_n(&p->rate_hz, rate_hz, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void tiltPollerRead(tilt_poller *p, tilt_state *out){
+  uint32_t seq;
+
+  do{
+    while ((seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    memcpy(out, &p->state, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (seq != __atomic_load_n(&p->seq, __ATOMIC_RELAXED));
+}
+
+const char *tiltStatusName(int status){
+  switch (status){
+  case TILT_STATUS_STOPPED:
+    return "stopped";
+  case TILT_STATUS_LIMIT:
+    return "limit";
+  case TILT_STATUS_MOVING:
+    return "moving";
+  default:
+    return "unknown";
+  }
+}
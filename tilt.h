@@ -0,0 +1,54 @@
+#ifndef __tilt_h__
+#define __tilt_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libfreenect.h"
+#include "devqueue.h"
+#include "stats.h"
+
+#define TILT_DEFAULT_HZ 10
+#define TILT_MAX_HZ 100
+
+// Last reading of the motor and accelerometer.
+typedef struct {
+  double angle;       // Degrees.
+  int status;         // freenect_tilt_status_code.
+  double ax, ay, az;  // m/s^2.
+  int16_t raw[3];
+  uint64_t stamp_ns;  // nowNs() of the reading.
+  int valid;
+} tilt_state;
+
+/*
+  The device control thread. Polls tilt state at `rate_hz`, so the
+  libfreenect event loop only services streams: every
+  freenect_update_tilt_state is a synchronous control transfer. Between
+  polls it sleeps on the device command queue and runs commands as they
+  are posted. Readers copy `state` under a sequence lock, odd while the
+  poller writes.
+*/
+typedef struct {
+  freenect_device *dev;
+  dev_queue *queue;
+  int rate_hz;
+  pthread_t thread;
+  int running;
+  int quit;
+
+  uint32_t seq;
+  tilt_state state;
+
+  uint64_t polls;
+  uint64_t errors;
+  stage_timer poll;
+} tilt_poller;
+
+void tiltPollerInit(tilt_poller *p);
+int tiltPollerStart(tilt_poller *p, freenect_device *dev, dev_queue *queue);
+void tiltPollerStop(tilt_poller *p);
+int tiltPollerSetRate(tilt_poller *p, int rate_hz);
+void tiltPollerRead(tilt_poller *p, tilt_state *out);
+const char *tiltStatusName(int status);
+
+#endif
@@ -0,0 +1,118 @@
+#include <string.h>
+#include "unpack.h"
+
+size_t packedBytes(int bits, int pixels){
+  return ((size_t) pixels * bits + 7) / 8;
+}
+
+static inline uint64_t loadBe64(const uint8_t *p){
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return __builtin_bswap64(v);
+}
+
+/*
+  11 bit: bytes 0-7 hold pixels 0-4 and bytes 3-10 hold 5-7, so both loads
+  stay inside the 11 byte group.
+*/
+static inline void unpack11(const uint8_t *in, uint16_t *out){
+  uint64_t hi = loadBe64(in);
+  uint64_t lo = loadBe64(in + 3);
+  out[0] = hi >> 53;
+  out[1] = (hi >> 42) & 0x7ff;
+  out[2] = (hi >> 31) & 0x7ff;
+  out[3] = (hi >> 20) & 0x7ff;
+  out[4] = (hi >> 9) & 0x7ff;
+  out[5] = (lo >> 22) & 0x7ff;
+  out[6] = (lo >> 11) & 0x7ff;
+  out[7] = lo & 0x7ff;
+}
+
+// 10 bit: bytes 0-7 hold pixels 0-5, bytes 2-9 hold 6 and 7.
+static inline void unpack10(const uint8_t *in, uint16_t *out){
+  uint64_t hi = loadBe64(in);
+  uint64_t lo = loadBe64(in + 2);
+  out[0] = hi >> 54;
+  out[1] = (hi >> 44) & 0x3ff;
+  out[2] = (hi >> 34) & 0x3ff;
+  out[3] = (hi >> 24) & 0x3ff;
+  out[4] = (hi >> 14) & 0x3ff;
+  out[5] = (hi >> 4) & 0x3ff;
+  out[6] = (lo >> 10) & 0x3ff;
+  out[7] = lo & 0x3ff;
+}
+
+void unpackDepth(const uint8_t *in, uint16_t *out, int bits, int pixels){
+  int i;
+
+  if (bits == 11){
+    for (i = 0; i < pixels; i += 8, in += 11)
+      unpack11(in, out + i);
+  }
+  else{
+    for (i = 0; i < pixels; i += 8, in += 10)
+      unpack10(in, out + i);
+  }
+}
+
+void unpackDepthScalar(const uint8_t *in, uint16_t *out, int bits, int pixels){
+  uint32_t buffer = 0, mask = (1u << bits) - 1;
+  int have = 0;
+
+  while (pixels--){
+    while (have < bits){
+      buffer = (buffer << 8) | *in++;
+      have += 8;
+    }
+    have -= bits;
+    *out++ = (buffer >> have) & mask;
+  }
+}
+
+// One pixel of a packed frame, reading only the two or three bytes it spans.
+uint16_t unpackDepthPixel(const uint8_t *in, int bits, int index){
+  size_t bit = (size_t) index * bits;
+  const uint8_t *b = in + (bit >> 3);
+  int last = (int) (((bit & 7) + bits - 1) >> 3);
+  uint32_t v = b[0];
+  int i;
+
+  for (i = 1; i <= last; i++)
+    v = (v << 8) | b[i];
+  return (v >> ((last + 1) * 8 - (bit & 7) - bits)) & ((1u << bits) - 1);
+}
+
+void packDepth(const uint16_t *in, uint8_t *out, int bits, int pixels){
+  uint32_t buffer = 0, mask = (1u << bits) - 1;
+  int have = 0;
+
+  while (pixels--){
+    buffer = (buffer << bits) | (*in++ & mask);
+    have += bits;
+    while (have >= 8){
+      have -= 8;
+      *out++ = buffer >> have;
+    }
+  }
+  if (have > 0)
+    *out = buffer << (8 - have);
+}
+
+typedef struct {
+  const uint8_t *in;
+  uint16_t *out;
+  int bits;
+  int width;
+} unpack_job;
+
+static void unpackBand(void *arg, int band, int y0, int y1){
+  unpack_job *job = arg;
+  size_t row = packedBytes(job->bits, job->width);
+  unpackDepth(job->in + row * y0, job->out + (size_t) job->width * y0, job->bits,
+              job->width * (y1 - y0));
+}
+
+void unpackDepthFrame(work_pool *pool, const uint8_t *in, uint16_t *out, int bits, int width, int height){
+  unpack_job job = { in, out, bits, width };
+  workPoolRun(pool, height, unpackBand, &job);
+}
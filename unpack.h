@@ -0,0 +1,22 @@
+#ifndef __unpack_h__
+#define __unpack_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "workpool.h"
+
+/*
+  Packed depth is an MSB first bit stream: 8 pixels in 11 bytes for 11 bit,
+  4 in 5 bytes for 10 bit. unpackDepth works 8 pixels at a time from two
+  overlapping big endian 64 bit loads; unpackDepthScalar is the bit reader
+  libfreenect uses, kept as the reference. `pixels` is a multiple of 8 for
+  unpackDepth, which every Kinect row is.
+*/
+size_t packedBytes(int bits, int pixels);
+void unpackDepth(const uint8_t *in, uint16_t *out, int bits, int pixels);
+void unpackDepthScalar(const uint8_t *in, uint16_t *out, int bits, int pixels);
+void packDepth(const uint16_t *in, uint8_t *out, int bits, int pixels);
+uint16_t unpackDepthPixel(const uint8_t *in, int bits, int index);
+void unpackDepthFrame(work_pool *pool, const uint8_t *in, uint16_t *out, int bits, int width, int height);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include "video_proc.h"
+#include "demosaic.h"
+#include "modes.h"
+#include "dbg.h"
+
+// Demosaic Bayer frames, copy the rest.
+static int convertStage(void *ctx, frame *f){
+  video_proc *p = ctx;
+  uint64_t start = nowNs();
+
+  if (p->mode.video_format == FREENECT_VIDEO_BAYER){
+    demosaic(p->pool, f->data, p->out, p->mode.width, p->mode.height);
+    stageTimerRecord(&p->demosaic, nowNs() - start);
+  }
+  else{
+    memcpy(p->out, f->data, p->mode.bytes);
+    stageTimerRecord(&p->copy, nowNs() - start);
+  }
+  return 0;
+}
+
+static int publishStage(void *ctx, frame *f){
+  video_proc *p = ctx;
+  p->publish(&p->out, &p->mode);
+  return 0;
+}
+
+int videoProcInit(video_proc *p, frame_pool *frames, size_t out_bytes, work_pool *pool, video_publish_fn publish){
+  memset(p, 0, sizeof(*p));
+  p->out_bytes = out_bytes;
+  p->pool = pool;
+  p->publish = publish;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  stageTimerInit(&p->demosaic, "demosaic");
+  stageTimerInit(&p->copy, "video copy");
+  pipelineInit(&p->pipe, "video");
+  pipelineAdd(&p->pipe, "convert", convertStage, p, 0, VIDEO_IMAGE, 0);
+  pipelineAdd(&p->pipe, "publish", publishStage, p, VIDEO_IMAGE, 0, 0);
+
+  check (frameHandoffInit(&p->frames_in, frames) == 0, "Video frame pool is empty.");
+  check (posix_memalign((void **) &p->out, 64, out_bytes) == 0,
+         "Could not allocate video output.");
+  memset(p->out, 0, out_bytes);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  videoProcFree(p);
+  return 1;
+}
+
+void videoProcFree(video_proc *p){
+  frameHandoffFree(&p->frames_in);
+  free (p->out);
+  p->out = NULL;
+}
+
+static void *videoProcThread(void *arg){
+  video_proc *p = arg;
+  frame *f;
+
+  pthread_mutex_lock(&p->lock);
+  while (1){
+    while (!p->quit && !p->frames_in.ready)
+      pthread_cond_wait(&p->cond, &p->lock);
+    if (p->quit)
+      break;
+    f = frameHandoffTake(&p->frames_in);
+    p->mode = p->req_mode;
+    pthread_mutex_unlock(&p->lock);
+
+    pipelineRun(&p->pipe, f);
+    frameRelease(f);
+    __atomic_add_fetch(&p->frames, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+int videoProcStart(video_proc *p){
+  check (!p->running, "Video processing already running.");
+  p->quit = 0;
+  check (pipelineStart(&p->pipe) == 0, "Could not start the video pipeline.");
+  check (pthread_create(&p->thread, NULL, videoProcThread, p) == 0, "Could not create video thread.");
+  p->running = 1;
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  return 1;
+}
+
+void videoProcStop(video_proc *p){
+  if (!p->running)
+    return;
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+  pipelineStop(&p->pipe);
+  p->running = 0;
+}
+
+/*
+  Describe the mode the next frames arrive in. Called with the stream
+  stopped; a frame still waiting in the old mode is dropped.
+*/
+int videoProcSetMode(video_proc *p, const freenect_frame_mode *mode){
+  if ((size_t) mode->bytes > p->frames_in.pool->frame_bytes || modeVideoUploadBytes(mode) > p->out_bytes)
+    return 1;
+  pthread_mutex_lock(&p->lock);
+  p->req_mode = *mode;
+  frameHandoffDropReady(&p->frames_in);
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+void *videoProcFillBuffer(video_proc *p){
+  return p->frames_in.fill->data;
+}
+
+void *videoProcPush(video_proc *p, void *filled, uint32_t timestamp){
+  void *next;
+
+  pthread_mutex_lock(&p->lock);
+  next = frameHandoffPush(&p->frames_in, filled, p->req_mode.bytes, timestamp);
+  streamMeterTick(&p->meter, p->req_mode.bytes);
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+
+  return next;
+}
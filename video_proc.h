@@ -0,0 +1,63 @@
+#ifndef __video_proc_h__
+#define __video_proc_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libfreenect.h"
+#include "framepool.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "workpool.h"
+
+// Product of the convert stage.
+#define VIDEO_IMAGE 1
+
+/*
+  Swap the finished frame in `*out` with the displayed back buffer. `mode`
+  is the mode it was streamed in; Bayer frames arrive demosaiced to RGB.
+*/
+typedef void (*video_publish_fn)(uint8_t **out, const freenect_frame_mode *mode);
+
+/*
+  Video processing off the libfreenect thread, the same frame hand-off as
+  depth_proc: rgb_cb only publishes the filled frame and gets a free one
+  from the pool for freenect_set_video_buffer.
+
+  The video pipeline is convert then publish. Bayer frames are demosaiced
+  in row bands on the work pool straight into the buffer that is then
+  swapped in for upload, so the USB link carries one byte per pixel and
+  nothing copies the RGB image. Other formats are copied as they come.
+*/
+typedef struct {
+  size_t out_bytes;
+  frame_handoff frames_in;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;
+  int quit;
+
+  work_pool *pool;
+  uint8_t *out;
+  video_publish_fn publish;
+  pipeline pipe;
+
+  // Mode of the ready frame, and of the next ones.
+  freenect_frame_mode req_mode;
+  freenect_frame_mode mode;
+
+  uint64_t frames;
+  stream_meter meter;
+  stage_timer demosaic;
+  stage_timer copy;
+} video_proc;
+
+int videoProcInit(video_proc *p, frame_pool *frames, size_t out_bytes, work_pool *pool, video_publish_fn publish);
+void videoProcFree(video_proc *p);
+int videoProcStart(video_proc *p);
+void videoProcStop(video_proc *p);
+void *videoProcFillBuffer(video_proc *p);
+void *videoProcPush(video_proc *p, void *filled, uint32_t timestamp);
+int videoProcSetMode(video_proc *p, const freenect_frame_mode *mode);
+
+#endif
@@ -0,0 +1,333 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "voxel.h"
+#include "dbg.h"
+
+#define VOXEL_BIAS (1 << 20)
+
+static int tableInit(voxel_table *t, int min_slots){
+  int slots = 1;
+
+  while (slots < min_slots)
+    slots <<= 1;
+  t->slots = calloc(slots, sizeof(voxel_slot));
+  t->used = malloc(slots / 2 * sizeof(int));
+  t->mask = slots - 1;
+  t->limit = slots / 2;
+  return t->slots && t->used ? 0 : 1;
+}
+
+static void tableFree(voxel_table *t){
+  free (t->slots);
+  free (t->used);
+  t->slots = NULL;
+  t->used = NULL;
+}
+
+static void buildRays(voxel_grid *vg){
+  int u, v, i = 0;
+
+  for (v = 0; v < vg->height; v++)
+    for (u = 0; u < vg->width; u++, i++)
+      depthIntrinsicsRay(&vg->k, u, v, &vg->ray_x[i], &vg->ray_y[i]);
+}
+
+// `bands` is the most the work pool will split a frame into.
+int voxelGridInit(voxel_grid *vg, const depth_probe *probe, floor_estimator *floor, int bands){
+  int i;
+
+  memset(vg, 0, sizeof(*vg));
+  check (bands >= 1 && bands <= WORK_POOL_MAX_THREADS + 1, "Too many bands.");
+  vg->width = probe->width;
+  vg->height = probe->height;
+  vg->nbands = bands;
+  vg->probe = probe;
+  vg->floor = floor;
+  vg->size_mm = VOXEL_DEFAULT_MM;
+  pthread_mutex_init(&vg->lock, NULL);
+  stageTimerInit(&vg->insert, "voxel insert");
+  stageTimerInit(&vg->merge, "voxel merge");
+
+  vg->ray_x = malloc((size_t) vg->width * vg->height * sizeof(float));
+  vg->ray_y = malloc((size_t) vg->width * vg->height * sizeof(float));
+  check_mem(vg->ray_x && vg->ray_y);
+  for (i = 0; i < bands; i++)
+    check_mem(tableInit(&vg->bands[i], (vg->height + bands - 1) / bands * vg->width) == 0);
+  check_mem(tableInit(&vg->merged, VOXEL_SLOTS) == 0);
+  for (i = 0; i < 2; i++){
+    vg->points[i] = malloc(VOXEL_MAX * sizeof(voxel_point));
+    check_mem(vg->points[i]);
+  }
+  depthIntrinsicsDefault(&vg->k);
+  buildRays(vg);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  voxelGridFree(vg);
+  return 1;
+}
+
+void voxelGridFree(voxel_grid *vg){
+  int i;
+
+  for (i = 0; i < WORK_POOL_MAX_THREADS + 1; i++)
+    tableFree(&vg->bands[i]);
+  tableFree(&vg->merged);
+  free (vg->ray_x);
+  free (vg->ray_y);
+  free (vg->points[0]);
+  free (vg->points[1]);
+  vg->ray_x = vg->ray_y = NULL;
+  vg->points[0] = vg->points[1] = NULL;
+}
+
+int voxelSetSize(voxel_grid *vg, int size_mm){
+  if (size_mm < VOXEL_MIN_MM || size_mm > VOXEL_MAX_MM)
+    return 1;
+  __atomic_store_n(&vg->size_mm, size_mm, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// The rays are rebuilt on the next frame, by the stage.
+int voxelSetIntrinsics(voxel_grid *vg, const depth_intrinsics *k){
+  if (k->fx <= 0 || k->fy <= 0)
+    return 1;
+  pthread_mutex_lock(&vg->lock);
+  vg->k = *k;
+  vg->k_dirty = 1;
+  pthread_mutex_unlock(&vg->lock);
+  return 0;
+}
+
+static inline uint64_t voxelKey(int ix, int iy, int iz){
+  return (uint64_t) (ix + VOXEL_BIAS) << 42 | (uint64_t) (iy + VOXEL_BIAS) << 21 | (uint64_t) (iz + VOXEL_BIAS);
+}
+
+static inline int keyAxis(uint64_t key, int shift){
+  return (int) (key >> shift & 0x1FFFFF) - VOXEL_BIAS;
+}
+
+// The slot the point went to, NULL when the table was full.
+static inline voxel_slot *tableAdd(voxel_table *t, uint32_t gen, uint64_t key, uint32_t n, int32_t sx, int32_t sy, int32_t sz){
+  uint32_t i = (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 40) & t->mask;
+  voxel_slot *s;
+
+  for (;; i = (i + 1) & t->mask){
+    s = &t->slots[i];
+    if (s->gen != gen){
+      if (t->count == t->limit){
+        t->overflow += n;
+        return NULL;
+      }
+      s->gen = gen;
+      s->key = key;
+      s->n = n;
+      s->sx = sx;
+      s->sy = sy;
+      s->sz = sz;
+      t->used[t->count++] = i;
+      return s;
+    }
+    if (s->key == key){
+      s->n += n;
+      s->sx += sx;
+      s->sy += sy;
+      s->sz += sz;
+      return s;
+    }
+  }
+}
+
+// Rows [y0, y1) into the band's own table.
+static void insertBand(void *arg, int band, int y0, int y1){
+  voxel_grid *vg = arg;
+  voxel_table *t = &vg->bands[band];
+  voxel_slot *last = NULL;
+  // Locals, or every store to a slot reloads them.
+  const float *ray_x, *ray_y, inv = vg->inv_size;
+  const uint16_t *lut = vg->lut, *row;
+  const uint16_t no_data = vg->no_data;
+  const int size = vg->frame_size, width = vg->width, lut_size = vg->lut_size;
+  const uint32_t gen = vg->gen;
+  float fx, fy;
+  int u, v, x, y, ix, iy, iz;
+  uint64_t key;
+  uint16_t raw, mm;
+
+  t->count = 0;
+  t->overflow = 0;
+  for (v = y0; v < y1; v++){
+    row = vg->raw + (size_t) v * width;
+    ray_x = vg->ray_x + (size_t) v * width;
+    ray_y = vg->ray_y + (size_t) v * width;
+    for (u = 0; u < width; u++){
+      if ((raw = row[u]) == no_data)
+        continue;
+      mm = !lut ? raw : raw < lut_size ? lut[raw] : 0;
+      if (mm == 0)
+        continue;
+      // Truncated to the millimeter, and rounded down to the voxel without a call or a division.
+      x = (int) (ray_x[u] * mm);
+      y = (int) (ray_y[u] * mm);
+      fx = x * inv;
+      fy = y * inv;
+      ix = (int) fx - (fx < 0);
+      iy = (int) fy - (fy < 0);
+      iz = (int) (mm * inv);
+      key = voxelKey(ix, iy, iz);
+      if (last && last->key == key){
+        last->n++;
+        last->sx += x - ix * size;
+        last->sy += y - iy * size;
+        last->sz += mm - iz * size;
+      }
+      else
+        last = tableAdd(t, gen, key, 1, x - ix * size, y - iy * size, mm - iz * size);
+    }
+  }
+}
+
+/*
+  Decays the map and marks it with this frame's voxels, projected on the
+  floor of `fit` when it is valid. Under `lock`.
+*/
+static void updateMap(voxel_grid *vg, const floor_fit *fit, const voxel_point *pts, int count){
+  float right[3] = { 1, 0, 0 }, fwd[3] = { 0, 0, 1 }, len, h, r, f;
+  const float *n = fit->n;
+  int i, col, row, v;
+
+  if (fit->valid){
+    // The camera's x and z axes laid flat on the floor.
+    for (i = 0; i < 3; i++){
+      right[i] -= n[0] * n[i];
+      fwd[i] -= n[2] * n[i];
+    }
+    len = sqrtf(right[0] * right[0] + right[1] * right[1] + right[2] * right[2]);
+    for (i = 0; i < 3; i++) right[i] /= len;
+    len = sqrtf(fwd[0] * fwd[0] + fwd[1] * fwd[1] + fwd[2] * fwd[2]);
+    for (i = 0; i < 3; i++) fwd[i] /= len;
+  }
+
+  for (i = 0; i < VOXEL_MAP_SIZE * VOXEL_MAP_SIZE; i++)
+    vg->map[i] -= vg->map[i] >> VOXEL_MAP_DECAY;
+  for (i = 0; i < count; i++){
+    if (fit->valid){
+      h = n[0] * pts[i].x + n[1] * pts[i].y + n[2] * pts[i].z + fit->height;
+      if (h < VOXEL_MAP_LOW || h > VOXEL_MAP_HIGH)
+        continue;
+    }
+    r = right[0] * pts[i].x + right[1] * pts[i].y + right[2] * pts[i].z;
+    f = fwd[0] * pts[i].x + fwd[1] * pts[i].y + fwd[2] * pts[i].z;
+    col = (int) floorf(r * 1000 / VOXEL_MAP_CELL_MM) + VOXEL_MAP_SIZE / 2;
+    row = (int) floorf(f * 1000 / VOXEL_MAP_CELL_MM);
+    if (col < 0 || row < 0 || col >= VOXEL_MAP_SIZE || row >= VOXEL_MAP_SIZE)
+      continue;
+    v = vg->map[row * VOXEL_MAP_SIZE + col] + VOXEL_MAP_HIT;
+    vg->map[row * VOXEL_MAP_SIZE + col] = v > 255 ? 255 : v;
+  }
+}
+
+/*
+  One frame of raw depth in the format of `no_data`, on the depth thread.
+  1 when the pool has more bands than there are tables.
+*/
+int voxelGridUpdate(voxel_grid *vg, work_pool *pool, const uint16_t *raw, uint16_t no_data, uint64_t seq){
+  uint64_t start = nowNs(), in = 0;
+  voxel_table *m = &vg->merged;
+  voxel_slot *s;
+  voxel_point *out;
+  floor_fit fit;
+  int bands = pool ? pool->bands : 1, b, i, size;
+
+  if (bands > vg->nbands)
+    return 1;
+  pthread_mutex_lock(&vg->lock);
+  if (vg->k_dirty){
+    buildRays(vg);
+    vg->k_dirty = 0;
+  }
+  pthread_mutex_unlock(&vg->lock);
+
+  // Generation 0 is what calloc left, never current.
+  if (++vg->gen == 0)
+    vg->gen = 1;
+  size = vg->frame_size = __atomic_load_n(&vg->size_mm, __ATOMIC_RELAXED);
+  vg->inv_size = 1.0f / size;
+  vg->raw = raw;
+  vg->no_data = no_data;
+  vg->lut = depthProbeTable(vg->probe, no_data, &vg->lut_size);
+  if (pool)
+    workPoolRun(pool, vg->height, insertBand, vg);
+  else
+    insertBand(vg, 0, 0, vg->height);
+  stageTimerRecord(&vg->insert, nowNs() - start);
+
+  start = nowNs();
+  m->count = 0;
+  m->overflow = 0;
+  for (b = 0; b < bands; b++){
+    in += vg->bands[b].overflow;
+    for (i = 0; i < vg->bands[b].count; i++){
+      s = &vg->bands[b].slots[vg->bands[b].used[i]];
+      in += s->n;
+      tableAdd(m, vg->gen, s->key, s->n, s->sx, s->sy, s->sz);
+    }
+  }
+  out = vg->points[!vg->front];
+  for (i = 0; i < m->count; i++){
+    s = &m->slots[m->used[i]];
+    out[i].x = (keyAxis(s->key, 42) * size + (float) s->sx / s->n) * 0.001f;
+    out[i].y = (keyAxis(s->key, 21) * size + (float) s->sy / s->n) * 0.001f;
+    out[i].z = (keyAxis(s->key, 0) * size + (float) s->sz / s->n) * 0.001f;
+    out[i].n = s->n;
+  }
+
+  memset(&fit, 0, sizeof(fit));
+  if (vg->floor)
+    floorRead(vg->floor, &fit);
+  pthread_mutex_lock(&vg->lock);
+  vg->front = !vg->front;
+  vg->count[vg->front] = m->count;
+  vg->seq = seq;
+  updateMap(vg, &fit, out, m->count);
+  pthread_mutex_unlock(&vg->lock);
+
+  for (b = 0; b < bands; b++)
+    m->overflow += vg->bands[b].overflow;
+  vg->in_points = in;
+  __atomic_add_fetch(&vg->overflow, m->overflow, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&vg->frames, 1, __ATOMIC_RELAXED);
+  stageTimerRecord(&vg->merge, nowNs() - start);
+  return 0;
+}
+
+// Up to `max` centroids of the last frame, the count returned.
+int voxelCopyPoints(voxel_grid *vg, voxel_point *out, int max, uint64_t *seq){
+  int n;
+
+  pthread_mutex_lock(&vg->lock);
+  n = vg->count[vg->front] < max ? vg->count[vg->front] : max;
+  memcpy(out, vg->points[vg->front], n * sizeof(voxel_point));
+  *seq = vg->seq;
+  pthread_mutex_unlock(&vg->lock);
+  return n;
+}
+
+void voxelCopyMap(voxel_grid *vg, uint8_t *out){
+  pthread_mutex_lock(&vg->lock);
+  memcpy(out, vg->map, sizeof(vg->map));
+  pthread_mutex_unlock(&vg->lock);
+}
+
+// ASCII PLY of the centroids, meters, with the pixel count of each voxel.
+int voxelWritePly(FILE *f, const voxel_point *pts, int count){
+  int i;
+
+  fprintf(f, "ply\nformat ascii 1.0\nelement vertex %d\nproperty float x\nproperty float y\nproperty float z\n"
+          "property uint count\nend_header\n", count);
+  for (i = 0; i < count; i++)
+    fprintf(f, "%.4f %.4f %.4f %u\n", pts[i].x, pts[i].y, pts[i].z, pts[i].n);
+  return ferror(f);
+}
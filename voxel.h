@@ -0,0 +1,118 @@
+#ifndef __voxel_h__
+#define __voxel_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "floor.h"
+#include "probe.h"
+#include "stats.h"
+#include "workpool.h"
+
+#define VOXEL_SLOTS (1 << 19)       // Merged table; band tables get a slot per pixel of their rows.
+#define VOXEL_MAX (VOXEL_SLOTS / 2) // Voxels per frame, keeping the merged table half empty.
+#define VOXEL_DEFAULT_MM 50
+#define VOXEL_MIN_MM 10
+#define VOXEL_MAX_MM 1000           // Keeps the offset sums of a voxel in 32 bits.
+
+#define VOXEL_MAP_SIZE 128          // Cells on a side of the occupancy map.
+#define VOXEL_MAP_CELL_MM 50
+#define VOXEL_MAP_HIT 64            // Added per occupied voxel over a cell, saturating at 255.
+#define VOXEL_MAP_DECAY 3           // Every frame a cell loses 1/8 of its value.
+#define VOXEL_MAP_LOW 0.05f         // Meters over the floor a voxel has to be in to mark the map.
+#define VOXEL_MAP_HIGH 2.0f
+
+/*
+  A voxel in a table: the sums are millimeter offsets from the voxel's
+  corner, so they stay small whatever its position. A slot is empty unless
+  `gen` is the current frame's, which is how the tables are emptied
+  without touching them.
+*/
+typedef struct {
+  uint64_t key;
+  uint32_t gen;
+  uint32_t n;
+  int32_t sx, sy, sz;
+  int32_t pad;
+} voxel_slot;
+
+// Open addressing with linear probing, `used` lists the slots filled this frame.
+typedef struct {
+  voxel_slot *slots;
+  uint32_t mask;
+  int *used;
+  int count, limit;
+  uint64_t overflow;   // Points that found the table at its limit.
+} voxel_table;
+
+// Centroid of one occupied voxel, meters in camera coordinates.
+typedef struct {
+  float x, y, z;
+  uint32_t n;
+} voxel_point;
+
+/*
+  Voxel grid downsampling of the depth frame, a stage of the depth
+  pipeline. Each band of rows bins its pixels into its own table, so
+  insertion takes no locks, and the band tables are merged into one; the
+  output is a centroid per occupied voxel. Pixels become points through
+  the probe's millimeter tables and a ray per pixel, computed from the
+  intrinsics with the lens distortion undone; a run of pixels in the same
+  voxel goes to the slot of the previous one without hashing. Every table
+  and buffer is allocated at init and reused; a voxel size small enough
+  to fill them loses the points that do not fit, and counts them.
+
+  The occupancy map is a fixed top-down grid in front of the camera,
+  columns across and rows away from it. Every frame it decays and the
+  voxels between VOXEL_MAP_LOW and VOXEL_MAP_HIGH over the floor mark
+  their cells; without a floor fit the camera is taken as level and
+  every voxel counts.
+
+  The stage writes `points[back]` and swaps it to the front under
+  `lock`, which readers hold to copy the front points or the map.
+*/
+typedef struct {
+  int width, height;
+  int nbands;
+  const depth_probe *probe;
+  floor_estimator *floor;
+  depth_intrinsics k;
+  int k_dirty;         // New intrinsics under `lock`, the stage rebuilds the rays.
+  float *ray_x, *ray_y; // x/z and y/z of every pixel.
+
+  int size_mm;         // Takes effect on the next frame.
+  int frame_size;
+  float inv_size;
+  uint32_t gen;
+  const uint16_t *raw;
+  uint16_t no_data;
+  const uint16_t *lut;
+  int lut_size;
+
+  voxel_table bands[WORK_POOL_MAX_THREADS + 1];
+  voxel_table merged;
+
+  pthread_mutex_t lock;
+  voxel_point *points[2];
+  int count[2];
+  int front;
+  uint64_t seq;
+  uint8_t map[VOXEL_MAP_SIZE * VOXEL_MAP_SIZE];
+
+  uint64_t frames;
+  uint64_t in_points;  // Pixels with a depth, last frame.
+  uint64_t overflow;
+  stage_timer insert;
+  stage_timer merge;
+} voxel_grid;
+
+int voxelGridInit(voxel_grid *vg, const depth_probe *probe, floor_estimator *floor, int bands);
+void voxelGridFree(voxel_grid *vg);
+int voxelSetSize(voxel_grid *vg, int size_mm);
+int voxelSetIntrinsics(voxel_grid *vg, const depth_intrinsics *k);
+int voxelGridUpdate(voxel_grid *vg, work_pool *pool, const uint16_t *raw, uint16_t no_data, uint64_t seq);
+int voxelCopyPoints(voxel_grid *vg, voxel_point *out, int max, uint64_t *seq);
+void voxelCopyMap(voxel_grid *vg, uint8_t *out);
+int voxelWritePly(FILE *f, const voxel_point *pts, int count);
+
+#endif
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/sysinfo.h>
+#include "workpool.h"
+#include "dbg.h"
+
+int workPoolPin(pthread_t thread, int cpu){
+  cpu_set_t set;
+  if (cpu < 0)
+    return 0;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % get_nprocs(), &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+void workPoolBand(int rows, int bands, int band, int *y0, int *y1){
+  *y0 = rows * band / bands;
+  *y1 = rows * (band + 1) / bands;
+}
+
+static void *workPoolThread(void *arg){
+  work_pool_worker *w = arg;
+  work_pool *p = w->pool;
+  uint64_t seen = 0;
+  int y0, y1;
+
+  pthread_mutex_lock(&p->lock);
+  while (1){
+    while (!p->quit && p->generation == seen)
+      pthread_cond_wait(&p->start_cond, &p->lock);
+    if (p->quit)
+      break;
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+
+    workPoolBand(p->rows, p->bands, w->index, &y0, &y1);
+    if (y1 > y0)
+      p->fn(p->arg, w->index, y0, y1);
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->pending == 0)
+      pthread_cond_signal(&p->done_cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+int workPoolInit(work_pool *p, int nthreads, int first_cpu){
+  int i;
+  if (nthreads < 0) nthreads = 0;
+  if (nthreads > WORK_POOL_MAX_THREADS) nthreads = WORK_POOL_MAX_THREADS;
+
+  p->nthreads = 0;
+  p->bands = 1;
+  p->generation = 0;
+  p->pending = 0;
+  p->quit = 0;
+  p->first_cpu = first_cpu;
+  pthread_mutex_init(&p->run_lock, NULL);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start_cond, NULL);
+  pthread_cond_init(&p->done_cond, NULL);
+
+  for (i = 0; i < nthreads; i++){
+    p->workers[i].pool = p;
+    p->workers[i].index = i + 1;
+    check (pthread_create(&p->threads[i], NULL, workPoolThread, &p->workers[i]) == 0, "Could not create pool worker.");
+    p->nthreads++;
+    if (first_cpu >= 0 && workPoolPin(p->threads[i], first_cpu + i) != 0)
+      debug ("Could not pin pool worker %d to cpu %d.", i, first_cpu + i);
+  }
+  p->bands = p->nthreads + 1;
+  debug ("Work pool started with %d workers.", p->nthreads);
+  return 0;
+
+ error:
+  free (USER_ERR_MSG);
+  // Run with whatever workers did start.
+  p->bands = p->nthreads + 1;
+  return 1;
+}
+
+void workPoolShutdown(work_pool *p){
+  int i;
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start_cond);
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < p->nthreads; i++)
+    pthread_join(p->threads[i], NULL);
+  p->nthreads = 0;
+  p->bands = 1;
+}
+
+void workPoolRun(work_pool *p, int rows, band_fn fn, void *arg){
+  int y0, y1;
+
+  pthread_mutex_lock(&p->run_lock);
+  if (p->nthreads > 0){
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    p->rows = rows;
+    p->pending = p->nthreads;
+    p->generation++;
+    pthread_cond_broadcast(&p->start_cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  workPoolBand(rows, p->bands, 0, &y0, &y1);
+  if (y1 > y0)
+    fn(arg, 0, y0, y1);
+
+  if (p->nthreads > 0){
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0)
+      pthread_cond_wait(&p->done_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->run_lock);
+}
@@ -0,0 +1,48 @@
+#ifndef __workpool_h__
+#define __workpool_h__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define WORK_POOL_MAX_THREADS 16
+
+/*
+  Called once per band with the rows [y0, y1) it owns. Band 0 always runs on
+  the thread that called workPoolRun, the others on the pool workers.
+*/
+typedef void (*band_fn)(void *arg, int band, int y0, int y1);
+
+struct work_pool;
+
+typedef struct {
+  struct work_pool *pool;
+  int index;
+} work_pool_worker;
+
+typedef struct work_pool {
+  pthread_t threads[WORK_POOL_MAX_THREADS];
+  work_pool_worker workers[WORK_POOL_MAX_THREADS];
+  int nthreads;     // Worker threads, the caller is not counted.
+  int bands;        // nthreads + 1
+  int first_cpu;    // Worker i is pinned to first_cpu + i, -1 leaves them floating.
+
+  pthread_mutex_t run_lock; // Serializes callers of workPoolRun.
+  pthread_mutex_t lock;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  uint64_t generation;
+  int pending;
+  int quit;
+
+  band_fn fn;
+  void *arg;
+  int rows;
+} work_pool;
+
+int workPoolInit(work_pool *p, int nthreads, int first_cpu);
+int workPoolPin(pthread_t thread, int cpu);
+void workPoolShutdown(work_pool *p);
+void workPoolRun(work_pool *p, int rows, band_fn fn, void *arg);
+void workPoolBand(int rows, int bands, int band, int *y0, int *y1);
+
+#endif